@@ -28,6 +28,9 @@
 #include <string.h>
 #include <limits.h> // for CHAR_MAX
 #include <getopt.h>
+
+#include <sstream>
+
 #ifndef _WIN32
 #include <unistd.h> // for isatty()
 #endif
@@ -36,6 +39,7 @@
 #include "cli_pager.hpp"
 
 #include "trace_parser.hpp"
+#include "trace_shards.hpp"
 #include "trace_dump.hpp"
 #include "trace_callset.hpp"
 #include "trace_option.hpp"
@@ -51,6 +55,8 @@ static ColorOption color = COLOR_OPTION_AUTO;
 
 static bool verbose = false;
 
+static unsigned jobs = 1;
+
 static trace::CallSet calls(trace::FREQUENCY_ALL);
 
 static const char *synopsis = "Dump given trace(s) to standard output.";
@@ -64,6 +70,8 @@ usage(void)
         "\n"
         "    -h, --help           show this help message and exit\n"
         "    -v, --verbose        verbose output\n"
+        "    -j, --jobs=N         dump with N threads, or one per processor if 0\n"
+        "                         [default: 1]\n"
         "    --calls=CALLSET      only dump specified calls\n"
         "    --color[=WHEN]\n"
         "    --colour[=WHEN]      colored syntax highlighting\n"
@@ -84,12 +92,13 @@ enum {
 };
 
 const static char *
-shortOptions = "hv";
+shortOptions = "hvj:";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
     {"verbose", no_argument, 0, 'v'},
+    {"jobs", required_argument, 0, 'j'},
     {"calls", required_argument, 0, CALLS_OPT},
     {"colour", optional_argument, 0, COLOR_OPT},
     {"color", optional_argument, 0, COLOR_OPT},
@@ -99,6 +108,59 @@ longOptions[] = {
     {0, 0, 0, 0}
 };
 
+/**
+ * Dumps the calls of a shard into memory, until it is its turn to be
+ * written out.
+ */
+class DumpVisitor : public trace::ShardVisitor
+{
+    trace::DumpFlags dumpFlags;
+    std::ostringstream os;
+
+public:
+    DumpVisitor(trace::DumpFlags _dumpFlags) :
+        dumpFlags(_dumpFlags)
+    {}
+
+    void visit(trace::Call *call, unsigned frame) {
+        if (calls.contains(*call)) {
+            if (verbose ||
+                !(call->flags & trace::CALL_FLAG_VERBOSE)) {
+                trace::dump(*call, os, dumpFlags);
+            }
+        }
+    }
+
+    void finish(void) {
+        std::cout << os.str();
+        os.str(std::string());
+    }
+};
+
+
+static bool
+dumpSharded(const char *filename, trace::DumpFlags dumpFlags)
+{
+    trace::ShardedTrace trace;
+    if (!trace.open(filename)) {
+        return false;
+    }
+
+    std::vector<trace::ShardVisitor *> visitors;
+    for (size_t i = 0; i < trace.getShardCount(); ++i) {
+        visitors.push_back(new DumpVisitor(dumpFlags));
+    }
+
+    bool ok = trace.visit(visitors, jobs);
+
+    for (size_t i = 0; i < visitors.size(); ++i) {
+        delete visitors[i];
+    }
+
+    return ok;
+}
+
+
 static int
 command(int argc, char *argv[])
 {
@@ -113,6 +175,9 @@ command(int argc, char *argv[])
         case 'v':
             verbose = true;
             break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
         case CALLS_OPT:
             calls.merge(optarg);
             break;
@@ -171,21 +236,37 @@ command(int argc, char *argv[])
     }
 
     for (int i = optind; i < argc; ++i) {
+        if (jobs != 1) {
+            if (!dumpSharded(argv[i], dumpFlags)) {
+                return 1;
+            }
+            continue;
+        }
+
         trace::Parser p;
 
         if (!p.open(argv[i])) {
             return 1;
         }
 
+        // Skip straight to the first call when the trace is indexed
+        trace::ParseBookmark bookmark;
+        if (calls.getFirst() > 0 &&
+            p.getCallBookmark(calls.getFirst(), bookmark)) {
+            p.setBookmark(bookmark);
+        }
+
+        trace::CallSet::Cursor cursor(calls);
+
         trace::Call *call;
         while ((call = p.parse_call())) {
-            if (calls.contains(*call)) {
+            if (cursor.contains(*call)) {
                 if (verbose ||
                     !(call->flags & trace::CALL_FLAG_VERBOSE)) {
                     trace::dump(*call, std::cout, dumpFlags);
                 }
             }
-            delete call;
+            p.recycle(call);
         }
     }
 
@@ -73,6 +73,7 @@ static const Command * commands[] = {
     &dump_images_command,
     &pickle_command,
     &sed_command,
+    &symbolize_command,
     &repack_command,
     &retrace_command,
     &trace_command,
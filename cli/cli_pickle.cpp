@@ -274,14 +274,16 @@ command(int argc, char *argv[])
             return 1;
         }
 
+        trace::CallSet::Cursor cursor(calls);
+
         trace::Call *call;
         while ((call = parser.parse_call())) {
-            if (calls.contains(*call)) {
+            if (cursor.contains(*call)) {
                 writer.begin();
                 visitor.visit(call);
                 writer.end();
             }
-            delete call;
+            parser.recycle(call);
         }
     }
 
@@ -24,15 +24,22 @@
  **************************************************************************/
 
 
+#include <assert.h>
+#include <limits.h> // for CHAR_MAX
 #include <string.h>
 #include <getopt.h>
 
+#include <deque>
 #include <iostream>
+#include <map>
+#include <string>
 
 #include "cli.hpp"
 
 #include "trace_file.hpp"
 #include "trace_ostream.hpp"
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
 
 
 static const char *synopsis = "Repack a trace file with different compression.";
@@ -47,39 +54,51 @@ usage(void)
         << "Snappy compression allows for faster replay and smaller memory footprint,\n"
         << "at the expense of a slightly smaller compression ratio than zlib\n"
         << "\n"
+        << "Only snappy traces carry a seek index, for seeking to calls quickly.\n"
+        << "It is kept when repacking into snappy, and rebuilt by --dedup.\n"
+        << "\n"
         << "    -z,--zlib    Use ZLib compression instead\n"
+        << "    -d,--dedup   Store identical blobs only once, by rewriting every call\n"
+        << "                 (keeping call numbers and the order of overlapping calls)\n"
+        << "    --format=NAME[:LEVEL]\n"
+        << "                 Use the given compression (snappy, zlib"
+#ifdef HAVE_ZSTD
+        << ", zstd"
+#endif
+#ifdef HAVE_LZ4
+        << ", lz4"
+#endif
+        << "),\n"
+        << "                 optionally with a compressor specific level\n"
         << "\n";
 }
 
+enum {
+    FORMAT_OPT = CHAR_MAX + 1,
+};
+
 const static char *
-shortOptions = "hz";
+shortOptions = "hzd";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
     {"zlib", no_argument, 0, 'z'},
+    {"dedup", no_argument, 0, 'd'},
+    {"format", required_argument, 0, FORMAT_OPT},
     {0, 0, 0, 0}
 };
 
-enum Format {
-    FORMAT_SNAPPY = 0,
-    FORMAT_ZLIB,
-};
-
 static int
-repack(const char *inFileName, const char *outFileName, Format format)
+repack(const char *inFileName, const char *outFileName,
+       trace::Compression compression, int level)
 {
     trace::File *inFile = trace::File::createForRead(inFileName);
     if (!inFile) {
         return 1;
     }
 
-    trace::OutStream *outFile;
-    if (format == FORMAT_SNAPPY) {
-        outFile = trace::createSnappyStream(outFileName);
-    } else {
-        outFile = trace::createZLibStream(outFileName);
-    }
+    trace::OutStream *outFile = trace::createStream(outFileName, compression, level);
     if (!outFile) {
         delete inFile;
         return 1;
@@ -93,6 +112,12 @@ repack(const char *inFileName, const char *outFileName, Format format)
         outFile->write(buf, read);
     }
 
+    // The uncompressed stream is the same, so is the seek index
+    std::string index;
+    if (inFile->getIndex(index)) {
+        outFile->writeIndex(index.data(), index.size());
+    }
+
     delete [] buf;
     delete outFile;
     delete inFile;
@@ -100,10 +125,76 @@ repack(const char *inFileName, const char *outFileName, Format format)
     return 0;
 }
 
+/*
+ * Rewrite every call, keeping the call numbers, and the order of the enter
+ * and leave events of calls which overlapped, e.g., from different threads.
+ *
+ * Calls are parsed in the order they were left, while their enter events
+ * must be written in call number order, so calls left before earlier ones
+ * are held back until those are parsed too.
+ */
+static int
+rewrite(const char *inFileName, const char *outFileName,
+        trace::Compression compression, int level)
+{
+    trace::Parser p;
+    if (!p.open(inFileName)) {
+        std::cerr << "error: failed to open " << inFileName << "\n";
+        return 1;
+    }
+
+    trace::Writer writer;
+    if (!writer.open(outFileName, compression, level)) {
+        std::cerr << "error: failed to create " << outFileName << "\n";
+        return 1;
+    }
+
+    // Calls parsed but not entered yet, by number, and not left yet, in the
+    // order they were left
+    std::map<unsigned, trace::Call *> entering;
+    std::deque<trace::Call *> leaving;
+    unsigned next_call_no = 0;
+
+    trace::Call *call;
+    while ((call = p.parse_call())) {
+        entering[call->no] = call;
+        leaving.push_back(call);
+
+        std::map<unsigned, trace::Call *>::iterator it;
+        while ((it = entering.begin()) != entering.end() &&
+               it->first == next_call_no) {
+            unsigned call_no = writer.writeCallEnter(it->second);
+            assert(call_no == next_call_no);
+            (void)call_no;
+            entering.erase(it);
+            ++next_call_no;
+        }
+
+        while (!leaving.empty() &&
+               leaving.front()->no < next_call_no) {
+            call = leaving.front();
+            // Calls never left are parsed last, flagged as incomplete
+            if (!(call->flags & trace::CALL_FLAG_INCOMPLETE)) {
+                writer.writeCallLeave(call, call->no);
+            }
+            leaving.pop_front();
+            p.recycle(call);
+        }
+    }
+
+    // All calls entered are eventually parsed
+    assert(entering.empty());
+    assert(leaving.empty());
+
+    return 0;
+}
+
 static int
 command(int argc, char *argv[])
 {
-    Format format = FORMAT_SNAPPY;
+    trace::Compression compression = trace::COMPRESSION_SNAPPY;
+    int level = 0;
+    bool dedup = false;
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
         switch (opt) {
@@ -111,7 +202,17 @@ command(int argc, char *argv[])
             usage();
             return 0;
         case 'z':
-            format = FORMAT_ZLIB;
+            compression = trace::COMPRESSION_ZLIB;
+            level = 0;
+            break;
+        case 'd':
+            dedup = true;
+            break;
+        case FORMAT_OPT:
+            if (!trace::parseCompression(optarg, compression, level)) {
+                std::cerr << "error: unsupported compression `" << optarg << "`\n";
+                return 1;
+            }
             break;
         default:
             std::cerr << "error: unexpected option `" << (char)opt << "`\n";
@@ -126,7 +227,10 @@ command(int argc, char *argv[])
         return 1;
     }
 
-    return repack(argv[optind], argv[optind + 1], format);
+    if (dedup) {
+        return rewrite(argv[optind], argv[optind + 1], compression, level);
+    }
+    return repack(argv[optind], argv[optind + 1], compression, level);
 }
 
 const Command repack_command = {
@@ -51,7 +51,7 @@ guessApi(const char *filename)
     }
     trace::Call *call;
     while ((call = p.parse_call())) {
-        delete call;
+        p.recycle(call);
 
         if (p.api != trace::API_UNKNOWN) {
             return p.api;
@@ -108,6 +108,12 @@ public:
 
     void visit(String *node) {
         if (!searchName.compare(node->value)) {
+            if (node->isArenaAllocated()) {
+                // Arena strings don't own their characters, and the call
+                // does not outlive us.
+                node->value = replaceName.c_str();
+                return;
+            }
             size_t len = replaceName.length() + 1;
             delete [] node->value;
             char *str = new char [len];
@@ -210,7 +216,7 @@ sed_trace(Replacements &replacements, const char *inFileName, std::string &outFi
 
         writer.writeCall(call);
 
-        delete call;
+        p.recycle(call);
     }
 
     std::cerr << "Edited trace is available as " << outFileName << "\n";
@@ -0,0 +1,277 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+#include <getopt.h>
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "cli.hpp"
+
+#include "os_backtrace.hpp"
+#include "os_string.hpp"
+
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
+
+
+static const char *synopsis = "Resolve deferred backtraces of a trace.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace symbolize [OPTIONS] TRACE_FILE\n"
+        << synopsis << "\n"
+        "\n"
+        "    -h, --help               Show detailed help for symbolize options and exit\n"
+        "    -o, --output=TRACE_FILE  Output trace file\n"
+        "\n"
+        "Backtraces captured with APITRACE_BACKTRACE_DEFERRED=1 only hold the\n"
+        "module and offset of each frame.  This looks up the function, file and\n"
+        "line of those frames, which requires the same binaries to be present.\n"
+    ;
+}
+
+const static char *
+shortOptions = "ho:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+};
+
+using namespace trace;
+
+
+static char *
+copyString(const char *s)
+{
+    if (!s) {
+        return NULL;
+    }
+    size_t len = strlen(s) + 1;
+    char *copy = new char[len];
+    memcpy(copy, s, len);
+    return copy;
+}
+
+
+/**
+ * Map the stack frames of the input trace to the symbolized frames of the
+ * output trace.
+ */
+class Symbolizer
+{
+protected:
+    typedef std::map<Id, Backtrace> FrameMap;
+    FrameMap frames;
+
+    Id nextFrameId;
+
+    unsigned numResolved;
+    unsigned numUnresolved;
+
+    StackFrame *
+    newFrame(const RawStackFrame &raw) {
+        StackFrame *frame = new StackFrame;
+        frame->id = nextFrameId++;
+        frame->module = copyString(raw.module);
+        frame->function = copyString(raw.function);
+        frame->filename = copyString(raw.filename);
+        frame->linenumber = raw.linenumber;
+        frame->offset = raw.offset;
+        return frame;
+    }
+
+    const Backtrace &
+    lookup(const StackFrame *frame) {
+        FrameMap::iterator it = frames.find(frame->id);
+        if (it != frames.end()) {
+            return it->second;
+        }
+
+        Backtrace &symbolized = frames[frame->id];
+
+        std::vector<RawStackFrame> resolved;
+        bool deferred = frame->module && !frame->function && !frame->filename;
+        if (deferred && os::symbolize_frame(*frame, resolved)) {
+            ++numResolved;
+        } else {
+            if (deferred) {
+                ++numUnresolved;
+            }
+            resolved.clear();
+            resolved.push_back(*frame);
+        }
+
+        for (unsigned i = 0; i < resolved.size(); ++i) {
+            symbolized.push_back(newFrame(resolved[i]));
+        }
+
+        return symbolized;
+    }
+
+public:
+    Symbolizer() :
+        nextFrameId(0),
+        numResolved(0),
+        numUnresolved(0)
+    {}
+
+    ~Symbolizer() {
+        for (FrameMap::iterator it = frames.begin(); it != frames.end(); ++it) {
+            for (unsigned i = 0; i < it->second.size(); ++i) {
+                delete it->second[i];
+            }
+        }
+    }
+
+    void
+    symbolize(Call *call) {
+        if (!call->backtrace) {
+            return;
+        }
+
+        Backtrace symbolized;
+        for (unsigned i = 0; i < call->backtrace->size(); ++i) {
+            const Backtrace &frames = lookup((*call->backtrace)[i]);
+            symbolized.insert(symbolized.end(), frames.begin(), frames.end());
+        }
+
+        // The frames themselves belong to the parser or to us
+        call->backtrace->swap(symbolized);
+    }
+
+    unsigned
+    resolved(void) const {
+        return numResolved;
+    }
+
+    unsigned
+    unresolved(void) const {
+        return numUnresolved;
+    }
+};
+
+
+static int
+symbolize_trace(const char *inFileName, std::string &outFileName)
+{
+    trace::Parser p;
+
+    if (!p.open(inFileName)) {
+        std::cerr << "error: failed to open " << inFileName << "\n";
+        return 1;
+    }
+
+    if (outFileName.empty()) {
+        os::String base(inFileName);
+        base.trimExtension();
+
+        outFileName = std::string(base.str()) + std::string("-symbolized.trace");
+    }
+
+    trace::Writer writer;
+    if (!writer.open(outFileName.c_str())) {
+        std::cerr << "error: failed to create " << outFileName << "\n";
+        return 1;
+    }
+
+    Symbolizer symbolizer;
+
+    trace::Call *call;
+    while ((call = p.parse_call())) {
+        symbolizer.symbolize(call);
+
+        writer.writeCall(call);
+
+        p.recycle(call);
+    }
+
+    if (symbolizer.unresolved()) {
+        std::cerr << "warning: could not resolve " << symbolizer.unresolved()
+                  << " of " << symbolizer.resolved() + symbolizer.unresolved()
+                  << " stack frames\n";
+    }
+
+    std::cerr << "Symbolized trace is available as " << outFileName << "\n";
+
+    return 0;
+}
+
+
+static int
+command(int argc, char *argv[])
+{
+    std::string outFileName;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'o':
+            outFileName = optarg;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << (char)opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        std::cerr << "error: apitrace symbolize requires a trace file as an argument.\n";
+        usage();
+        return 1;
+    }
+
+    if (argc > optind + 1) {
+        std::cerr << "error: extraneous arguments:";
+        for (int i = optind + 1; i < argc; i++) {
+            std::cerr << " " << argv[i];
+        }
+        std::cerr << "\n";
+        usage();
+        return 1;
+    }
+
+    return symbolize_trace(argv[optind], outFileName);
+}
+
+
+const Command symbolize_command = {
+    "symbolize",
+    synopsis,
+    usage,
+    command
+};
@@ -104,6 +104,9 @@ trim_trace(const char *filename, struct trim_options *options)
         return 1;
     }
 
+    /* Calls are copied as they are, so there's no need to decode them. */
+    p.setLazyArgs(true);
+
     /* Prepare output file and writer for output. */
     if (options->output.empty()) {
         os::String base(filename);
@@ -119,6 +122,9 @@ trim_trace(const char *filename, struct trim_options *options)
     }
 
 
+    trace::CallSet::Cursor calls(options->calls);
+    trace::CallSet::Cursor frames(options->frames);
+
     frame = 0;
     trace::Call *call;
     while ((call = p.parse_call())) {
@@ -128,10 +134,17 @@ trim_trace(const char *filename, struct trim_options *options)
         if ((options->calls.empty() || call->no > options->calls.getLast()) &&
             (options->frames.empty() || frame > options->frames.getLast())) {
 
-            delete call;
+            p.recycle(call);
             break;
         }
 
+        /* Patches of mapped buffers are relative to every earlier patch
+         * of the same buffer, from any thread, so keep them all. */
+        if (strcmp(call->name(), "memcpy_patch") == 0) {
+            writer.writeCall(call);
+            goto NEXT;
+        }
+
         /* If requested, ignore all calls not belonging to the specified thread. */
         if (options->thread != -1 && call->thread_id != options->thread) {
             goto NEXT;
@@ -140,8 +153,8 @@ trim_trace(const char *filename, struct trim_options *options)
         /* If this call is included in the user-specified call set,
          * then require it (and all dependencies) in the trimmed
          * output. */
-        if (options->calls.contains(*call) ||
-            options->frames.contains(frame, call->flags)) {
+        if (calls.contains(*call) ||
+            frames.contains(frame, call->flags)) {
 
             writer.writeCall(call);
         }
@@ -151,7 +164,7 @@ trim_trace(const char *filename, struct trim_options *options)
             frame++;
         }
 
-        delete call;
+        p.recycle(call);
     }
 
     std::cerr << "Trimmed trace is available as " << options->output << "\n";
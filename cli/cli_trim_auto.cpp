@@ -24,6 +24,9 @@
  *
  **************************************************************************/
 
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sstream>
 #include <string.h>
 #include <limits.h> // for CHAR_MAX
@@ -160,6 +163,100 @@ struct trim_auto_options {
     TrimFlags trim_flags;
 };
 
+/*
+ * Where each call parsed in pass 1 starts, in parse order, spilled to a
+ * temporary file.  This allows pass 2 to jump over the calls which are not
+ * required, and to copy the others without decoding them, instead of
+ * parsing the whole trace again.
+ */
+class CallOffsets {
+public:
+    struct Record {
+        uint64_t chunk;
+        uint32_t offsetInChunk;
+        uint32_t next_call_no;
+        uint32_t call_no;
+        /* Whether parsing can resume here, i.e., no calls were pending. */
+        uint32_t resumable;
+
+        void
+        getBookmark(trace::ParseBookmark &bookmark) const {
+            bookmark.offset = trace::File::Offset(chunk, offsetInChunk);
+            bookmark.next_call_no = next_call_no;
+        }
+    };
+
+    CallOffsets() {
+        file = tmpfile();
+    }
+
+    ~CallOffsets() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    bool
+    isOpen(void) const {
+        return file != NULL;
+    }
+
+    bool
+    append(const trace::ParseBookmark &bookmark, trace::CallNo call_no, bool resumable) {
+        Record record;
+        record.chunk = bookmark.offset.chunk;
+        record.offsetInChunk = bookmark.offset.offsetInChunk;
+        record.next_call_no = bookmark.next_call_no;
+        record.call_no = call_no;
+        record.resumable = resumable;
+        return fwrite(&record, sizeof record, 1, file) == 1;
+    }
+
+    void
+    rewind(void) {
+        fflush(file);
+        ::rewind(file);
+    }
+
+    bool
+    read(Record &record) {
+        return fread(&record, sizeof record, 1, file) == 1;
+    }
+
+private:
+    FILE *file;
+};
+
+struct CallsetPrinter {
+    int first;
+    int last;
+
+    CallsetPrinter() :
+        first(-1),
+        last(-1)
+    {}
+
+    void
+    add(trace::CallNo call_no) {
+        if (first < 0) {
+            first = call_no;
+            printf ("%d", first);
+        } else if ((int)call_no != last + 1) {
+            if (last != first)
+                printf ("-%d", last);
+            first = call_no;
+            printf (",%d", first);
+        }
+        last = call_no;
+    }
+
+    void
+    finish(void) {
+        if (last != first)
+            printf ("-%d\n", last);
+    }
+};
+
 static int
 trim_trace(const char *filename, struct trim_auto_options *options)
 {
@@ -168,7 +265,7 @@ trim_trace(const char *filename, struct trim_auto_options *options)
     TraceAnalyzer analyzer(options->trim_flags);
     trace::FastCallSet *required;
     unsigned frame;
-    int call_range_first, call_range_last;
+    CallsetPrinter callset;
 
     if (!p.open(filename)) {
         std::cerr << "error: failed to open " << filename << "\n";
@@ -178,20 +275,57 @@ trim_trace(const char *filename, struct trim_auto_options *options)
     /* Mark the beginning so we can return here for pass 2. */
     p.getBookmark(beginning);
 
+    /* Record where each call starts if we can seek back to it. */
+    CallOffsets *offsets = NULL;
+    if (p.supportsOffsets()) {
+        offsets = new CallOffsets;
+        if (!offsets->isOpen()) {
+            delete offsets;
+            offsets = NULL;
+        }
+    }
+
     /* In pass 1, analyze which calls are needed. */
     frame = 0;
+    trace::CallSet::Cursor calls(options->calls);
+    trace::CallSet::Cursor frames(options->frames);
+
     trace::Call *call;
-    while ((call = p.parse_call())) {
+    trace::ParseBookmark bookmark;
+    bool resumable = true;
+    while (true) {
+        if (offsets) {
+            p.getBookmark(bookmark);
+            resumable = !p.hasPendingCalls();
+        }
+
+        call = p.parse_call();
+        if (!call) {
+            break;
+        }
 
         /* There's no use doing any work past the last call and frame
          * requested by the user. */
         if ((options->calls.empty() || call->no > options->calls.getLast()) &&
             (options->frames.empty() || frame > options->frames.getLast())) {
 
-            delete call;
+            p.recycle(call);
             break;
         }
 
+        if (offsets && !offsets->append(bookmark, call->no, resumable)) {
+            std::cerr << "warning: failed to record call offsets\n";
+            delete offsets;
+            offsets = NULL;
+        }
+
+        /* Patches of mapped buffers are relative to every earlier patch
+         * of the same buffer, from any thread, so keep them all. */
+        if (strcmp(call->name(), "memcpy_patch") == 0) {
+            analyzer.require(call);
+            goto NEXT;
+        }
+
         /* If requested, ignore all calls not belonging to the specified thread. */
         if (options->thread != -1 && call->thread_id != options->thread) {
             goto NEXT;
@@ -205,8 +339,8 @@ trim_trace(const char *filename, struct trim_auto_options *options)
         /* If this call is included in the user-specified call set,
          * then require it (and all dependencies) in the trimmed
          * output. */
-        if (options->calls.contains(*call) ||
-            options->frames.contains(frame, call->flags)) {
+        if (calls.contains(*call) ||
+            frames.contains(frame, call->flags)) {
 
             analyzer.require(call);
         }
@@ -223,7 +357,7 @@ trim_trace(const char *filename, struct trim_auto_options *options)
         if (call->flags & trace::CALL_FLAG_END_FRAME)
             frame++;
 
-        delete call;
+        p.recycle(call);
     }
 
     /* Prepare output file and writer for output. */
@@ -237,56 +371,114 @@ trim_trace(const char *filename, struct trim_auto_options *options)
     trace::Writer writer;
     if (!writer.open(options->output.c_str())) {
         std::cerr << "error: failed to create " << options->output << "\n";
+        delete offsets;
         return 1;
     }
 
-    /* Reset bookmark for pass 2. */
-    p.setBookmark(beginning);
-
-    /* In pass 2, emit the calls that are required. */
+    /* In pass 2, emit the calls that are required.  No more are added, so
+     * merge them into a single run of ranges, to be stepped through in
+     * call order. */
     required = analyzer.get_required();
+    required->compact();
+    trace::FastCallSet::Cursor required_cursor(*required);
+
+    /* Calls are copied as they are, so there's no need to decode them. */
+    p.setLazyArgs(true);
+
+    if (offsets) {
+        /* Go through the calls in the order pass 1 parsed them, only
+         * seeking when a required call doesn't follow the last one
+         * emitted.  Seeking to a call which isn't resumable means
+         * seeking to the last one which is instead, and parsing the
+         * calls in between again. */
+        CallOffsets::Record record, resume;
+        size_t since_resume = 0;
+        bool positioned = false;
+
+        offsets->rewind();
+        while (offsets->read(record)) {
+            if (record.resumable) {
+                resume = record;
+                since_resume = 0;
+            } else {
+                ++since_resume;
+            }
 
-    frame = 0;
-    call_range_first = -1;
-    call_range_last = -1;
-    while ((call = p.parse_call())) {
+            if (!required_cursor.contains(record.call_no)) {
+                positioned = false;
+                continue;
+            }
 
-        /* There's no use doing any work past the last call and frame
-         * requested by the user. */
-        if ((options->calls.empty() || call->no > options->calls.getLast()) &&
-            (options->frames.empty() || frame > options->frames.getLast())) {
+            if (!positioned) {
+                resume.getBookmark(bookmark);
+                p.setBookmark(bookmark);
+                for (size_t i = 0; i < since_resume; ++i) {
+                    p.recycle(p.parse_call());
+                }
+                positioned = true;
+            }
 
-            delete call;
-            break;
-        }
+            call = p.parse_call();
+            if (!call) {
+                std::cerr << "error: failed to parse call " << record.call_no << "\n";
+                delete offsets;
+                return 1;
+            }
+            assert(call->no == record.call_no);
 
-        if (required->contains(call->no)) {
             writer.writeCall(call);
 
             if (options->print_callset) {
-                if (call_range_first < 0) {
-                    call_range_first = call->no;
-                    printf ("%d", call_range_first);
-                } else if (call->no != call_range_last + 1) {
-                    if (call_range_last != call_range_first)
-                        printf ("-%d", call_range_last);
-                    call_range_first = call->no;
-                    printf (",%d", call_range_first);
-                }
-                call_range_last = call->no;
+                callset.add(call->no);
             }
+
+            p.recycle(call);
         }
 
-        if (call->flags & trace::CALL_FLAG_END_FRAME) {
-            frame++;
+        delete offsets;
+    } else {
+        /* Reset bookmark for pass 2, or start over if the file doesn't
+         * support seeking. */
+        if (p.supportsOffsets()) {
+            p.setBookmark(beginning);
+        } else {
+            p.close();
+            if (!p.open(filename)) {
+                std::cerr << "error: failed to open " << filename << "\n";
+                return 1;
+            }
         }
 
-        delete call;
+        frame = 0;
+        while ((call = p.parse_call())) {
+
+            /* There's no use doing any work past the last call and frame
+             * requested by the user. */
+            if ((options->calls.empty() || call->no > options->calls.getLast()) &&
+                (options->frames.empty() || frame > options->frames.getLast())) {
+
+                p.recycle(call);
+                break;
+            }
+
+            if (required_cursor.contains(call->no)) {
+                writer.writeCall(call);
+
+                if (options->print_callset) {
+                    callset.add(call->no);
+                }
+            }
+
+            if (call->flags & trace::CALL_FLAG_END_FRAME) {
+                frame++;
+            }
+
+            p.recycle(call);
+        }
     }
 
     if (options->print_callset) {
-        if (call_range_last != call_range_first)
-            printf ("-%d\n", call_range_last);
+        callset.finish();
     }
 
     std::cerr << "Trimmed trace is available as " << options->output << "\n";
@@ -23,7 +23,7 @@
  *
  **************************************************************************/
 
-#include <sstream>
+#include <algorithm>
 
 #include "cli_trim_auto_analyzer.hpp"
 
@@ -39,131 +39,231 @@ TraceAnalyzer::renderingHasSideEffect(void)
     return transformFeedbackActive || framebufferObjectActive;
 }
 
-/* Provide: Record that the given call affects the given resource
- * as a side effect. */
 void
-TraceAnalyzer::provide(std::string resource, trace::CallNo call_no)
+CallRanges::add(trace::CallNo first, trace::CallNo last)
 {
-    resources[resource].insert(call_no);
+    /* Calls are mostly provided in increasing order, so try extending
+     * the last range first. */
+    if (!ranges.empty()) {
+        Range &back = ranges.back();
+        if (back.first <= first && first <= back.last + 1) {
+            if (last > back.last) {
+                back.last = last;
+            }
+            return;
+        }
+    }
+
+    bool sorted = normalizedSize == ranges.size() &&
+                  (ranges.empty() || first > ranges.back().last + 1);
+
+    ranges.push_back(Range(first, last));
+
+    if (sorted) {
+        normalizedSize = ranges.size();
+    } else if (ranges.size() > 2 * normalizedSize + 64) {
+        normalize();
+    }
 }
 
-/* Like provide, but with a simply-formatted string, (appending an
- * integer to the given string). */
 void
-TraceAnalyzer::providef(std::string resource,
-                        int resource_no,
-                        trace::CallNo call_no)
+CallRanges::add(const CallRanges &other)
 {
-    std::stringstream ss;
-    ss << resource << resource_no;
-    provide(ss.str(), call_no);
+    std::vector<Range>::const_iterator range;
+
+    if (other.normalizedSize != other.ranges.size() ||
+        normalizedSize != ranges.size()) {
+        for (range = other.ranges.begin(); range != other.ranges.end(); range++) {
+            add(range->first, range->last);
+        }
+        return;
+    }
+
+    /* Both are sorted, so just merge them. */
+    size_t middle = ranges.size();
+    ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+    std::inplace_merge(ranges.begin(), ranges.begin() + middle, ranges.end());
+    coalesce();
 }
 
-/* Link: Establish a dependency between resource 'resource' and
- * resource 'dependency'. This dependency is captured by name so
- * that if the list of calls that provide 'dependency' grows
- * before 'resource' is consumed, those calls will still be
- * captured. */
 void
-TraceAnalyzer::link(std::string resource, std::string dependency)
+CallRanges::clear(void)
 {
-    dependencies[resource].insert(dependency);
+    std::vector<Range>().swap(ranges);
+    normalizedSize = 0;
 }
 
-/* Like link, but with a simply-formatted string, (appending an
- * integer to the given string). */
+/* Normalize: Sort the ranges appended since last normalized, and merge
+ * them with the others. */
 void
-TraceAnalyzer::linkf(std::string resource, std::string dependency, int dep_no)
+CallRanges::normalize(void)
 {
+    if (normalizedSize == ranges.size()) {
+        return;
+    }
 
-    std::stringstream ss;
-    ss << dependency << dep_no;
-    link(resource, ss.str());
+    std::vector<Range>::iterator middle = ranges.begin() + normalizedSize;
+    std::sort(middle, ranges.end());
+    std::inplace_merge(ranges.begin(), middle, ranges.end());
+    coalesce();
 }
 
-/* Unlink: Remove dependency from 'resource' on 'dependency'. */
+/* Coalesce: Merge sorted ranges which overlap or are adjacent. */
 void
-TraceAnalyzer::unlink(std::string resource, std::string dependency)
+CallRanges::coalesce(void)
 {
-    dependencies[resource].erase(dependency);
-    if (dependencies[resource].size() == 0) {
-        dependencies.erase(resource);
+    size_t count = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (count && ranges[i].first <= ranges[count - 1].last + 1) {
+            if (ranges[i].last > ranges[count - 1].last) {
+                ranges[count - 1].last = ranges[i].last;
+            }
+        } else {
+            ranges[count++] = ranges[i];
+        }
     }
+    ranges.resize(count);
+
+    normalizedSize = count;
+}
+
+/* Lookup: Get the id of the given resource, assigning the next one the
+ * first time it's seen. */
+unsigned
+TraceAnalyzer::lookup(ResourceKind kind, unsigned a, unsigned b)
+{
+    unsigned long long key = (unsigned long long)a << 32 | b;
+    std::unordered_map<unsigned long long, unsigned>::iterator it;
+
+    it = resourceIds[kind].find(key);
+    if (it != resourceIds[kind].end()) {
+        return it->second;
+    }
+
+    unsigned id = resources.size();
+    resources.resize(id + 1);
+    resourceIds[kind][key] = id;
+    return id;
+}
+
+/* Provide: Record that the given call affects the given resource
+ * as a side effect. */
+void
+TraceAnalyzer::provide(unsigned resource, trace::CallNo call_no)
+{
+    resources[resource].calls.add(call_no);
+    changed(resource);
 }
 
-/* Like unlink, but with a simply-formated string, (appending an
- * integer to the given string). */
+/* Like provide, but for all the given calls. */
 void
-TraceAnalyzer::unlinkf(std::string resource, std::string dependency, int dep_no)
+TraceAnalyzer::provide(unsigned resource, const CallRanges &calls)
 {
+    resources[resource].calls.add(calls);
+    changed(resource);
+}
 
-    std::stringstream ss;
-    ss << dependency << dep_no;
-    unlink(resource, ss.str());
+/* Unprovide all: Forget all the calls providing 'resource'. */
+void
+TraceAnalyzer::unprovideAll(unsigned resource)
+{
+    resources[resource].calls.clear();
+    changed(resource);
+
+    if (resource == RESOURCE_FRAMEBUFFER) {
+        renderStateInFramebuffer = false;
+    } else if (resource == RESOURCE_STATE) {
+        renderStateInState = false;
+    }
+}
+
+/* Link: Establish a dependency between resource 'resource' and
+ * resource 'dependency'. This dependency is captured by id so
+ * that if the list of calls that provide 'dependency' grows
+ * before 'resource' is consumed, those calls will still be
+ * captured. */
+void
+TraceAnalyzer::link(unsigned resource, unsigned dependency)
+{
+    std::vector<unsigned> &deps = resources[resource].dependencies;
+    std::vector<unsigned>::iterator dep;
+
+    dep = std::lower_bound(deps.begin(), deps.end(), dependency);
+    if (dep == deps.end() || *dep != dependency) {
+        deps.insert(dep, dependency);
+        changed(resource);
+    }
+}
+
+/* Unlink: Remove dependency from 'resource' on 'dependency'. */
+void
+TraceAnalyzer::unlink(unsigned resource, unsigned dependency)
+{
+    std::vector<unsigned> &deps = resources[resource].dependencies;
+    std::vector<unsigned>::iterator dep;
+
+    dep = std::lower_bound(deps.begin(), deps.end(), dependency);
+    if (dep != deps.end() && *dep == dependency) {
+        deps.erase(dep);
+        changed(resource);
+    }
 }
 
 /* Unlink all: Remove dependencies from 'resource' to all other
  * resources. */
 void
-TraceAnalyzer::unlinkAll(std::string resource)
+TraceAnalyzer::unlinkAll(unsigned resource)
 {
-    dependencies.erase(resource);
+    std::vector<unsigned>().swap(resources[resource].dependencies);
+    changed(resource);
 }
 
-/* Resolve: Recursively compute all calls providing 'resource',
- * (including linked dependencies of 'resource' on other
- * resources). */
-std::set<unsigned>
-TraceAnalyzer::resolve(std::string resource)
+/* Resolve: Compute all calls providing 'resource', (including linked
+ * dependencies of 'resource' on other resources, chased with a
+ * worklist, visiting each resource once). */
+void
+TraceAnalyzer::resolve(unsigned resource, CallRanges &calls)
 {
-    std::set<std::string> *deps;
-    std::set<std::string>::iterator dep;
+    unsigned visit = ++resolveCount;
 
-    std::set<unsigned> *calls;
-    std::set<unsigned>::iterator call;
+    worklist.clear();
+    worklist.push_back(resource);
+    resources[resource].visited = visit;
 
-    std::set<unsigned> result, deps_set;
+    while (!worklist.empty()) {
+        Resource &res = resources[worklist.back()];
+        worklist.pop_back();
 
-    /* Recursively chase dependencies. */
-    if (dependencies.count(resource)) {
-        deps = &dependencies[resource];
-        for (dep = deps->begin(); dep != deps->end(); dep++) {
-            deps_set = resolve(*dep);
-            for (call = deps_set.begin(); call != deps_set.end(); call++) {
-                result.insert(*call);
-            }
-        }
-    }
+        res.calls.normalize();
+        calls.add(res.calls);
 
-    /* Also look for calls that directly provide 'resource' */
-    if (resources.count(resource)) {
-        calls = &resources[resource];
-        for (call = calls->begin(); call != calls->end(); call++) {
-            result.insert(*call);
+        std::vector<unsigned>::const_iterator dep;
+        for (dep = res.dependencies.begin(); dep != res.dependencies.end(); dep++) {
+            if (resources[*dep].visited != visit) {
+                resources[*dep].visited = visit;
+                worklist.push_back(*dep);
+            }
         }
     }
 
-    return result;
+    calls.normalize();
 }
 
 /* Consume: Resolve all calls that provide the given resource, and
  * add them to the required list. Then clear the call list for
  * 'resource' along with any dependencies. */
 void
-TraceAnalyzer::consume(std::string resource)
+TraceAnalyzer::consume(unsigned resource)
 {
+    CallRanges calls;
 
-    std::set<unsigned> calls;
-    std::set<unsigned>::iterator call;
+    resolve(resource, calls);
 
-    calls = resolve(resource);
+    unlinkAll(resource);
+    unprovideAll(resource);
 
-    dependencies.erase(resource);
-    resources.erase(resource);
-
-    for (call = calls.begin(); call != calls.end(); call++) {
-        required.add(*call);
-    }
+    /* The resolved ranges are sorted, so add them at once. */
+    required.add(calls.ranges);
 }
 
 void
@@ -253,8 +353,8 @@ TraceAnalyzer::stateTrackPostCall(trace::Call *call)
      * next frame. */
     if (call->flags & trace::CALL_FLAG_SWAP_RENDERTARGET &&
         call->flags & trace::CALL_FLAG_END_FRAME) {
-        dependencies.erase("framebuffer");
-        resources.erase("framebuffer");
+        unlinkAll(RESOURCE_FRAMEBUFFER);
+        unprovideAll(RESOURCE_FRAMEBUFFER);
         return;
     }
 
@@ -286,7 +386,7 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
         if (textures) {
             for (i = 0; i < textures->size(); i++) {
                 texture = textures->values[i]->toUInt();
-                providef("texture-", texture, call->no);
+                provide(this->texture(texture), call->no);
             }
         }
         return true;
@@ -301,28 +401,26 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
 
         texture = call->arg(3).toUInt();
 
-        linkf("render-state", "texture-", texture);
+        link(RESOURCE_RENDER_STATE, this->texture(texture));
 
-        provide("state", call->no);
+        provide(RESOURCE_STATE, call->no);
     }
 
     if (strcmp(name, "glBindTexture") == 0) {
         GLenum target;
         GLuint texture;
-
-        std::stringstream ss_target, ss_texture;
+        unsigned unit_target;
 
         target = static_cast<GLenum>(call->arg(0).toSInt());
         texture = call->arg(1).toUInt();
 
-        ss_target << "texture-unit-" << activeTextureUnit << "-target-" << target;
-        ss_texture << "texture-" << texture;
+        unit_target = textureUnitTarget(activeTextureUnit, target);
 
-        resources.erase(ss_target.str());
-        provide(ss_target.str(), call->no);
+        unprovideAll(unit_target);
+        provide(unit_target, call->no);
 
-        unlinkAll(ss_target.str());
-        link(ss_target.str(), ss_texture.str());
+        unlinkAll(unit_target);
+        link(unit_target, this->texture(texture));
 
         /* FIXME: This really shouldn't be necessary. The effect
          * this provide() has is that all glBindTexture calls will
@@ -336,7 +434,7 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
          *
          * More investigation is necessary, but for now, be
          * conservative and don't trim. */
-        provide("state", call->no);
+        provide(RESOURCE_STATE, call->no);
 
         return true;
     }
@@ -351,25 +449,15 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glInvalidateTexImage") == 0 ||
         strcmp(name, "glInvalidateTexSubImage") == 0) {
 
-        std::set<unsigned> *calls;
-        std::set<unsigned>::iterator c;
-        std::stringstream ss_target, ss_texture;
-
         GLenum target = static_cast<GLenum>(call->arg(0).toSInt());
 
-        ss_target << "texture-unit-" << activeTextureUnit << "-target-" << target;
-        ss_texture << "texture-" << texture_map[target];
+        unsigned unit_target = textureUnitTarget(activeTextureUnit, target);
+        unsigned texture = this->texture(texture_map[target]);
 
         /* The texture resource depends on this call and any calls
          * providing the given texture target. */
-        provide(ss_texture.str(), call->no);
-
-        if (resources.count(ss_target.str())) {
-            calls = &resources[ss_target.str()];
-            for (c = calls->begin(); c != calls->end(); c++) {
-                provide(ss_texture.str(), *c);
-            }
-        }
+        provide(texture, call->no);
+        provide(texture, resources[unit_target].calls);
 
         return true;
     }
@@ -384,14 +472,10 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
             cap == GL_TEXTURE_3D ||
             cap == GL_TEXTURE_CUBE_MAP)
         {
-            std::stringstream ss;
-
-            ss << "texture-unit-" << activeTextureUnit << "-target-" << cap;
-
-            link("render-state", ss.str());
+            link(RESOURCE_RENDER_STATE, textureUnitTarget(activeTextureUnit, cap));
         }
 
-        provide("state", call->no);
+        provide(RESOURCE_STATE, call->no);
         return true;
     }
 
@@ -405,14 +489,10 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
             cap == GL_TEXTURE_3D ||
             cap == GL_TEXTURE_CUBE_MAP)
         {
-            std::stringstream ss;
-
-            ss << "texture-unit-" << activeTextureUnit << "-target-" << cap;
-
-            unlink("render-state", ss.str());
+            unlink(RESOURCE_RENDER_STATE, textureUnitTarget(activeTextureUnit, cap));
         }
 
-        provide("state", call->no);
+        provide(RESOURCE_STATE, call->no);
         return true;
     }
 
@@ -427,7 +507,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glCreateShaderObjectARB") == 0) {
 
         GLuint shader = call->ret->toUInt();
-        providef("shader-", shader, call->no);
+        provide(this->shader(shader), call->no);
         return true;
     }
 
@@ -439,7 +519,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glGetShaderInfoLog") == 0) {
 
         GLuint shader = call->arg(0).toUInt();
-        providef("shader-", shader, call->no);
+        provide(this->shader(shader), call->no);
         return true;
     }
 
@@ -447,7 +527,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glCreateProgramObjectARB") == 0) {
 
         GLuint program = call->ret->toUInt();
-        providef("program-", program, call->no);
+        provide(this->program(program), call->no);
         return true;
     }
 
@@ -455,16 +535,12 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glAttachObjectARB") == 0) {
 
         GLuint program, shader;
-        std::stringstream ss_program, ss_shader;
 
         program = call->arg(0).toUInt();
         shader = call->arg(1).toUInt();
 
-        ss_program << "program-" << program;
-        ss_shader << "shader-" << shader;
-
-        link(ss_program.str(), ss_shader.str());
-        provide(ss_program.str(), call->no);
+        link(this->program(program), this->shader(shader));
+        provide(this->program(program), call->no);
 
         return true;
     }
@@ -473,15 +549,11 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glDetachObjectARB") == 0) {
 
         GLuint program, shader;
-        std::stringstream ss_program, ss_shader;
 
         program = call->arg(0).toUInt();
         shader = call->arg(1).toUInt();
 
-        ss_program << "program-" << program;
-        ss_shader << "shader-" << shader;
-
-        unlink(ss_program.str(), ss_shader.str());
+        unlink(this->program(program), this->shader(shader));
 
         return true;
     }
@@ -493,20 +565,16 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
 
         program = call->arg(0).toUInt();
 
-        unlinkAll("render-program-state");
+        unlinkAll(RESOURCE_RENDER_PROGRAM_STATE);
 
         if (program == 0) {
-            unlink("render-state", "render-program-state");
-            provide("state", call->no);
+            unlink(RESOURCE_RENDER_STATE, RESOURCE_RENDER_PROGRAM_STATE);
+            provide(RESOURCE_STATE, call->no);
         } else {
-            std::stringstream ss;
+            link(RESOURCE_RENDER_STATE, RESOURCE_RENDER_PROGRAM_STATE);
+            link(RESOURCE_RENDER_PROGRAM_STATE, this->program(program));
 
-            ss << "program-" << program;
-
-            link("render-state", "render-program-state");
-            link("render-program-state", ss.str());
-
-            provide(ss.str(), call->no);
+            provide(this->program(program), call->no);
         }
 
         return true;
@@ -523,7 +591,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
 
         GLuint program = call->arg(0).toUInt();
 
-        providef("program-", program, call->no);
+        provide(this->program(program), call->no);
 
         return true;
     }
@@ -534,7 +602,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
     if (call->sig->num_args > 0 &&
         strcmp(call->sig->arg_names[0], "location") == 0) {
 
-        providef("program-", activeProgram, call->no);
+        provide(program(activeProgram), call->no);
 
         /* We can't easily tell if this uniform is being used to
          * associate a sampler in the shader with a texture
@@ -550,23 +618,19 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
             GLint max_unit = MAX(GL_MAX_TEXTURE_COORDS, GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS);
 
             GLint unit = call->arg(1).toSInt();
-            std::stringstream ss_program;
-            std::stringstream ss_texture;
 
             if (unit < max_unit) {
-
-                ss_program << "program-" << activeProgram;
-
-                ss_texture << "texture-unit-" << GL_TEXTURE0 + unit << "-target-";
+                unsigned active_program = program(activeProgram);
+                GLenum texture_unit = GL_TEXTURE0 + unit;
 
                 /* We don't know what target(s) might get bound to
                  * this texture unit, so conservatively link to
                  * all. Only bound textures will actually get inserted
                  * into the output call stream. */
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_1D);
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_2D);
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_3D);
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_CUBE_MAP);
+                link(active_program, textureUnitTarget(texture_unit, GL_TEXTURE_1D));
+                link(active_program, textureUnitTarget(texture_unit, GL_TEXTURE_2D));
+                link(active_program, textureUnitTarget(texture_unit, GL_TEXTURE_3D));
+                link(active_program, textureUnitTarget(texture_unit, GL_TEXTURE_CUBE_MAP));
             }
         }
 
@@ -589,7 +653,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
           strcmp(call->sig->arg_names[0], "programObj") == 0))) {
 
         GLuint program = call->arg(0).toUInt();
-        providef("program-", program, call->no);
+        provide(this->program(program), call->no);
         return true;
     }
 
@@ -606,23 +670,33 @@ TraceAnalyzer::recordDrawingSideEffects(trace::Call *call, const char *name)
     if (call->flags & trace::CALL_FLAG_RENDER ||
         insideBeginEnd) {
 
-        std::set<unsigned> calls;
-        std::set<unsigned>::iterator c;
-
-        provide("framebuffer", call->no);
-
-        calls = resolve("render-state");
+        provide(RESOURCE_FRAMEBUFFER, call->no);
+
+        /* Consecutive draws often share the same render state, so
+         * only resolve it again after something changed, and don't
+         * provide the same calls twice.  This relies on nothing ever
+         * depending on "state" or "framebuffer", whose changes aren't
+         * counted. */
+        if (renderStateChangeCount != changeCount) {
+            renderStateCalls.clear();
+            resolve(RESOURCE_RENDER_STATE, renderStateCalls);
+            renderStateChangeCount = changeCount;
+            renderStateInFramebuffer = false;
+            renderStateInState = false;
+        }
 
-        for (c = calls.begin(); c != calls.end(); c++) {
-            provide("framebuffer", *c);
+        if (!renderStateInFramebuffer) {
+            provide(RESOURCE_FRAMEBUFFER, renderStateCalls);
+            renderStateInFramebuffer = true;
         }
 
         /* In some cases, rendering has side effects beyond the
          * framebuffer update. */
         if (renderingHasSideEffect()) {
-            provide("state", call->no);
-            for (c = calls.begin(); c != calls.end(); c++) {
-                provide("state", *c);
+            provide(RESOURCE_STATE, call->no);
+            if (!renderStateInState) {
+                provide(RESOURCE_STATE, renderStateCalls);
+                renderStateInState = true;
             }
         }
 
@@ -656,14 +730,14 @@ TraceAnalyzer::recordSideEffects(trace::Call *call)
      * lists will work, but does not trim out unused display
      * lists. */
     if (insideNewEndList != 0) {
-        provide("state", call->no);
+        provide(RESOURCE_STATE, call->no);
 
         /* Also, any texture bound inside a display list is
          * conservatively considered required. */
         if (strcmp(name, "glBindTexture") == 0) {
             GLuint texture = call->arg(1).toUInt();
 
-            linkf("state", "texture-", texture);
+            link(RESOURCE_STATE, this->texture(texture));
         }
 
         return;
@@ -698,24 +772,35 @@ TraceAnalyzer::recordSideEffects(trace::Call *call)
     }
 
     /* By default, assume this call affects the state somehow. */
-    resources["state"].insert(call->no);
+    provide(RESOURCE_STATE, call->no);
 }
 
 void
 TraceAnalyzer::requireDependencies(trace::Call *call)
 {
 
+    /* Patches of mapped buffers only depend on the earlier patches, which
+     * are all required. */
+    if (strcmp(call->name(), "memcpy_patch") == 0) {
+        return;
+    }
+
     /* Swap-buffers calls depend on framebuffer state. */
     if (call->flags & trace::CALL_FLAG_SWAP_RENDERTARGET &&
         call->flags & trace::CALL_FLAG_END_FRAME) {
-        consume("framebuffer");
+        consume(RESOURCE_FRAMEBUFFER);
     }
 
     /* By default, just assume this call depends on generic state. */
-    consume("state");
+    consume(RESOURCE_STATE);
 }
 
 TraceAnalyzer::TraceAnalyzer(TrimFlags trimFlagsOpt):
+    resolveCount(0),
+    changeCount(1),
+    renderStateChangeCount(0),
+    renderStateInFramebuffer(false),
+    renderStateInState(false),
     transformFeedbackActive(false),
     framebufferObjectActive(false),
     insideBeginEnd(false),
@@ -723,7 +808,11 @@ TraceAnalyzer::TraceAnalyzer(TrimFlags trimFlagsOpt):
     activeTextureUnit(GL_TEXTURE0),
     trimFlags(trimFlagsOpt)
 {
-    /* Nothing needed. */
+    /* The resources without numbers get the first ids, in order. */
+    lookup(RESOURCE_STATE);
+    lookup(RESOURCE_FRAMEBUFFER);
+    lookup(RESOURCE_RENDER_STATE);
+    lookup(RESOURCE_RENDER_PROGRAM_STATE);
 }
 
 TraceAnalyzer::~TraceAnalyzer()
@@ -23,7 +23,10 @@
  *
  **************************************************************************/
 
-#include <set>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <GL/gl.h>
 #include <GL/glext.h>
@@ -52,10 +55,79 @@ enum {
     TRIM_FLAG_DRAWING			= (1 << 3),
 };
 
+/**
+ * Ranges of call numbers, appended in any order, and sorted and merged
+ * whenever they grow too much, or before being read.  Adding ranges in
+ * increasing order, or sorted ranges to sorted ranges, keeps them sorted.
+ */
+class CallRanges {
+public:
+    typedef trace::FastCallRange Range;
+
+    trace::FastCallRangeList ranges;
+
+    CallRanges() : normalizedSize(0) {}
+
+    bool empty(void) const { return ranges.empty(); }
+
+    void add(trace::CallNo first, trace::CallNo last);
+    void add(trace::CallNo call_no) { add(call_no, call_no); }
+    void add(const CallRanges &other);
+
+    void clear(void);
+
+    void normalize(void);
+
+private:
+    /* Number of ranges, from the start, which are sorted and merged. */
+    size_t normalizedSize;
+
+    void coalesce(void);
+};
+
 class TraceAnalyzer {
 private:
-    std::map<std::string, std::set<unsigned> > resources;
-    std::map<std::string, std::set<std::string> > dependencies;
+    /* Kinds of resources, which are all identified by a dense id, along
+     * with up to two numbers (e.g., texture name, or texture unit and
+     * target). */
+    enum ResourceKind {
+        RESOURCE_STATE,
+        RESOURCE_FRAMEBUFFER,
+        RESOURCE_RENDER_STATE,
+        RESOURCE_RENDER_PROGRAM_STATE,
+        RESOURCE_TEXTURE,
+        RESOURCE_TEXTURE_UNIT_TARGET,
+        RESOURCE_SHADER,
+        RESOURCE_PROGRAM,
+        RESOURCE_KIND_COUNT
+    };
+
+    struct Resource {
+        /* Calls providing this resource directly. */
+        CallRanges calls;
+        /* Resources this one depends on, sorted. */
+        std::vector<unsigned> dependencies;
+        /* Last resolve() which visited this resource. */
+        unsigned visited;
+
+        Resource() : visited(0) {}
+    };
+
+    std::vector<Resource> resources;
+    std::unordered_map<unsigned long long, unsigned> resourceIds[RESOURCE_KIND_COUNT];
+    unsigned resolveCount;
+    std::vector<unsigned> worklist;
+
+    /* Number of changes to resources which may be depended upon (i.e.,
+     * all but "state" and "framebuffer"), and the calls providing
+     * "render-state" as of that many changes. */
+    unsigned long long changeCount;
+    unsigned long long renderStateChangeCount;
+    CallRanges renderStateCalls;
+    /* Whether those calls were provided to "framebuffer" and "state"
+     * since they were last cleared. */
+    bool renderStateInFramebuffer;
+    bool renderStateInState;
 
     std::map<GLenum, unsigned> texture_map;
 
@@ -69,15 +141,27 @@ private:
     GLuint activeProgram;
     unsigned int trimFlags;
 
-    void provide(std::string resource, trace::CallNo call_no);
-    void providef(std::string resource, int resource_no, trace::CallNo call_no);
+    unsigned lookup(ResourceKind kind, unsigned a = 0, unsigned b = 0);
+    unsigned texture(GLuint texture) { return lookup(RESOURCE_TEXTURE, texture); }
+    unsigned textureUnitTarget(GLenum unit, GLenum target) {
+        return lookup(RESOURCE_TEXTURE_UNIT_TARGET, unit, target);
+    }
+    unsigned shader(GLuint shader) { return lookup(RESOURCE_SHADER, shader); }
+    unsigned program(GLuint program) { return lookup(RESOURCE_PROGRAM, program); }
+
+    void changed(unsigned resource) {
+        if (resource != RESOURCE_STATE && resource != RESOURCE_FRAMEBUFFER) {
+            ++changeCount;
+        }
+    }
 
-    void link(std::string resource, std::string dependency);
-    void linkf(std::string resource, std::string dependency, int dep_no);
+    void provide(unsigned resource, trace::CallNo call_no);
+    void provide(unsigned resource, const CallRanges &calls);
+    void unprovideAll(unsigned resource);
 
-    void unlink(std::string resource, std::string dependency);
-    void unlinkf(std::string resource, std::string dependency, int dep_no);
-    void unlinkAll(std::string resource);
+    void link(unsigned resource, unsigned dependency);
+    void unlink(unsigned resource, unsigned dependency);
+    void unlinkAll(unsigned resource);
 
     void stateTrackPreCall(trace::Call *call);
 
@@ -90,9 +174,9 @@ private:
     void stateTrackPostCall(trace::Call *call);
 
     bool renderingHasSideEffect(void);
-    std::set<unsigned> resolve(std::string resource);
+    void resolve(unsigned resource, CallRanges &calls);
 
-    void consume(std::string resource);
+    void consume(unsigned resource);
     void requireDependencies(trace::Call *call);
 
 public:
@@ -87,6 +87,13 @@ void
 breakpoint(void);
 
 
+/**
+ * Number of processors currently online (at least 1).
+ */
+unsigned
+getNumberOfProcessors(void);
+
+
 void setExceptionCallback(void (*callback)(void));
 void resetExceptionCallback(void);
 
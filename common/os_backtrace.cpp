@@ -35,17 +35,25 @@
 #include <set>
 #include <vector>
 #include "os.hpp"
+#include "os_thread.hpp"
 
 #if defined(ANDROID)
 #  include <dlfcn.h>
+#  include <map>
+#  include <string>
 #elif HAVE_BACKTRACE
 #  include <stdint.h>
+#  include <stdio.h>
 #  include <dlfcn.h>
+#  include <elf.h>
+#  include <link.h>
 #  include <unistd.h>
 #  include <map>
+#  include <string>
 #  include <vector>
 #  include <cxxabi.h>
 #  include <backtrace.h>
+#  include <backtrace-supported.h>
 #endif
 
 
@@ -122,6 +130,12 @@ bool backtrace_is_needed(const char* fname) {
     return backtraceFunctionNamePrefixes.contain(fname);
 }
 
+bool backtrace_is_deferred(void) {
+    static bool deferred = getenv("APITRACE_BACKTRACE_DEFERRED") &&
+                           atoi(getenv("APITRACE_BACKTRACE_DEFERRED")) != 0;
+    return deferred;
+}
+
 #if defined(ANDROID)
 
 /* The following two declarations are copied from Android sources */
@@ -161,6 +175,7 @@ private:
     void (*dumpBacktrace)(const DebugOutputTarget*, void*);
     DebugOutputTarget debugTarget;
     Id nextFrameId;
+    std::map<std::string, Id> frameIds;
 public:
     DalvikBacktraceProvider() {
         nextFrameId = 0;
@@ -226,12 +241,19 @@ public:
         char* rawBacktrace_it = rawBacktrace;
         while (*rawBacktrace_it != '\0') {
             RawStackFrame stackFrame;
-            // TODO: Keep a cache of stack frames
-            stackFrame.id = nextFrameId++;
             /* skip leading space */
             while (*rawBacktrace_it == ' ') {
                 rawBacktrace_it++;
             }
+            /* Frames are identified by their text, which is parsed in place */
+            const char *line_end = strchr(rawBacktrace_it, '\n');
+            std::string line(rawBacktrace_it, line_end ? line_end - rawBacktrace_it
+                                                       : strlen(rawBacktrace_it));
+            std::map<std::string, Id>::iterator frameId = frameIds.find(line);
+            if (frameId == frameIds.end()) {
+                frameId = frameIds.insert(std::make_pair(line, nextFrameId++)).first;
+            }
+            stackFrame.id = frameId->second;
             /* Skip "at " */
             rawBacktrace_it += 3;
             stackFrame.function = rawBacktrace_it;
@@ -270,6 +292,8 @@ public:
 
 std::vector<RawStackFrame> get_backtrace() {
     static DalvikBacktraceProvider backtraceProvider;
+    static os::mutex mutex;
+    os::unique_lock<os::mutex> lock(mutex);
     return backtraceProvider.parseBacktrace(backtraceProvider.getBacktrace());
 }
 
@@ -277,6 +301,10 @@ void dump_backtrace() {
     /* TODO */
 }
 
+bool symbolize_frame(const RawStackFrame &frame, std::vector<RawStackFrame> &frames) {
+    return false;
+}
+
 
 #elif HAVE_BACKTRACE
 
@@ -331,14 +359,31 @@ static void dumpFrame(const RawStackFrame &frame)
 
 #define BT_DEPTH 10
 
+typedef std::map<uintptr_t, std::vector<RawStackFrame> > FrameCache;
+
+/*
+ * Frames of the PCs each thread has seen, copied from the shared cache, so
+ * that threads only contend for the mutex on PCs new to them.  These are
+ * never freed, like the threads' trace buffers.
+ */
+static OS_THREAD_SPECIFIC_PTR(FrameCache)
+thread_frame_cache;
+
 class libbacktraceProvider {
     struct backtrace_state *state;
     int skipFrames;
     Id nextFrameId;
-    std::map<uintptr_t, std::vector<RawStackFrame> > cache;
-    std::vector<RawStackFrame> *current, *current_frames;
+
+    /*
+     * The shared cache, and everything used to symbolize frames, is
+     * protected by the mutex.  Walking the stack is not.
+     */
+    os::mutex mutex;
+    FrameCache cache;
+    std::vector<RawStackFrame> *current_frames;
     RawStackFrame *current_frame;
     bool missingDwarf;
+    bool deferred;
 
     static void bt_err_callback(void *vdata, const char *msg, int errnum)
     {
@@ -394,23 +439,57 @@ class libbacktraceProvider {
                                        : pc - (uintptr_t)info.dli_fbase;
     }
 
-    static int bt_callback(void *vdata, uintptr_t pc)
+    /*
+     * Only record the module and the offset from its base, leaving the
+     * expensive DWARF lookup for `apitrace symbolize`.
+     */
+    static void dl_fill_raw(RawStackFrame *frame, uintptr_t pc)
     {
-        libbacktraceProvider *this_ = (libbacktraceProvider*)vdata;
-        std::vector<RawStackFrame> &frames = this_->cache[pc];
-        if (!frames.size()) {
+        Dl_info info = {0};
+        dladdr((void*)pc, &info);
+        frame->module = info.dli_fname;
+        frame->offset = pc - (uintptr_t)info.dli_fbase;
+    }
+
+    static void bt_walk_err_callback(void *vdata, const char *msg, int errnum)
+    {
+        if (errnum > 0)
+            os::log("libbacktrace: %s: %s\n", msg, strerror(errnum));
+        else if (errnum == 0)
+            os::log("libbacktrace: %s\n", msg);
+    }
+
+    static int bt_walk_callback(void *vdata, uintptr_t pc)
+    {
+        std::vector<uintptr_t> *pcs = (std::vector<uintptr_t> *)vdata;
+        pcs->push_back(pc);
+        return pcs->size() >= BT_DEPTH;
+    }
+
+    /*
+     * Frames of a PC, symbolized the first time any thread sees it.  Must be
+     * called with the mutex held.
+     */
+    const std::vector<RawStackFrame> &lookupFrames(uintptr_t pc)
+    {
+        std::vector<RawStackFrame> &frames = cache[pc];
+        if (!frames.size() && deferred) {
+            RawStackFrame frame;
+            dl_fill_raw(&frame, pc);
+            frame.id = nextFrameId++;
+            frames.push_back(frame);
+        } else if (!frames.size()) {
             RawStackFrame frame;
             dl_fill(&frame, pc);
-            this_->current_frame = &frame;
-            this_->current_frames = &frames;
-            backtrace_pcinfo(this_->state, pc, bt_full_callback, bt_err_callback, vdata);
+            current_frame = &frame;
+            current_frames = &frames;
+            backtrace_pcinfo(state, pc, bt_full_callback, bt_err_callback, this);
             if (!frames.size()) {
-                frame.id = this_->nextFrameId++;
+                frame.id = nextFrameId++;
                 frames.push_back(frame);
             }
         }
-        this_->current->insert(this_->current->end(), frames.begin(), frames.end());
-        return this_->current->size() >= BT_DEPTH;
+        return frames;
     }
 
     static int bt_full_dump_callback(void *vdata, uintptr_t pc,
@@ -441,16 +520,33 @@ class libbacktraceProvider {
 
 public:
     libbacktraceProvider():
-        state(backtrace_create_state(NULL, 0, bt_err_callback, NULL))
+        state(backtrace_create_state(NULL, 0, bt_err_callback, NULL)),
+        deferred(backtrace_is_deferred())
     {
         backtrace_simple(state, 0, bt_countskip, bt_err_callback, this);
     }
 
     std::vector<RawStackFrame> getParsedBacktrace()
     {
+        std::vector<uintptr_t> pcs;
+        pcs.reserve(BT_DEPTH);
+        backtrace_simple(state, skipFrames, bt_walk_callback, bt_walk_err_callback, &pcs);
+
+        FrameCache *local = thread_frame_cache;
+        if (!local) {
+            local = new FrameCache;
+            thread_frame_cache = local;
+        }
+
         std::vector<RawStackFrame> parsedBacktrace;
-        current = &parsedBacktrace;
-        backtrace_simple(state, skipFrames, bt_callback, bt_err_callback, this);
+        for (size_t i = 0; i < pcs.size() && parsedBacktrace.size() < BT_DEPTH; ++i) {
+            FrameCache::iterator it = local->find(pcs[i]);
+            if (it == local->end()) {
+                os::unique_lock<os::mutex> lock(mutex);
+                it = local->insert(std::make_pair(pcs[i], lookupFrames(pcs[i]))).first;
+            }
+            parsedBacktrace.insert(parsedBacktrace.end(), it->second.begin(), it->second.end());
+        }
         return parsedBacktrace;
     }
 
@@ -471,6 +567,141 @@ void dump_backtrace() {
 }
 
 
+/*
+ * Offline symbolization of frames captured with APITRACE_BACKTRACE_DEFERRED,
+ * loading the debug information of each module with its base at zero.
+ */
+class ModuleSymbolizer {
+    struct Module {
+        struct backtrace_state *state;
+        uintptr_t base;
+    };
+    std::map<std::string, Module> modules;
+
+    std::vector<RawStackFrame> *current_frames;
+    const RawStackFrame *current_frame;
+    const char *symname;
+    uintptr_t symval;
+
+    static void err_callback(void *vdata, const char *msg, int errnum)
+    {
+        // Missing debug information (errnum == -1) is common, and the
+        // symbol table is used instead
+    }
+
+    static int full_callback(void *vdata, uintptr_t pc,
+                             const char *file, int line, const char *func)
+    {
+        ModuleSymbolizer *this_ = (ModuleSymbolizer*)vdata;
+        if (!file && !func) {
+            return 0;
+        }
+        RawStackFrame frame = *this_->current_frame;
+        frame.filename = file;
+        frame.linenumber = file ? line : -1;
+        if (func) {
+            int status;
+            char *demangled = abi::__cxa_demangle(func, NULL, NULL, &status);
+            frame.function = demangled ? demangled : func;
+        }
+        this_->current_frames->push_back(frame);
+        return 0;
+    }
+
+    static void syminfo_callback(void *vdata, uintptr_t pc,
+                                 const char *symname, uintptr_t symval)
+    {
+        ModuleSymbolizer *this_ = (ModuleSymbolizer*)vdata;
+        this_->symname = symname;
+        this_->symval = symval;
+    }
+
+    /*
+     * Offsets are relative to the load address, which for non position
+     * independent executables is the address of the first segment.
+     */
+    static uintptr_t getBase(const char *filename)
+    {
+        uintptr_t base = 0;
+        FILE *fp = fopen(filename, "rb");
+        if (!fp) {
+            return base;
+        }
+        ElfW(Ehdr) ehdr;
+        if (fread(&ehdr, sizeof ehdr, 1, fp) == 1 &&
+            memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 &&
+            ehdr.e_type == ET_EXEC) {
+            for (unsigned i = 0; i < ehdr.e_phnum; ++i) {
+                ElfW(Phdr) phdr;
+                if (fseek(fp, ehdr.e_phoff + i * ehdr.e_phentsize, SEEK_SET) != 0 ||
+                    fread(&phdr, sizeof phdr, 1, fp) != 1) {
+                    break;
+                }
+                if (phdr.p_type == PT_LOAD) {
+                    base = phdr.p_vaddr & ~(uintptr_t)(phdr.p_align ? phdr.p_align - 1 : 0);
+                    break;
+                }
+            }
+        }
+        fclose(fp);
+        return base;
+    }
+
+public:
+    bool symbolize(const RawStackFrame &frame, std::vector<RawStackFrame> &frames)
+    {
+        // Without ELF/DWARF support libbacktrace can't even read the symbols
+        if (!BACKTRACE_SUPPORTED || !frame.module || frame.offset < 0) {
+            return false;
+        }
+
+        std::map<std::string, Module>::iterator it = modules.find(frame.module);
+        if (it == modules.end()) {
+            Module module;
+            module.state = NULL;
+            module.base = 0;
+            if (access(frame.module, R_OK) == 0) {
+                module.state = backtrace_create_state(strdup(frame.module), 0, err_callback, NULL);
+                module.base = getBase(frame.module);
+            }
+            it = modules.insert(std::make_pair(std::string(frame.module), module)).first;
+        }
+        const Module &module = it->second;
+        if (!module.state) {
+            return false;
+        }
+
+        uintptr_t pc = module.base + frame.offset;
+        size_t count = frames.size();
+
+        current_frame = &frame;
+        current_frames = &frames;
+        backtrace_pcinfo(module.state, pc, full_callback, err_callback, this);
+        if (frames.size() > count) {
+            return true;
+        }
+
+        symname = NULL;
+        backtrace_syminfo(module.state, pc, syminfo_callback, err_callback, this);
+        if (!symname) {
+            return false;
+        }
+        RawStackFrame symbolized = frame;
+        int status;
+        char *demangled = abi::__cxa_demangle(symname, NULL, NULL, &status);
+        symbolized.function = demangled ? demangled : symname;
+        symbolized.offset = pc - symval;
+        frames.push_back(symbolized);
+        return true;
+    }
+};
+
+bool symbolize_frame(const RawStackFrame &frame, std::vector<RawStackFrame> &frames) {
+    static ModuleSymbolizer symbolizer;
+    return symbolizer.symbolize(frame, frames);
+}
+
+
 #else /* !HAVE_BACKTRACE */
 
 std::vector<RawStackFrame> get_backtrace() {
@@ -480,6 +711,10 @@ std::vector<RawStackFrame> get_backtrace() {
 void dump_backtrace() {
 }
 
+bool symbolize_frame(const RawStackFrame &frame, std::vector<RawStackFrame> &frames) {
+    return false;
+}
+
 #endif
 
 
@@ -38,6 +38,19 @@ using trace::RawStackFrame;
 std::vector<RawStackFrame> get_backtrace();
 bool backtrace_is_needed(const char* fname);
 
+/*
+ * Whether backtraces only record the module and offset of each frame
+ * (APITRACE_BACKTRACE_DEFERRED), to be symbolized afterwards.
+ */
+bool backtrace_is_deferred(void);
+
+/*
+ * Resolve a frame recorded with just its module and offset, appending one
+ * frame per inlined function (innermost first).  Returns false when the
+ * module or its symbols are not available.
+ */
+bool symbolize_frame(const RawStackFrame &frame, std::vector<RawStackFrame> &frames);
+
 void dump_backtrace();
 
 
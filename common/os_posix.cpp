@@ -293,6 +293,14 @@ breakpoint(void)
 }
 
 
+unsigned
+getNumberOfProcessors(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (unsigned)count : 1;
+}
+
+
 static void (*gCallback)(void) = NULL;
 
 #define NUM_SIGNALS 16
@@ -0,0 +1,170 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Bump allocator for short-lived objects, such as the values of a call.
+ */
+
+#pragma once
+
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+
+
+namespace trace {
+
+
+class Arena
+{
+public:
+    enum {
+        ALIGNMENT = sizeof(double),
+        INLINE_SIZE = 256,
+        BLOCK_SIZE = 4096,
+    };
+
+private:
+    struct Block {
+        Block *next;
+        size_t size;
+        double data[1];
+    };
+
+    // The first few allocations are served from storage embedded in the
+    // arena itself, so that small calls need no heap allocation at all.
+    union {
+        double align;
+        char buf[INLINE_SIZE];
+    } initial;
+
+    char *ptr;
+    char *end;
+
+    // Blocks in use, and blocks released by reset() kept for reuse
+    Block *blocks;
+    Block *spare;
+
+    // Disallow copying
+    Arena(const Arena &);
+    Arena & operator = (const Arena &);
+
+    static void
+    freeBlocks(Block *block) {
+        while (block) {
+            Block *next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+
+    void *
+    allocateSlow(size_t size) {
+        Block *block;
+        if (size > BLOCK_SIZE / 2) {
+            // Dedicated block -- keep bumping in the current one
+            block = static_cast<Block *>(::operator new(offsetof(Block, data) + size));
+            block->size = size;
+            block->next = blocks;
+            blocks = block;
+            return block->data;
+        }
+
+        if (spare) {
+            block = spare;
+            spare = block->next;
+        } else {
+            block = static_cast<Block *>(::operator new(offsetof(Block, data) + BLOCK_SIZE));
+            block->size = BLOCK_SIZE;
+        }
+        block->next = blocks;
+        blocks = block;
+
+        char *p = reinterpret_cast<char *>(block->data);
+        ptr = p + size;
+        end = p + BLOCK_SIZE;
+        return p;
+    }
+
+public:
+    Arena() :
+        ptr(initial.buf),
+        end(initial.buf + sizeof initial.buf),
+        blocks(NULL),
+        spare(NULL)
+    {}
+
+    ~Arena() {
+        freeBlocks(blocks);
+        freeBlocks(spare);
+    }
+
+    /**
+     * Release everything allocated so far at once.  Regular blocks are kept
+     * for subsequent allocations, so an arena which is reset and reused for
+     * similarly sized contents stops touching the heap.
+     */
+    void
+    reset(void) {
+        while (blocks) {
+            Block *next = blocks->next;
+            if (blocks->size == BLOCK_SIZE) {
+                blocks->next = spare;
+                spare = blocks;
+            } else {
+                ::operator delete(blocks);
+            }
+            blocks = next;
+        }
+        ptr = initial.buf;
+        end = initial.buf + sizeof initial.buf;
+    }
+
+    /**
+     * Allocate size bytes, suitably aligned for any trace value.  The memory
+     * is only released when the arena is reset or destroyed.
+     */
+    inline void *
+    allocate(size_t size) {
+        size = (size + ALIGNMENT - 1) & ~size_t(ALIGNMENT - 1);
+        if (size <= size_t(end - ptr)) {
+            void *p = ptr;
+            ptr += size;
+            return p;
+        }
+        return allocateSlow(size);
+    }
+
+    template< class T >
+    inline T *
+    allocateArray(size_t count) {
+        return static_cast<T *>(allocate(count * sizeof(T)));
+    }
+};
+
+
+} /* namespace trace */
@@ -262,3 +262,119 @@ CallSet::CallSet(CallFlags freq): limits(std::numeric_limits<CallNo>::min(), std
     }
 }
 
+
+
+void
+CallSet::addRange(const CallRange & range)
+{
+    if (range.start > range.stop ||
+        range.freq == FREQUENCY_NONE) {
+        return;
+    }
+
+    if (empty()) {
+        limits.start = range.start;
+        limits.stop = range.stop;
+    } else {
+        if (range.start < limits.start)
+            limits.start = range.start;
+        if (range.stop > limits.stop)
+            limits.stop = range.stop;
+    }
+
+    if (range.step == 1 && range.freq == FREQUENCY_ALL) {
+        addInterval(range.start, range.stop);
+    } else {
+        addSteppedRange(range);
+    }
+}
+
+
+/*
+ * Merge the interval with those it overlaps or is adjacent to.  Intervals
+ * are usually added in order, which amounts to appending or extending the
+ * last one.
+ */
+void
+CallSet::addInterval(CallNo start, CallNo stop)
+{
+    // First interval ending at or after the one before start
+    IntervalList::iterator first = intervals.begin();
+    if (start > 0) {
+        first = std::lower_bound(intervals.begin(), intervals.end(), start - 1, intervalEndsBefore);
+    }
+
+    // First interval starting after the one after stop
+    IntervalList::iterator last = intervals.end();
+    if (stop < std::numeric_limits<CallNo>::max()) {
+        last = std::upper_bound(first, intervals.end(), stop + 1, intervalStartsAfter);
+    }
+
+    if (first == last) {
+        Interval interval;
+        interval.start = start;
+        interval.stop = stop;
+        intervals.insert(first, interval);
+        return;
+    }
+
+    first->start = std::min(first->start, start);
+    first->stop = std::max(last[-1].stop, stop);
+    intervals.erase(first + 1, last);
+}
+
+
+void
+CallSet::addSteppedRange(const CallRange & range)
+{
+    size_t i = std::upper_bound(ranges.begin(), ranges.end(), range.start, rangeStartsAfter) - ranges.begin();
+    ranges.insert(ranges.begin() + i, range);
+
+    maxStops.resize(ranges.size());
+    for (; i < ranges.size(); ++i) {
+        CallNo stop = ranges[i].stop;
+        maxStops[i] = i > 0 ? std::max(maxStops[i - 1], stop) : stop;
+    }
+}
+
+
+bool
+CallSet::Cursor::contains(CallNo callNo, CallFlags callFlags)
+{
+    if (callNo < last) {
+        return set->contains(callNo, callFlags);
+    }
+    last = callNo;
+
+    const IntervalList &intervals = set->intervals;
+    while (interval < intervals.size() &&
+           intervals[interval].stop < callNo) {
+        ++interval;
+    }
+    if (interval < intervals.size() &&
+        intervals[interval].start <= callNo) {
+        return true;
+    }
+
+    const RangeList &ranges = set->ranges;
+    while (next < ranges.size() &&
+           ranges[next].start <= callNo) {
+        active.push_back(next++);
+    }
+
+    bool found = false;
+    size_t i = 0;
+    while (i < active.size()) {
+        const CallRange &range = ranges[active[i]];
+        if (range.stop < callNo) {
+            active[i] = active.back();
+            active.pop_back();
+            continue;
+        }
+        if (range.contains(callNo, callFlags)) {
+            found = true;
+        }
+        ++i;
+    }
+    return found;
+}
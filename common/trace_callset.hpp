@@ -47,11 +47,11 @@
 #pragma once
 
 
+#include <algorithm>
 #include <limits>
-#include <list>
+#include <vector>
 
 #include "trace_model.hpp"
-#include "trace_fast_callset.hpp"
 
 namespace trace {
 
@@ -99,21 +99,71 @@ namespace trace {
 
 
     // A collection of call ranges
+    //
+    // Ranges of consecutive calls are kept merged into disjoint intervals,
+    // sorted by start, and the ranges with a step or frequency are kept
+    // sorted by start too, along with the highest stop up to each one, so
+    // that lookups take logarithmic time (plus the number of step or
+    // frequency ranges overlapping the call's).
     class CallSet
     {
     private:
         CallRange limits;
         bool firstmerge;
 
-    public:
-        FastCallSet fast_call_set;
+        struct Interval {
+            CallNo start;
+            CallNo stop;
+        };
+
+        typedef std::vector<Interval> IntervalList;
+        IntervalList intervals;
 
-        // TODO: use binary tree to speed up lookups, (less important
-        // now that we are using FastCallSet for ranges without step
-        // or freq).
-        typedef std::list< CallRange > RangeList;
+        typedef std::vector<CallRange> RangeList;
         RangeList ranges;
+        std::vector<CallNo> maxStops;
+
+        void
+        addInterval(CallNo start, CallNo stop);
+
+        void
+        addSteppedRange(const CallRange & range);
+
+        static inline bool
+        intervalStartsAfter(CallNo callNo, const Interval &interval) {
+            return callNo < interval.start;
+        }
+
+        static inline bool
+        intervalEndsBefore(const Interval &interval, CallNo callNo) {
+            return interval.stop < callNo;
+        }
+
+        static inline bool
+        rangeStartsAfter(CallNo callNo, const CallRange &range) {
+            return callNo < range.start;
+        }
+
+        inline bool
+        containsInterval(CallNo callNo) const {
+            IntervalList::const_iterator it =
+                std::upper_bound(intervals.begin(), intervals.end(), callNo, intervalStartsAfter);
+            return it != intervals.begin() && callNo <= it[-1].stop;
+        }
+
+        inline bool
+        containsSteppedRange(CallNo callNo, CallFlags callFlags) const {
+            size_t i = std::upper_bound(ranges.begin(), ranges.end(), callNo, rangeStartsAfter) - ranges.begin();
+            // Scan back while earlier ranges may still reach the call
+            while (i-- > 0 && maxStops[i] >= callNo) {
+                if (ranges[i].contains(callNo, callFlags)) {
+                    return true;
+                }
+            }
+            return false;
+        }
 
+    public:
         CallSet(): limits(std::numeric_limits<CallNo>::min(), std::numeric_limits<CallNo>::max()), firstmerge(true) {}
 
         CallSet(CallFlags freq);
@@ -124,66 +174,65 @@ namespace trace {
         // Not empty set
         inline bool
         empty() const {
-            return fast_call_set.empty() && ranges.empty();
+            return intervals.empty() && ranges.empty();
         }
 
         void
-        addRange(const CallRange & range) {
-            if (range.start <= range.stop &&
-                range.freq != FREQUENCY_NONE) {
-
-                if (empty()) {
-                    limits.start = range.start;
-                    limits.stop = range.stop;
-                } else {
-                    if (range.start < limits.start)
-                        limits.start = range.start;
-                    if (range.stop > limits.stop)
-                        limits.stop = range.stop;
-                }
-
-                /* Optimize by using fast_call_set whenever possible */
-                if (range.step == 1 && range.freq == FREQUENCY_ALL) {
-                    fast_call_set.add(range.start, range.stop);
-                } else {
-                    RangeList::iterator it = ranges.begin();
-                    while (it != ranges.end() && it->start < range.start) {
-                        ++it;
-                    }
-
-                    ranges.insert(it, range);
-                }
-            }
-        }
+        addRange(const CallRange & range);
 
         inline bool
         contains(CallNo callNo, CallFlags callFlags = FREQUENCY_ALL) const {
-            if (empty()) {
-                return false;
-            }
-            if (fast_call_set.contains(callNo))
-                return true;
-            RangeList::const_iterator it;
-            for (it = ranges.begin(); it != ranges.end() && it->start <= callNo; ++it) {
-                if (it->contains(callNo, callFlags)) {
-                    return true;
-                }
-            }
-            return false;
+            return containsInterval(callNo) ||
+                   (!ranges.empty() && containsSteppedRange(callNo, callFlags));
         }
 
         inline bool
-        contains(const trace::Call &call) {
+        contains(const trace::Call &call) const {
             return contains(call.no, call.flags);
         }
 
-        CallNo getFirst() {
+        CallNo getFirst() const {
             return limits.start;
         }
 
-        CallNo getLast() {
+        CallNo getLast() const {
             return limits.stop;
         }
+
+        // Lookups of non-decreasing call numbers, as when parsing a trace
+        // from a single thread, in amortized constant time.  Lookups of
+        // earlier calls still work, at the cost of a regular lookup.  The set
+        // must not be changed while in use.
+        class Cursor
+        {
+        private:
+            const CallSet *set;
+            CallNo last;
+
+            // First interval which does not end before the last call
+            size_t interval;
+
+            // First step or frequency range starting after the last call, and
+            // the earlier ones which do not end before it
+            size_t next;
+            std::vector<size_t> active;
+
+        public:
+            Cursor(const CallSet &_set) :
+                set(&_set),
+                last(0),
+                interval(0),
+                next(0)
+            {}
+
+            bool
+            contains(CallNo callNo, CallFlags callFlags = FREQUENCY_ALL);
+
+            inline bool
+            contains(const trace::Call &call) {
+                return contains(call.no, call.flags);
+            }
+        };
     };
 
 
@@ -0,0 +1,208 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Micro-benchmark of call set lookups.
+ *
+ * Builds call sets with many ranges, both plain ones (as given by
+ * --calls=@file lists) and ones with a step, and measures how fast they can
+ * be looked up, in call order and at random, with the list of ranges call
+ * sets used to be, FastCallSet, CallSet, and CallSet::Cursor.
+ */
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <list>
+#include <vector>
+
+#include "os_time.hpp"
+#include "trace_callset.hpp"
+#include "trace_fast_callset.hpp"
+
+
+using namespace trace;
+
+
+/*
+ * How call sets used to look up ranges with a step or frequency.
+ */
+class ListCallSet
+{
+    std::list<CallRange> ranges;
+
+public:
+    void
+    addRange(const CallRange &range) {
+        std::list<CallRange>::iterator it = ranges.begin();
+        while (it != ranges.end() && it->start < range.start) {
+            ++it;
+        }
+        ranges.insert(it, range);
+    }
+
+    bool
+    contains(CallNo callNo, CallFlags callFlags) const {
+        std::list<CallRange>::const_iterator it;
+        for (it = ranges.begin(); it != ranges.end() && it->start <= callNo; ++it) {
+            if (it->contains(callNo, callFlags)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+enum Impl {
+    IMPL_LIST = 0,
+    IMPL_FAST,
+    IMPL_CALLSET,
+    IMPL_CURSOR,
+    IMPL_COUNT
+};
+
+static const char *implNames[IMPL_COUNT] = {
+    "list",
+    "fast",
+    "callset",
+    "cursor",
+};
+
+
+struct Sets {
+    bool stepped;
+    ListCallSet list;
+    FastCallSet fast;
+    CallSet callSet;
+};
+
+
+static void
+buildSets(Sets &sets, unsigned numRanges, bool stepped)
+{
+    sets.stepped = stepped;
+    srand(0);
+    CallNo start = 0;
+    for (unsigned i = 0; i < numRanges; ++i) {
+        start += 2 + rand() % 64;
+        CallNo stop = start + rand() % 32;
+        CallRange range(start, stop, stepped ? 2 : 1);
+        if (stepped) {
+            sets.list.addRange(range);
+        } else {
+            sets.fast.add(start, stop);
+        }
+        sets.callSet.addRange(range);
+        start = stop;
+    }
+}
+
+
+static double
+lookup(const Sets &sets, Impl impl, const std::vector<CallNo> &calls, unsigned &found)
+{
+    CallSet::Cursor cursor(sets.callSet);
+
+    long long start = os::getTime();
+
+    found = 0;
+    for (size_t i = 0; i < calls.size(); ++i) {
+        CallNo callNo = calls[i];
+        bool contained = false;
+        switch (impl) {
+        case IMPL_LIST:
+            contained = sets.list.contains(callNo, FREQUENCY_ALL);
+            break;
+        case IMPL_FAST:
+            contained = sets.fast.contains(callNo);
+            break;
+        case IMPL_CALLSET:
+            contained = sets.callSet.contains(callNo);
+            break;
+        case IMPL_CURSOR:
+            contained = cursor.contains(callNo);
+            break;
+        default:
+            assert(0);
+        }
+        found += contained;
+    }
+
+    long long end = os::getTime();
+
+    return double(end - start) / os::timeFrequency;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    unsigned numRanges = 1000;
+    unsigned numRuns = 3;
+
+    if (argc > 1) {
+        numRanges = atoi(argv[1]);
+    }
+
+    for (unsigned stepped = 0; stepped < 2; ++stepped) {
+        Sets sets;
+        buildSets(sets, numRanges, stepped);
+
+        std::vector<CallNo> inOrder;
+        for (CallNo callNo = 0; callNo <= sets.callSet.getLast(); ++callNo) {
+            inOrder.push_back(callNo);
+        }
+        std::vector<CallNo> shuffled(inOrder);
+        for (size_t i = shuffled.size(); i > 1; --i) {
+            std::swap(shuffled[i - 1], shuffled[rand() % i]);
+        }
+
+        for (unsigned run = 0; run < numRuns; ++run) {
+            for (unsigned impl = 0; impl < IMPL_COUNT; ++impl) {
+                // The list only holds stepped ranges, and FastCallSet plain ones
+                if ((impl == IMPL_LIST && !stepped) ||
+                    (impl == IMPL_FAST && stepped)) {
+                    continue;
+                }
+
+                for (unsigned order = 0; order < 2; ++order) {
+                    const std::vector<CallNo> &calls = order ? shuffled : inOrder;
+                    unsigned found;
+                    double seconds = lookup(sets, Impl(impl), calls, found);
+                    printf("%-7s %-7s %-8s %zu lookups (%u found) in %.3f s, %.2f Mlookups/s\n",
+                           stepped ? "stepped" : "plain",
+                           implNames[impl],
+                           order ? "random" : "in-order",
+                           calls.size(), found, seconds, calls.size() / seconds * 1e-6);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Checks CallSet and CallSet::Cursor lookups against the linear scan of all
+ * ranges call sets used to do, on randomized sets.
+ */
+
+
+#include <limits>
+#include <list>
+
+#include "gtest/gtest.h"
+
+#include "trace_callset.hpp"
+
+
+using namespace trace;
+
+
+/*
+ * How call sets used to look up ranges.
+ */
+class ListCallSet
+{
+    std::list<CallRange> ranges;
+
+public:
+    void
+    addRange(const CallRange &range) {
+        ranges.push_back(range);
+    }
+
+    bool
+    contains(CallNo callNo, CallFlags callFlags) const {
+        std::list<CallRange>::const_iterator it;
+        for (it = ranges.begin(); it != ranges.end(); ++it) {
+            if (it->contains(callNo, callFlags)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+static const CallNo maxCallNo = 2000;
+
+static const CallFlags frequencies[] = {
+    FREQUENCY_ALL,
+    FREQUENCY_FRAME,
+    FREQUENCY_RENDERTARGET,
+    FREQUENCY_RENDER,
+};
+
+static const CallFlags callFlags[] = {
+    0,
+    CALL_FLAG_END_FRAME,
+    CALL_FLAG_END_FRAME | CALL_FLAG_SWAP_RENDERTARGET,
+    CALL_FLAG_SWAP_RENDERTARGET,
+    CALL_FLAG_RENDER,
+};
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof (a)[0])
+
+
+class CallSetTest : public testing::Test
+{
+protected:
+    unsigned seed;
+
+    ListCallSet list;
+    CallSet set;
+
+    unsigned
+    random(void) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0x7fff;
+    }
+
+    void
+    addRange(const CallRange &range) {
+        list.addRange(range);
+        set.addRange(range);
+    }
+
+    /*
+     * Add ranges in random order, some overlapping, some adjacent to the
+     * previous one, and some with a step or frequency.
+     */
+    void
+    addRandomRanges(unsigned count, unsigned steppedPercent) {
+        CallNo prevStop = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            CallNo start;
+            switch (random() % 4) {
+            case 0:
+                // Adjacent to the previous range
+                start = prevStop + 1;
+                break;
+            case 1:
+                // Overlapping the previous range's end
+                start = prevStop > 8 ? prevStop - random() % 8 : 0;
+                break;
+            default:
+                start = random() % maxCallNo;
+                break;
+            }
+            CallNo length = random() % 64;
+
+            CallNo step = 1;
+            CallFlags freq = FREQUENCY_ALL;
+            if (random() % 100 < steppedPercent) {
+                // Longer, so that they overlap each other more
+                length *= 4;
+                if (random() % 2) {
+                    step = 2 + random() % 6;
+                } else {
+                    freq = frequencies[1 + random() % (ARRAY_SIZE(frequencies) - 1)];
+                    if (random() % 4 == 0) {
+                        step = 2 + random() % 3;
+                    }
+                }
+            }
+
+            CallNo stop = start + length;
+            addRange(CallRange(start, stop, step, freq));
+            prevStop = stop;
+        }
+    }
+
+    CallFlags
+    randomFlags(void) {
+        return callFlags[random() % ARRAY_SIZE(callFlags)];
+    }
+
+    /*
+     * Look up every call in order, and at random.
+     */
+    void
+    check(void) {
+        for (CallNo callNo = 0; callNo <= maxCallNo + 100; ++callNo) {
+            CallFlags flags = randomFlags();
+            ASSERT_EQ(list.contains(callNo, flags), set.contains(callNo, flags))
+                << "call " << callNo << " flags " << flags;
+        }
+
+        for (unsigned i = 0; i < 4000; ++i) {
+            CallNo callNo = random() % (maxCallNo + 100);
+            CallFlags flags = randomFlags();
+            ASSERT_EQ(list.contains(callNo, flags), set.contains(callNo, flags))
+                << "call " << callNo << " flags " << flags;
+        }
+    }
+
+    /*
+     * Look up calls with a cursor, mostly moving forward, sometimes by a
+     * lot, and sometimes backwards.
+     */
+    void
+    checkCursor(void) {
+        CallSet::Cursor cursor(set);
+        CallNo callNo = 0;
+        for (unsigned i = 0; i < 8000; ++i) {
+            switch (random() % 16) {
+            case 0:
+                callNo = callNo > 100 ? callNo - random() % 100 : 0;
+                break;
+            case 1:
+                callNo += random() % 200;
+                break;
+            case 2:
+                // Same call again
+                break;
+            default:
+                ++callNo;
+                break;
+            }
+            if (callNo > maxCallNo + 100) {
+                callNo = random() % 100;
+            }
+
+            CallFlags flags = randomFlags();
+            ASSERT_EQ(list.contains(callNo, flags), cursor.contains(callNo, flags))
+                << "lookup " << i << " call " << callNo << " flags " << flags;
+        }
+    }
+};
+
+
+TEST_F(CallSetTest, intervals)
+{
+    for (unsigned i = 1; i <= 50; ++i) {
+        seed = i;
+        list = ListCallSet();
+        set = CallSet();
+        addRandomRanges(1 + i % 40, 0);
+        check();
+        checkCursor();
+    }
+}
+
+
+TEST_F(CallSetTest, stepped)
+{
+    for (unsigned i = 1; i <= 50; ++i) {
+        seed = i;
+        list = ListCallSet();
+        set = CallSet();
+        addRandomRanges(1 + i % 40, 100);
+        check();
+        checkCursor();
+    }
+}
+
+
+TEST_F(CallSetTest, mixed)
+{
+    for (unsigned i = 1; i <= 100; ++i) {
+        seed = i;
+        list = ListCallSet();
+        set = CallSet();
+        addRandomRanges(1 + i % 80, 30);
+        check();
+        checkCursor();
+    }
+}
+
+
+TEST_F(CallSetTest, frames)
+{
+    // As used for --frames
+    static const CallFlags frameFrequencies[] = {
+        FREQUENCY_FRAME,
+        FREQUENCY_RENDERTARGET,
+        FREQUENCY_RENDER,
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(frameFrequencies); ++i) {
+        seed = i + 1;
+        list = ListCallSet();
+        set = CallSet(frameFrequencies[i]);
+        list.addRange(CallRange(std::numeric_limits<CallNo>::min(),
+                                std::numeric_limits<CallNo>::max(),
+                                1, frameFrequencies[i]));
+        check();
+        checkCursor();
+
+        // Along with explicit calls
+        addRandomRanges(20, 30);
+        check();
+        checkCursor();
+    }
+}
+
+
+TEST_F(CallSetTest, parse)
+{
+    seed = 1;
+    set.merge("5,6,7,100-200/3,150-160,300-/frame,0-500/draw,1000-1100/fbo");
+    addRange(CallRange(5));
+    addRange(CallRange(6));
+    addRange(CallRange(7));
+    list.addRange(CallRange(100, 200, 3));
+    list.addRange(CallRange(150, 160));
+    list.addRange(CallRange(300, std::numeric_limits<CallNo>::max(), 1, FREQUENCY_FRAME));
+    list.addRange(CallRange(0, 500, 1, FREQUENCY_RENDER));
+    list.addRange(CallRange(1000, 1100, 1, FREQUENCY_RENDERTARGET));
+    check();
+    checkCursor();
+}
+
+
+int
+main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
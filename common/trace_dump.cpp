@@ -266,6 +266,8 @@ public:
 
     void visit(Call *call) {
         CallFlags callFlags = call->flags;
+
+        call->decode();
         
         if (!(dumpFlags & DUMP_FLAG_NO_CALL_NO)) {
             os << call->no << " ";
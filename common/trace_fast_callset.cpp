@@ -27,184 +27,210 @@
  *
  *********************************************************************/
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <limits>
+#include <algorithm>
 #include <vector>
 
-#include "os.hpp"
 #include "trace_fast_callset.hpp"
 
 using namespace trace;
 
-#define MAX_LEVEL 16
-
-FastCallRange::FastCallRange(CallNo first, CallNo last, int level)
-: ref_counter(0)
+/* Append a range to a list sorted by first call, merging it with the last
+ * one if they overlap or are adjacent. */
+void
+FastCallSet::append(FastCallRangeList &list, const FastCallRange &range)
 {
-    this->first = first;
-    this->last = last;
-    this->level = level;
+    if (!list.empty()) {
+        FastCallRange &back = list.back();
+        if (range.first <= back.last || range.first - back.last == 1) {
+            if (range.last > back.last) {
+                back.last = range.last;
+            }
+            return;
+        }
+    }
 
-    next.resize(level, 0);
+    list.push_back(range);
 }
 
-bool
-FastCallRange::contains(CallNo call_no) const
+/* Merge the last two runs. */
+void
+FastCallSet::merge_last(void)
 {
-    return (first <= call_no && last >= call_no);
+    const FastCallRangeList &a = runs[runs.size() - 2];
+    const FastCallRangeList &b = runs.back();
+    FastCallRangeList merged;
+    merged.reserve(a.size() + b.size());
+
+    FastCallRangeList::const_iterator i = a.begin();
+    FastCallRangeList::const_iterator j = b.begin();
+    while (i != a.end() || j != b.end()) {
+        if (j == b.end() || (i != a.end() && i->first <= j->first)) {
+            append(merged, *i++);
+        } else {
+            append(merged, *j++);
+        }
+    }
+
+    runs.pop_back();
+    runs.back().swap(merged);
 }
 
-bool
-FastCallSet::empty(void) const
+/* Merge the last runs while the last one is not much smaller than the one
+ * before it, so that run sizes keep decreasing geometrically. */
+void
+FastCallSet::merge_runs(void)
 {
-    return max_level == 0;
+    while (runs.size() > 1 &&
+           runs[runs.size() - 2].size() <= 2 * runs.back().size()) {
+        merge_last();
+    }
 }
 
-FastCallSet::FastCallSet(): head(0, 0, MAX_LEVEL)
+void
+FastCallSet::add_run(FastCallRangeList &run)
 {
-    head.first = std::numeric_limits<CallNo>::max();
-    head.last = std::numeric_limits<CallNo>::min();
-
-    max_level = 0;
+    runs.push_back(FastCallRangeList());
+    runs.back().swap(run);
+    merge_runs();
 }
 
-/*
- * Generate a random level number, distributed
- * so that each level is 1/4 as likely as the one before
- *
- * Note that level numbers run 1 <= level < MAX_LEVEL
- */
-static int
-random_level (void)
+bool
+FastCallSet::empty(void) const
 {
-    /* tricky bit -- each bit is '1' 75% of the time */
-    long int bits = os::random() | os::random();
-    int	level = 1;
-
-    while (level < MAX_LEVEL)
-    {
-	if (bits & 1)
-	    break;
-        level++;
-	bits >>= 1;
-    }
-
-    return level;
+    return runs.empty();
 }
 
 void
 FastCallSet::add(CallNo first, CallNo last)
 {
-    std::vector<FastCallRangePtr*> update (MAX_LEVEL);
-    FastCallRange *node;
-    FastCallRangePtr new_node;
-    int i, level;
-
-    /* Find node immediately before insertion point.
-     * NOTE: FastCallRangePtr(), e.g., next[i](), returns FastCallRange* */
-    node = &head;  // Can't reference &head as a FastCallRangePtr
-    for (i = max_level - 1; i >= 0; i--) {
-        while (node->next[i]() && first > node->next[i]->last) {
-            node = node->next[i]();
+    /* Calls are mostly added in increasing order, so try extending the
+     * last run first. */
+    if (!runs.empty()) {
+        FastCallRangeList &run = runs.back();
+        if (run.back().first <= first) {
+            size_t size = run.size();
+            append(run, FastCallRange(first, last));
+            if (run.size() != size) {
+                merge_runs();
+            }
+            return;
         }
-        update[i] = &node->next[i];
     }
 
-    /* Can we contain first by expanding tail of current range by 1? */
-    if (node != &head && node->last == first - 1) {
-
-        new_node = FastCallRangePtr(node);
-        new_node->last = last;
-        goto MERGE_NODE_WITH_SUBSEQUENT_COVERED_NODES;
+    FastCallRangeList run(1, FastCallRange(first, last));
+    add_run(run);
+}
 
-    }
+void
+FastCallSet::add(CallNo call_no)
+{
+    this->add(call_no, call_no);
+}
 
-    /* Current range could not contain first, look at next. */
-    node = node->next[0]();
+void
+FastCallSet::add(const FastCallRangeList &ranges)
+{
+    FastCallRangeList::const_iterator range;
 
-    if (node) {
-        /* Do nothing if new range is already entirely contained. */
-        if (node->first <= first && node->last >= last) {
-            return;
-        }
+    if (ranges.empty()) {
+        return;
+    }
 
-        /* If last is already included, we can simply expand
-         * node->first to fully include the range. */
-        if (node->first <= last && node->last >= last) {
-            node->first = first;
-            return;
+    if (!runs.empty() && runs.back().back().first <= ranges.front().first) {
+        for (range = ranges.begin(); range != ranges.end(); range++) {
+            append(runs.back(), *range);
         }
+        merge_runs();
+        return;
+    }
 
-        /* This is our candidate node if first is contained */
-        if (node->first <= first && node->last >= first) {
-            new_node = FastCallRangePtr(node);
-            new_node->last = last;
-            goto MERGE_NODE_WITH_SUBSEQUENT_COVERED_NODES;
-        }
+    FastCallRangeList run;
+    run.reserve(ranges.size());
+    for (range = ranges.begin(); range != ranges.end(); range++) {
+        append(run, *range);
     }
+    add_run(run);
+}
 
-    /* Not possible to expand any existing node, so create a new one. */
+void
+FastCallSet::add(const FastCallSet &other)
+{
+    if (&other == this) {
+        return;
+    }
 
-    level = random_level();
+    if (runs.empty()) {
+        runs = other.runs;
+        return;
+    }
 
-    /* Handle first node of this level. */
-    if (level > max_level) {
-        level = max_level + 1;
-        update[max_level] = &head.next[max_level];
-        max_level = level;
+    std::vector<FastCallRangeList>::const_iterator run;
+    for (run = other.runs.begin(); run != other.runs.end(); run++) {
+        add(*run);
     }
+}
 
-    new_node = FastCallRangePtr(new FastCallRange(first, last, level));
+bool
+FastCallSet::contains(CallNo call_no) const
+{
+    std::vector<FastCallRangeList>::const_iterator run;
 
-    /* Perform insertion into all lists. */
-    for (i = 0; i < level; i++) {
-        new_node->next[i] = *update[i];
-        *update[i] = new_node;
+    for (run = runs.begin(); run != runs.end(); run++) {
+        FastCallRangeList::const_iterator it =
+            std::upper_bound(run->begin(), run->end(), call_no, starts_after);
+        if (it != run->begin() && call_no <= it[-1].last) {
+            return true;
+        }
     }
 
-MERGE_NODE_WITH_SUBSEQUENT_COVERED_NODES:
-    FastCallRangePtr next = new_node->next[0];
-    node = new_node();
-    while (next() && next->first <= node->last + 1) {
-        if (next->last > node->last)
-            node->last = next->last;
+    return false;
+}
 
-        for (i = 0; i < node->level && i < next->level; i++) {
-            node->next[i] = next->next[i];
-        }
+void
+FastCallSet::compact(void)
+{
+    while (runs.size() > 1) {
+        merge_last();
+    }
+}
 
-        for (; i < next->level; i++) {
-            *update[i] = next->next[i];
-        }
+const FastCallRangeList &
+FastCallSet::get_ranges(void)
+{
+    static const FastCallRangeList none;
 
-        next = node->next[0];
+    if (runs.empty()) {
+        return none;
     }
+
+    compact();
+    return runs.front();
 }
 
-void
-FastCallSet::add(CallNo call_no)
+FastCallSet::Cursor::Cursor(const FastCallSet &_set) :
+    set(&_set),
+    last(0),
+    next(_set.runs.size(), 0)
 {
-    this->add(call_no, call_no);
 }
 
 bool
-FastCallSet::contains(CallNo call_no) const
+FastCallSet::Cursor::contains(CallNo call_no)
 {
-    FastCallRange *node;
-    int i;
+    if (call_no < last) {
+        return set->contains(call_no);
+    }
+    last = call_no;
 
-    node = const_cast<FastCallRange*>(&head);
-    for (i = max_level - 1; i >= 0; i--) {
-        while (node->next[i]() && call_no > node->next[i]->last) {
-            node = node->next[i]();
+    for (size_t i = 0; i < set->runs.size(); i++) {
+        const FastCallRangeList &run = set->runs[i];
+        while (next[i] < run.size() && run[next[i]].last < call_no) {
+            ++next[i];
+        }
+        if (next[i] < run.size() && run[next[i]].first <= call_no) {
+            return true;
         }
     }
 
-    node = node->next[0]();
-
-    if (node == NULL)
-        return false;
-
-    return node->contains(call_no);
+    return false;
 }
@@ -26,8 +26,11 @@
  *
  *********************************************************************/
 
+
 #pragma once
 
+#include <vector>
+
 #include "trace_model.hpp"
 
 namespace trace {
@@ -46,14 +49,18 @@ namespace trace {
  *
  *   Sophistications:
  *
- *	* This callset is implemented with a skip list for
- *	  (probabilistically) logarithmic lookup times for
- *	  out-of-order lookups.
+ *	* This callset is kept as a few flat runs of ranges, each
+ *	  sorted and with overlapping or adjacent ranges merged, of
+ *	  geometrically decreasing sizes (like a log-structured merge
+ *	  tree).  Calls added in order extend the last run in constant
+ *	  time, while out-of-order ones start a new run, which gets
+ *	  merged with the previous ones once it grows to about their
+ *	  size, so additions take amortized logarithmic time, and
+ *	  lookups a binary search per run.
  *
- *	* This callset optimizes the addition of new calls which are
- *        within or adjacent to existing ranges, (by either doing
- *        nothing, expanding the limits of an existing range, or also
- *        merging two or more ranges).
+ *	* Ranges take 8 bytes each, with no per-range allocation.
+ *
+ *	* Sorted lists of ranges, and other sets, can be added at once.
  *
  * It would not be impossible to extend this code to support the
  * missing features of trace::CallSet, (though the 'step' and 'freq'
@@ -61,80 +68,85 @@ namespace trace {
  * optimizations in some cases).
  */
 
-class FastCallRangePtr;
-
-class FastCallRange {
-public:
+struct FastCallRange {
     CallNo first;
     CallNo last;
-    int level;
-    std::vector<FastCallRangePtr> next;
 
-    // (NOTE: Initalize ref_counter to 0 in all constructors)
-    FastCallRange(CallNo first, CallNo last, int level);
+    FastCallRange() {}
 
-    bool contains(CallNo call_no) const;
+    FastCallRange(CallNo _first, CallNo _last) :
+        first(_first),
+        last(_last)
+    {}
 
-private:
-    friend class FastCallRangePtr;
-    size_t ref_counter;
-    // ref_counter must be initialized to 0 by all constructors
-    // ref_counter is the number of FastCallRangePtr objects that point at this
-};
+    bool contains(CallNo call_no) const {
+        return first <= call_no && call_no <= last;
+    }
 
-class FastCallRangePtr {
-public:
-    FastCallRange* operator-> () { return  this->ptr; }
-    FastCallRange& operator * () { return *this->ptr; }
-    FastCallRange* operator ()() { return  this->ptr; } // get pointer
-
-
-    FastCallRangePtr () : ptr(0) {}
-    FastCallRangePtr(FastCallRange* _ptr) : ptr(_ptr)
-                                 { if (this->ptr) ++this->ptr->ref_counter; }
-
-   ~FastCallRangePtr()           { if (this->ptr)
-                                       if (--this->ptr->ref_counter == 0)
-                                           delete this->ptr;
-                                 }
-
-    FastCallRangePtr(FastCallRangePtr const& _ptr) : ptr(_ptr.ptr)
-                                 { if (this->ptr) ++this->ptr->ref_counter; }
-
-    FastCallRangePtr& operator= (FastCallRangePtr const& new_ptr)
-        {   // DO NOT CHANGE THE ORDER OF THESE STATEMENTS!
-            // (This order properly handles self-assignment)
-            // (This order also properly handles recursion, e.g.,
-            //  if a FastCallRange contains FastCallRangePtrs)
-            FastCallRange* const old_ptr = this->ptr;
-            this->ptr = new_ptr.ptr;
-            if (this->ptr)
-                ++this->ptr->ref_counter;
-            if (old_ptr) {
-                if (--old_ptr->ref_counter == 0)
-                    delete old_ptr;
-            }
-            return *this;
-        }
-private:
-    FastCallRange* ptr;
+    bool operator < (const FastCallRange &other) const {
+        return first < other.first ||
+               (first == other.first && last < other.last);
+    }
 };
 
+typedef std::vector<FastCallRange> FastCallRangeList;
+
 class FastCallSet {
-public:
-    FastCallRange head;
-    int max_level;
+private:
+    /* Runs from largest to smallest, the last one being added to. */
+    std::vector<FastCallRangeList> runs;
+
+    void add_run(FastCallRangeList &run);
 
-    FastCallSet();
+    void merge_last(void);
 
+    void merge_runs(void);
+
+    static void append(FastCallRangeList &list, const FastCallRange &range);
+
+    static bool starts_after(CallNo call_no, const FastCallRange &range) {
+        return call_no < range.first;
+    }
+
+public:
     bool empty(void) const;
 
     void add(CallNo first, CallNo last);
 
     void add(CallNo call_no);
 
+    /* Add ranges sorted by first call, which may overlap. */
+    void add(const FastCallRangeList &ranges);
+
+    /* Add all calls of another set. */
+    void add(const FastCallSet &other);
+
     bool contains(CallNo call_no) const;
+
+    /* Merge all runs into one, for the fastest lookups once no more calls
+     * will be added. */
+    void compact(void);
+
+    /* Compact, and return the ranges, for iterating over the whole set in
+     * order. */
+    const FastCallRangeList &get_ranges(void);
+
+    /* Looks up calls in increasing order, as they're written out, in
+     * amortized constant time.  Earlier calls are looked up the normal
+     * way.  The set must not be changed while in use. */
+    class Cursor {
+    private:
+        const FastCallSet *set;
+        CallNo last;
+
+        // First range of each run which does not end before the last call
+        std::vector<size_t> next;
+
+    public:
+        Cursor(const FastCallSet &_set);
+
+        bool contains(CallNo call_no);
+    };
 };
 
 } /* namespace trace */
-
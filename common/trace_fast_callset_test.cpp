@@ -0,0 +1,336 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Checks FastCallSet against a std::set of the same calls.
+ */
+
+
+#include <set>
+
+#include "gtest/gtest.h"
+
+#include "trace_fast_callset.hpp"
+
+
+using namespace trace;
+
+
+class FastCallSetTest : public testing::Test
+{
+protected:
+    unsigned seed;
+
+    FastCallSet set;
+    std::set<CallNo> reference;
+
+    unsigned
+    random(void) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0x7fff;
+    }
+
+    void
+    reset(unsigned _seed) {
+        seed = _seed;
+        set = FastCallSet();
+        reference.clear();
+    }
+
+    void
+    addReference(CallNo first, CallNo last) {
+        for (CallNo call_no = first; call_no <= last; ++call_no) {
+            reference.insert(call_no);
+        }
+    }
+
+    void
+    add(CallNo first, CallNo last) {
+        set.add(first, last);
+        addReference(first, last);
+    }
+
+    CallNo
+    maxCallNo(void) const {
+        return reference.empty() ? 0 : *reference.rbegin();
+    }
+
+    /*
+     * Look up every call, directly and with a cursor.
+     */
+    void
+    check(void) {
+        EXPECT_EQ(reference.empty(), set.empty());
+
+        CallNo end = maxCallNo() + 10;
+        for (CallNo call_no = 0; call_no <= end; ++call_no) {
+            ASSERT_EQ(reference.count(call_no) != 0, set.contains(call_no))
+                << "call " << call_no;
+        }
+
+        FastCallSet::Cursor cursor(set);
+        for (CallNo call_no = 0; call_no <= end; ++call_no) {
+            ASSERT_EQ(reference.count(call_no) != 0, cursor.contains(call_no))
+                << "call " << call_no;
+        }
+    }
+
+    /*
+     * Look up calls with a cursor, skipping ahead and sometimes moving
+     * backwards.
+     */
+    void
+    checkCursor(void) {
+        FastCallSet::Cursor cursor(set);
+        CallNo end = maxCallNo() + 10;
+        CallNo call_no = 0;
+        while (call_no <= end) {
+            CallNo lookup = call_no;
+            if (random() % 10 == 0) {
+                lookup = call_no > 20 ? call_no - random() % 20 : 0;
+            }
+            ASSERT_EQ(reference.count(lookup) != 0, cursor.contains(lookup))
+                << "call " << lookup;
+            call_no += 1 + (random() % 4 == 0 ? random() % 30 : 0);
+        }
+    }
+
+    /*
+     * Check that the ranges are sorted, fully merged, and hold the same
+     * calls, without changing the set being tested.
+     */
+    void
+    checkRanges(void) {
+        FastCallSet copy = set;
+        const FastCallRangeList &ranges = copy.get_ranges();
+
+        std::set<CallNo> calls;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            ASSERT_LE(ranges[i].first, ranges[i].last);
+            if (i > 0) {
+                ASSERT_GT(ranges[i].first, ranges[i - 1].last + 1)
+                    << "ranges " << i - 1 << " and " << i << " not merged";
+            }
+            for (CallNo call_no = ranges[i].first; call_no <= ranges[i].last; ++call_no) {
+                calls.insert(call_no);
+            }
+        }
+        EXPECT_TRUE(calls == reference);
+
+        // Compacting doesn't change lookups
+        for (CallNo call_no = 0; call_no <= maxCallNo() + 10; ++call_no) {
+            ASSERT_EQ(reference.count(call_no) != 0, copy.contains(call_no))
+                << "call " << call_no;
+        }
+    }
+};
+
+
+TEST_F(FastCallSetTest, empty)
+{
+    reset(1);
+    check();
+    checkRanges();
+}
+
+
+TEST_F(FastCallSetTest, inOrder)
+{
+    reset(1);
+    for (CallNo call_no = 0; call_no < 1000; call_no += 1 + random() % 3) {
+        set.add(call_no);
+        addReference(call_no, call_no);
+    }
+    check();
+    checkCursor();
+    checkRanges();
+}
+
+
+TEST_F(FastCallSetTest, overlappingAndAdjacent)
+{
+    reset(1);
+
+    add(10, 20);
+    // Adjacent after
+    add(21, 30);
+    // Adjacent before
+    add(5, 9);
+    // Overlapping the end
+    add(25, 40);
+    // Overlapping the start
+    add(0, 6);
+    // Contained
+    add(12, 14);
+    // Disjoint
+    add(50, 60);
+    add(45, 47);
+    // Bridging two ranges
+    add(41, 44);
+    check();
+    checkCursor();
+    checkRanges();
+
+    FastCallSet copy = set;
+    const FastCallRangeList &ranges = copy.get_ranges();
+    ASSERT_EQ(2u, ranges.size());
+    EXPECT_EQ(0u, ranges[0].first);
+    EXPECT_EQ(47u, ranges[0].last);
+    EXPECT_EQ(50u, ranges[1].first);
+    EXPECT_EQ(60u, ranges[1].last);
+}
+
+
+TEST_F(FastCallSetTest, mergingRuns)
+{
+    for (unsigned i = 1; i <= 200; ++i) {
+        reset(i);
+
+        // Mostly increasing, with calls sometimes going back, which start
+        // new runs, to be merged as they grow
+        CallNo call_no = 0;
+        unsigned count = random() % 500;
+        for (unsigned j = 0; j < count; ++j) {
+            switch (random() % 4) {
+            case 0:
+                call_no = random() % (call_no + 1);
+                break;
+            case 1:
+                call_no += random() % 4;
+                break;
+            default:
+                call_no += 1 + random() % 16;
+                break;
+            }
+            add(call_no, call_no + random() % 8);
+        }
+        check();
+        checkCursor();
+        checkRanges();
+    }
+}
+
+
+TEST_F(FastCallSetTest, addRanges)
+{
+    for (unsigned i = 1; i <= 200; ++i) {
+        reset(i);
+
+        unsigned count = random() % 50;
+        for (unsigned j = 0; j < count; ++j) {
+            // Sorted by first call, but overlapping or adjacent at times
+            FastCallRangeList ranges;
+            CallNo first = random() % 2000;
+            for (unsigned k = random() % 8; k > 0; --k) {
+                CallNo last = first + random() % 5;
+                ranges.push_back(FastCallRange(first, last));
+                addReference(first, last);
+                switch (random() % 3) {
+                case 0:
+                    first += random() % (last - first + 1);
+                    break;
+                case 1:
+                    first = last + 1;
+                    break;
+                default:
+                    first = last + 2 + random() % 10;
+                    break;
+                }
+            }
+            set.add(ranges);
+        }
+        check();
+        checkCursor();
+        checkRanges();
+    }
+}
+
+
+TEST_F(FastCallSetTest, addSet)
+{
+    for (unsigned i = 1; i <= 200; ++i) {
+        reset(i);
+
+        FastCallSet other;
+        unsigned count = random() % 300;
+        for (unsigned j = 0; j < count; ++j) {
+            CallNo first = random() % 3000;
+            CallNo last = first + random() % 4;
+            addReference(first, last);
+            if (random() % 2) {
+                set.add(first, last);
+            } else {
+                other.add(first, last);
+            }
+            if (random() % 32 == 0) {
+                set.add(other);
+                other = FastCallSet();
+            }
+        }
+        set.add(other);
+
+        // Adding itself is a no-op
+        set.add(set);
+
+        check();
+        checkCursor();
+        checkRanges();
+    }
+}
+
+
+TEST_F(FastCallSetTest, cursorAcrossRuns)
+{
+    for (unsigned i = 1; i <= 20; ++i) {
+        reset(i);
+
+        // A large run of even blocks, then odd blocks added backwards, each
+        // starting a run of its own, until they are merged
+        for (CallNo call_no = 0; call_no < 4000; call_no += 20) {
+            add(call_no, call_no + 9);
+        }
+        for (CallNo block = 200; block > 0; --block) {
+            CallNo call_no = block * 20 - 10;
+            if (random() % 3 == 0) {
+                add(call_no + random() % 5, call_no + 5 + random() % 5);
+            }
+            if (random() % 32 == 0) {
+                check();
+                checkCursor();
+            }
+        }
+        check();
+        checkCursor();
+        checkRanges();
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -33,7 +33,8 @@ using namespace trace;
 
 
 File::File(const std::string &filename)
-    : m_isOpened(false)
+    : m_isOpened(false),
+      m_capture(NULL)
 {
     if (!filename.empty()) {
         open(filename);
@@ -52,3 +53,31 @@ void File::setCurrentOffset(const File::Offset &offset)
     assert(0);
 }
 
+
+bool File::getIndex(std::string &data)
+{
+    return false;
+}
+
+
+bool File::getOffset(unsigned long long position, File::Offset &offset)
+{
+    return false;
+}
+
+
+const char *File::rawReadInPlace(size_t length, std::shared_ptr<char> &storage)
+{
+    return NULL;
+}
+
+
+/*
+ * By default bytes are captured one read at a time.  Implementations with
+ * the data at hand can do better.
+ */
+void File::rawSetCapture(std::vector<char> *capture)
+{
+    m_capture = capture;
+}
+
@@ -28,6 +28,8 @@
 
 #include <string>
 #include <fstream>
+#include <memory>
+#include <vector>
 #include <stdint.h>
 
 
@@ -47,6 +49,12 @@ public:
 public:
     static File *createZLib(void);
     static File *createSnappy(void);
+#ifdef HAVE_ZSTD
+    static File *createZstd(void);
+#endif
+#ifdef HAVE_LZ4
+    static File *createLZ4(void);
+#endif
     static File *createForRead(const char *filename);
 public:
     File(const std::string &filename = std::string());
@@ -56,17 +64,39 @@ public:
 
     bool open(const std::string &filename);
     size_t read(void *buffer, size_t length);
+    const char *readInPlace(size_t length, std::shared_ptr<char> &storage);
     void close();
     int getc();
     bool skip(size_t length);
     int percentRead();
 
+    /**
+     * Append a copy of every byte consumed from now on to the given buffer,
+     * or stop doing so when NULL.
+     */
+    void setCapture(std::vector<char> *capture) {
+        rawSetCapture(capture);
+    }
+
     virtual bool supportsOffsets() const = 0;
     virtual File::Offset currentOffset() = 0;
     virtual void setCurrentOffset(const File::Offset &offset);
+
+    /**
+     * Get the seek index appended by the writer, if any.
+     */
+    virtual bool getIndex(std::string &data);
+
+    /**
+     * Translate a position in the uncompressed stream into an offset.  Only
+     * available when the file has an index.
+     */
+    virtual bool getOffset(unsigned long long position, File::Offset &offset);
 protected:
     virtual bool rawOpen(const std::string &filename) = 0;
     virtual size_t rawRead(void *buffer, size_t length) = 0;
+    virtual const char *rawReadInPlace(size_t length, std::shared_ptr<char> &storage);
+    virtual void rawSetCapture(std::vector<char> *capture);
     virtual int rawGetc() = 0;
     virtual void rawClose() = 0;
     virtual bool rawSkip(size_t length) = 0;
@@ -74,6 +104,9 @@ protected:
 
 protected:
     bool m_isOpened;
+
+    // Capture buffer, when capturing byte by byte
+    std::vector<char> *m_capture;
 };
 
 inline bool File::isOpened() const
@@ -96,7 +129,28 @@ inline size_t File::read(void *buffer, size_t length)
     if (!m_isOpened) {
         return 0;
     }
-    return rawRead(buffer, length);
+    size_t read = rawRead(buffer, length);
+    if (m_capture) {
+        const char *data = static_cast<const char *>(buffer);
+        m_capture->insert(m_capture->end(), data, data + read);
+    }
+    return read;
+}
+
+/**
+ * Read length bytes without copying them.
+ *
+ * On success returns a pointer into the decompressed data, and sets storage
+ * to a reference that keeps that data alive.  Returns NULL without consuming
+ * anything when the bytes are not contiguous in memory, in which case read()
+ * must be used instead, as is always the case while capturing.
+ */
+inline const char *File::readInPlace(size_t length, std::shared_ptr<char> &storage)
+{
+    if (!m_isOpened || m_capture) {
+        return NULL;
+    }
+    return rawReadInPlace(length, storage);
 }
 
 inline int File::percentRead()
@@ -120,7 +174,11 @@ inline int File::getc()
     if (!m_isOpened) {
         return -1;
     }
-    return rawGetc();
+    int c = rawGetc();
+    if (m_capture && c != -1) {
+        m_capture->push_back(c);
+    }
+    return c;
 }
 
 inline bool File::skip(size_t length)
@@ -128,6 +186,13 @@ inline bool File::skip(size_t length)
     if (!m_isOpened) {
         return false;
     }
+    if (m_capture) {
+        size_t size = m_capture->size();
+        m_capture->resize(size + length);
+        size_t read = length ? rawRead(&(*m_capture)[size], length) : 0;
+        m_capture->resize(size + read);
+        return read == length;
+    }
     return rawSkip(length);
 }
 
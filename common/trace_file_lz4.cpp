@@ -0,0 +1,228 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include "trace_file.hpp"
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include <lz4frame.h>
+
+#include "os.hpp"
+
+
+#define LZ4_INPUT_SIZE (64 * 1024)
+#define LZ4_OUTPUT_SIZE (4 * 1024 * 1024)
+
+
+using namespace trace;
+
+
+class LZ4File : public File {
+public:
+    LZ4File(const std::string &filename = std::string());
+    virtual ~LZ4File();
+
+    virtual bool supportsOffsets() const;
+    virtual File::Offset currentOffset();
+protected:
+    virtual bool rawOpen(const std::string &filename);
+    virtual size_t rawRead(void *buffer, size_t length);
+    virtual int rawGetc();
+    virtual void rawClose();
+    virtual bool rawSkip(size_t length);
+    virtual int rawPercentRead();
+private:
+    bool fillOutput(void);
+
+    std::ifstream m_stream;
+    std::streampos m_endPos;
+    LZ4F_decompressionContext_t m_dctx;
+
+    // Compressed data, and the part not consumed yet
+    std::vector<char> m_input;
+    const char *m_inputPtr;
+    const char *m_inputEnd;
+
+    // Decompressed data, and the part not consumed yet
+    std::vector<char> m_output;
+    const char *m_outputPtr;
+    const char *m_outputEnd;
+
+    unsigned long long m_offset;
+};
+
+LZ4File::LZ4File(const std::string &filename)
+    : File(filename),
+      m_dctx(NULL),
+      m_inputPtr(NULL),
+      m_inputEnd(NULL),
+      m_outputPtr(NULL),
+      m_outputEnd(NULL),
+      m_offset(0)
+{
+}
+
+LZ4File::~LZ4File()
+{
+    close();
+}
+
+bool LZ4File::rawOpen(const std::string &filename)
+{
+    m_stream.open(filename.c_str(), std::fstream::binary | std::fstream::in);
+    if (!m_stream.is_open()) {
+        return false;
+    }
+
+    m_stream.seekg(0, std::ios::end);
+    m_endPos = m_stream.tellg();
+    m_stream.seekg(0, std::ios::beg);
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&m_dctx, LZ4F_VERSION))) {
+        m_dctx = NULL;
+        m_stream.close();
+        return false;
+    }
+
+    m_input.resize(LZ4_INPUT_SIZE);
+    m_inputPtr = m_inputEnd = &m_input[0];
+
+    m_output.resize(LZ4_OUTPUT_SIZE);
+    m_outputPtr = m_outputEnd = &m_output[0];
+    m_offset = 0;
+
+    return true;
+}
+
+/*
+ * Decompress more data once all decompressed data was consumed.  Returns
+ * false at the end of the stream.
+ */
+bool LZ4File::fillOutput(void)
+{
+    if (m_outputPtr < m_outputEnd) {
+        return true;
+    }
+
+    do {
+        if (m_inputPtr == m_inputEnd) {
+            m_stream.read(&m_input[0], m_input.size());
+            m_inputPtr = &m_input[0];
+            m_inputEnd = m_inputPtr + m_stream.gcount();
+            if (m_inputPtr == m_inputEnd) {
+                return false;
+            }
+        }
+
+        size_t outputSize = m_output.size();
+        size_t inputSize = m_inputEnd - m_inputPtr;
+        size_t ret = LZ4F_decompress(m_dctx, &m_output[0], &outputSize,
+                                     m_inputPtr, &inputSize, NULL);
+        if (LZ4F_isError(ret)) {
+            os::log("error: lz4 decompression failed: %s\n", LZ4F_getErrorName(ret));
+            return false;
+        }
+        m_inputPtr += inputSize;
+
+        m_outputPtr = &m_output[0];
+        m_outputEnd = m_outputPtr + outputSize;
+    } while (m_outputPtr == m_outputEnd);
+
+    return true;
+}
+
+size_t LZ4File::rawRead(void *buffer, size_t length)
+{
+    char *dst = static_cast<char *>(buffer);
+    size_t read = 0;
+    while (read < length && fillOutput()) {
+        size_t size = std::min(length - read, size_t(m_outputEnd - m_outputPtr));
+        memcpy(dst + read, m_outputPtr, size);
+        m_outputPtr += size;
+        read += size;
+    }
+    m_offset += read;
+    return read;
+}
+
+int LZ4File::rawGetc()
+{
+    if (!fillOutput()) {
+        return -1;
+    }
+    ++m_offset;
+    return (unsigned char)*m_outputPtr++;
+}
+
+void LZ4File::rawClose()
+{
+    if (m_dctx) {
+        LZ4F_freeDecompressionContext(m_dctx);
+        m_dctx = NULL;
+    }
+    m_stream.close();
+    m_input.clear();
+    m_output.clear();
+    m_inputPtr = m_inputEnd = NULL;
+    m_outputPtr = m_outputEnd = NULL;
+}
+
+File::Offset LZ4File::currentOffset()
+{
+    return File::Offset(m_offset);
+}
+
+bool LZ4File::supportsOffsets() const
+{
+    return false;
+}
+
+bool LZ4File::rawSkip(size_t length)
+{
+    while (length && fillOutput()) {
+        size_t size = std::min(length, size_t(m_outputEnd - m_outputPtr));
+        m_outputPtr += size;
+        m_offset += size;
+        length -= size;
+    }
+    return length == 0;
+}
+
+int LZ4File::rawPercentRead()
+{
+    std::streampos pos = m_stream.eof() ? m_endPos : m_stream.tellg();
+    return int(100 * (double(pos) / double(m_endPos)));
+}
+
+
+File * File::createLZ4(void) {
+    return new LZ4File;
+}
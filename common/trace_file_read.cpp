@@ -42,16 +42,29 @@ File::createForRead(const char *filename)
         os::log("error: failed to open %s\n", filename);
         return NULL;
     }
-    unsigned char byte1, byte2;
-    stream >> byte1;
-    stream >> byte2;
+    unsigned char magic[4] = {0, 0, 0, 0};
+    stream.read((char *)magic, sizeof magic);
     stream.close();
 
     File *file;
-    if (byte1 == SNAPPY_BYTE1 && byte2 == SNAPPY_BYTE2) {
+    if (magic[0] == SNAPPY_BYTE1 && magic[1] == SNAPPY_BYTE2) {
         file = File::createSnappy();
-    } else if (byte1 == 0x1f && byte2 == 0x8b) {
+    } else if (magic[0] == 0x1f && magic[1] == 0x8b) {
         file = File::createZLib();
+    } else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef HAVE_ZSTD
+        file = File::createZstd();
+#else
+        os::log("error: %s: zstd compression not supported by this build\n", filename);
+        return NULL;
+#endif
+    } else if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18) {
+#ifdef HAVE_LZ4
+        file = File::createLZ4();
+#else
+        os::log("error: %s: lz4 compression not supported by this build\n", filename);
+        return NULL;
+#endif
     } else  {
         os::log("error: %s: unkwnown compression\n", filename);
         return NULL;
@@ -48,6 +48,15 @@
  * to offer a pretty good compression/disk io speed ratio
  * but that might change.
  *
+ * Reading is pipelined: a few worker threads walk the chunk length
+ * prefixes, reading the compressed data sequentially, and decompress up to
+ * SNAPPY_READAHEAD_CHUNKS chunks ahead of the parser, in parallel.  The
+ * parser only waits when the chunk it needs is not ready yet.
+ *
+ * When possible the file is memory mapped, so that chunks are decompressed
+ * straight from the page cache, and large blobs can refer to the
+ * decompressed chunks instead of being copied.
+ *
  */
 
 
@@ -55,21 +64,127 @@
 
 #include <iostream>
 #include <algorithm>
+#include <vector>
 
 #include <assert.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "os.hpp"
+#include "os_thread.hpp"
 #include "trace_file.hpp"
 #include "trace_snappy.hpp"
 
 
 #define SNAPPY_CHUNK_SIZE (1 * 1024 * 1024)
 
+/*
+ * Maximum number of chunks in flight, including the one being parsed.
+ */
+#define SNAPPY_READAHEAD_CHUNKS 8
+
+#define SNAPPY_MAX_READ_THREADS 4
+
 
 
 using namespace trace;
 
 
+/*
+ * Map a whole file read-only.  Returns NULL on failure, or if the file is
+ * too large for the address space.
+ */
+static const char *
+mapFile(const std::string &filename, size_t &size)
+{
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) ||
+        fileSize.QuadPart == 0 ||
+        (unsigned long long)fileSize.QuadPart > (size_t)-1) {
+        CloseHandle(hFile);
+        return NULL;
+    }
+
+    HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (!hMapping) {
+        return NULL;
+    }
+
+    // The view keeps the mapping alive
+    void *map = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if (!map) {
+        return NULL;
+    }
+
+    size = (size_t)fileSize.QuadPart;
+    return static_cast<const char *>(map);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) ||
+        st.st_size == 0 ||
+        (unsigned long long)st.st_size > (size_t)-1) {
+        ::close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    size = (size_t)st.st_size;
+    return static_cast<const char *>(map);
+#endif
+}
+
+
+static void
+unmapFile(const char *map, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(map);
+#else
+    munmap(const_cast<char *>(map), size);
+#endif
+}
+
+
+static inline size_t
+decodeCompressedLength(const unsigned char *buf)
+{
+    size_t length;
+    length  =  (size_t)buf[0];
+    length |= ((size_t)buf[1] <<  8);
+    length |= ((size_t)buf[2] << 16);
+    length |= ((size_t)buf[3] << 24);
+    return length;
+}
+
+
 class SnappyFile : public File {
 public:
     SnappyFile(const std::string &filename = std::string());
@@ -78,15 +193,52 @@ public:
     virtual bool supportsOffsets() const;
     virtual File::Offset currentOffset();
     virtual void setCurrentOffset(const File::Offset &offset);
+    virtual bool getIndex(std::string &data);
+    virtual bool getOffset(unsigned long long position, File::Offset &offset);
 protected:
     virtual bool rawOpen(const std::string &filename);
     virtual size_t rawRead(void *buffer, size_t length);
+    virtual const char *rawReadInPlace(size_t length, std::shared_ptr<char> &storage);
+    virtual void rawSetCapture(std::vector<char> *capture);
     virtual int rawGetc();
     virtual void rawClose();
     virtual bool rawSkip(size_t length);
     virtual int rawPercentRead();
 
 private:
+    struct Chunk {
+        enum State {
+            EMPTY,
+            LOADING,
+            READY,
+        };
+
+        State state;
+
+        // Position of the chunk's length prefix in the file
+        std::streampos offset;
+
+        // Compressed data, either in the file mapping or in compressed
+        std::vector<char> compressed;
+        const char *compressedData;
+        size_t compressedLength;
+
+        // Decompressed data, which blobs may keep referring to
+        std::shared_ptr<char> data;
+        size_t size;
+        size_t capacity;
+
+        Chunk() :
+            state(EMPTY),
+            compressedData(NULL),
+            compressedLength(0),
+            size(0),
+            capacity(0)
+        {}
+
+        void decompress(void);
+    };
+
     inline size_t usedCacheSize() const
     {
         assert(m_cachePtr >= m_cache);
@@ -103,47 +255,117 @@ private:
     }
     inline bool endOfData() const
     {
-        return m_stream.eof() && freeCacheSize() == 0;
+        return m_cacheSize == 0;
     }
-    void flushWriteCache();
-    void flushReadCache(size_t skipLength = 0);
-    void createCache(size_t size);
-    void writeCompressedLength(size_t length);
+    void flushReadCache(void);
+    void flushCapture(void);
+    void startReadAhead(void);
+    void stopReadAhead(void);
+    void restartReadAhead(std::streampos offset);
     size_t readCompressedLength();
+    bool fetchChunk(Chunk &chunk);
+    bool readAt(unsigned long long offset, void *buffer, size_t length);
+    void loadIndex(void);
+
+    static void
+    readerThread(SnappyFile *_this);
+
+    void
+    readerLoop(void);
+
 private:
     std::fstream m_stream;
-    size_t m_cacheMaxSize;
+
+    const char *m_map;
+    size_t m_mapSize;
+    size_t m_mapPos;
+
     size_t m_cacheSize;
     char *m_cache;
     char *m_cachePtr;
 
-    char *m_compressedCache;
+    // Capture buffer, and start of the bytes consumed from the cache but
+    // not copied into it yet
+    std::vector<char> *m_captureBuffer;
+    const char *m_captureStart;
 
     File::Offset m_currentOffset;
     std::streampos m_endPos;
+
+    // Seek index, and uncompressed start and file offset of every chunk,
+    // plus one past the last chunk
+    std::string m_index;
+    std::vector<unsigned long long> m_chunkPositions;
+    std::vector<unsigned long long> m_chunkOffsets;
+
+    Chunk m_chunks[SNAPPY_READAHEAD_CHUNKS];
+
+    /*
+     * Chunks are numbered in file order since the last seek.  m_readIndex is
+     * the next chunk to be read from the file, m_consumeIndex the next chunk
+     * to be handed to the parser.  Both are protected by m_mutex, as is the
+     * file stream itself.
+     */
+    unsigned m_readIndex;
+    unsigned m_consumeIndex;
+    unsigned m_busy;
+    // How many chunks may be read ahead of the parser.  Only one after a
+    // seek, until the parser moves on to the next chunk, as seeks often come
+    // in bursts (e.g., reading blob data, or definitions, back).
+    unsigned m_readAhead;
+    bool m_eof;
+    bool m_stop;
+
+    os::mutex m_mutex;
+    os::condition_variable m_workCond;
+    os::condition_variable m_readyCond;
+    std::vector<os::thread> m_threads;
 };
 
 SnappyFile::SnappyFile(const std::string &filename)
     : File(),
-      m_cacheMaxSize(SNAPPY_CHUNK_SIZE),
-      m_cacheSize(m_cacheMaxSize),
-      m_cache(new char [m_cacheMaxSize]),
-      m_cachePtr(m_cache)
+      m_map(NULL),
+      m_mapSize(0),
+      m_mapPos(0),
+      m_cacheSize(0),
+      m_cache(NULL),
+      m_cachePtr(NULL),
+      m_captureBuffer(NULL),
+      m_captureStart(NULL),
+      m_readIndex(0),
+      m_consumeIndex(0),
+      m_busy(0),
+      m_readAhead(SNAPPY_READAHEAD_CHUNKS - 1),
+      m_eof(false),
+      m_stop(false)
 {
-    size_t maxCompressedLength =
-        snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
-    m_compressedCache = new char[maxCompressedLength];
 }
 
 SnappyFile::~SnappyFile()
 {
     close();
-    delete [] m_compressedCache;
-    delete [] m_cache;
 }
 
 bool SnappyFile::rawOpen(const std::string &filename)
 {
+    m_map = mapFile(filename, m_mapSize);
+    if (m_map) {
+        m_endPos = m_mapSize;
+        if (m_mapSize < 2 ||
+            (unsigned char)m_map[0] != SNAPPY_BYTE1 ||
+            (unsigned char)m_map[1] != SNAPPY_BYTE2) {
+            unmapFile(m_map, m_mapSize);
+            m_map = NULL;
+            return false;
+        }
+        m_mapPos = 2;
+
+        loadIndex();
+        startReadAhead();
+        flushReadCache();
+        return true;
+    }
+
     std::ios_base::openmode fmode = std::fstream::binary
                                   | std::fstream::in;
 
@@ -161,6 +383,11 @@ bool SnappyFile::rawOpen(const std::string &filename)
         m_stream >> byte2;
         assert(byte1 == SNAPPY_BYTE1 && byte2 == SNAPPY_BYTE2);
 
+        loadIndex();
+        m_stream.clear();
+        m_stream.seekg(2, std::ios::beg);
+
+        startReadAhead();
         flushReadCache();
     }
     return m_stream.is_open();
@@ -196,8 +423,46 @@ size_t SnappyFile::rawRead(void *buffer, size_t length)
     return length;
 }
 
+const char *SnappyFile::rawReadInPlace(size_t length, std::shared_ptr<char> &storage)
+{
+    if (endOfData() || freeCacheSize() < length) {
+        return NULL;
+    }
+
+    const Chunk &chunk = m_chunks[(m_consumeIndex - 1) % SNAPPY_READAHEAD_CHUNKS];
+    assert(chunk.data.get() == m_cache);
+    storage = chunk.data;
+
+    const char *buf = m_cachePtr;
+    m_cachePtr += length;
+    return buf;
+}
+
+void SnappyFile::rawSetCapture(std::vector<char> *capture)
+{
+    flushCapture();
+    m_captureBuffer = capture;
+    m_captureStart = m_cachePtr;
+}
+
+/*
+ * Copy the bytes consumed from the current chunk so far into the capture
+ * buffer, in one go.
+ */
+void SnappyFile::flushCapture(void)
+{
+    if (m_captureBuffer && m_cachePtr > m_captureStart) {
+        m_captureBuffer->insert(m_captureBuffer->end(), m_captureStart, (const char *)m_cachePtr);
+    }
+    m_captureStart = m_cachePtr;
+}
+
 int SnappyFile::rawGetc()
 {
+    if (m_cachePtr < m_cache + m_cacheSize) {
+        return (unsigned char)*m_cachePtr++;
+    }
+
     unsigned char c = 0;
     if (rawRead(&c, 1) != 1)
         return -1;
@@ -206,82 +471,386 @@ int SnappyFile::rawGetc()
 
 void SnappyFile::rawClose()
 {
+    stopReadAhead();
+    if (m_map) {
+        unmapFile(m_map, m_mapSize);
+        m_map = NULL;
+    }
     m_stream.close();
-    delete [] m_cache;
+    for (unsigned i = 0; i < SNAPPY_READAHEAD_CHUNKS; ++i) {
+        Chunk &chunk = m_chunks[i];
+        chunk.data.reset();
+        chunk.capacity = 0;
+        chunk.compressedData = NULL;
+        std::vector<char>().swap(chunk.compressed);
+    }
     m_cache = NULL;
     m_cachePtr = NULL;
+    m_cacheSize = 0;
+    m_captureBuffer = NULL;
+    m_captureStart = NULL;
+    m_index.clear();
+    m_chunkPositions.clear();
+    m_chunkOffsets.clear();
+}
+
+bool SnappyFile::readAt(unsigned long long offset, void *buffer, size_t length)
+{
+    if (offset > (unsigned long long)m_endPos ||
+        length > (unsigned long long)m_endPos - offset) {
+        return false;
+    }
+    if (m_map) {
+        memcpy(buffer, m_map + offset, length);
+        return true;
+    }
+    m_stream.clear();
+    m_stream.seekg(offset, std::ios::beg);
+    m_stream.read((char *)buffer, length);
+    return !m_stream.fail();
 }
 
-void SnappyFile::flushReadCache(size_t skipLength)
+/*
+ * Look for a seek index at the end of the file.
+ */
+void SnappyFile::loadIndex(void)
 {
-    //assert(m_cachePtr == m_cache + m_cacheSize);
-    m_currentOffset.chunk = m_stream.tellg();
-    size_t compressedLength;
-    compressedLength = readCompressedLength();
+    unsigned long long fileSize = m_endPos;
+    if (fileSize < 2 + 8 + SNAPPY_TRAILER_SIZE) {
+        return;
+    }
+
+    unsigned char trailer[SNAPPY_TRAILER_SIZE];
+    if (!readAt(fileSize - SNAPPY_TRAILER_SIZE, trailer, sizeof trailer) ||
+        memcmp(trailer + 8, SNAPPY_INDEX_MAGIC, 4) != 0) {
+        return;
+    }
+
+    unsigned long long endOfChunks = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+        endOfChunks |= (unsigned long long)trailer[i] << (8*i);
+    }
+
+    unsigned char header[8];
+    if (endOfChunks < 2 ||
+        endOfChunks > fileSize - SNAPPY_TRAILER_SIZE - sizeof header ||
+        !readAt(endOfChunks, header, sizeof header) ||
+        decodeCompressedLength(header) != 0) {
+        std::cerr << "warning: ignoring invalid trace index\n";
+        return;
+    }
+
+    size_t compressedLength = decodeCompressedLength(header + 4);
+    if (endOfChunks + sizeof header + compressedLength != fileSize - SNAPPY_TRAILER_SIZE) {
+        std::cerr << "warning: ignoring invalid trace index\n";
+        return;
+    }
+
+    std::vector<char> compressed(compressedLength);
+    std::string block;
+    if (!readAt(endOfChunks + sizeof header, &compressed[0], compressedLength) ||
+        !::snappy::Uncompress(&compressed[0], compressedLength, &block) ||
+        block.size() < 4) {
+        std::cerr << "warning: ignoring invalid trace index\n";
+        return;
+    }
+
+    const unsigned char *data = (const unsigned char *)block.data();
+    size_t numChunks = decodeCompressedLength(data);
+    if ((block.size() - 4) / 8 < numChunks) {
+        std::cerr << "warning: ignoring invalid trace index\n";
+        return;
+    }
+    data += 4;
+
+    unsigned long long position = 0;
+    unsigned long long offset = 2;
+    m_chunkPositions.resize(numChunks + 1);
+    m_chunkOffsets.resize(numChunks + 1);
+    for (size_t i = 0; i < numChunks; ++i) {
+        m_chunkPositions[i] = position;
+        m_chunkOffsets[i] = offset;
+        offset += 4 + decodeCompressedLength(data);
+        position += decodeCompressedLength(data + 4);
+        data += 8;
+    }
+    // Sentinel for the end of the stream
+    m_chunkPositions[numChunks] = position;
+    m_chunkOffsets[numChunks] = offset;
+
+    if (offset != endOfChunks) {
+        std::cerr << "warning: ignoring invalid trace index\n";
+        m_chunkPositions.clear();
+        m_chunkOffsets.clear();
+        return;
+    }
+
+    m_index.assign((const char *)data, block.data() + block.size() - (const char *)data);
+}
+
+bool SnappyFile::getIndex(std::string &data)
+{
+    if (m_chunkOffsets.empty()) {
+        return false;
+    }
+    data = m_index;
+    return true;
+}
+
+bool SnappyFile::getOffset(unsigned long long position, File::Offset &offset)
+{
+    std::vector<unsigned long long>::const_iterator it =
+        std::upper_bound(m_chunkPositions.begin(), m_chunkPositions.end(), position);
+    if (it == m_chunkPositions.begin() ||
+        it == m_chunkPositions.end()) {
+        return false;
+    }
+    --it;
+    size_t i = it - m_chunkPositions.begin();
+    offset.chunk = m_chunkOffsets[i];
+    offset.offsetInChunk = position - *it;
+    return true;
+}
+
+void SnappyFile::startReadAhead(void)
+{
+    m_readIndex = 0;
+    m_consumeIndex = 0;
+    m_busy = 0;
+    m_readAhead = SNAPPY_READAHEAD_CHUNKS - 1;
+    m_eof = false;
+    m_stop = false;
+
+    // Leave one processor to the parser, but always have at least one
+    // reader so that file I/O overlaps with parsing.
+    unsigned numThreads = os::getNumberOfProcessors();
+    if (numThreads > 1) {
+        --numThreads;
+    }
+    numThreads = std::min(numThreads, (unsigned)SNAPPY_MAX_READ_THREADS);
+
+    for (unsigned i = 0; i < numThreads; ++i) {
+        m_threads.push_back(os::thread(readerThread, this));
+    }
+}
+
+void SnappyFile::stopReadAhead(void)
+{
+    {
+        os::unique_lock<os::mutex> lock(m_mutex);
+        m_stop = true;
+        m_workCond.notify_one();
+    }
+
+    for (unsigned i = 0; i < m_threads.size(); ++i) {
+        m_threads[i].join();
+    }
+    m_threads.clear();
+}
+
+/*
+ * Discard all chunks read so far and resume reading at the given file
+ * position.
+ */
+void SnappyFile::restartReadAhead(std::streampos offset)
+{
+    os::unique_lock<os::mutex> lock(m_mutex);
+
+    // Wait for chunks being decompressed, as they still refer to the slots.
+    while (m_busy) {
+        m_readyCond.wait(lock);
+    }
+
+    for (unsigned i = 0; i < SNAPPY_READAHEAD_CHUNKS; ++i) {
+        m_chunks[i].state = Chunk::EMPTY;
+    }
+    m_readIndex = 0;
+    m_consumeIndex = 0;
+    m_readAhead = 1;
+    m_eof = false;
+
+    if (m_map) {
+        m_mapPos = (size_t)offset;
+    } else {
+        // to remove eof bit
+        m_stream.clear();
+        // seek to the start of a chunk
+        m_stream.seekg(offset, std::ios::beg);
+    }
+
+    m_workCond.notify_one();
+}
+
+void SnappyFile::readerThread(SnappyFile *_this)
+{
+    _this->readerLoop();
+}
+
+void SnappyFile::readerLoop(void)
+{
+    os::unique_lock<os::mutex> lock(m_mutex);
+
+    while (true) {
+        // Always leave the slot currently being parsed alone.
+        while (!m_stop &&
+               (m_eof || m_readIndex - m_consumeIndex >= m_readAhead)) {
+            m_workCond.wait(lock);
+        }
+        if (m_stop) {
+            // Wake up the next reader, so that it also sees m_stop.
+            m_workCond.notify_one();
+            break;
+        }
+
+        // File reads are serialized by the mutex, so that chunks are
+        // numbered in file order.
+        Chunk &chunk = m_chunks[m_readIndex % SNAPPY_READAHEAD_CHUNKS];
+        assert(chunk.state != Chunk::LOADING);
+        if (!fetchChunk(chunk)) {
+            m_eof = true;
+            m_readyCond.notify_one();
+            continue;
+        }
+
+        chunk.state = Chunk::LOADING;
+        ++m_readIndex;
+        ++m_busy;
+
+        // Let another reader pick up the following chunk while we
+        // decompress this one.
+        m_workCond.notify_one();
+
+        lock.unlock();
+        chunk.decompress();
+        lock.lock();
+
+        chunk.state = Chunk::READY;
+        --m_busy;
+        m_readyCond.notify_one();
+    }
+}
+
+/*
+ * Locate the compressed data of the next chunk in the file.  Returns false at
+ * the end of the file.
+ */
+bool SnappyFile::fetchChunk(Chunk &chunk)
+{
+    if (m_map) {
+        if (m_mapSize - m_mapPos < 4) {
+            return false;
+        }
+        size_t compressedLength =
+            decodeCompressedLength((const unsigned char *)m_map + m_mapPos);
+        if (!compressedLength) {
+            return false;
+        }
+        if (m_mapSize - m_mapPos - 4 < compressedLength) {
+            std::cerr << "warning: unexpected end of file while reading trace\n";
+            return false;
+        }
+        chunk.offset = m_mapPos;
+        chunk.compressedData = m_map + m_mapPos + 4;
+        chunk.compressedLength = compressedLength;
+        m_mapPos += 4 + compressedLength;
+        return true;
+    }
+
+    std::streampos offset = m_stream.tellg();
+    size_t compressedLength = readCompressedLength();
     if (!compressedLength) {
         // Reached end of file
-        createCache(0);
-        return;
+        return false;
     }
 
-    m_stream.read((char*)m_compressedCache, compressedLength);
+    if (chunk.compressed.size() < compressedLength) {
+        chunk.compressed.resize(compressedLength);
+    }
+    m_stream.read(&chunk.compressed[0], compressedLength);
     if (m_stream.fail()) {
         // XXX: Unforunately Snappy's interface is not expressive enough
         // to allow recovering part of the uncompressed bytes.
         std::cerr << "warning: unexpected end of file while reading trace\n";
-        createCache(0);
-        return;
-    }
-    ::snappy::GetUncompressedLength(m_compressedCache, compressedLength,
-                                    &m_cacheSize);
-    createCache(m_cacheSize);
-    if (skipLength < m_cacheSize) {
-        ::snappy::RawUncompress(m_compressedCache, compressedLength,
-                                m_cache);
+        return false;
     }
+
+    chunk.offset = offset;
+    chunk.compressedData = &chunk.compressed[0];
+    chunk.compressedLength = compressedLength;
+    return true;
 }
 
-void SnappyFile::createCache(size_t size)
+void SnappyFile::Chunk::decompress(void)
 {
-    if (size > m_cacheMaxSize) {
-        do {
-            m_cacheMaxSize <<= 1;
-        } while (size > m_cacheMaxSize);
+    size_t length = 0;
+    if (!::snappy::GetUncompressedLength(compressedData, compressedLength,
+                                         &length)) {
+        std::cerr << "warning: corrupted chunk while reading trace\n";
+        size = 0;
+        return;
+    }
 
-        delete [] m_cache;
-        m_cache = new char[size];
-        m_cacheMaxSize = size;
+    // Don't overwrite data that blobs still refer to
+    if (length > capacity || data.use_count() > 1) {
+        capacity = std::max(length, (size_t)SNAPPY_CHUNK_SIZE);
+        data = std::shared_ptr<char>(new char[capacity], std::default_delete<char[]>());
     }
+    size = length;
 
-    m_cachePtr = m_cache;
-    m_cacheSize = size;
+    ::snappy::RawUncompress(compressedData, compressedLength, data.get());
 }
 
-void SnappyFile::writeCompressedLength(size_t length)
+/*
+ * Switch to the next chunk, waiting for it to be decompressed if necessary.
+ */
+void SnappyFile::flushReadCache(void)
 {
-    unsigned char buf[4];
-    buf[0] = length & 0xff; length >>= 8;
-    buf[1] = length & 0xff; length >>= 8;
-    buf[2] = length & 0xff; length >>= 8;
-    buf[3] = length & 0xff; length >>= 8;
-    assert(length == 0);
-    m_stream.write((const char *)buf, sizeof buf);
+    flushCapture();
+
+    os::unique_lock<os::mutex> lock(m_mutex);
+
+    // The chunk we were parsing can now be recycled.
+    if (m_cache) {
+        Chunk &previous = m_chunks[(m_consumeIndex - 1) % SNAPPY_READAHEAD_CHUNKS];
+        assert(previous.data.get() == m_cache);
+        previous.state = Chunk::EMPTY;
+    }
+
+    Chunk &chunk = m_chunks[m_consumeIndex % SNAPPY_READAHEAD_CHUNKS];
+    while (chunk.state != Chunk::READY) {
+        if (m_eof && m_readIndex == m_consumeIndex) {
+            m_cache = NULL;
+            m_cachePtr = NULL;
+            m_cacheSize = 0;
+            m_captureStart = NULL;
+            return;
+        }
+        m_readyCond.wait(lock);
+    }
+
+    // Reading on past the first chunk after a seek
+    if (m_consumeIndex) {
+        m_readAhead = SNAPPY_READAHEAD_CHUNKS - 1;
+    }
+
+    ++m_consumeIndex;
+    m_workCond.notify_one();
+
+    m_currentOffset.chunk = chunk.offset;
+    m_cache = chunk.data.get();
+    m_cachePtr = m_cache;
+    m_cacheSize = chunk.size;
+    m_captureStart = m_cachePtr;
 }
 
 size_t SnappyFile::readCompressedLength()
 {
     unsigned char buf[4];
-    size_t length;
     m_stream.read((char *)buf, sizeof buf);
     if (m_stream.fail()) {
-        length = 0;
-    } else {
-        length  =  (size_t)buf[0];
-        length |= ((size_t)buf[1] <<  8);
-        length |= ((size_t)buf[2] << 16);
-        length |= ((size_t)buf[3] << 24);
+        return 0;
     }
-    return length;
+    return decodeCompressedLength(buf);
 }
 
 bool SnappyFile::supportsOffsets() const
@@ -297,15 +866,23 @@ File::Offset SnappyFile::currentOffset()
 
 void SnappyFile::setCurrentOffset(const File::Offset &offset)
 {
-    // to remove eof bit
-    m_stream.clear();
-    // seek to the start of a chunk
-    m_stream.seekg(offset.chunk, std::ios::beg);
+    // Seeking within the chunk being parsed needs no I/O at all
+    if (m_cache && m_currentOffset.chunk == offset.chunk) {
+        assert(m_cacheSize >= offset.offsetInChunk);
+        flushCapture();
+        m_cachePtr = m_cache + offset.offsetInChunk;
+        m_captureStart = m_cachePtr;
+        return;
+    }
+
+    restartReadAhead(offset.chunk);
     // load the chunk
+    m_cache = NULL;
     flushReadCache();
     assert(m_cacheSize >= offset.offsetInChunk);
     // seek within our cache to the correct location within the chunk
     m_cachePtr = m_cache + offset.offsetInChunk;
+    m_captureStart = m_cachePtr;
 
 }
 
@@ -324,7 +901,7 @@ bool SnappyFile::rawSkip(size_t length)
             m_cachePtr += chunkSize;
             sizeToRead -= chunkSize;
             if (sizeToRead > 0) {
-                flushReadCache(sizeToRead);
+                flushReadCache();
             }
             if (!m_cacheSize) {
                 break;
@@ -337,7 +914,7 @@ bool SnappyFile::rawSkip(size_t length)
 
 int SnappyFile::rawPercentRead()
 {
-    return int(100 * (double(m_stream.tellg()) / double(m_endPos)));
+    return int(100 * (double(m_currentOffset.chunk) / double(m_endPos)));
 }
 
 
@@ -143,9 +143,10 @@ bool ZLibFile::supportsOffsets() const
     return false;
 }
 
-bool ZLibFile::rawSkip(size_t)
+bool ZLibFile::rawSkip(size_t length)
 {
-    return false;
+    // Forward seeks are emulated by decompressing
+    return gzseek(m_gzFile, length, SEEK_CUR) != -1;
 }
 
 int ZLibFile::rawPercentRead()
@@ -0,0 +1,226 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include "trace_file.hpp"
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include <zstd.h>
+
+#include "os.hpp"
+
+
+/*
+ * Largest window accepted, so that traces compressed with long distance
+ * matching can be read.
+ */
+#define ZSTD_WINDOW_LOG_MAX 31
+
+
+using namespace trace;
+
+
+class ZstdFile : public File {
+public:
+    ZstdFile(const std::string &filename = std::string());
+    virtual ~ZstdFile();
+
+    virtual bool supportsOffsets() const;
+    virtual File::Offset currentOffset();
+protected:
+    virtual bool rawOpen(const std::string &filename);
+    virtual size_t rawRead(void *buffer, size_t length);
+    virtual int rawGetc();
+    virtual void rawClose();
+    virtual bool rawSkip(size_t length);
+    virtual int rawPercentRead();
+private:
+    bool fillOutput(void);
+
+    std::ifstream m_stream;
+    std::streampos m_endPos;
+    ZSTD_DCtx *m_dctx;
+
+    std::vector<char> m_input;
+    ZSTD_inBuffer m_inBuffer;
+
+    // Decompressed data, and the part not consumed yet
+    std::vector<char> m_output;
+    const char *m_outputPtr;
+    const char *m_outputEnd;
+
+    unsigned long long m_offset;
+};
+
+ZstdFile::ZstdFile(const std::string &filename)
+    : File(filename),
+      m_dctx(NULL),
+      m_outputPtr(NULL),
+      m_outputEnd(NULL),
+      m_offset(0)
+{
+}
+
+ZstdFile::~ZstdFile()
+{
+    close();
+}
+
+bool ZstdFile::rawOpen(const std::string &filename)
+{
+    m_stream.open(filename.c_str(), std::fstream::binary | std::fstream::in);
+    if (!m_stream.is_open()) {
+        return false;
+    }
+
+    m_stream.seekg(0, std::ios::end);
+    m_endPos = m_stream.tellg();
+    m_stream.seekg(0, std::ios::beg);
+
+    m_dctx = ZSTD_createDCtx();
+    if (!m_dctx) {
+        m_stream.close();
+        return false;
+    }
+    ZSTD_DCtx_setParameter(m_dctx, ZSTD_d_windowLogMax, ZSTD_WINDOW_LOG_MAX);
+
+    m_input.resize(ZSTD_DStreamInSize());
+    m_inBuffer.src = &m_input[0];
+    m_inBuffer.size = 0;
+    m_inBuffer.pos = 0;
+
+    m_output.resize(ZSTD_DStreamOutSize());
+    m_outputPtr = m_outputEnd = &m_output[0];
+    m_offset = 0;
+
+    return true;
+}
+
+/*
+ * Decompress more data once all decompressed data was consumed.  Returns
+ * false at the end of the stream.
+ */
+bool ZstdFile::fillOutput(void)
+{
+    if (m_outputPtr < m_outputEnd) {
+        return true;
+    }
+
+    do {
+        if (m_inBuffer.pos == m_inBuffer.size) {
+            m_stream.read(&m_input[0], m_input.size());
+            m_inBuffer.size = m_stream.gcount();
+            m_inBuffer.pos = 0;
+            if (m_inBuffer.size == 0) {
+                return false;
+            }
+        }
+
+        ZSTD_outBuffer outBuffer = { &m_output[0], m_output.size(), 0 };
+        size_t ret = ZSTD_decompressStream(m_dctx, &outBuffer, &m_inBuffer);
+        if (ZSTD_isError(ret)) {
+            os::log("error: zstd decompression failed: %s\n", ZSTD_getErrorName(ret));
+            return false;
+        }
+
+        m_outputPtr = &m_output[0];
+        m_outputEnd = m_outputPtr + outBuffer.pos;
+    } while (m_outputPtr == m_outputEnd);
+
+    return true;
+}
+
+size_t ZstdFile::rawRead(void *buffer, size_t length)
+{
+    char *dst = static_cast<char *>(buffer);
+    size_t read = 0;
+    while (read < length && fillOutput()) {
+        size_t size = std::min(length - read, size_t(m_outputEnd - m_outputPtr));
+        memcpy(dst + read, m_outputPtr, size);
+        m_outputPtr += size;
+        read += size;
+    }
+    m_offset += read;
+    return read;
+}
+
+int ZstdFile::rawGetc()
+{
+    if (!fillOutput()) {
+        return -1;
+    }
+    ++m_offset;
+    return (unsigned char)*m_outputPtr++;
+}
+
+void ZstdFile::rawClose()
+{
+    if (m_dctx) {
+        ZSTD_freeDCtx(m_dctx);
+        m_dctx = NULL;
+    }
+    m_stream.close();
+    m_input.clear();
+    m_output.clear();
+    m_outputPtr = m_outputEnd = NULL;
+}
+
+File::Offset ZstdFile::currentOffset()
+{
+    return File::Offset(m_offset);
+}
+
+bool ZstdFile::supportsOffsets() const
+{
+    return false;
+}
+
+bool ZstdFile::rawSkip(size_t length)
+{
+    while (length && fillOutput()) {
+        size_t size = std::min(length, size_t(m_outputEnd - m_outputPtr));
+        m_outputPtr += size;
+        m_offset += size;
+        length -= size;
+    }
+    return length == 0;
+}
+
+int ZstdFile::rawPercentRead()
+{
+    std::streampos pos = m_stream.eof() ? m_endPos : m_stream.tellg();
+    return int(100 * (double(pos) / double(m_endPos)));
+}
+
+
+File * File::createZstd(void) {
+    return new ZstdFile;
+}
@@ -34,7 +34,7 @@
 namespace trace {
 
 
-#define TRACE_VERSION 5
+#define TRACE_VERSION 7
 
 
 enum Event {
@@ -67,8 +67,25 @@ enum Type {
     TYPE_OPAQUE,
     TYPE_REPR,
     TYPE_WSTRING,
+    TYPE_BLOB_DEF,
+    TYPE_BLOB_REF,
+    TYPE_STRING_DEF,
+    TYPE_STRING_REF,
 };
 
+
+/*
+ * Blobs may only be referred to while no more than this many bytes of blobs
+ * were defined after them, so that readers need no more than this much
+ * memory to resolve references while reading sequentially.
+ */
+#define BLOB_WINDOW_SIZE (64 * 1024 * 1024)
+
+/*
+ * Likewise for strings.
+ */
+#define STRING_WINDOW_SIZE (1024 * 1024)
+
 enum BacktraceDetail {
     BACKTRACE_END = 0,
     BACKTRACE_MODULE,
@@ -78,6 +95,19 @@ enum BacktraceDetail {
     BACKTRACE_OFFSET,
 };
 
+/*
+ * Kinds of definitions which are only written on first occurrence, and
+ * referred to by id afterwards.
+ */
+enum SigKind {
+    SIG_FUNCTION = 0,
+    SIG_STRUCT,
+    SIG_ENUM,
+    SIG_BITMASK,
+    SIG_FRAME,
+    SIG_KIND_COUNT
+};
+
 
 } /* namespace trace */
 
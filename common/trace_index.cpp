@@ -0,0 +1,217 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include "trace_index.hpp"
+
+
+#define INDEX_VERSION 2
+
+
+namespace trace {
+
+
+static void
+writeUInt(std::string &data, unsigned long long value)
+{
+    do {
+        char c = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            c |= 0x80;
+        }
+        data.push_back(c);
+    } while (value);
+}
+
+
+static bool
+readUInt(const char *&data, const char *end, unsigned long long &value)
+{
+    value = 0;
+    unsigned shift = 0;
+    unsigned char c;
+    do {
+        if (data == end || shift >= 64) {
+            return false;
+        }
+        c = *data++;
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+
+/*
+ * Entries are written in stream order, so positions are delta encoded.
+ */
+static void
+writeEntries(std::string &data, const Index::EntryList &entries, bool deltaNo,
+             bool withSize = false)
+{
+    writeUInt(data, entries.size());
+    unsigned long long no = 0;
+    unsigned long long position = 0;
+    for (Index::EntryList::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        assert(it->position >= position);
+        assert(!deltaNo || it->no >= no);
+        writeUInt(data, deltaNo ? it->no - no : it->no);
+        writeUInt(data, it->position - position);
+        if (withSize) {
+            writeUInt(data, it->size);
+        }
+        no = it->no;
+        position = it->position;
+    }
+}
+
+
+static bool
+readEntries(const char *&data, const char *end, Index::EntryList &entries, bool deltaNo,
+            bool withSize = false)
+{
+    unsigned long long count;
+    if (!readUInt(data, end, count) ||
+        count > (unsigned long long)(end - data)) {
+        return false;
+    }
+    entries.resize(count);
+    unsigned long long no = 0;
+    unsigned long long position = 0;
+    for (Index::EntryList::iterator it = entries.begin(); it != entries.end(); ++it) {
+        unsigned long long value;
+        if (!readUInt(data, end, value)) {
+            return false;
+        }
+        no = deltaNo ? no + value : value;
+        if (!readUInt(data, end, value)) {
+            return false;
+        }
+        position += value;
+        it->no = no;
+        it->position = position;
+        if (withSize && !readUInt(data, end, it->size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void
+Index::clear(void)
+{
+    calls.clear();
+    frames.clear();
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        sigs[kind].clear();
+    }
+    blobs.clear();
+    strings.clear();
+}
+
+
+void
+Index::serialize(std::string &data) const
+{
+    writeUInt(data, INDEX_VERSION);
+    writeEntries(data, calls, true);
+    writeEntries(data, frames, true);
+    writeUInt(data, SIG_KIND_COUNT);
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        writeEntries(data, sigs[kind], false);
+    }
+    writeEntries(data, blobs, true, true);
+    writeEntries(data, strings, true, true);
+}
+
+
+bool
+Index::parse(const char *data, size_t size)
+{
+    const char *end = data + size;
+
+    clear();
+
+    unsigned long long version;
+    // Version 1 lacked blobs and strings
+    if (!readUInt(data, end, version) ||
+        version < 1 || version > INDEX_VERSION) {
+        return false;
+    }
+
+    unsigned long long numKinds;
+    if (!readEntries(data, end, calls, true) ||
+        !readEntries(data, end, frames, true) ||
+        !readUInt(data, end, numKinds) ||
+        numKinds != SIG_KIND_COUNT) {
+        clear();
+        return false;
+    }
+
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        if (!readEntries(data, end, sigs[kind], false)) {
+            clear();
+            return false;
+        }
+    }
+
+    if (version >= 2 &&
+        (!readEntries(data, end, blobs, true, true) ||
+         !readEntries(data, end, strings, true, true))) {
+        clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool
+entryNoLess(unsigned long long no, const Index::Entry &entry)
+{
+    return no < entry.no;
+}
+
+
+const Index::Entry *
+Index::findCall(unsigned long long call_no) const
+{
+    EntryList::const_iterator it =
+        std::upper_bound(calls.begin(), calls.end(), call_no, entryNoLess);
+    if (it == calls.begin()) {
+        return NULL;
+    }
+    --it;
+    return &*it;
+}
+
+
+} /* namespace trace */
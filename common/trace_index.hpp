@@ -0,0 +1,99 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Seek index which the writer appends to traces, so that readers can jump to
+ * a given call or frame without scanning the whole trace.
+ */
+
+#pragma once
+
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "trace_format.hpp"
+
+
+namespace trace {
+
+
+class Index
+{
+public:
+    /*
+     * Positions are offsets into the uncompressed trace stream.  Use
+     * File::getOffset() to convert them into file offsets.
+     */
+    struct Entry {
+        unsigned long long no;
+        unsigned long long position;
+        // Only for blobs and strings
+        unsigned long long size;
+
+        Entry(unsigned long long _no = 0, unsigned long long _position = 0,
+              unsigned long long _size = 0) :
+            no(_no),
+            position(_position),
+            size(_size)
+        {}
+    };
+
+    typedef std::vector<Entry> EntryList;
+
+    // A sample of call enter events, by call number
+    EntryList calls;
+
+    // Enter event of the first call of each frame, by call number
+    EntryList frames;
+
+    // Start of each signature definition, right after its id, by id
+    EntryList sigs[SIG_KIND_COUNT];
+
+    // Start of the data of each blob and interned string definition, by id,
+    // along with its size, so that they can be referred to after seeking
+    EntryList blobs;
+    EntryList strings;
+
+    void
+    clear(void);
+
+    void
+    serialize(std::string &data) const;
+
+    bool
+    parse(const char *data, size_t size);
+
+    /**
+     * Find the last sampled call which is not after the given one.
+     */
+    const Entry *
+    findCall(unsigned long long call_no) const;
+};
+
+
+} /* namespace trace */
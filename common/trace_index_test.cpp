@@ -0,0 +1,261 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Writes a trace, and checks that seeking to calls and frames through the
+ * seek index appended to it yields the same calls as parsing it from the
+ * start, including blobs and strings defined before the seek target.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
+
+
+using namespace trace;
+
+
+static const char *filename = "trace_index_test.trace";
+
+static const unsigned numFrames = 40;
+static const unsigned callsPerFrame = 50;
+
+static const char *argNames[] = {"frame", "blob", "name", "filler"};
+static const FunctionSig drawSig = {1, "glDrawTest", 4, argNames};
+
+static const char *swapArgNames[] = {"dpy", "drawable"};
+static const FunctionSig swapSig = {2, "glXSwapBuffers", 2, swapArgNames};
+
+
+/*
+ * Arguments of each call written, so that they can be checked after seeking.
+ */
+struct Expected {
+    unsigned frame;
+    int blob;
+    int string;
+};
+
+
+class IndexTest : public testing::Test
+{
+protected:
+    std::vector<std::string> blobs;
+    std::vector<std::string> strings;
+    std::vector<Expected> calls;
+    std::vector<unsigned> frameStarts;
+
+    static unsigned
+    random(unsigned &seed) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0x7fff;
+    }
+
+    void
+    SetUp(void) {
+        unsigned seed = 1;
+
+        // Blobs big enough to be written once and referred to afterwards
+        blobs.resize(20);
+        for (size_t i = 0; i < blobs.size(); ++i) {
+            blobs[i].resize(1024 + random(seed) % 4096);
+            for (size_t j = 0; j < blobs[i].size(); ++j) {
+                blobs[i][j] = (char)random(seed);
+            }
+        }
+
+        strings.resize(30);
+        for (size_t i = 0; i < strings.size(); ++i) {
+            char buf[64];
+            snprintf(buf, sizeof buf, "interned_string_%u", (unsigned)i);
+            strings[i] = buf;
+        }
+
+        // Incompressible small blobs, to span several snappy chunks and
+        // index samples
+        std::string filler(1000, 0);
+
+        Writer writer;
+        ASSERT_TRUE(writer.open(filename, COMPRESSION_SNAPPY));
+
+        for (unsigned frame = 0; frame < numFrames; ++frame) {
+            frameStarts.push_back(calls.size());
+
+            for (unsigned i = 0; i < callsPerFrame; ++i) {
+                Expected expected;
+                expected.frame = frame;
+                // New blobs and strings keep being defined along the trace
+                expected.blob = random(seed) % std::min<size_t>(blobs.size(), frame / 2 + 1);
+                expected.string = random(seed) % std::min<size_t>(strings.size(), frame + 1);
+
+                for (size_t j = 0; j < filler.size(); ++j) {
+                    filler[j] = (char)random(seed);
+                }
+
+                unsigned call_no = writer.beginEnter(&drawSig, 0);
+                writer.beginArg(0);
+                writer.writeUInt(frame);
+                writer.endArg();
+                writer.beginArg(1);
+                writer.writeBlob(blobs[expected.blob].data(), blobs[expected.blob].size());
+                writer.endArg();
+                writer.beginArg(2);
+                writer.writeString(strings[expected.string].c_str());
+                writer.endArg();
+                writer.beginArg(3);
+                writer.writeBlob(filler.data(), filler.size());
+                writer.endArg();
+                writer.endEnter();
+                writer.beginLeave(call_no);
+                writer.endLeave();
+
+                ASSERT_EQ(call_no, calls.size());
+                calls.push_back(expected);
+            }
+
+            unsigned call_no = writer.beginEnter(&swapSig, 0);
+            writer.endEnter();
+            writer.beginLeave(call_no);
+            writer.endLeave();
+
+            Expected expected;
+            expected.frame = frame;
+            expected.blob = -1;
+            expected.string = -1;
+            calls.push_back(expected);
+        }
+
+        writer.close();
+    }
+
+    void
+    TearDown(void) {
+        remove(filename);
+    }
+
+    void
+    checkCall(Call *call) {
+        ASSERT_TRUE(call != NULL);
+        ASSERT_LT(call->no, calls.size());
+        const Expected &expected = calls[call->no];
+
+        if (expected.blob < 0) {
+            EXPECT_STREQ("glXSwapBuffers", call->name());
+            return;
+        }
+
+        EXPECT_STREQ("glDrawTest", call->name());
+        EXPECT_EQ(expected.frame, call->arg(0).toUInt());
+
+        const Blob *blob = call->arg(1).toBlob();
+        ASSERT_TRUE(blob != NULL);
+        const std::string &data = blobs[expected.blob];
+        ASSERT_EQ(data.size(), blob->size) << "call " << call->no;
+        EXPECT_EQ(0, memcmp(data.data(), blob->buf, data.size())) << "call " << call->no;
+
+        const char *string = call->arg(2).toString();
+        ASSERT_TRUE(string != NULL);
+        EXPECT_EQ(strings[expected.string], string) << "call " << call->no;
+    }
+};
+
+
+TEST_F(IndexTest, seekToCall)
+{
+    Parser parser;
+    ASSERT_TRUE(parser.open(filename));
+    ASSERT_TRUE(parser.hasIndex());
+
+    // From the end backwards too, so that definitions are first seen after
+    // seeking past them
+    static const unsigned targets[] = {1500, 2000, 700, 35, 1999, 0, 1000};
+    for (size_t i = 0; i < sizeof targets / sizeof targets[0]; ++i) {
+        unsigned target = targets[i];
+
+        ParseBookmark bookmark;
+        ASSERT_TRUE(parser.getCallBookmark(target, bookmark));
+        EXPECT_LE(bookmark.next_call_no, target);
+        parser.setBookmark(bookmark);
+
+        Call *call;
+        while ((call = parser.parse_call()) && call->no < target) {
+            parser.recycle(call);
+        }
+        ASSERT_TRUE(call != NULL);
+        ASSERT_EQ(target, call->no);
+
+        // The calls which follow too
+        for (unsigned j = 0; j < 10 && call; ++j) {
+            checkCall(call);
+            parser.recycle(call);
+            call = parser.parse_call();
+        }
+        parser.recycle(call);
+    }
+}
+
+
+TEST_F(IndexTest, seekToFrame)
+{
+    static const unsigned targets[] = {30, 39, 5, 0, 17};
+    for (size_t i = 0; i < sizeof targets / sizeof targets[0]; ++i) {
+        unsigned frame = targets[i];
+
+        // A fresh parser each time
+        Parser parser;
+        ASSERT_TRUE(parser.open(filename));
+
+        ParseBookmark bookmark;
+        ASSERT_TRUE(parser.getFrameBookmark(frame, bookmark));
+        EXPECT_EQ(frameStarts[frame], bookmark.next_call_no);
+        parser.setBookmark(bookmark);
+
+        for (unsigned j = 0; j <= callsPerFrame; ++j) {
+            Call *call = parser.parse_call();
+            ASSERT_TRUE(call != NULL);
+            EXPECT_EQ(frameStarts[frame] + j, call->no);
+            EXPECT_EQ(frame, calls[call->no].frame);
+            checkCall(call);
+            parser.recycle(call);
+        }
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
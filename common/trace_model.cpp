@@ -44,10 +44,37 @@ Call::~Call() {
     if (ret) {
         delete ret;
     }
+
+    // The stack frames themselves belong to the parser
+    delete backtrace;
+}
+
+
+void
+Call::clear(void) {
+    for (unsigned i = 0; i < args.size(); ++i) {
+        delete args[i].value;
+    }
+    args.clear();
+
+    delete ret;
+    ret = 0;
+
+    delete backtrace;
+    backtrace = 0;
+
+    raw.clear();
+    rawLeave = 0;
+    rawSigs.clear();
+    decoder = 0;
+    rawRefs = false;
+
+    arena.reset();
 }
 
 Value &
 Call::argByName(const char *argName) {
+    decode();
     for (unsigned i = 0; i < sig->num_args; ++i) {
         if (strcmp(sig->arg_names[i], argName) == 0) {
             return arg(i);
@@ -58,12 +85,16 @@ Call::argByName(const char *argName) {
 
 
 String::~String() {
-    delete [] value;
+    if (!storage && !isArenaAllocated()) {
+        delete [] value;
+    }
 }
 
 
 WString::~WString() {
-    delete [] value;
+    if (!isArenaAllocated()) {
+        delete [] value;
+    }
 }
 
 
@@ -139,10 +170,14 @@ Blob::~Blob() {
     // bound blobs and keep the total size bounded.
 
     if (!bound) {
-        delete [] buf;
+        if (!storage && !isArenaAllocated()) {
+            delete [] buf;
+        }
         return;
     }
 
+    assert(!storage);
+
     while (!boundBlobQueue.empty() &&
            BoundBlob::totalSize + size > BLOB_MAX_BOUND_SIZE) {
         boundBlobQueue.pop_front();
@@ -233,7 +268,20 @@ void * Repr   ::toPointer(void) const { return machineValue->toPointer(); }
 
 void * Value  ::toPointer(bool bind) { assert(0); return NULL; }
 void * Null   ::toPointer(bool bind) { return NULL; }
-void * Blob   ::toPointer(bool bind) { if (bind) bound = true; return buf; }
+void * Blob   ::toPointer(bool bind) {
+    if (bind) {
+        // Bound blobs outlive their call, so don't let them pin shared storage
+        // nor refer to the call's arena
+        if (storage || isArenaAllocated()) {
+            char *copy = new char[size];
+            memcpy(copy, buf, size);
+            buf = copy;
+            storage.reset();
+        }
+        bound = true;
+    }
+    return buf;
+}
 void * Pointer::toPointer(bool bind) { return (void *)value; }
 void * Repr   ::toPointer(bool bind) { return machineValue->toPointer(bind); }
 
@@ -34,9 +34,13 @@
 #include <stdlib.h>
 
 #include <map>
+#include <memory>
 #include <vector>
 #include <ostream>
 
+#include "trace_arena.hpp"
+#include "trace_format.hpp"
+
 
 namespace trace {
 
@@ -91,15 +95,71 @@ struct BitmaskSig {
 
 
 class Visitor;
+class Call;
 class Null;
 class Struct;
 class Array;
+class Blob;
 
 
 class Value
 {
+    // Values are either allocated individually on the heap, or carved out of
+    // the arena of the call they belong to.  A small header in front of each
+    // value tells them apart, so that deleting a value tree works the same
+    // way in both cases (arena memory is merely released with the arena).
+    union Header {
+        bool arena;
+        double align;
+    };
+
+    static inline void *
+    allocate(size_t size, Arena *arena) {
+        Header *header;
+        if (arena) {
+            header = static_cast<Header *>(arena->allocate(sizeof(Header) + size));
+        } else {
+            header = static_cast<Header *>(::operator new(sizeof(Header) + size));
+        }
+        header->arena = arena != NULL;
+        return header + 1;
+    }
+
 public:
     virtual ~Value() {}
+
+    static void *operator new(size_t size) {
+        return allocate(size, NULL);
+    }
+
+    /**
+     * Allocate from the given arena, or from the heap when it is NULL.
+     */
+    static void *operator new(size_t size, Arena *arena) {
+        return allocate(size, arena);
+    }
+
+    static void operator delete(void *ptr) {
+        if (ptr) {
+            Header *header = static_cast<Header *>(ptr) - 1;
+            if (!header->arena) {
+                ::operator delete(header);
+            }
+        }
+    }
+
+    static void operator delete(void *ptr, Arena *arena) {
+        operator delete(ptr);
+    }
+
+    /**
+     * Whether this value lives in an arena.  Arena values don't own the
+     * buffers they point to either, as these come from the same arena.
+     */
+    bool isArenaAllocated(void) const {
+        return (reinterpret_cast<const Header *>(this) - 1)->arena;
+    }
+
     virtual void visit(Visitor &visitor) = 0;
 
     virtual bool toBool(void) const = 0;
@@ -122,6 +182,9 @@ public:
     virtual const Struct *toStruct(void) const { return NULL; }
     virtual Struct *toStruct(void) { return NULL; }
 
+    virtual const Blob *toBlob(void) const { return NULL; }
+    virtual Blob *toBlob(void) { return NULL; }
+
     Value & operator[](size_t index) const;
 };
 
@@ -229,6 +292,16 @@ class String : public Value
 {
 public:
     String(const char * _value) : value(_value) {}
+
+    /**
+     * String referring to data owned by someone else (e.g., the parser's
+     * interned strings), kept alive through storage.
+     */
+    String(const char * _value, const std::shared_ptr<char> &_storage) :
+        value(_value),
+        storage(_storage)
+    {}
+
     ~String();
 
     bool toBool(void) const;
@@ -236,6 +309,7 @@ public:
     void visit(Visitor &visitor);
 
     const char * value;
+    std::shared_ptr<char> storage;
 };
 
 
@@ -332,16 +406,42 @@ public:
         bound = false;
     }
 
+    /**
+     * Blob whose buffer was allocated along with it from the same arena.
+     */
+    Blob(size_t _size, char *_buf) {
+        assert(isArenaAllocated());
+        size = _size;
+        buf = _buf;
+        bound = false;
+    }
+
+    /**
+     * Blob referring to data owned by someone else (e.g., a decompressed trace
+     * chunk), kept alive through storage.
+     */
+    Blob(size_t _size, const char *_buf, const std::shared_ptr<char> &_storage) :
+        storage(_storage)
+    {
+        size = _size;
+        buf = const_cast<char *>(_buf);
+        bound = false;
+    }
+
     ~Blob();
 
     bool toBool(void) const;
     void *toPointer(void) const;
     void *toPointer(bool bind);
+    const Blob *toBlob(void) const { return this; }
+    Blob *toBlob(void) { return this; }
     void visit(Visitor &visitor);
 
     size_t size;
     char *buf;
     bool bound;
+
+    std::shared_ptr<char> storage;
 };
 
 
@@ -542,6 +642,17 @@ struct Arg
 };
 
 
+/**
+ * Decodes the details of calls parsed lazily.
+ */
+class CallDecoder
+{
+public:
+    virtual ~CallDecoder() {}
+    virtual void decodeCall(Call *call) = 0;
+};
+
+
 class Call
 {
 public:
@@ -554,24 +665,75 @@ public:
     CallFlags flags;
     Backtrace* backtrace;
 
+    // Storage for the values parsed from the trace
+    Arena arena;
+
+    struct SigRef {
+        SigKind kind;
+        Id id;
+        // Where the signature definition would go in raw
+        size_t offset;
+        // The StructSig, EnumSig, BitmaskSig or StackFrame, per kind
+        const void *sig;
+
+        SigRef(SigKind _kind, Id _id, size_t _offset) :
+            kind(_kind), id(_id), offset(_offset), sig(0) {}
+    };
+
+    // Encoded details (arguments, return value and backtrace) of lazily
+    // parsed calls, as found in the enter event followed by the leave event
+    // starting at rawLeave, minus any signature definitions, plus the
+    // signatures they refer to, in order.  decoder is set until they get
+    // decoded.
+    std::vector<char> raw;
+    size_t rawLeave;
+    std::vector<SigRef> rawSigs;
+    CallDecoder *decoder;
+
+    // Whether raw defines or refers to blobs or strings by id, which is only
+    // meaningful to the parser
+    bool rawRefs;
+
     Call(const FunctionSig *_sig, const CallFlags &_flags, unsigned _thread_id) :
         thread_id(_thread_id), 
         sig(_sig), 
         args(_sig->num_args), 
         ret(0),
         flags(_flags),
-        backtrace(0) {
+        backtrace(0),
+        rawLeave(0),
+        decoder(0),
+        rawRefs(false) {
     }
 
     ~Call();
 
+    /**
+     * Release the values and backtrace of the call, while keeping the memory
+     * that held them, so that the call object can be reused.
+     */
+    void clear(void);
+
     inline const char *
     name(void) const {
         return sig->name;
     }
 
+    /**
+     * Decode the details of a lazily parsed call, if not done yet.  This
+     * must be done before accessing args, ret or backtrace directly, and
+     * before the parser is closed.
+     */
+    inline void
+    decode(void) {
+        if (decoder) {
+            decoder->decodeCall(this);
+        }
+    }
+
     inline Value &
     arg(unsigned index) {
+        decode();
         assert(index < args.size());
         return *(args[index].value);
     }
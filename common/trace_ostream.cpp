@@ -0,0 +1,101 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Selection of the compressor for output streams.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_ostream.hpp"
+
+
+using namespace trace;
+
+
+static const struct {
+    const char *name;
+    Compression compression;
+} compressors[] = {
+    {"snappy", COMPRESSION_SNAPPY},
+    {"zlib", COMPRESSION_ZLIB},
+    {"gzip", COMPRESSION_ZLIB},
+#ifdef HAVE_ZSTD
+    {"zstd", COMPRESSION_ZSTD},
+#endif
+#ifdef HAVE_LZ4
+    {"lz4", COMPRESSION_LZ4},
+#endif
+};
+
+
+bool
+trace::parseCompression(const char *spec, Compression &compression, int &level)
+{
+    const char *sep = strchr(spec, ':');
+    size_t len = sep ? size_t(sep - spec) : strlen(spec);
+
+    for (unsigned i = 0; i < sizeof compressors / sizeof compressors[0]; ++i) {
+        if (strlen(compressors[i].name) == len &&
+            strncmp(compressors[i].name, spec, len) == 0) {
+            compression = compressors[i].compression;
+            level = 0;
+            if (sep) {
+                char *end = NULL;
+                level = strtol(sep + 1, &end, 10);
+                if (end == sep + 1 || *end != '\0') {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+OutStream *
+trace::createStream(const char *filename, Compression compression, int level)
+{
+    switch (compression) {
+    case COMPRESSION_SNAPPY:
+        return createSnappyStream(filename);
+    case COMPRESSION_ZLIB:
+        return createZLibStream(filename, level);
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        return createZstdStream(filename, level);
+#endif
+#ifdef HAVE_LZ4
+    case COMPRESSION_LZ4:
+        return createLZ4Stream(filename, level);
+#endif
+    default:
+        return nullptr;
+    }
+}
@@ -39,14 +39,60 @@ public:
 
     virtual bool write(const void *buffer, size_t length) = 0;
     virtual void flush(void) = 0;
+
+    /**
+     * Flush as much as possible when the process is crashing or about to
+     * abort, without relying on any other thread.
+     */
+    virtual void flushForCrash(void) {
+        flush();
+    }
+
+    /**
+     * Append the seek index after all data written so far.  Nothing else may
+     * be written afterwards.  Returns false if the stream format has no room
+     * for an index.
+     */
+    virtual bool writeIndex(const void *data, size_t length) {
+        return false;
+    }
+};
+
+
+enum Compression {
+    COMPRESSION_SNAPPY = 0,
+    COMPRESSION_ZLIB,
+    COMPRESSION_ZSTD,
+    COMPRESSION_LZ4,
 };
 
 
+/**
+ * Parse a compression specification such as "zstd" or "zstd:19", where the
+ * optional level is specific to each compressor, and 0 means its default.
+ * Returns false for unknown compressors or those this build lacks.
+ */
+bool
+parseCompression(const char *spec, Compression &compression, int &level);
+
+OutStream *
+createStream(const char *filename, Compression compression, int level = 0);
+
 OutStream *
 createSnappyStream(const char *filename);
 
 OutStream *
-createZLibStream(const char *filename);
+createZLibStream(const char *filename, int level = 0);
+
+#ifdef HAVE_ZSTD
+OutStream *
+createZstdStream(const char *filename, int level = 0);
+#endif
+
+#ifdef HAVE_LZ4
+OutStream *
+createLZ4Stream(const char *filename, int level = 0);
+#endif
 
 
 } /* namespace trace */
@@ -0,0 +1,177 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include "trace_ostream.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include <string.h>
+
+#include <lz4frame.h>
+
+#include "os.hpp"
+#include "trace_overhead.hpp"
+
+
+/*
+ * Most input is handed to the compressor in blocks of this size, bounding
+ * the output buffer.
+ */
+#define LZ4_BLOCK_SIZE (1 * 1024 * 1024)
+
+
+using namespace trace;
+
+
+/*
+ * LZ4 frame output stream.
+ *
+ * Levels below 3 select the fast compressor, and levels 3 and above the high
+ * compression one.  Either way decompression is very fast.
+ */
+class LZ4OutStream : public OutStream {
+public:
+    LZ4OutStream(const char *filename, int level);
+    ~LZ4OutStream();
+
+    bool write(const void *buffer, size_t length);
+    void flush(void);
+    bool isOpen(void) {
+        return m_stream.is_open() && m_cctx;
+    }
+
+private:
+    void close(void);
+    bool check(size_t result);
+
+private:
+    std::ofstream m_stream;
+    LZ4F_compressionContext_t m_cctx;
+    LZ4F_preferences_t m_prefs;
+    std::vector<char> m_output;
+};
+
+
+LZ4OutStream::LZ4OutStream(const char *filename, int level)
+    : m_cctx(NULL)
+{
+    m_stream.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!m_stream.is_open()) {
+        return;
+    }
+
+    memset(&m_prefs, 0, sizeof m_prefs);
+    m_prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+    m_prefs.frameInfo.blockMode = LZ4F_blockLinked;
+    m_prefs.compressionLevel = level;
+
+    m_output.resize(LZ4F_compressBound(LZ4_BLOCK_SIZE, &m_prefs));
+
+    if (LZ4F_isError(LZ4F_createCompressionContext(&m_cctx, LZ4F_VERSION))) {
+        m_cctx = NULL;
+        return;
+    }
+
+    size_t size = LZ4F_compressBegin(m_cctx, &m_output[0], m_output.size(), &m_prefs);
+    if (!check(size)) {
+        LZ4F_freeCompressionContext(m_cctx);
+        m_cctx = NULL;
+        return;
+    }
+    m_stream.write(&m_output[0], size);
+}
+
+LZ4OutStream::~LZ4OutStream()
+{
+    close();
+}
+
+bool LZ4OutStream::check(size_t result)
+{
+    if (LZ4F_isError(result)) {
+        os::log("apitrace: error: lz4 compression failed: %s\n",
+                LZ4F_getErrorName(result));
+        return false;
+    }
+    return true;
+}
+
+bool LZ4OutStream::write(const void *buffer, size_t length)
+{
+    overhead::Scope scope(overhead::CATEGORY_COMPRESSION);
+
+    const char *data = static_cast<const char *>(buffer);
+    while (length) {
+        size_t blockSize = std::min(length, size_t(LZ4_BLOCK_SIZE));
+        size_t size = LZ4F_compressUpdate(m_cctx, &m_output[0], m_output.size(),
+                                          data, blockSize, NULL);
+        if (!check(size)) {
+            return false;
+        }
+        m_stream.write(&m_output[0], size);
+        data += blockSize;
+        length -= blockSize;
+    }
+    return true;
+}
+
+void LZ4OutStream::flush(void)
+{
+    size_t size = LZ4F_flush(m_cctx, &m_output[0], m_output.size(), NULL);
+    if (check(size)) {
+        m_stream.write(&m_output[0], size);
+    }
+    m_stream.flush();
+}
+
+void LZ4OutStream::close(void)
+{
+    if (m_cctx) {
+        size_t size = LZ4F_compressEnd(m_cctx, &m_output[0], m_output.size(), NULL);
+        if (check(size)) {
+            m_stream.write(&m_output[0], size);
+        }
+        LZ4F_freeCompressionContext(m_cctx);
+        m_cctx = NULL;
+    }
+    m_stream.close();
+}
+
+
+OutStream *
+trace::createLZ4Stream(const char *filename, int level)
+{
+    LZ4OutStream *outStream = new LZ4OutStream(filename, level);
+    if (!outStream->isOpen()) {
+        os::log("error: could not open %s for writing\n", filename);
+        delete outStream;
+        outStream = nullptr;
+    }
+
+    return outStream;
+}
@@ -28,6 +28,8 @@
 #include "trace_ostream.hpp"
 
 #include <fstream>
+#include <string>
+#include <vector>
 
 #include <assert.h>
 #include <string.h>
@@ -35,15 +37,33 @@
 #include <snappy.h>
 
 #include "os.hpp"
+#include "os_process.hpp"
+#include "os_thread.hpp"
+#include "trace_overhead.hpp"
 #include "trace_snappy.hpp"
 
 
 #define SNAPPY_CHUNK_SIZE (1 * 1024 * 1024)
 
+/*
+ * Number of uncompressed chunks.  One is being filled by the application
+ * thread while the others are queued for (or undergoing) compression.
+ */
+#define SNAPPY_NUM_CHUNKS 3
+
 
 using namespace trace;
 
 
+/*
+ * Snappy output stream.
+ *
+ * Compression and file I/O are done on a dedicated thread, so that the
+ * application threads only pay for copying the data into the current chunk.
+ * Filled chunks are handed over to the compressor thread through a bounded
+ * ring, and the application thread only blocks when all chunks are in
+ * flight.
+ */
 class SnappyOutStream : public OutStream {
 public:
     SnappyOutStream(const char *filename);
@@ -52,6 +72,8 @@ public:
     SnappyOutStream(void);
     bool write(const void *buffer, size_t length);
     void flush(void);
+    void flushForCrash(void);
+    bool writeIndex(const void *data, size_t length);
     bool isOpen(void) {
         return m_stream.is_open();
     }
@@ -81,6 +103,15 @@ private:
     void flushWriteCache();
     void createCache(size_t size);
     void writeCompressedLength(size_t length);
+    void writeLength(std::string &data, size_t length);
+
+    void waitForCompressor();
+    void compressorLoop(void);
+    void compressChunk(const char *data, size_t length);
+
+    static void
+    compressorThread(SnappyOutStream *_this);
+
 private:
     std::ofstream m_stream;
     size_t m_cacheMaxSize;
@@ -89,14 +120,66 @@ private:
     char *m_cachePtr;
 
     char *m_compressedCache;
+
+    struct Chunk {
+        char *data;
+        size_t length;
+    };
+
+    /**
+     * These are protected by the mutex.
+     */
+    Chunk m_chunks[SNAPPY_NUM_CHUNKS];
+    unsigned m_head;
+    unsigned m_count;
+    bool m_stop;
+    bool m_busy;
+
+    os::mutex m_mutex;
+    os::condition_variable m_pendingCond;
+    os::condition_variable m_doneCond;
+
+    os::thread m_thread;
+    os::ProcessId m_pid;
+
+    /**
+     * Whether chunks are compressed by the application thread, as the
+     * compressor thread is no longer relied upon after a crash.
+     */
+    bool m_synchronous;
+
+    /**
+     * Compressed and uncompressed size of every chunk written, for the
+     * index.  Only touched by whoever is compressing.
+     */
+    std::vector<std::pair<size_t, size_t> > m_chunkSizes;
 };
 
+
+/*
+ * Whether the current thread is a compressor thread.
+ */
+static OS_THREAD_SPECIFIC(uintptr_t)
+is_compressor_thread;
+
+
 SnappyOutStream::SnappyOutStream(const char *filename)
     : m_cacheMaxSize(SNAPPY_CHUNK_SIZE),
       m_cacheSize(m_cacheMaxSize),
-      m_cache(new char [m_cacheMaxSize]),
-      m_cachePtr(m_cache)
+      m_head(0),
+      m_count(0),
+      m_stop(false),
+      m_busy(false),
+      m_pid(os::getCurrentProcessId()),
+      m_synchronous(false)
 {
+    for (unsigned i = 0; i < SNAPPY_NUM_CHUNKS; ++i) {
+        m_chunks[i].data = new char [m_cacheMaxSize];
+        m_chunks[i].length = 0;
+    }
+    m_cache = m_chunks[0].data;
+    m_cachePtr = m_cache;
+
     size_t maxCompressedLength =
         snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
     m_compressedCache = new char[maxCompressedLength];
@@ -108,6 +191,8 @@ SnappyOutStream::SnappyOutStream(const char *filename)
     if (m_stream.is_open()) {
         m_stream << SNAPPY_BYTE1;
         m_stream << SNAPPY_BYTE2;
+
+        m_thread = os::thread(compressorThread, this);
     }
 }
 
@@ -115,7 +200,9 @@ SnappyOutStream::~SnappyOutStream()
 {
     close();
     delete [] m_compressedCache;
-    delete [] m_cache;
+    for (unsigned i = 0; i < SNAPPY_NUM_CHUNKS; ++i) {
+        delete [] m_chunks[i].data;
+    }
 }
 
 bool SnappyOutStream::write(const void *buffer, size_t length)
@@ -150,9 +237,31 @@ bool SnappyOutStream::write(const void *buffer, size_t length)
 
 void SnappyOutStream::close()
 {
+    if (!m_cache) {
+        return;
+    }
+
+    if (os::getCurrentProcessId() != m_pid) {
+        // We are a forked child process, and the compressor thread was not
+        // inherited, so there is nobody to wait for.
+        m_cache = NULL;
+        m_cachePtr = NULL;
+        return;
+    }
+
     flushWriteCache();
+
+    if (m_thread.joinable()) {
+        m_mutex.lock();
+        m_stop = true;
+        m_mutex.unlock();
+        m_pendingCond.notify_one();
+
+        m_thread.join();
+        m_thread = os::thread();
+    }
+
     m_stream.close();
-    delete [] m_cache;
     m_cache = NULL;
     m_cachePtr = NULL;
 }
@@ -160,26 +269,200 @@ void SnappyOutStream::close()
 void SnappyOutStream::flush(void)
 {
     flushWriteCache();
+    waitForCompressor();
     m_stream.flush();
 }
 
+/*
+ * The compressor thread can't be relied upon to make progress when the
+ * process is crashing, so the queued chunks are compressed on the calling
+ * thread, as are all later ones.
+ */
+void SnappyOutStream::flushForCrash(void)
+{
+    // If we crashed inside the compressor thread there is no way to finish
+    // the chunk it was writing, so simply flush whatever reached the stream.
+    if (is_compressor_thread) {
+        m_stream.flush();
+        return;
+    }
+
+    if (m_thread.joinable() && !m_synchronous) {
+        os::unique_lock<os::mutex> lock(m_mutex);
+
+        // A chunk already being compressed must still be written first
+        while (m_busy) {
+            m_doneCond.wait(lock);
+        }
+
+        while (m_count) {
+            const Chunk &chunk = m_chunks[m_head];
+            compressChunk(chunk.data, chunk.length);
+            m_head = (m_head + 1) % SNAPPY_NUM_CHUNKS;
+            --m_count;
+        }
+
+        m_stop = true;
+        m_synchronous = true;
+        m_pendingCond.notify_one();
+    }
+
+    flushWriteCache();
+
+    m_stream.flush();
+}
+
+/*
+ * Hand over the current chunk to the compressor thread, and switch to the
+ * next free chunk.
+ */
 void SnappyOutStream::flushWriteCache(void)
 {
     size_t inputLength = usedCacheSize();
 
     if (inputLength) {
-        size_t compressedLength;
+        if (!m_thread.joinable() || m_synchronous) {
+            compressChunk(m_cache, inputLength);
+            m_cachePtr = m_cache;
+            return;
+        }
+
+        os::unique_lock<os::mutex> lock(m_mutex);
 
-        ::snappy::RawCompress(m_cache, inputLength,
-                              m_compressedCache, &compressedLength);
+        unsigned tail = (m_head + m_count) % SNAPPY_NUM_CHUNKS;
+        assert(m_chunks[tail].data == m_cache);
+        m_chunks[tail].length = inputLength;
+        ++m_count;
 
-        writeCompressedLength(compressedLength);
-        m_stream.write(m_compressedCache, compressedLength);
+        m_pendingCond.notify_one();
+
+        // Wait for the next chunk to become available
+        if (m_count == SNAPPY_NUM_CHUNKS) {
+            overhead::Scope scope(overhead::CATEGORY_COMPRESSION_WAIT);
+            while (m_count == SNAPPY_NUM_CHUNKS) {
+                m_doneCond.wait(lock);
+            }
+        }
+
+        tail = (m_head + m_count) % SNAPPY_NUM_CHUNKS;
+        m_cache = m_chunks[tail].data;
         m_cachePtr = m_cache;
     }
     assert(m_cachePtr == m_cache);
 }
 
+/*
+ * Wait until all queued chunks have been compressed and written.
+ */
+void SnappyOutStream::waitForCompressor(void)
+{
+    os::unique_lock<os::mutex> lock(m_mutex);
+    while (m_count) {
+        m_doneCond.wait(lock);
+    }
+}
+
+void SnappyOutStream::compressorThread(SnappyOutStream *_this)
+{
+    is_compressor_thread = 1;
+    _this->compressorLoop();
+}
+
+void SnappyOutStream::compressorLoop(void)
+{
+    os::unique_lock<os::mutex> lock(m_mutex);
+
+    while (true) {
+        while (!m_count && !m_stop) {
+            m_pendingCond.wait(lock);
+        }
+
+        if (!m_count) {
+            assert(m_stop);
+            break;
+        }
+
+        // The chunk at the head is not touched by the application thread
+        // until we release it, so compress it without holding the lock.
+        const Chunk &chunk = m_chunks[m_head];
+        m_busy = true;
+        lock.unlock();
+        compressChunk(chunk.data, chunk.length);
+        lock.lock();
+        m_busy = false;
+
+        m_head = (m_head + 1) % SNAPPY_NUM_CHUNKS;
+        --m_count;
+
+        m_doneCond.notify_one();
+    }
+}
+
+void SnappyOutStream::compressChunk(const char *data, size_t length)
+{
+    overhead::Scope scope(overhead::CATEGORY_COMPRESSION);
+
+    size_t compressedLength;
+
+    ::snappy::RawCompress(data, length,
+                          m_compressedCache, &compressedLength);
+
+    writeCompressedLength(compressedLength);
+    m_stream.write(m_compressedCache, compressedLength);
+
+    m_chunkSizes.push_back(std::make_pair(compressedLength, length));
+}
+
+void SnappyOutStream::writeLength(std::string &data, size_t length)
+{
+    for (unsigned i = 0; i < 4; ++i) {
+        data.push_back(length & 0xff);
+        length >>= 8;
+    }
+    assert(length == 0);
+}
+
+/*
+ * Terminate the chunks with a zero length, which readers unaware of indices
+ * take for the end of file, and append the chunk table plus the writer's
+ * index in a compressed block, followed by a trailer pointing back at it.
+ */
+bool SnappyOutStream::writeIndex(const void *data, size_t length)
+{
+    if (!m_cache ||
+        os::getCurrentProcessId() != m_pid) {
+        return false;
+    }
+
+    flushWriteCache();
+    waitForCompressor();
+
+    unsigned long long endOfChunks = m_stream.tellp();
+    writeCompressedLength(0);
+
+    std::string block;
+    writeLength(block, m_chunkSizes.size());
+    for (size_t i = 0; i < m_chunkSizes.size(); ++i) {
+        writeLength(block, m_chunkSizes[i].first);
+        writeLength(block, m_chunkSizes[i].second);
+    }
+    block.append(static_cast<const char *>(data), length);
+
+    std::string compressed;
+    ::snappy::Compress(block.data(), block.size(), &compressed);
+    writeCompressedLength(compressed.size());
+    m_stream.write(compressed.data(), compressed.size());
+
+    unsigned char trailer[SNAPPY_TRAILER_SIZE];
+    for (unsigned i = 0; i < 8; ++i) {
+        trailer[i] = (endOfChunks >> (8*i)) & 0xff;
+    }
+    memcpy(trailer + 8, SNAPPY_INDEX_MAGIC, 4);
+    m_stream.write((const char *)trailer, sizeof trailer);
+
+    return true;
+}
+
 void SnappyOutStream::writeCompressedLength(size_t length)
 {
     unsigned char buf[4];
@@ -34,6 +34,7 @@
 #include <zlib.h>
 
 #include "os.hpp"
+#include "trace_overhead.hpp"
 
 #include <iostream>
 
@@ -66,6 +67,7 @@ ZLibOutStream::~ZLibOutStream()
 
 bool ZLibOutStream::write(const void *buffer, size_t length)
 {
+    overhead::Scope scope(overhead::CATEGORY_COMPRESSION);
     return gzwrite(m_gzFile, buffer, unsigned(length)) != -1;
 }
 
@@ -84,7 +86,7 @@ void ZLibOutStream::flush()
 
 
 OutStream *
-trace::createZLibStream(const char *filename)
+trace::createZLibStream(const char *filename, int level)
 {
     gzFile file = gzopen(filename, "wb");
     if (!file) {
@@ -92,8 +94,11 @@ trace::createZLibStream(const char *filename)
     }
 
     // Currently we only use gzip for offline compression, so aim for maximum
-    // compression
-    gzsetparams(file, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY);
+    // compression by default
+    if (level <= 0 || level > Z_BEST_COMPRESSION) {
+        level = Z_BEST_COMPRESSION;
+    }
+    gzsetparams(file, level, Z_DEFAULT_STRATEGY);
 
     return new ZLibOutStream(file);
 }
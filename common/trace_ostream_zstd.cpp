@@ -0,0 +1,182 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include "trace_ostream.hpp"
+
+#include <fstream>
+#include <vector>
+
+#include <zstd.h>
+
+#include "os.hpp"
+#include "trace_overhead.hpp"
+
+
+#if ZSTD_VERSION_NUMBER < 10400
+#error "zstd 1.4.0 or newer is required"
+#endif
+
+
+/*
+ * Default compression level, a good balance between speed and size for
+ * captures.  Archives are better served by 19 or above.
+ */
+#define ZSTD_DEFAULT_LEVEL 3
+
+
+using namespace trace;
+
+
+/*
+ * Zstandard output stream.
+ *
+ * Long distance matching is enabled, as traces are full of data uploaded
+ * over and over again, many megabytes apart.  Compression is spread over
+ * worker threads when libzstd supports it.
+ */
+class ZstdOutStream : public OutStream {
+public:
+    ZstdOutStream(const char *filename, int level);
+    ~ZstdOutStream();
+
+    bool write(const void *buffer, size_t length);
+    void flush(void);
+    bool isOpen(void) {
+        return m_stream.is_open() && m_cctx;
+    }
+
+private:
+    void close(void);
+    bool compress(ZSTD_inBuffer &input, ZSTD_EndDirective directive);
+
+private:
+    std::ofstream m_stream;
+    ZSTD_CCtx *m_cctx;
+    std::vector<char> m_output;
+};
+
+
+ZstdOutStream::ZstdOutStream(const char *filename, int level)
+    : m_cctx(NULL),
+      m_output(ZSTD_CStreamOutSize())
+{
+    m_stream.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!m_stream.is_open()) {
+        return;
+    }
+
+    m_cctx = ZSTD_createCCtx();
+    if (!m_cctx) {
+        return;
+    }
+
+    if (level == 0) {
+        level = ZSTD_DEFAULT_LEVEL;
+    }
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_enableLongDistanceMatching, 1);
+
+    // Fails harmlessly when libzstd was built without multithreading
+    unsigned numThreads = os::getNumberOfProcessors();
+    if (numThreads > 1) {
+        ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_nbWorkers, numThreads);
+    }
+}
+
+ZstdOutStream::~ZstdOutStream()
+{
+    close();
+}
+
+/*
+ * Feed the input to the compressor, writing out whatever it produces, until
+ * the input is consumed and, unless just continuing, the frame flushed or
+ * ended.
+ */
+bool ZstdOutStream::compress(ZSTD_inBuffer &input, ZSTD_EndDirective directive)
+{
+    overhead::Scope scope(overhead::CATEGORY_COMPRESSION);
+
+    bool done;
+    do {
+        ZSTD_outBuffer output = { &m_output[0], m_output.size(), 0 };
+        size_t remaining = ZSTD_compressStream2(m_cctx, &output, &input, directive);
+        if (ZSTD_isError(remaining)) {
+            os::log("apitrace: error: zstd compression failed: %s\n",
+                    ZSTD_getErrorName(remaining));
+            return false;
+        }
+        m_stream.write(&m_output[0], output.pos);
+
+        if (directive == ZSTD_e_continue) {
+            done = input.pos == input.size;
+        } else {
+            done = remaining == 0;
+        }
+    } while (!done);
+
+    return true;
+}
+
+bool ZstdOutStream::write(const void *buffer, size_t length)
+{
+    ZSTD_inBuffer input = { buffer, length, 0 };
+    return compress(input, ZSTD_e_continue);
+}
+
+void ZstdOutStream::flush(void)
+{
+    ZSTD_inBuffer input = { NULL, 0, 0 };
+    compress(input, ZSTD_e_flush);
+    m_stream.flush();
+}
+
+void ZstdOutStream::close(void)
+{
+    if (m_cctx) {
+        if (m_stream.is_open()) {
+            ZSTD_inBuffer input = { NULL, 0, 0 };
+            compress(input, ZSTD_e_end);
+        }
+        ZSTD_freeCCtx(m_cctx);
+        m_cctx = NULL;
+    }
+    m_stream.close();
+}
+
+
+OutStream *
+trace::createZstdStream(const char *filename, int level)
+{
+    ZstdOutStream *outStream = new ZstdOutStream(filename, level);
+    if (!outStream->isOpen()) {
+        os::log("error: could not open %s for writing\n", filename);
+        delete outStream;
+        outStream = nullptr;
+    }
+
+    return outStream;
+}
@@ -0,0 +1,324 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "os.hpp"
+#include "os_thread.hpp"
+#include "trace_overhead.hpp"
+
+
+namespace trace {
+
+namespace overhead {
+
+
+bool enabled = false;
+
+// Reference points to calibrate the ticks
+static long long startTicks = 0;
+static long long startTime = 0;
+
+
+static const char *
+categoryNames[CATEGORY_COUNT] = {
+    "lock",
+    "backtrace",
+    "compression",
+    "compression_wait",
+    "shadow",
+};
+
+
+struct CallCost {
+    const char *name;
+    unsigned long long calls;
+    long long ticks;
+    long long categories[CATEGORY_COUNT];
+
+    CallCost() :
+        name(nullptr),
+        calls(0),
+        ticks(0)
+    {
+        memset(categories, 0, sizeof categories);
+    }
+
+    void
+    add(const CallCost &other) {
+        calls += other.calls;
+        ticks += other.ticks;
+        for (unsigned i = 0; i < CATEGORY_COUNT; ++i) {
+            categories[i] += other.categories[i];
+        }
+    }
+};
+
+
+/**
+ * Maximum nesting of calls awaiting their leave record.
+ */
+#define MAX_PENDING_CALLS 16
+
+
+/**
+ * Per-thread counters.
+ *
+ * These are never freed, so that they can be reported after the thread
+ * terminated.  They are only updated by the owning thread, and read without
+ * synchronization when reporting, which is fine for statistics.
+ */
+struct ThreadCosts {
+    // Indexed by signature id
+    std::vector<CallCost> calls;
+    long long categories[CATEGORY_COUNT];
+
+    // Record being written, if any
+    const FunctionSig *current;
+    long long start;
+
+    // Calls whose enter record was written, but not their leave record
+    const FunctionSig *pending[MAX_PENDING_CALLS];
+    unsigned numPending;
+
+    ThreadCosts() :
+        current(nullptr),
+        start(0),
+        numPending(0)
+    {
+        memset(categories, 0, sizeof categories);
+    }
+
+    CallCost &
+    getCost(const FunctionSig *sig) {
+        if (sig->id >= calls.size()) {
+            calls.resize(sig->id + 1);
+        }
+        CallCost &cost = calls[sig->id];
+        cost.name = sig->name;
+        return cost;
+    }
+};
+
+
+/*
+ * All threads' counters.  Never freed, as they are reported from the
+ * destructor of the localWriter singleton, which may run after this
+ * module's static objects were destroyed.
+ */
+struct Registry {
+    os::mutex mutex;
+    std::vector<ThreadCosts *> threads;
+};
+
+static Registry *registry = nullptr;
+
+static OS_THREAD_SPECIFIC_PTR(ThreadCosts)
+thread_costs;
+
+
+static inline ThreadCosts *
+getThreadCosts(void) {
+    ThreadCosts *tc = thread_costs;
+    if (!tc) {
+        tc = new ThreadCosts;
+        thread_costs = tc;
+
+        os::unique_lock<os::mutex> lock(registry->mutex);
+        registry->threads.push_back(tc);
+    }
+    return tc;
+}
+
+
+void
+enable(void) {
+    registry = new Registry;
+    startTicks = getTicks();
+    startTime = os::getTime();
+    enabled = true;
+}
+
+
+void
+addTicks(Category category, long long ticks) {
+    ThreadCosts *tc = getThreadCosts();
+    tc->categories[category] += ticks;
+    if (tc->current) {
+        tc->getCost(tc->current).categories[category] += ticks;
+    }
+}
+
+
+/*
+ * The time spent writing the record is accumulated into the call when the
+ * record is complete.
+ */
+static void
+endRecord(ThreadCosts *tc) {
+    if (tc->current) {
+        tc->getCost(tc->current).ticks += getTicks() - tc->start;
+        tc->current = nullptr;
+    }
+}
+
+
+void
+beginEnter(const FunctionSig *sig) {
+    ThreadCosts *tc = getThreadCosts();
+    tc->current = sig;
+    tc->start = getTicks();
+    ++tc->getCost(sig).calls;
+}
+
+void
+endEnter(void) {
+    ThreadCosts *tc = getThreadCosts();
+    if (tc->numPending < MAX_PENDING_CALLS) {
+        tc->pending[tc->numPending] = tc->current;
+    }
+    ++tc->numPending;
+    endRecord(tc);
+}
+
+void
+beginLeave(void) {
+    ThreadCosts *tc = getThreadCosts();
+    const FunctionSig *sig = nullptr;
+    if (tc->numPending) {
+        --tc->numPending;
+        if (tc->numPending < MAX_PENDING_CALLS) {
+            sig = tc->pending[tc->numPending];
+        }
+    }
+    tc->current = sig;
+    tc->start = getTicks();
+}
+
+void
+endLeave(void) {
+    endRecord(getThreadCosts());
+}
+
+
+static void
+writeCategories(FILE *fp, const long long *categories, double scale) {
+    for (unsigned i = 0; i < CATEGORY_COUNT; ++i) {
+        fprintf(fp, ", \"%s\": %.6f", categoryNames[i], categories[i] * scale);
+    }
+}
+
+
+static bool
+compareTicks(const CallCost &a, const CallCost &b) {
+    return a.ticks > b.ticks;
+}
+
+
+void
+report(const char *fileName) {
+    if (!enabled) {
+        return;
+    }
+
+    long long elapsedTicks = getTicks() - startTicks;
+    long long elapsedTime = os::getTime() - startTime;
+    if (elapsedTicks <= 0 || elapsedTime <= 0) {
+        return;
+    }
+    double scale = (double)elapsedTime / ((double)elapsedTicks * os::timeFrequency);
+
+    std::vector<CallCost> calls;
+    CallCost total;
+    long long categories[CATEGORY_COUNT] = {0};
+
+    registry->mutex.lock();
+    unsigned numThreads = registry->threads.size();
+    for (ThreadCosts *tc : registry->threads) {
+        if (calls.size() < tc->calls.size()) {
+            calls.resize(tc->calls.size());
+        }
+        for (size_t id = 0; id < tc->calls.size(); ++id) {
+            const CallCost &cost = tc->calls[id];
+            if (cost.name) {
+                calls[id].name = cost.name;
+                calls[id].add(cost);
+                total.add(cost);
+            }
+        }
+        for (unsigned i = 0; i < CATEGORY_COUNT; ++i) {
+            categories[i] += tc->categories[i];
+        }
+    }
+    registry->mutex.unlock();
+
+    calls.erase(std::remove_if(calls.begin(), calls.end(),
+                               [](const CallCost &cost) { return !cost.calls; }),
+                calls.end());
+    std::sort(calls.begin(), calls.end(), compareTicks);
+
+    FILE *fp = fopen(fileName, "wt");
+    if (!fp) {
+        os::log("apitrace: error: failed to open %s\n", fileName);
+        return;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"elapsed\": %.6f,\n", (double)elapsedTime / os::timeFrequency);
+    fprintf(fp, "  \"threads\": %u,\n", numThreads);
+
+    // Totals include the time spent by other threads (e.g., compression)
+    fprintf(fp, "  \"total\": {\"calls\": %llu, \"time\": %.6f",
+            total.calls, total.ticks * scale);
+    writeCategories(fp, categories, scale);
+    fprintf(fp, "},\n");
+
+    fprintf(fp, "  \"functions\": [\n");
+    for (size_t i = 0; i < calls.size(); ++i) {
+        const CallCost &cost = calls[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"calls\": %llu, \"time\": %.6f",
+                cost.name, cost.calls, cost.ticks * scale);
+        writeCategories(fp, cost.categories, scale);
+        fprintf(fp, "}%s\n", i + 1 < calls.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    fclose(fp);
+
+    os::log("apitrace: tracing overhead was %.3f s over %llu calls, see %s\n",
+            total.ticks * scale, total.calls, fileName);
+}
+
+
+} /* namespace overhead */
+
+} /* namespace trace */
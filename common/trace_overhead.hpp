@@ -0,0 +1,141 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Self-profiling of the tracer, to tell which calls are expensive to trace.
+ */
+
+#pragma once
+
+
+#if defined(__i386__) || defined(__x86_64__)
+#  include <x86intrin.h>
+#elif defined(_M_IX86) || defined(_M_X64)
+#  include <intrin.h>
+#endif
+
+#include "os_time.hpp"
+#include "trace_model.hpp"
+
+
+namespace trace {
+
+namespace overhead {
+
+
+enum Category {
+    CATEGORY_LOCK,             // waiting for the writer mutex
+    CATEGORY_BACKTRACE,        // obtaining backtraces
+    CATEGORY_COMPRESSION,      // compressing chunks
+    CATEGORY_COMPRESSION_WAIT, // waiting for the compressor thread
+    CATEGORY_SHADOW,           // copying into shadow buffers
+    CATEGORY_COUNT
+};
+
+
+/**
+ * Set from APITRACE_OVERHEAD, before any call is traced.
+ */
+extern bool enabled;
+
+void
+enable(void);
+
+
+/**
+ * Cheap timestamp, in an unspecified unit calibrated against os::getTime
+ * when reporting.  Assumes an invariant TSC on x86.
+ */
+inline long long
+getTicks(void) {
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return os::getTime();
+#endif
+}
+
+
+/**
+ * Accumulate time into the current thread's counters, and into the call
+ * being traced by it, if any.
+ */
+void
+addTicks(Category category, long long ticks);
+
+
+/**
+ * Accumulate the time spent in a scope, when enabled.
+ */
+class Scope {
+private:
+    Category m_category;
+    long long m_start;
+
+public:
+    inline
+    Scope(Category category) :
+        m_category(category),
+        m_start(enabled ? getTicks() : 0)
+    {}
+
+    inline
+    ~Scope() {
+        if (m_start) {
+            addTicks(m_category, getTicks() - m_start);
+        }
+    }
+};
+
+
+/*
+ * Bracket the enter and leave records of a call, as written by LocalWriter.
+ * Fake calls emitted between the enter and leave records of another call
+ * are accounted separately.
+ */
+
+void
+beginEnter(const FunctionSig *sig);
+
+void
+endEnter(void);
+
+void
+beginLeave(void);
+
+void
+endLeave(void);
+
+
+/**
+ * Write the counters of all threads as JSON.
+ */
+void
+report(const char *fileName);
+
+
+} /* namespace overhead */
+
+} /* namespace trace */
@@ -29,13 +29,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "trace_file.hpp"
 #include "trace_dump.hpp"
+#include "trace_index.hpp"
 #include "trace_parser.hpp"
 
 
 #define TRACE_VERBOSE 0
 
+/*
+ * Blobs smaller than this are always copied, as it's cheaper than sharing.
+ */
+#define BLOB_IN_PLACE_MIN_SIZE 4096
+
 
 namespace trace {
 
@@ -47,6 +55,18 @@ Parser::Parser() {
     api = API_UNKNOWN;
 
     glGetErrorSig = NULL;
+
+    index = NULL;
+
+    useArena = true;
+    arena = NULL;
+
+    lazyArgs = false;
+    capturing = NULL;
+    main_file = NULL;
+
+    blob_window = 0;
+    string_window = 0;
 }
 
 
@@ -55,6 +75,80 @@ Parser::~Parser() {
 }
 
 
+/*
+ * Read-only File over bytes in memory, such as the captured details of a call.
+ */
+class BufferFile : public File {
+public:
+    BufferFile(const char *data, size_t size) :
+        m_ptr(data),
+        m_end(data + size)
+    {
+        m_isOpened = true;
+    }
+
+    BufferFile(const std::vector<char> &raw) :
+        m_ptr(raw.empty() ? NULL : &raw[0]),
+        m_end(m_ptr + raw.size())
+    {
+        m_isOpened = true;
+    }
+
+    ~BufferFile() {
+        close();
+    }
+
+    bool supportsOffsets() const {
+        return false;
+    }
+
+    // Past every signature definition, so that signatures are only parsed
+    // when first seen
+    File::Offset currentOffset() {
+        return File::Offset(~0ULL, ~0U);
+    }
+
+protected:
+    bool rawOpen(const std::string &filename) {
+        return false;
+    }
+
+    size_t rawRead(void *buffer, size_t length) {
+        length = std::min(length, size_t(m_end - m_ptr));
+        memcpy(buffer, m_ptr, length);
+        m_ptr += length;
+        return length;
+    }
+
+    int rawGetc() {
+        if (m_ptr == m_end) {
+            return -1;
+        }
+        return static_cast<unsigned char>(*m_ptr++);
+    }
+
+    void rawClose() {
+    }
+
+    bool rawSkip(size_t length) {
+        if (length > size_t(m_end - m_ptr)) {
+            m_ptr = m_end;
+            return false;
+        }
+        m_ptr += length;
+        return true;
+    }
+
+    int rawPercentRead() {
+        return 100;
+    }
+
+private:
+    const char *m_ptr;
+    const char *m_end;
+};
+
+
 bool Parser::open(const char *filename) {
     assert(!file);
     file = File::createForRead(filename);
@@ -62,6 +156,18 @@ bool Parser::open(const char *filename) {
         return false;
     }
 
+    return open_header();
+}
+
+
+bool Parser::openBuffer(const char *data, size_t size) {
+    assert(!file);
+    file = new BufferFile(data, size);
+    return open_header();
+}
+
+
+bool Parser::open_header(void) {
     version = read_uint();
     if (version > TRACE_VERSION) {
         std::cerr << "error: unsupported trace format version " << version << "\n";
@@ -71,6 +177,8 @@ bool Parser::open(const char *filename) {
     }
     api = API_UNKNOWN;
 
+    load_index();
+
     return true;
 }
 
@@ -100,6 +208,7 @@ void Parser::close(void) {
     }
 
     deleteAll(calls);
+    deleteAll(free_calls);
 
     // Delete all signature data.  Signatures are mere structures which don't
     // own their own memory, so we need to destroy all data we created here.
@@ -154,6 +263,23 @@ void Parser::close(void) {
     }
     bitmasks.clear();
 
+    for (BlobMap::iterator it = blobs.begin(); it != blobs.end(); ++it) {
+        delete *it;
+    }
+    blobs.clear();
+    blob_order.clear();
+    blob_window = 0;
+
+    for (BlobMap::iterator it = strings.begin(); it != strings.end(); ++it) {
+        delete *it;
+    }
+    strings.clear();
+    string_order.clear();
+    string_window = 0;
+
+    delete index;
+    index = NULL;
+
     next_call_no = 0;
 }
 
@@ -165,11 +291,20 @@ void Parser::getBookmark(ParseBookmark &bookmark) {
 
 
 void Parser::setBookmark(const ParseBookmark &bookmark) {
+    // Signatures, blobs and strings defined before the bookmark might not
+    // have been seen yet
+    if (index) {
+        load_indexed_definitions(bookmark.offset);
+    }
+
     file->setCurrentOffset(bookmark.offset);
     next_call_no = bookmark.next_call_no;
     
     // Simply ignore all pending calls
-    deleteAll(calls);
+    for (CallList::iterator it = calls.begin(); it != calls.end(); ++it) {
+        recycle(*it);
+    }
+    calls.clear();
 }
 
 
@@ -225,6 +360,26 @@ T *lookup(std::vector<T *> &map, size_t index) {
 }
 
 
+/*
+ * Signature definitions are left out of the captured call details, which
+ * only note the signatures they refer to, and where, instead.
+ */
+inline void Parser::begin_sig(SigKind kind, size_t id) {
+    if (capturing) {
+        file->setCapture(NULL);
+        capturing->rawSigs.push_back(Call::SigRef(kind, id, capturing->raw.size()));
+    }
+}
+
+
+inline void Parser::end_sig(const void *sig) {
+    if (capturing) {
+        capturing->rawSigs.back().sig = sig;
+        file->setCapture(&capturing->raw);
+    }
+}
+
+
 Parser::FunctionSigFlags *
 Parser::parse_function_sig(void) {
     size_t id = read_uint();
@@ -232,55 +387,7 @@ Parser::parse_function_sig(void) {
     FunctionSigState *sig = lookup(functions, id);
 
     if (!sig) {
-        /* parse the signature */
-        sig = new FunctionSigState;
-        sig->id = id;
-        sig->name = read_string();
-        sig->num_args = read_uint();
-        const char **arg_names = new const char *[sig->num_args];
-        for (unsigned i = 0; i < sig->num_args; ++i) {
-            arg_names[i] = read_string();
-        }
-        sig->arg_names = arg_names;
-        sig->flags = lookupCallFlags(sig->name);
-        sig->fileOffset = file->currentOffset();
-        functions[id] = sig;
-
-        /**
-         * Try to autodetect the API.
-         *
-         * XXX: Ideally we would allow to mix multiple APIs in a single trace,
-         * but as it stands today, retrace is done separately for each API.
-         */
-        if (api == API_UNKNOWN) {
-            const char *n = sig->name;
-            if ((n[0] == 'g' && n[1] == 'l' && n[2] == 'X') || // glX*
-                (n[0] == 'w' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') || // wgl[A-Z]*
-                (n[0] == 'C' && n[1] == 'G' && n[2] == 'L')) { // CGL*
-                api = trace::API_GL;
-            } else if (n[0] == 'e' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') { // egl[A-Z]*
-                api = trace::API_EGL;
-            } else if ((n[0] == 'D' &&
-                        ((n[1] == 'i' && n[2] == 'r' && n[3] == 'e' && n[4] == 'c' && n[5] == 't') || // Direct*
-                         (n[1] == '3' && n[2] == 'D'))) || // D3D*
-                       (n[0] == 'C' && n[1] == 'r' && n[2] == 'e' && n[3] == 'a' && n[4] == 't' && n[5] == 'e')) { // Create*
-                api = trace::API_DX;
-            } else {
-                /* TODO */
-            }
-        }
-
-        /**
-         * Note down the signature of special functions for future reference.
-         *
-         * NOTE: If the number of comparisons increases we should move this to a
-         * separate function and use bisection.
-         */
-        if (sig->num_args == 0 &&
-            strcmp(sig->name, "glGetError") == 0) {
-            glGetErrorSig = sig;
-        }
-
+        sig = parse_function_sig_def(id);
     } else if (file->currentOffset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /* name */
@@ -295,24 +402,72 @@ Parser::parse_function_sig(void) {
 }
 
 
+/*
+ * Parse the signature definition following its id.
+ */
+Parser::FunctionSigState *
+Parser::parse_function_sig_def(size_t id) {
+    FunctionSigState *sig = new FunctionSigState;
+    sig->defOffset = file->currentOffset();
+    sig->id = id;
+    sig->name = read_string();
+    sig->num_args = read_uint();
+    const char **arg_names = new const char *[sig->num_args];
+    for (unsigned i = 0; i < sig->num_args; ++i) {
+        arg_names[i] = read_string();
+    }
+    sig->arg_names = arg_names;
+    sig->flags = lookupCallFlags(sig->name);
+    sig->fileOffset = file->currentOffset();
+    functions[id] = sig;
+
+    /**
+     * Try to autodetect the API.
+     *
+     * XXX: Ideally we would allow to mix multiple APIs in a single trace,
+     * but as it stands today, retrace is done separately for each API.
+     */
+    if (api == API_UNKNOWN) {
+        const char *n = sig->name;
+        if ((n[0] == 'g' && n[1] == 'l' && n[2] == 'X') || // glX*
+            (n[0] == 'w' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') || // wgl[A-Z]*
+            (n[0] == 'C' && n[1] == 'G' && n[2] == 'L')) { // CGL*
+            api = trace::API_GL;
+        } else if (n[0] == 'e' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') { // egl[A-Z]*
+            api = trace::API_EGL;
+        } else if ((n[0] == 'D' &&
+                    ((n[1] == 'i' && n[2] == 'r' && n[3] == 'e' && n[4] == 'c' && n[5] == 't') || // Direct*
+                     (n[1] == '3' && n[2] == 'D'))) || // D3D*
+                   (n[0] == 'C' && n[1] == 'r' && n[2] == 'e' && n[3] == 'a' && n[4] == 't' && n[5] == 'e')) { // Create*
+            api = trace::API_DX;
+        } else {
+            /* TODO */
+        }
+    }
+
+    /**
+     * Note down the signature of special functions for future reference.
+     *
+     * NOTE: If the number of comparisons increases we should move this to a
+     * separate function and use bisection.
+     */
+    if (sig->num_args == 0 &&
+        strcmp(sig->name, "glGetError") == 0) {
+        glGetErrorSig = sig;
+    }
+
+    return sig;
+}
+
+
 StructSig *Parser::parse_struct_sig() {
     size_t id = read_uint();
+    begin_sig(SIG_STRUCT, id);
 
     StructSigState *sig = lookup(structs, id);
 
     if (!sig) {
-        /* parse the signature */
-        sig = new StructSigState;
-        sig->id = id;
-        sig->name = read_string();
-        sig->num_members = read_uint();
-        const char **member_names = new const char *[sig->num_members];
-        for (unsigned i = 0; i < sig->num_members; ++i) {
-            member_names[i] = read_string();
-        }
-        sig->member_names = member_names;
-        sig->fileOffset = file->currentOffset();
-        structs[id] = sig;
+        sig = parse_struct_sig_def(id);
     } else if (file->currentOffset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /* name */
@@ -322,11 +477,30 @@ StructSig *Parser::parse_struct_sig() {
         }
     }
 
+    end_sig(sig);
     assert(sig);
     return sig;
 }
 
 
+Parser::StructSigState *
+Parser::parse_struct_sig_def(size_t id) {
+    StructSigState *sig = new StructSigState;
+    sig->defOffset = file->currentOffset();
+    sig->id = id;
+    sig->name = read_string();
+    sig->num_members = read_uint();
+    const char **member_names = new const char *[sig->num_members];
+    for (unsigned i = 0; i < sig->num_members; ++i) {
+        member_names[i] = read_string();
+    }
+    sig->member_names = member_names;
+    sig->fileOffset = file->currentOffset();
+    structs[id] = sig;
+    return sig;
+}
+
+
 /*
  * Old enum signatures would cover a single name/value only:
  *
@@ -335,49 +509,48 @@ StructSig *Parser::parse_struct_sig() {
  */
 EnumSig *Parser::parse_old_enum_sig() {
     size_t id = read_uint();
+    begin_sig(SIG_ENUM, id);
 
     EnumSigState *sig = lookup(enums, id);
 
     if (!sig) {
-        /* parse the signature */
-        sig = new EnumSigState;
-        sig->id = id;
-        sig->num_values = 1;
-        EnumValue *values = new EnumValue[sig->num_values];
-        values->name = read_string();
-        values->value = read_sint();
-        sig->values = values;
-        sig->fileOffset = file->currentOffset();
-        enums[id] = sig;
+        sig = parse_old_enum_sig_def(id);
     } else if (file->currentOffset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /*name*/
         scan_value();
     }
 
+    end_sig(sig);
     assert(sig);
     return sig;
 }
 
 
+Parser::EnumSigState *
+Parser::parse_old_enum_sig_def(size_t id) {
+    EnumSigState *sig = new EnumSigState;
+    sig->defOffset = file->currentOffset();
+    sig->id = id;
+    sig->num_values = 1;
+    EnumValue *values = new EnumValue[sig->num_values];
+    values->name = read_string();
+    values->value = read_sint();
+    sig->values = values;
+    sig->fileOffset = file->currentOffset();
+    enums[id] = sig;
+    return sig;
+}
+
+
 EnumSig *Parser::parse_enum_sig() {
     size_t id = read_uint();
+    begin_sig(SIG_ENUM, id);
 
     EnumSigState *sig = lookup(enums, id);
 
     if (!sig) {
-        /* parse the signature */
-        sig = new EnumSigState;
-        sig->id = id;
-        sig->num_values = read_uint();
-        EnumValue *values = new EnumValue[sig->num_values];
-        for (EnumValue *it = values; it != values + sig->num_values; ++it) {
-            it->name = read_string();
-            it->value = read_sint();
-        }
-        sig->values = values;
-        sig->fileOffset = file->currentOffset();
-        enums[id] = sig;
+        sig = parse_enum_sig_def(id);
     } else if (file->currentOffset() < sig->fileOffset) {
         /* skip over the signature */
         int num_values = read_uint();
@@ -387,32 +560,38 @@ EnumSig *Parser::parse_enum_sig() {
         }
     }
 
+    end_sig(sig);
     assert(sig);
     return sig;
 }
 
 
+Parser::EnumSigState *
+Parser::parse_enum_sig_def(size_t id) {
+    EnumSigState *sig = new EnumSigState;
+    sig->defOffset = file->currentOffset();
+    sig->id = id;
+    sig->num_values = read_uint();
+    EnumValue *values = new EnumValue[sig->num_values];
+    for (EnumValue *it = values; it != values + sig->num_values; ++it) {
+        it->name = read_string();
+        it->value = read_sint();
+    }
+    sig->values = values;
+    sig->fileOffset = file->currentOffset();
+    enums[id] = sig;
+    return sig;
+}
+
+
 BitmaskSig *Parser::parse_bitmask_sig() {
     size_t id = read_uint();
+    begin_sig(SIG_BITMASK, id);
 
     BitmaskSigState *sig = lookup(bitmasks, id);
 
     if (!sig) {
-        /* parse the signature */
-        sig = new BitmaskSigState;
-        sig->id = id;
-        sig->num_flags = read_uint();
-        BitmaskFlag *flags = new BitmaskFlag[sig->num_flags];
-        for (BitmaskFlag *it = flags; it != flags + sig->num_flags; ++it) {
-            it->name = read_string();
-            it->value = read_uint();
-            if (it->value == 0 && it != flags) {
-                std::cerr << "warning: bitmask " << it->name << " is zero but is not first flag\n";
-            }
-        }
-        sig->flags = flags;
-        sig->fileOffset = file->currentOffset();
-        bitmasks[id] = sig;
+        sig = parse_bitmask_sig_def(id);
     } else if (file->currentOffset() < sig->fileOffset) {
         /* skip over the signature */
         int num_flags = read_uint();
@@ -422,11 +601,310 @@ BitmaskSig *Parser::parse_bitmask_sig() {
         }
     }
 
+    end_sig(sig);
     assert(sig);
     return sig;
 }
 
 
+Parser::BitmaskSigState *
+Parser::parse_bitmask_sig_def(size_t id) {
+    BitmaskSigState *sig = new BitmaskSigState;
+    sig->defOffset = file->currentOffset();
+    sig->id = id;
+    sig->num_flags = read_uint();
+    BitmaskFlag *flags = new BitmaskFlag[sig->num_flags];
+    for (BitmaskFlag *it = flags; it != flags + sig->num_flags; ++it) {
+        it->name = read_string();
+        it->value = read_uint();
+        if (it->value == 0 && it != flags) {
+            std::cerr << "warning: bitmask " << it->name << " is zero but is not first flag\n";
+        }
+    }
+    sig->flags = flags;
+    sig->fileOffset = file->currentOffset();
+    bitmasks[id] = sig;
+    return sig;
+}
+
+
+void Parser::load_index(void) {
+    std::string data;
+    if (!file->getIndex(data)) {
+        return;
+    }
+
+    index = new Index;
+    bool valid = index->parse(data.data(), data.size());
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        indexed_sigs_loaded[kind] = 0;
+    }
+    indexed_blobs_loaded = 0;
+    indexed_strings_loaded = 0;
+
+    // Make sure all positions are within the trace
+    File::Offset offset;
+    if (valid && !index->frames.empty()) {
+        valid = file->getOffset(index->frames.back().position, offset);
+    }
+    if (valid && !index->calls.empty()) {
+        valid = file->getOffset(index->calls.back().position, offset);
+    }
+    for (unsigned kind = 0; valid && kind < SIG_KIND_COUNT; ++kind) {
+        const Index::EntryList &sigs = index->sigs[kind];
+        if (!sigs.empty()) {
+            valid = file->getOffset(sigs.back().position, offset);
+        }
+    }
+    if (valid && !index->blobs.empty()) {
+        valid = file->getOffset(index->blobs.back().position, offset);
+    }
+    if (valid && !index->strings.empty()) {
+        valid = file->getOffset(index->strings.back().position, offset);
+    }
+
+    if (!valid) {
+        std::cerr << "warning: ignoring invalid trace index\n";
+        delete index;
+        index = NULL;
+    }
+}
+
+
+static bool
+definitionLess(const ParseDefinition &a, const ParseDefinition &b) {
+    return a.offset < b.offset;
+}
+
+
+/*
+ * Append the entries of the index not loaded yet which precede the given
+ * offset, as definitions.
+ */
+static void
+getIndexedDefinitions(File *file, const Index::EntryList &entries, size_t &loaded,
+                      const File::Offset &end, DefinitionKind kind, SigKind sigKind,
+                      std::vector<ParseDefinition> &definitions) {
+    while (loaded < entries.size()) {
+        const Index::Entry &entry = entries[loaded];
+        ParseDefinition definition;
+        if (!file->getOffset(entry.position, definition.offset) ||
+            !(definition.offset < end)) {
+            break;
+        }
+        definition.kind = kind;
+        definition.sigKind = sigKind;
+        definition.id = entry.no;
+        definition.size = entry.size;
+        definitions.push_back(definition);
+        ++loaded;
+    }
+}
+
+
+/*
+ * Learn the definitions listed in the index which precede the given offset,
+ * parsing signatures in file order, so that parsing can start there.
+ */
+void Parser::load_indexed_definitions(const File::Offset &end) {
+    assert(index);
+
+    // Entries of each kind are in file order
+    std::vector<ParseDefinition> definitions;
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        getIndexedDefinitions(file, index->sigs[kind], indexed_sigs_loaded[kind], end,
+                              DEFINITION_SIG, static_cast<SigKind>(kind), definitions);
+    }
+    getIndexedDefinitions(file, index->blobs, indexed_blobs_loaded, end,
+                          DEFINITION_BLOB, SIG_KIND_COUNT, definitions);
+    getIndexedDefinitions(file, index->strings, indexed_strings_loaded, end,
+                          DEFINITION_STRING, SIG_KIND_COUNT, definitions);
+
+    std::sort(definitions.begin(), definitions.end(), definitionLess);
+
+    loadDefinitions(definitions.begin(), definitions.end());
+}
+
+
+template<class T>
+static void
+getSigDefinitions(const std::vector<T *> &map, SigKind kind,
+                  std::vector<ParseDefinition> &definitions) {
+    for (size_t id = 0; id < map.size(); ++id) {
+        if (map[id]) {
+            ParseDefinition definition;
+            definition.offset = map[id]->defOffset;
+            definition.kind = DEFINITION_SIG;
+            definition.sigKind = kind;
+            definition.id = id;
+            definition.size = 0;
+            definitions.push_back(definition);
+        }
+    }
+}
+
+
+void Parser::getDefinitions(std::vector<ParseDefinition> &definitions) const {
+    definitions.clear();
+
+    getSigDefinitions(functions, SIG_FUNCTION, definitions);
+    getSigDefinitions(structs, SIG_STRUCT, definitions);
+    getSigDefinitions(enums, SIG_ENUM, definitions);
+    getSigDefinitions(bitmasks, SIG_BITMASK, definitions);
+    getSigDefinitions(frames, SIG_FRAME, definitions);
+
+    const BlobMap *maps[2] = {&blobs, &strings};
+    const DefinitionKind kinds[2] = {DEFINITION_BLOB, DEFINITION_STRING};
+    for (unsigned i = 0; i < 2; ++i) {
+        const BlobMap &map = *maps[i];
+        for (size_t id = 0; id < map.size(); ++id) {
+            const BlobState *state = map[id];
+            if (state && state->hasOffset) {
+                ParseDefinition definition;
+                definition.offset = state->fileOffset;
+                definition.kind = kinds[i];
+                definition.sigKind = SIG_KIND_COUNT;
+                definition.id = id;
+                definition.size = state->size;
+                definitions.push_back(definition);
+            }
+        }
+    }
+
+    std::sort(definitions.begin(), definitions.end(), definitionLess);
+}
+
+
+void Parser::loadDefinitions(std::vector<ParseDefinition>::const_iterator begin,
+                             std::vector<ParseDefinition>::const_iterator end) {
+    for (std::vector<ParseDefinition>::const_iterator it = begin; it != end; ++it) {
+        load_definition(*it);
+    }
+}
+
+
+/*
+ * Learn a definition, unless already known.  Signatures are parsed right
+ * away, leaving the file position wherever they end, while the data of blobs
+ * and strings is only read once referred to.
+ */
+void Parser::load_definition(const ParseDefinition &definition) {
+    size_t id = definition.id;
+
+    if (definition.kind != DEFINITION_SIG) {
+        BlobMap &map = definition.kind == DEFINITION_BLOB ? blobs : strings;
+        if (lookup(map, id)) {
+            return;
+        }
+        BlobState *state = new BlobState;
+        state->size = definition.size;
+        state->hasOffset = true;
+        state->fileOffset = definition.offset;
+        map[id] = state;
+        return;
+    }
+
+    switch (definition.sigKind) {
+    case SIG_FUNCTION:
+        if (lookup(functions, id)) {
+            return;
+        }
+        file->setCurrentOffset(definition.offset);
+        parse_function_sig_def(id);
+        break;
+    case SIG_STRUCT:
+        if (lookup(structs, id)) {
+            return;
+        }
+        file->setCurrentOffset(definition.offset);
+        parse_struct_sig_def(id);
+        break;
+    case SIG_ENUM:
+        if (lookup(enums, id)) {
+            return;
+        }
+        file->setCurrentOffset(definition.offset);
+        if (version >= 3) {
+            parse_enum_sig_def(id);
+        } else {
+            parse_old_enum_sig_def(id);
+        }
+        break;
+    case SIG_BITMASK:
+        if (lookup(bitmasks, id)) {
+            return;
+        }
+        file->setCurrentOffset(definition.offset);
+        parse_bitmask_sig_def(id);
+        break;
+    case SIG_FRAME:
+        if (lookup(frames, id)) {
+            return;
+        }
+        file->setCurrentOffset(definition.offset);
+        parse_backtrace_frame_def(id);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+
+bool Parser::getCallBookmark(unsigned call_no, ParseBookmark &bookmark) {
+    if (!index) {
+        return false;
+    }
+
+    const Index::Entry *entry = index->findCall(call_no);
+    if (!entry ||
+        !file->getOffset(entry->position, bookmark.offset)) {
+        return false;
+    }
+
+    bookmark.next_call_no = entry->no;
+    return true;
+}
+
+
+bool Parser::getFrameBookmark(unsigned frame_no, ParseBookmark &bookmark) {
+    if (!index ||
+        frame_no >= index->frames.size()) {
+        return false;
+    }
+
+    const Index::Entry &entry = index->frames[frame_no];
+    if (!file->getOffset(entry.position, bookmark.offset)) {
+        return false;
+    }
+
+    bookmark.next_call_no = entry.no;
+    return true;
+}
+
+
+Call *Parser::new_call(const FunctionSig *sig, CallFlags flags, unsigned thread_id) {
+    if (free_calls.empty()) {
+        return new Call(sig, flags, thread_id);
+    }
+
+    Call *call = free_calls.back();
+    free_calls.pop_back();
+    call->thread_id = thread_id;
+    call->sig = sig;
+    call->args.resize(sig->num_args);
+    call->flags = flags;
+    return call;
+}
+
+
+void Parser::recycle(Call *call) {
+    if (call) {
+        call->clear();
+        free_calls.push_back(call);
+    }
+}
+
+
 void Parser::parse_enter(Mode mode) {
     unsigned thread_id;
 
@@ -438,14 +916,14 @@ void Parser::parse_enter(Mode mode) {
 
     FunctionSigFlags *sig = parse_function_sig();
 
-    Call *call = new Call(sig, sig->flags, thread_id);
+    Call *call = new_call(sig, sig->flags, thread_id);
 
     call->no = next_call_no++;
 
     if (parse_call_details(call, mode)) {
         calls.push_back(call);
     } else {
-        delete call;
+        recycle(call);
     }
 }
 
@@ -466,22 +944,32 @@ Call *Parser::parse_leave(Mode mode) {
          * over its data.
          */
         const FunctionSig sig = {0, NULL, 0, NULL};
-        call = new Call(&sig, 0, 0);
+        call = new_call(&sig, 0, 0);
         parse_call_details(call, SCAN);
-        delete call;
+        recycle(call);
         return NULL;
     }
 
     if (parse_call_details(call, mode)) {
         return call;
     } else {
-        delete call;
+        recycle(call);
         return NULL;
     }
 }
 
 
 bool Parser::parse_call_details(Call *call, Mode mode) {
+    if (mode == LAZY) {
+        // Older traces encode enums differently, so can't be copied verbatim
+        if (version >= 3) {
+            return capture_call_details(call);
+        }
+        mode = FULL;
+    }
+
+    arena = useArena ? &call->arena : NULL;
+
     do {
         int c = read_byte();
         switch (c) {
@@ -518,6 +1006,76 @@ bool Parser::parse_call_details(Call *call, Mode mode) {
     } while(true);
 }
 
+/*
+ * Copy the details of a call event into call->raw, skipping over them.
+ */
+bool Parser::capture_call_details(Call *call) {
+    call->rawLeave = call->raw.size();
+    call->decoder = this;
+
+    capturing = call;
+    file->setCapture(&call->raw);
+
+    bool complete = false;
+    bool done = false;
+    do {
+        int c = read_byte();
+        switch (c) {
+        case trace::CALL_END:
+            complete = true;
+            done = true;
+            break;
+        case trace::CALL_ARG:
+            skip_uint();
+            scan_value();
+            break;
+        case trace::CALL_RET:
+            scan_value();
+            break;
+        case trace::CALL_BACKTRACE:
+            {
+                unsigned num_frames = read_uint();
+                for (unsigned i = 0; i < num_frames; ++i) {
+                    parse_backtrace_frame(SCAN);
+                }
+            }
+            break;
+        default:
+            std::cerr << "error: ("<<call->name()<< ") unknown call detail "
+                      << c << "\n";
+            exit(1);
+        case -1:
+            done = true;
+            break;
+        }
+    } while (!done);
+
+    file->setCapture(NULL);
+    capturing = NULL;
+
+    if (complete) {
+        // Leave the CALL_END out
+        call->raw.pop_back();
+    }
+
+    return complete;
+}
+
+
+void Parser::decodeCall(Call *call) {
+    assert(call->decoder == this);
+    assert(!capturing);
+    call->decoder = NULL;
+
+    BufferFile raw(call->raw);
+    main_file = file;
+    file = &raw;
+    parse_call_details(call, FULL);
+    file = main_file;
+    main_file = NULL;
+}
+
+
 bool Parser::parse_call_backtrace(Call *call, Mode mode) {
     unsigned num_frames = read_uint();
     Backtrace* backtrace = new Backtrace(num_frames);
@@ -530,40 +1088,12 @@ bool Parser::parse_call_backtrace(Call *call, Mode mode) {
 
 StackFrame * Parser::parse_backtrace_frame(Mode mode) {
     size_t id = read_uint();
+    begin_sig(SIG_FRAME, id);
 
     StackFrameState *frame = lookup(frames, id);
 
     if (!frame) {
-        frame = new StackFrameState;
-        int c = read_byte();
-        while (c != trace::BACKTRACE_END &&
-               c != -1) {
-            switch (c) {
-            case trace::BACKTRACE_MODULE:
-                frame->module = read_string();
-                break;
-            case trace::BACKTRACE_FUNCTION:
-                frame->function = read_string();
-                break;
-            case trace::BACKTRACE_FILENAME:
-                frame->filename = read_string();
-                break;
-            case trace::BACKTRACE_LINENUMBER:
-                frame->linenumber = read_uint();
-                break;
-            case trace::BACKTRACE_OFFSET:
-                frame->offset = read_uint();
-                break;
-            default:
-                std::cerr << "error: unknown backtrace detail "
-                          << c << "\n";
-                exit(1);
-            }
-            c = read_byte();
-        }
-
-        frame->fileOffset = file->currentOffset();
-        frames[id] = frame;
+        frame = parse_backtrace_frame_def(id);
     } else if (file->currentOffset() < frame->fileOffset) {
         int c = read_byte();
         while (c != trace::BACKTRACE_END &&
@@ -593,6 +1123,45 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
         }
     }
 
+    end_sig(frame);
+    return frame;
+}
+
+
+Parser::StackFrameState *
+Parser::parse_backtrace_frame_def(size_t id) {
+    StackFrameState *frame = new StackFrameState;
+    frame->defOffset = file->currentOffset();
+    frame->id = id;
+    int c = read_byte();
+    while (c != trace::BACKTRACE_END &&
+           c != -1) {
+        switch (c) {
+        case trace::BACKTRACE_MODULE:
+            frame->module = read_string();
+            break;
+        case trace::BACKTRACE_FUNCTION:
+            frame->function = read_string();
+            break;
+        case trace::BACKTRACE_FILENAME:
+            frame->filename = read_string();
+            break;
+        case trace::BACKTRACE_LINENUMBER:
+            frame->linenumber = read_uint();
+            break;
+        case trace::BACKTRACE_OFFSET:
+            frame->offset = read_uint();
+            break;
+        default:
+            std::cerr << "error: unknown backtrace detail "
+                      << c << "\n";
+            exit(1);
+        }
+        c = read_byte();
+    }
+
+    frame->fileOffset = file->currentOffset();
+    frames[id] = frame;
     return frame;
 }
 
@@ -604,6 +1173,9 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
  */
 void Parser::adjust_call_flags(Call *call) {
     // Mark glGetError() = GL_NO_ERROR as verbose
+    if (call->sig == glGetErrorSig) {
+        call->decode();
+    }
     if (call->sig == glGetErrorSig &&
         call->ret &&
         call->ret->toSInt() == 0) {
@@ -629,13 +1201,13 @@ Value *Parser::parse_value(void) {
     c = read_byte();
     switch (c) {
     case trace::TYPE_NULL:
-        value = new Null;
+        value = new (arena) Null;
         break;
     case trace::TYPE_FALSE:
-        value = new Bool(false);
+        value = new (arena) Bool(false);
         break;
     case trace::TYPE_TRUE:
-        value = new Bool(true);
+        value = new (arena) Bool(true);
         break;
     case trace::TYPE_SINT:
         value = parse_sint();
@@ -676,6 +1248,18 @@ Value *Parser::parse_value(void) {
     case trace::TYPE_WSTRING:
         value = parse_wstring();
         break;
+    case trace::TYPE_BLOB_DEF:
+        value = parse_blob_def();
+        break;
+    case trace::TYPE_BLOB_REF:
+        value = parse_blob_ref();
+        break;
+    case trace::TYPE_STRING_DEF:
+        value = parse_string_def();
+        break;
+    case trace::TYPE_STRING_REF:
+        value = parse_string_ref();
+        break;
     default:
         std::cerr << "error: unknown type " << c << "\n";
         exit(1);
@@ -740,6 +1324,18 @@ void Parser::scan_value(void) {
     case trace::TYPE_WSTRING:
         scan_wstring();
         break;
+    case trace::TYPE_BLOB_DEF:
+        scan_blob_def();
+        break;
+    case trace::TYPE_BLOB_REF:
+        scan_blob_ref();
+        break;
+    case trace::TYPE_STRING_DEF:
+        scan_string_def();
+        break;
+    case trace::TYPE_STRING_REF:
+        scan_string_ref();
+        break;
     default:
         std::cerr << "error: unknown type " << c << "\n";
         exit(1);
@@ -750,7 +1346,7 @@ void Parser::scan_value(void) {
 
 
 Value *Parser::parse_sint() {
-    return new SInt(-(signed long long)read_uint());
+    return new (arena) SInt(-(signed long long)read_uint());
 }
 
 
@@ -760,7 +1356,7 @@ void Parser::scan_sint() {
 
 
 Value *Parser::parse_uint() {
-    return new UInt(read_uint());
+    return new (arena) UInt(read_uint());
 }
 
 
@@ -772,7 +1368,7 @@ void Parser::scan_uint() {
 Value *Parser::parse_float() {
     float value;
     file->read(&value, sizeof value);
-    return new Float(value);
+    return new (arena) Float(value);
 }
 
 
@@ -784,7 +1380,7 @@ void Parser::scan_float() {
 Value *Parser::parse_double() {
     double value;
     file->read(&value, sizeof value);
-    return new Double(value);
+    return new (arena) Double(value);
 }
 
 
@@ -794,7 +1390,7 @@ void Parser::scan_double() {
 
 
 Value *Parser::parse_string() {
-    return new String(read_string());
+    return new (arena) String(read_string(arena));
 }
 
 
@@ -803,6 +1399,71 @@ void Parser::scan_string() {
 }
 
 
+/*
+ * Like blobs, string definitions are always read in full, and repeated
+ * strings share the same storage.
+ */
+Value *Parser::parse_string_def() {
+    size_t id = read_uint();
+    size_t len = read_uint();
+
+    std::shared_ptr<char> data;
+    if (define_data(strings, string_order, string_window, STRING_WINDOW_SIZE, id, len, data)) {
+        return new (arena) String(data.get(), data);
+    }
+
+    // Already defined, e.g., when reparsing after a seek
+    char * value = arena ? arena->allocateArray<char>(len + 1) : new char[len + 1];
+    if (len) {
+        file->read(value, len);
+    }
+    value[len] = 0;
+    return new (arena) String(value);
+}
+
+
+void Parser::scan_string_def() {
+    if (capturing) {
+        capturing->rawRefs = true;
+    }
+
+    size_t id = read_uint();
+    size_t len = read_uint();
+
+    std::shared_ptr<char> data;
+    if (!define_data(strings, string_order, string_window, STRING_WINDOW_SIZE, id, len, data) && len) {
+        file->skip(len);
+    }
+}
+
+
+Value *Parser::parse_string_ref() {
+    size_t id = read_uint();
+
+    std::shared_ptr<char> data;
+    if (id < strings.size() && strings[id]) {
+        data = fetch_data(strings, string_order, string_window, STRING_WINDOW_SIZE, id);
+    }
+    if (data) {
+        return new (arena) String(data.get(), data);
+    }
+
+    std::cerr << "warning: unresolved reference to string " << id << "\n";
+    char * value = arena ? arena->allocateArray<char>(1) : new char[1];
+    value[0] = 0;
+    return new (arena) String(value);
+}
+
+
+void Parser::scan_string_ref() {
+    if (capturing) {
+        capturing->rawRefs = true;
+    }
+
+    skip_uint(); /* id */
+}
+
+
 Value *Parser::parse_enum() {
     EnumSig *sig;
     signed long long value;
@@ -814,7 +1475,7 @@ Value *Parser::parse_enum() {
         assert(sig->num_values == 1);
         value = sig->values->value;
     }
-    return new Enum(sig, value);
+    return new (arena) Enum(sig, value);
 }
 
 
@@ -833,7 +1494,7 @@ Value *Parser::parse_bitmask() {
 
     unsigned long long value = read_uint();
 
-    return new Bitmask(sig, value);
+    return new (arena) Bitmask(sig, value);
 }
 
 
@@ -845,7 +1506,7 @@ void Parser::scan_bitmask() {
 
 Value *Parser::parse_array(void) {
     size_t len = read_uint();
-    Array *array = new Array(len);
+    Array *array = new (arena) Array(len);
     for (size_t i = 0; i < len; ++i) {
         array->values[i] = parse_value();
     }
@@ -863,7 +1524,26 @@ void Parser::scan_array(void) {
 
 Value *Parser::parse_blob(void) {
     size_t size = read_uint();
-    Blob *blob = new Blob(size);
+    return parse_blob_data(size);
+}
+
+
+Value *Parser::parse_blob_data(size_t size) {
+    // Large blobs refer to the decompressed data directly when possible
+    if (size >= BLOB_IN_PLACE_MIN_SIZE) {
+        std::shared_ptr<char> storage;
+        const char *buf = file->readInPlace(size, storage);
+        if (buf) {
+            return new (arena) Blob(size, buf, storage);
+        }
+    }
+
+    Blob *blob;
+    if (arena) {
+        blob = new (arena) Blob(size, arena->allocateArray<char>(size));
+    } else {
+        blob = new Blob(size);
+    }
     if (size) {
         file->read(blob->buf, size);
     }
@@ -879,9 +1559,172 @@ void Parser::scan_blob(void) {
 }
 
 
+/*
+ * Blob definitions are always read in full, even when scanning, as the
+ * references which follow them need the data.
+ */
+Value *Parser::parse_blob_def(void) {
+    size_t id = read_uint();
+    size_t size = read_uint();
+
+    std::shared_ptr<char> data;
+    if (define_blob(id, size, data)) {
+        return new (arena) Blob(size, data.get(), data);
+    }
+
+    // Already defined, e.g., when reparsing after a seek
+    return parse_blob_data(size);
+}
+
+
+void Parser::scan_blob_def(void) {
+    if (capturing) {
+        capturing->rawRefs = true;
+    }
+
+    size_t id = read_uint();
+    size_t size = read_uint();
+
+    std::shared_ptr<char> data;
+    if (!define_blob(id, size, data) && size) {
+        file->skip(size);
+    }
+}
+
+
+/*
+ * Read the data of a blob seen for the first time, keeping it while within
+ * the window references may be made from.  Returns false without consuming
+ * anything if the blob was already defined.
+ */
+bool Parser::define_blob(size_t id, size_t size, std::shared_ptr<char> &data) {
+    return define_data(blobs, blob_order, blob_window, BLOB_WINDOW_SIZE, id, size, data);
+}
+
+
+bool Parser::define_data(BlobMap &map, std::deque<size_t> &order, size_t &window, size_t window_size,
+                         size_t id, size_t size, std::shared_ptr<char> &data) {
+    BlobState *state = lookup(map, id);
+    if (state) {
+        return false;
+    }
+
+    state = new BlobState;
+    state->size = size;
+    state->hasOffset = !main_file && file->supportsOffsets();
+    if (state->hasOffset) {
+        state->fileOffset = file->currentOffset();
+    }
+
+    // NUL terminated, for strings
+    data.reset(new char[size + 1], std::default_delete<char[]>());
+    if (size) {
+        file->read(data.get(), size);
+    }
+    data.get()[size] = 0;
+    state->data = data;
+    map[id] = state;
+
+    keep_data(map, order, window, window_size, id);
+
+    return true;
+}
+
+
+/*
+ * Keep the data of a blob or string until the ones read after it add up to
+ * more than the window size.
+ */
+void Parser::keep_data(BlobMap &map, std::deque<size_t> &order, size_t &window, size_t window_size,
+                       size_t id) {
+    order.push_back(id);
+    window += map[id]->size;
+    while (window > window_size) {
+        BlobState *oldest = map[order.front()];
+        window -= oldest->size;
+        oldest->data.reset();
+        order.pop_front();
+    }
+
+}
+
+
+Value *Parser::parse_blob_ref(void) {
+    size_t id = read_uint();
+    size_t size = read_uint();
+
+    std::shared_ptr<char> data = fetch_blob(id, size);
+    if (data) {
+        return new (arena) Blob(size, data.get(), data);
+    }
+
+    std::cerr << "warning: unresolved reference to blob " << id << "\n";
+    Blob *blob;
+    if (arena) {
+        blob = new (arena) Blob(size, arena->allocateArray<char>(size));
+    } else {
+        blob = new Blob(size);
+    }
+    memset(blob->buf, 0, size);
+    return blob;
+}
+
+
+void Parser::scan_blob_ref(void) {
+    if (capturing) {
+        capturing->rawRefs = true;
+    }
+
+    skip_uint(); /* id */
+    skip_uint(); /* size */
+}
+
+
+/*
+ * Get the data of a previously defined blob, reading it again if it fell out
+ * of the window, which only happens after seeking, or was defined before the
+ * parser was started past it with loadDefinitions().
+ */
+std::shared_ptr<char> Parser::fetch_blob(size_t id, size_t size) {
+    BlobState *blob = id < blobs.size() ? blobs[id] : NULL;
+    if (!blob || blob->size != size) {
+        return std::shared_ptr<char>();
+    }
+    return fetch_data(blobs, blob_order, blob_window, BLOB_WINDOW_SIZE, id);
+}
+
+
+std::shared_ptr<char> Parser::fetch_data(BlobMap &map, std::deque<size_t> &order, size_t &window, size_t window_size,
+                                         size_t id) {
+    BlobState *state = map[id];
+    if (state->data || !state->hasOffset) {
+        return state->data;
+    }
+
+    size_t size = state->size;
+    File *dataFile = main_file ? main_file : file;
+    File::Offset offset = dataFile->currentOffset();
+    dataFile->setCurrentOffset(state->fileOffset);
+    std::shared_ptr<char> data(new char[size + 1], std::default_delete<char[]>());
+    size_t read = size ? dataFile->read(data.get(), size) : 0;
+    dataFile->setCurrentOffset(offset);
+
+    if (read != size) {
+        return std::shared_ptr<char>();
+    }
+    data.get()[size] = 0;
+
+    // As it is likely to be referred to again
+    state->data = data;
+    keep_data(map, order, window, window_size, id);
+
+    return data;
+}
+
+
 Value *Parser::parse_struct() {
     StructSig *sig = parse_struct_sig();
-    Struct *value = new Struct(sig);
+    Struct *value = new (arena) Struct(sig);
 
     for (size_t i = 0; i < sig->num_members; ++i) {
         value->members[i] = parse_value();
@@ -902,7 +1745,7 @@ void Parser::scan_struct() {
 Value *Parser::parse_opaque() {
     unsigned long long addr;
     addr = read_uint();
-    return new Pointer(addr);
+    return new (arena) Pointer(addr);
 }
 
 
@@ -914,7 +1757,7 @@ void Parser::scan_opaque() {
 Value *Parser::parse_repr() {
     Value *humanValue = parse_value();
     Value *machineValue = parse_value();
-    return new Repr(humanValue, machineValue);
+    return new (arena) Repr(humanValue, machineValue);
 }
 
 
@@ -926,7 +1769,7 @@ void Parser::scan_repr() {
 
 Value *Parser::parse_wstring() {
     size_t len = read_uint();
-    wchar_t * value = new wchar_t[len + 1];
+    wchar_t * value = arena ? arena->allocateArray<wchar_t>(len + 1) : new wchar_t[len + 1];
     for (size_t i = 0; i < len; ++i) {
         value[i] = read_uint();
     }
@@ -934,7 +1777,7 @@ Value *Parser::parse_wstring() {
 #if TRACE_VERBOSE
     std::cerr << "\tWSTRING \"" << value << "\"\n";
 #endif
-    return new WString(value);
+    return new (arena) WString(value);
 }
 
 
@@ -946,9 +1789,9 @@ void Parser::scan_wstring() {
 }
 
 
-const char * Parser::read_string(void) {
+const char * Parser::read_string(Arena *arena) {
     size_t len = read_uint();
-    char * value = new char[len + 1];
+    char * value = arena ? arena->allocateArray<char>(len + 1) : new char[len + 1];
     if (len) {
         file->read(value, len);
     }
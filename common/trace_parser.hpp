@@ -26,8 +26,11 @@
 #pragma once
 
 
+#include <deque>
 #include <iostream>
 #include <list>
+#include <memory>
+#include <vector>
 
 #include "trace_file.hpp"
 #include "trace_format.hpp"
@@ -38,6 +41,9 @@
 namespace trace {
 
 
+class Index;
+
+
 struct ParseBookmark
 {
     File::Offset offset;
@@ -45,12 +51,41 @@ struct ParseBookmark
 };
 
 
+enum DefinitionKind {
+    DEFINITION_SIG = 0,
+    DEFINITION_BLOB,
+    DEFINITION_STRING,
+};
+
+
+/**
+ * Where something later calls may refer to -- a signature, blob, or string --
+ * was defined, so that another parser can start past it.
+ */
+struct ParseDefinition
+{
+    // Right after the id for signatures, of the data for blobs and strings
+    File::Offset offset;
+    DefinitionKind kind;
+    SigKind sigKind;
+    size_t id;
+    size_t size;
+};
+
+
 // Parser interface
 class AbstractParser
 {
 public:
     virtual ~AbstractParser() {}
     virtual  Call *parse_call(void) = 0;
+
+    /**
+     * Dispose of a call returned by parse_call(), possibly reusing its
+     * memory for the calls parsed next.  Equivalent to deleting it.
+     */
+    virtual void recycle(Call *call) { delete call; }
+
     virtual void getBookmark(ParseBookmark &bookmark) = 0;
     virtual void setBookmark(const ParseBookmark &bookmark) = 0;
     virtual bool open(const char *filename) = 0;
@@ -59,7 +94,7 @@ public:
 };
 
 
-class Parser: public AbstractParser
+class Parser: public AbstractParser, public CallDecoder
 {
 protected:
     File *file;
@@ -67,7 +102,8 @@ protected:
     enum Mode {
         FULL = 0,
         SCAN,
-        SKIP
+        SKIP,
+        LAZY
     };
 
     typedef std::list<Call *> CallList;
@@ -85,6 +121,8 @@ protected:
         // reparsing to determine whether the signature definition is to be
         // expected next or not.
         File::Offset fileOffset;
+        // Offset of the definition itself, right after the id.
+        File::Offset defOffset;
     };
 
     typedef SigState<FunctionSigFlags> FunctionSigState;
@@ -105,10 +143,57 @@ protected:
     BitmaskMap bitmasks;
     StackFrameMap frames;
 
+    // Also used for interned strings, whose data is NUL terminated
+    struct BlobState {
+        size_t size;
+        // Where the blob's data is, when the file supports offsets
+        bool hasOffset;
+        File::Offset fileOffset;
+        // The data, while within the window references may be made from
+        std::shared_ptr<char> data;
+    };
+
+    typedef std::vector<BlobState *> BlobMap;
+
+    // Blobs defined so far, by id, and the ids of those within the window,
+    // in order of definition, adding up to blob_window bytes
+    BlobMap blobs;
+    std::deque<size_t> blob_order;
+    size_t blob_window;
+
+    // Likewise for strings
+    BlobMap strings;
+    std::deque<size_t> string_order;
+    size_t string_window;
+
     FunctionSig *glGetErrorSig;
 
+    // Seek index appended to the trace, if any, and how many of the
+    // signatures, blobs and strings it lists were loaded so far, per kind
+    Index *index;
+    size_t indexed_sigs_loaded[SIG_KIND_COUNT];
+    size_t indexed_blobs_loaded;
+    size_t indexed_strings_loaded;
+
     unsigned next_call_no;
 
+    // Whether to allocate values from the arena of their call, and the arena
+    // of the call being currently parsed
+    bool useArena;
+    Arena *arena;
+
+    // Calls given back through recycle(), ready for reuse
+    std::vector<Call *> free_calls;
+
+    // Whether to parse calls lazily, and the call whose details are being
+    // captured
+    bool lazyArgs;
+    Call *capturing;
+
+    // The trace file, while file points to the details of a lazily parsed
+    // call being decoded
+    File *main_file;
+
     unsigned long long version;
 public:
     API api;
@@ -119,12 +204,20 @@ public:
 
     bool open(const char *filename);
 
+    /**
+     * Parse an uncompressed trace held in memory, which must outlive the
+     * parser.
+     */
+    bool openBuffer(const char *data, size_t size);
+
     void close(void);
 
     Call *parse_call(void) {
-        return parse_call(FULL);
+        return parse_call(lazyArgs ? LAZY : FULL);
     }
 
+    void recycle(Call *call);
+
     bool supportsOffsets() const
     {
         return file->supportsOffsets();
@@ -134,6 +227,70 @@ public:
 
     void setBookmark(const ParseBookmark &bookmark);
 
+    /**
+     * Whether some calls were entered but not left yet, which would be lost
+     * by setting a bookmark taken now.
+     */
+    bool hasPendingCalls(void) const {
+        return !calls.empty();
+    }
+
+    /**
+     * Whether the trace has a seek index, allowing to jump to any call or
+     * frame without scanning the trace first.
+     */
+    bool hasIndex(void) const {
+        return index != NULL;
+    }
+
+    /**
+     * Get a bookmark to start parsing at the given call, or somewhat before
+     * it.  Only available for traces with an index.
+     */
+    bool getCallBookmark(unsigned call_no, ParseBookmark &bookmark);
+
+    /**
+     * Get a bookmark to the first call of the given frame.  Only available
+     * for traces with an index.
+     */
+    bool getFrameBookmark(unsigned frame_no, ParseBookmark &bookmark);
+
+    /**
+     * Get where the signatures, blobs and strings seen so far were defined,
+     * in file order.  Only meaningful for files which support offsets.
+     */
+    void getDefinitions(std::vector<ParseDefinition> &definitions) const;
+
+    /**
+     * Learn the given definitions, as obtained from getDefinitions() on
+     * another parser of the same file, so that parsing can start past them.
+     * Must be followed by setBookmark().
+     */
+    void loadDefinitions(std::vector<ParseDefinition>::const_iterator begin,
+                         std::vector<ParseDefinition>::const_iterator end);
+
+    /**
+     * Allocate the values of each call from the call's own arena (the
+     * default), or individually on the heap, which is slower but friendlier
+     * to memory checkers.
+     */
+    void setArenaAllocation(bool enable) {
+        useArena = enable;
+    }
+
+    /**
+     * Keep the encoded details of each call as they are, and only decode
+     * them on demand -- see Call::decode().  This makes parsing cheaper
+     * for tools which mostly look at the call signatures, flags and
+     * numbers, and allows Writer::writeCall() to copy undecoded calls
+     * verbatim.
+     */
+    void setLazyArgs(bool enable) {
+        lazyArgs = enable;
+    }
+
+    void decodeCall(Call *call);
+
     unsigned long long getVersion(void) const {
         return version;
     }
@@ -153,8 +310,20 @@ protected:
     FunctionSigFlags *parse_function_sig(void);
     StructSig *parse_struct_sig();
     EnumSig *parse_old_enum_sig();
+    EnumSigState *parse_old_enum_sig_def(size_t id);
     EnumSig *parse_enum_sig();
     BitmaskSig *parse_bitmask_sig();
+
+    FunctionSigState *parse_function_sig_def(size_t id);
+    StructSigState *parse_struct_sig_def(size_t id);
+    EnumSigState *parse_enum_sig_def(size_t id);
+    BitmaskSigState *parse_bitmask_sig_def(size_t id);
+
+    bool open_header(void);
+
+    void load_index(void);
+    void load_indexed_definitions(const File::Offset &end);
+    void load_definition(const ParseDefinition &definition);
     
 public:
     static CallFlags
@@ -163,14 +332,21 @@ public:
 protected:
     Call *parse_Call(Mode mode);
 
+    Call *new_call(const FunctionSig *sig, CallFlags flags, unsigned thread_id);
+
     void parse_enter(Mode mode);
 
     Call *parse_leave(Mode mode);
 
     bool parse_call_details(Call *call, Mode mode);
+    bool capture_call_details(Call *call);
+
+    inline void begin_sig(SigKind kind, size_t id);
+    inline void end_sig(const void *sig);
 
     bool parse_call_backtrace(Call *call, Mode mode);
     StackFrame * parse_backtrace_frame(Mode mode);
+    StackFrameState *parse_backtrace_frame_def(size_t id);
 
     void adjust_call_flags(Call *call);
 
@@ -202,6 +378,12 @@ protected:
     Value *parse_string();
     void scan_string();
 
+    Value *parse_string_def(void);
+    void scan_string_def(void);
+
+    Value *parse_string_ref(void);
+    void scan_string_ref(void);
+
     Value *parse_enum();
     void scan_enum();
 
@@ -214,6 +396,23 @@ protected:
     Value *parse_blob(void);
     void scan_blob(void);
 
+    Value *parse_blob_data(size_t size);
+
+    Value *parse_blob_def(void);
+    void scan_blob_def(void);
+    bool define_blob(size_t id, size_t size, std::shared_ptr<char> &data);
+
+    Value *parse_blob_ref(void);
+    void scan_blob_ref(void);
+    std::shared_ptr<char> fetch_blob(size_t id, size_t size);
+
+    bool define_data(BlobMap &map, std::deque<size_t> &order, size_t &window, size_t window_size,
+                     size_t id, size_t size, std::shared_ptr<char> &data);
+    void keep_data(BlobMap &map, std::deque<size_t> &order, size_t &window, size_t window_size,
+                   size_t id);
+    std::shared_ptr<char> fetch_data(BlobMap &map, std::deque<size_t> &order, size_t &window, size_t window_size,
+                                     size_t id);
+
     Value *parse_struct();
     void scan_struct();
 
@@ -226,7 +425,11 @@ protected:
     Value *parse_wstring();
     void scan_wstring();
 
-    const char * read_string(void);
+    /**
+     * Read a string, allocating it from the given arena when not NULL, or
+     * with new[] otherwise.
+     */
+    const char * read_string(Arena *arena = NULL);
     void skip_string(void);
 
     signed long long read_sint(void);
@@ -0,0 +1,235 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Micro-benchmark of the trace parser.
+ *
+ * Writes a synthetic trace resembling a draw-heavy OpenGL application, and
+ * measures how fast it can be parsed with the values of each call allocated
+ * from the call's arena versus individually on the heap, with calls
+ * recycled through the parser versus deleted, and with the call details left
+ * undecoded.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "os_time.hpp"
+#include "trace_writer.hpp"
+#include "trace_parser.hpp"
+
+
+using namespace trace;
+
+
+static const char *glBindBuffer_args[] = {"target", "buffer"};
+static const FunctionSig glBindBuffer_sig = {0, "glBindBuffer", 2, glBindBuffer_args};
+
+static const char *glVertexAttribPointer_args[] = {"index", "size", "type", "normalized", "stride", "pointer"};
+static const FunctionSig glVertexAttribPointer_sig = {1, "glVertexAttribPointer", 6, glVertexAttribPointer_args};
+
+static const char *glUniform4fv_args[] = {"location", "count", "value"};
+static const FunctionSig glUniform4fv_sig = {2, "glUniform4fv", 3, glUniform4fv_args};
+
+static const char *glDrawElements_args[] = {"mode", "count", "type", "indices"};
+static const FunctionSig glDrawElements_sig = {3, "glDrawElements", 4, glDrawElements_args};
+
+static const char *glGetUniformLocation_args[] = {"program", "name"};
+static const FunctionSig glGetUniformLocation_sig = {4, "glGetUniformLocation", 2, glGetUniformLocation_args};
+
+static const char *glXSwapBuffers_args[] = {"dpy", "drawable"};
+static const FunctionSig glXSwapBuffers_sig = {5, "glXSwapBuffers", 2, glXSwapBuffers_args};
+
+static const EnumValue GLenum_values[] = {
+    {"GL_ARRAY_BUFFER", 0x8892},
+    {"GL_FLOAT", 0x1406},
+    {"GL_TRIANGLES", 0x0004},
+    {"GL_UNSIGNED_SHORT", 0x1403},
+};
+static const EnumSig GLenum_sig = {0, 4, GLenum_values};
+
+
+static void
+writeCalls(Writer &writer, unsigned numCalls)
+{
+    unsigned short indices[12] = {0, 1, 2, 2, 1, 3, 4, 5, 6, 6, 5, 7};
+    float color[4] = {1.0f, 0.5f, 0.25f, 1.0f};
+
+    unsigned n = 0;
+    while (n < numCalls) {
+        unsigned call;
+
+        call = writer.beginEnter(&glBindBuffer_sig, 0);
+        writer.beginArg(0); writer.writeEnum(&GLenum_sig, 0x8892); writer.endArg();
+        writer.beginArg(1); writer.writeUInt(n % 16); writer.endArg();
+        writer.endEnter();
+        writer.beginLeave(call);
+        writer.endLeave();
+        ++n;
+
+        for (unsigned i = 0; i < 3; ++i) {
+            call = writer.beginEnter(&glVertexAttribPointer_sig, 0);
+            writer.beginArg(0); writer.writeUInt(i); writer.endArg();
+            writer.beginArg(1); writer.writeSInt(4); writer.endArg();
+            writer.beginArg(2); writer.writeEnum(&GLenum_sig, 0x1406); writer.endArg();
+            writer.beginArg(3); writer.writeBool(false); writer.endArg();
+            writer.beginArg(4); writer.writeSInt(48); writer.endArg();
+            writer.beginArg(5); writer.writePointer(16 * i); writer.endArg();
+            writer.endEnter();
+            writer.beginLeave(call);
+            writer.endLeave();
+            ++n;
+        }
+
+        call = writer.beginEnter(&glGetUniformLocation_sig, 0);
+        writer.beginArg(0); writer.writeUInt(3); writer.endArg();
+        writer.beginArg(1); writer.writeString("u_modelViewProjection"); writer.endArg();
+        writer.endEnter();
+        writer.beginLeave(call);
+        writer.beginReturn(); writer.writeSInt(n % 8); writer.endReturn();
+        writer.endLeave();
+        ++n;
+
+        call = writer.beginEnter(&glUniform4fv_sig, 0);
+        writer.beginArg(0); writer.writeSInt(n % 8); writer.endArg();
+        writer.beginArg(1); writer.writeSInt(1); writer.endArg();
+        writer.beginArg(2);
+        writer.beginArray(4);
+        for (unsigned i = 0; i < 4; ++i) {
+            writer.beginElement(); writer.writeFloat(color[i]); writer.endElement();
+        }
+        writer.endArray();
+        writer.endArg();
+        writer.endEnter();
+        writer.beginLeave(call);
+        writer.endLeave();
+        ++n;
+
+        call = writer.beginEnter(&glDrawElements_sig, 0);
+        writer.beginArg(0); writer.writeEnum(&GLenum_sig, 0x0004); writer.endArg();
+        writer.beginArg(1); writer.writeSInt(12); writer.endArg();
+        writer.beginArg(2); writer.writeEnum(&GLenum_sig, 0x1403); writer.endArg();
+        writer.beginArg(3); writer.writeBlob(indices, sizeof indices); writer.endArg();
+        writer.endEnter();
+        writer.beginLeave(call);
+        writer.endLeave();
+        ++n;
+
+        if (n % 1000 < 7) {
+            call = writer.beginEnter(&glXSwapBuffers_sig, 0);
+            writer.beginArg(0); writer.writePointer(0x1234); writer.endArg();
+            writer.beginArg(1); writer.writeUInt(0x2a00002); writer.endArg();
+            writer.endEnter();
+            writer.beginLeave(call);
+            writer.endLeave();
+            ++n;
+        }
+    }
+}
+
+
+enum Mode {
+    MODE_HEAP = 0,
+    MODE_ARENA,
+    MODE_RECYCLE,
+    MODE_LAZY,
+    MODE_COUNT
+};
+
+static const char *modeNames[MODE_COUNT] = {
+    "heap",
+    "arena",
+    "recycle",
+    "lazy",
+};
+
+
+static double
+parseTrace(const char *filename, Mode mode, unsigned long long &numCalls)
+{
+    Parser parser;
+    if (!parser.open(filename)) {
+        fprintf(stderr, "error: failed to open %s\n", filename);
+        exit(1);
+    }
+    parser.setArenaAllocation(mode != MODE_HEAP);
+    parser.setLazyArgs(mode == MODE_LAZY);
+
+    long long start = os::getTime();
+
+    numCalls = 0;
+    Call *call;
+    while ((call = parser.parse_call())) {
+        ++numCalls;
+        if (mode >= MODE_RECYCLE) {
+            parser.recycle(call);
+        } else {
+            delete call;
+        }
+    }
+
+    long long end = os::getTime();
+
+    return double(end - start) / os::timeFrequency;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    const char *filename = "trace_parser_bench.trace";
+    unsigned numCalls = 2000000;
+    unsigned numRuns = 3;
+
+    if (argc > 1) {
+        numCalls = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        filename = argv[2];
+    }
+
+    Writer writer;
+    if (!writer.open(filename)) {
+        fprintf(stderr, "error: failed to create %s\n", filename);
+        return 1;
+    }
+    writeCalls(writer, numCalls);
+    writer.close();
+
+    for (unsigned run = 0; run < numRuns; ++run) {
+        for (unsigned mode = 0; mode < MODE_COUNT; ++mode) {
+            unsigned long long parsedCalls;
+            double seconds = parseTrace(filename, Mode(mode), parsedCalls);
+            printf("%-8s %llu calls in %.3f s, %.2f Mcalls/s\n",
+                   modeNames[mode],
+                   parsedCalls, seconds, parsedCalls / seconds * 1e-6);
+        }
+    }
+
+    remove(filename);
+
+    return 0;
+}
@@ -45,6 +45,7 @@ public:
     Call *parse_call(void);
 
     // Delegate to Parser
+    void recycle(Call *call) { parser->recycle(call); }
     void getBookmark(ParseBookmark &bookmark) { parser->getBookmark(bookmark); }
     void setBookmark(const ParseBookmark &bookmark) { parser->setBookmark(bookmark); }
     bool open(const char *filename);
@@ -0,0 +1,141 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+
+#include <snappy.h>
+
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
+#include "trace_ring.hpp"
+
+
+namespace trace {
+
+
+RingStream::RingStream(unsigned maxSegments) :
+    m_maxSegments(maxSegments),
+    m_hasPrologue(false)
+{
+}
+
+
+bool
+RingStream::write(const void *buffer, size_t length)
+{
+    m_current.append(static_cast<const char *>(buffer), length);
+    return true;
+}
+
+
+void
+RingStream::cut(void)
+{
+    std::string compressed;
+    ::snappy::Compress(m_current.data(), m_current.size(), &compressed);
+    m_current.clear();
+
+    if (!m_hasPrologue) {
+        m_prologue.swap(compressed);
+        m_hasPrologue = true;
+        return;
+    }
+
+    m_segments.push_back(std::string());
+    m_segments.back().swap(compressed);
+    while (m_segments.size() > m_maxSegments) {
+        m_segments.pop_front();
+    }
+}
+
+
+size_t
+RingStream::size(void) const
+{
+    size_t total = m_prologue.size() + m_current.size();
+    for (const std::string &segment : m_segments) {
+        total += segment.size();
+    }
+    return total;
+}
+
+
+/*
+ * Copy every complete call of a segment.  Calls still pending when the
+ * segment ends (e.g., on other threads) are lost, as their leave event is in
+ * the next segment.
+ */
+static void
+dumpSegment(Writer &writer, const char *data, size_t size)
+{
+    Parser parser;
+    parser.setLazyArgs(true);
+    if (!parser.openBuffer(data, size)) {
+        return;
+    }
+
+    Call *call;
+    while ((call = parser.parse_call())) {
+        writer.writeCall(call);
+        parser.recycle(call);
+    }
+}
+
+
+static void
+dumpCompressedSegment(Writer &writer, const std::string &compressed)
+{
+    std::string segment;
+    if (!::snappy::Uncompress(compressed.data(), compressed.size(), &segment)) {
+        assert(0);
+        return;
+    }
+    dumpSegment(writer, segment.data(), segment.size());
+}
+
+
+bool
+RingStream::dump(const char *filename, Compression compression, int level) const
+{
+    Writer writer;
+    if (!writer.open(filename, compression, level)) {
+        return false;
+    }
+
+    if (m_hasPrologue) {
+        dumpCompressedSegment(writer, m_prologue);
+    }
+    for (const std::string &segment : m_segments) {
+        dumpCompressedSegment(writer, segment);
+    }
+    dumpSegment(writer, m_current.data(), m_current.size());
+
+    writer.close();
+    return true;
+}
+
+
+} /* namespace trace */
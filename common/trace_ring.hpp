@@ -0,0 +1,90 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * In-memory ring of recently traced frames, for flight recorder captures.
+ */
+
+#pragma once
+
+
+#include <deque>
+#include <string>
+
+#include "trace_ostream.hpp"
+
+
+namespace trace {
+
+
+/**
+ * Stream that keeps the trace in memory, as a sequence of segments.
+ *
+ * Each segment is a self-contained trace (see Writer::restart), normally
+ * holding one frame.  The first segment, holding everything traced before
+ * the first frame ended (context creation, initial resource uploads, etc), is
+ * kept for good, while only the most recent segments after it are kept.
+ * Finished segments are kept snappy compressed.
+ */
+class RingStream : public OutStream {
+protected:
+    unsigned m_maxSegments;
+
+    std::string m_prologue;
+    bool m_hasPrologue;
+
+    std::deque<std::string> m_segments;
+
+    std::string m_current;
+
+public:
+    RingStream(unsigned maxSegments);
+
+    bool write(const void *buffer, size_t length);
+
+    void flush(void) {}
+
+    /**
+     * Finish the current segment, discarding the oldest ones beyond the
+     * maximum.
+     */
+    void cut(void);
+
+    /**
+     * Number of compressed bytes held.
+     */
+    size_t size(void) const;
+
+    /**
+     * Write the prologue, the ring and the unfinished segment into a new
+     * trace file, renumbering the calls.
+     */
+    bool dump(const char *filename,
+              Compression compression = COMPRESSION_SNAPPY,
+              int level = 0) const;
+};
+
+
+} /* namespace trace */
@@ -0,0 +1,289 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include "os.hpp"
+#include "os_thread.hpp"
+#include "trace_shards.hpp"
+
+
+namespace trace {
+
+
+class ShardedTrace::Workers
+{
+public:
+    const ShardedTrace &trace;
+    const std::vector<ShardVisitor *> &visitors;
+
+    // How many shards may be started ahead of the first one not finished,
+    // to bound the memory held by the visitors' results
+    size_t window;
+
+    os::mutex mutex;
+    os::condition_variable workCond;
+    os::condition_variable doneCond;
+    size_t next;
+    size_t finished;
+    std::vector<bool> done;
+    bool failed;
+
+    Workers(const ShardedTrace &_trace, const std::vector<ShardVisitor *> &_visitors, size_t _window) :
+        trace(_trace),
+        visitors(_visitors),
+        window(_window),
+        next(0),
+        finished(0),
+        done(_visitors.size(), false),
+        failed(false)
+    {}
+
+    static void
+    workerThread(Workers *_this) {
+        _this->workerLoop();
+    }
+
+    void
+    workerLoop(void);
+
+    void
+    visitShard(Parser &parser, size_t index);
+
+    void
+    finishShards(void);
+};
+
+
+void
+ShardedTrace::Workers::workerLoop(void)
+{
+    Parser parser;
+    parser.setLazyArgs(trace.m_lazyArgs);
+    bool opened = parser.open(trace.m_filename.c_str());
+
+    // Shards are taken in order, so definitions only need loading once
+    std::vector<ParseDefinition>::const_iterator loaded = trace.m_definitions.begin();
+
+    os::unique_lock<os::mutex> lock(mutex);
+    if (!opened) {
+        failed = true;
+    }
+
+    while (true) {
+        while (!failed &&
+               next < done.size() &&
+               next >= finished + window) {
+            workCond.wait(lock);
+        }
+        if (failed || next >= done.size()) {
+            // Wake up the next waiter in turn
+            workCond.notify_one();
+            doneCond.notify_one();
+            break;
+        }
+
+        size_t index = next++;
+        if (next < finished + window) {
+            workCond.notify_one();
+        }
+        lock.unlock();
+
+        const Shard &shard = trace.m_shards[index];
+        if (trace.m_seekable) {
+            std::vector<ParseDefinition>::const_iterator end = loaded;
+            while (end != trace.m_definitions.end() &&
+                   end->offset < shard.bookmark.offset) {
+                ++end;
+            }
+            parser.loadDefinitions(loaded, end);
+            loaded = end;
+            parser.setBookmark(shard.bookmark);
+        }
+
+        visitShard(parser, index);
+
+        lock.lock();
+        done[index] = true;
+        doneCond.notify_one();
+    }
+}
+
+
+void
+ShardedTrace::Workers::visitShard(Parser &parser, size_t index)
+{
+    const Shard &shard = trace.m_shards[index];
+    ShardVisitor *visitor = visitors[index];
+    unsigned frame = shard.firstFrame;
+
+    for (unsigned i = 0; i < shard.callCount; ++i) {
+        Call *call = parser.parse_call();
+        if (!call) {
+            break;
+        }
+        bool endFrame = call->flags & CALL_FLAG_END_FRAME;
+        visitor->visit(call, frame);
+        parser.recycle(call);
+        if (endFrame) {
+            ++frame;
+        }
+    }
+}
+
+
+/*
+ * Let the visitors merge their results as soon as their shard and all those
+ * before it were visited.
+ */
+void
+ShardedTrace::Workers::finishShards(void)
+{
+    os::unique_lock<os::mutex> lock(mutex);
+    while (!failed && finished < done.size()) {
+        if (!done[finished]) {
+            doneCond.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        visitors[finished]->finish();
+        lock.lock();
+
+        ++finished;
+        workCond.notify_one();
+    }
+}
+
+
+ShardedTrace::ShardedTrace() :
+    m_seekable(false),
+    m_lazyArgs(false)
+{
+}
+
+
+bool
+ShardedTrace::open(const char *filename, unsigned maxShards)
+{
+    m_shards.clear();
+    m_definitions.clear();
+
+    Parser parser;
+    if (!parser.open(filename)) {
+        return false;
+    }
+
+    m_filename = filename;
+    m_seekable = parser.supportsOffsets();
+
+    if (!maxShards) {
+        maxShards = 4 * os::getNumberOfProcessors();
+    }
+
+    // Runs of frames which can be parsed on their own, i.e., not interrupted
+    // by calls from other threads
+    std::vector<Shard> pieces;
+    Shard piece;
+    parser.getBookmark(piece.bookmark);
+    piece.firstFrame = 0;
+    piece.callCount = 0;
+
+    unsigned frame = 0;
+    unsigned long long totalCalls = 0;
+
+    Call *call;
+    while ((call = parser.scan_call())) {
+        ++piece.callCount;
+        ++totalCalls;
+
+        bool endFrame = call->flags & CALL_FLAG_END_FRAME;
+        parser.recycle(call);
+
+        if (endFrame) {
+            ++frame;
+            if (m_seekable && !parser.hasPendingCalls()) {
+                pieces.push_back(piece);
+                parser.getBookmark(piece.bookmark);
+                piece.firstFrame = frame;
+                piece.callCount = 0;
+            }
+        }
+    }
+
+    if (piece.callCount) {
+        pieces.push_back(piece);
+    }
+
+    if (m_seekable) {
+        parser.getDefinitions(m_definitions);
+    }
+
+    // Group them into shards of roughly the same number of calls
+    unsigned long long target = (totalCalls + maxShards - 1) / maxShards;
+    for (std::vector<Shard>::const_iterator it = pieces.begin(); it != pieces.end(); ++it) {
+        if (!m_shards.empty() &&
+            m_shards.back().callCount < target) {
+            m_shards.back().callCount += it->callCount;
+        } else {
+            m_shards.push_back(*it);
+        }
+    }
+
+    return true;
+}
+
+
+bool
+ShardedTrace::visit(const std::vector<ShardVisitor *> &visitors, unsigned numThreads)
+{
+    assert(visitors.size() == m_shards.size());
+
+    if (!numThreads) {
+        numThreads = os::getNumberOfProcessors();
+    }
+    numThreads = std::min(numThreads, (unsigned)m_shards.size());
+
+    Workers workers(*this, visitors, 2 * numThreads);
+
+    std::vector<os::thread> threads;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threads.push_back(os::thread(Workers::workerThread, &workers));
+    }
+
+    workers.finishShards();
+
+    for (unsigned i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    return !workers.failed;
+}
+
+
+} /* namespace trace */
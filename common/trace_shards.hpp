@@ -0,0 +1,133 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Parallel analysis of traces, by splitting them into shards of whole frames
+ * which are parsed independently of each other.
+ */
+
+#pragma once
+
+
+#include <string>
+#include <vector>
+
+#include "trace_parser.hpp"
+
+
+namespace trace {
+
+
+struct Shard
+{
+    // Where parsing the shard starts
+    ParseBookmark bookmark;
+
+    unsigned firstFrame;
+    unsigned callCount;
+};
+
+
+/**
+ * Per shard state of an analysis.
+ *
+ * Every call of the shard is passed to visit(), in order, from one of the
+ * worker threads.  As values may be shared with other threads, blobs must
+ * not be bound.
+ */
+class ShardVisitor
+{
+public:
+    virtual ~ShardVisitor() {}
+
+    /**
+     * Frame is the trace wide number of the frame the call belongs to.  The
+     * call is recycled afterwards.
+     */
+    virtual void visit(Call *call, unsigned frame) = 0;
+
+    /**
+     * Called from the thread which invoked ShardedTrace::visit(), in shard
+     * order, once all calls of the shard were visited, to merge the results
+     * with those of the preceding shards.
+     */
+    virtual void finish(void) {}
+};
+
+
+/**
+ * A trace split into shards.
+ *
+ * Opening the trace scans it once, noting the bookmarks of the frames which
+ * are not interrupted by calls from other threads, and where the signatures,
+ * blobs and strings were defined.  Each worker then parses the shards it is
+ * given with a parser of its own, preloaded with the definitions preceding
+ * them.
+ *
+ * Traces which do not support offsets make up a single shard.
+ */
+class ShardedTrace
+{
+public:
+    ShardedTrace();
+
+    /**
+     * Split the trace into at most maxShards shards of roughly the same
+     * number of calls, or four per processor by default.
+     */
+    bool open(const char *filename, unsigned maxShards = 0);
+
+    size_t getShardCount(void) const {
+        return m_shards.size();
+    }
+
+    const Shard &getShard(size_t index) const {
+        return m_shards[index];
+    }
+
+    void setLazyArgs(bool enable) {
+        m_lazyArgs = enable;
+    }
+
+    /**
+     * Visit the calls of each shard with its visitor, one per shard, using
+     * up to numThreads worker threads (one per processor by default).
+     * Returns false if the trace could not be reopened.
+     */
+    bool visit(const std::vector<ShardVisitor *> &visitors, unsigned numThreads = 0);
+
+private:
+    std::string m_filename;
+    bool m_seekable;
+    bool m_lazyArgs;
+
+    std::vector<Shard> m_shards;
+    std::vector<ParseDefinition> m_definitions;
+
+    class Workers;
+};
+
+
+} /* namespace trace */
@@ -42,6 +42,20 @@
  * The default size of an uncompressed chunk is specified in
  * SNAPPY_CHUNK_SIZE.
  *
+ * The chunks may be followed by a seek index:
+ * index {
+ *     uint32 - zero, marking the end of the chunks
+ *     uint32 - length of the compressed index block
+ *     compressed index block {
+ *         uint32 - number of chunks
+ *         uint32, uint32 - compressed and uncompressed size of each chunk
+ *         index data from trace::Index
+ *     }
+ *     uint64 - file offset of the end of chunks marker
+ *     4 bytes - SNAPPY_INDEX_MAGIC
+ * }
+ * All integers are little endian.
+ *
  * Note:
  * Currently the default size for a a to-be-compressed data is
  * 1mb, meaning that the compressed data will be <= 1mb.
@@ -58,4 +72,7 @@
 #define SNAPPY_BYTE1 'a'
 #define SNAPPY_BYTE2 't'
 
+#define SNAPPY_INDEX_MAGIC "atix"
+#define SNAPPY_TRAILER_SIZE 12
+
 
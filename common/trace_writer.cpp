@@ -36,12 +36,41 @@
 #include "trace_ostream.hpp"
 #include "trace_writer.hpp"
 #include "trace_format.hpp"
+#include "trace_index.hpp"
+#include "trace_parser.hpp"
+
+
+/*
+ * Minimum number of bytes between sampled calls in the index.
+ */
+#define INDEX_CALL_INTERVAL (64*1024)
+
+/*
+ * Minimum size of the blobs written only once.  Smaller blobs aren't worth
+ * hashing.
+ */
+#define BLOB_REF_MIN_SIZE 1024
+
+/*
+ * Minimum length of the strings written only once.  Shorter strings take
+ * about as many bytes as their references.
+ */
+#define STRING_REF_MIN_LENGTH 8
 
 namespace trace {
 
 
 Writer::Writer() :
-    call_no(0)
+    call_no(0),
+    m_index(nullptr),
+    m_position(0),
+    m_frameStart(true),
+    m_blobRefs(true),
+    m_blobWindow(0),
+    m_nextBlobId(0),
+    m_stringRefs(true),
+    m_stringWindow(0),
+    m_nextStringId(0)
 {
     m_file = nullptr;
 }
@@ -53,34 +82,76 @@ Writer::~Writer()
 
 void
 Writer::close(void) {
+    if (m_file && m_index) {
+        std::string data;
+        m_index->serialize(data);
+        m_file->writeIndex(data.data(), data.size());
+    }
+    discardIndex();
+
     delete m_file;
     m_file = nullptr;
 }
 
+void
+Writer::discardIndex(void) {
+    delete m_index;
+    m_index = nullptr;
+}
+
 bool
-Writer::open(const char *filename) {
+Writer::open(const char *filename, Compression compression, int level) {
     close();
 
-    m_file = createSnappyStream(filename);
-    if (!m_file) {
+    OutStream *stream = createStream(filename, compression, level);
+    if (!stream) {
         return false;
     }
 
+    open(stream);
+    return true;
+}
+
+void
+Writer::open(OutStream *stream) {
+    close();
+
+    m_file = stream;
+    m_index = new Index;
+    m_endsFrame.clear();
+
+    restart();
+}
+
+void
+Writer::restart(void) {
     call_no = 0;
-    functions.clear();
-    structs.clear();
-    enums.clear();
-    bitmasks.clear();
-    frames.clear();
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        sigs[kind].clear();
+    }
 
-    _writeUInt(TRACE_VERSION);
+    m_position = 0;
+    m_frameStart = true;
 
-    return true;
+    m_blobs.clear();
+    m_blobOrder.clear();
+    m_blobWindow = 0;
+    m_nextBlobId = 0;
+
+    m_strings.clear();
+    m_stringOrder.clear();
+    m_stringWindow = 0;
+    m_nextStringId = 0;
+
+    _writeUInt(TRACE_VERSION);
 }
 
 void inline
 Writer::_write(const void *sBuffer, size_t dwBytesToWrite) {
     m_file->write(sBuffer, dwBytesToWrite);
+    if (m_index) {
+        m_position += dwBytesToWrite;
+    }
 }
 
 void inline
@@ -126,12 +197,69 @@ Writer::_writeString(const char *str) {
     _write(str, len);
 }
 
-inline bool lookup(std::vector<bool> &map, size_t index) {
+bool Writer::lookupSig(SigKind kind, size_t index) {
+    std::vector<bool> &map = sigs[kind];
     if (index >= map.size()) {
         map.resize(index + 1);
-        return false;
-    } else {
-        return map[index];
+    } else if (map[index]) {
+        return true;
+    }
+    map[index] = true;
+
+    // The definition follows
+    if (m_index) {
+        m_index->sigs[kind].push_back(Index::Entry(index, m_position));
+    }
+
+    return false;
+}
+
+void Writer::writeRawCall(const Call *call) {
+    std::vector<Call::SigRef>::const_iterator sig = call->rawSigs.begin();
+
+    unsigned call_no = beginEnter(call->sig, call->thread_id);
+    writeRawDetails(call, 0, call->rawLeave, sig);
+    endEnter();
+    beginLeave(call_no);
+    writeRawDetails(call, call->rawLeave, call->raw.size(), sig);
+    endLeave();
+}
+
+/*
+ * Copy the encoded call details between begin and end, inserting the
+ * definitions of the signatures not defined yet where they belong.
+ */
+void Writer::writeRawDetails(const Call *call, size_t begin, size_t end,
+                             std::vector<Call::SigRef>::const_iterator &sig) {
+    const char *raw = call->raw.empty() ? NULL : &call->raw[0];
+
+    for (; sig != call->rawSigs.end() && sig->offset <= end; ++sig) {
+        if (!lookupSig(sig->kind, sig->id)) {
+            _write(raw + begin, sig->offset - begin);
+            begin = sig->offset;
+
+            switch (sig->kind) {
+            case SIG_STRUCT:
+                writeStructSigDef(static_cast<const StructSig *>(sig->sig));
+                break;
+            case SIG_ENUM:
+                writeEnumSigDef(static_cast<const EnumSig *>(sig->sig));
+                break;
+            case SIG_BITMASK:
+                writeBitmaskSigDef(static_cast<const BitmaskSig *>(sig->sig));
+                break;
+            case SIG_FRAME:
+                writeStackFrameDef(static_cast<const StackFrame *>(sig->sig));
+                break;
+            default:
+                assert(0);
+                break;
+            }
+        }
+    }
+
+    if (end > begin) {
+        _write(raw + begin, end - begin);
     }
 }
 
@@ -144,45 +272,79 @@ void Writer::beginBacktrace(unsigned num_frames) {
 
 void Writer::writeStackFrame(const RawStackFrame *frame) {
     _writeUInt(frame->id);
-    if (!lookup(frames, frame->id)) {
-        if (frame->module != NULL) {
-            _writeByte(trace::BACKTRACE_MODULE);
-            _writeString(frame->module);
-        }
-        if (frame->function != NULL) {
-            _writeByte(trace::BACKTRACE_FUNCTION);
-            _writeString(frame->function);
-        }
-        if (frame->filename != NULL) {
-            _writeByte(trace::BACKTRACE_FILENAME);
-            _writeString(frame->filename);
-        }
-        if (frame->linenumber >= 0) {
-            _writeByte(trace::BACKTRACE_LINENUMBER);
-            _writeUInt(frame->linenumber);
-        }
-        if (frame->offset >= 0) {
-            _writeByte(trace::BACKTRACE_OFFSET);
-            _writeUInt(frame->offset);
-        }
-        _writeByte(trace::BACKTRACE_END);
-        frames[frame->id] = true;
+    if (!lookupSig(SIG_FRAME, frame->id)) {
+        writeStackFrameDef(frame);
     }
 }
 
-unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
+void Writer::writeStackFrameDef(const RawStackFrame *frame) {
+    if (frame->module != NULL) {
+        _writeByte(trace::BACKTRACE_MODULE);
+        _writeString(frame->module);
+    }
+    if (frame->function != NULL) {
+        _writeByte(trace::BACKTRACE_FUNCTION);
+        _writeString(frame->function);
+    }
+    if (frame->filename != NULL) {
+        _writeByte(trace::BACKTRACE_FILENAME);
+        _writeString(frame->filename);
+    }
+    if (frame->linenumber >= 0) {
+        _writeByte(trace::BACKTRACE_LINENUMBER);
+        _writeUInt(frame->linenumber);
+    }
+    if (frame->offset >= 0) {
+        _writeByte(trace::BACKTRACE_OFFSET);
+        _writeUInt(frame->offset);
+    }
+    _writeByte(trace::BACKTRACE_END);
+}
+
+void Writer::writeEnterEvent(const FunctionSig *sig, unsigned thread_id) {
     _writeByte(trace::EVENT_ENTER);
     _writeUInt(thread_id);
     _writeUInt(sig->id);
-    if (!lookup(functions, sig->id)) {
+    if (!lookupSig(SIG_FUNCTION, sig->id)) {
         _writeString(sig->name);
         _writeUInt(sig->num_args);
         for (unsigned i = 0; i < sig->num_args; ++i) {
             _writeString(sig->arg_names[i]);
         }
-        functions[sig->id] = true;
     }
+}
+
+void Writer::indexCall(const FunctionSig *sig, unsigned call) {
+    if (m_frameStart) {
+        m_index->frames.push_back(Index::Entry(call, m_position));
+        m_frameStart = false;
+    }
+
+    if (m_index->calls.empty() ||
+        m_position - m_index->calls.back().position >= INDEX_CALL_INTERVAL) {
+        m_index->calls.push_back(Index::Entry(call, m_position));
+    }
+
+    m_frameStart = endsFrame(sig);
+}
+
+bool Writer::endsFrame(const FunctionSig *sig) {
+    if (sig->id >= m_endsFrame.size()) {
+        m_endsFrame.resize(sig->id + 1);
+    }
+    unsigned char &endsFrame = m_endsFrame[sig->id];
+    if (!endsFrame) {
+        CallFlags flags = Parser::lookupCallFlags(sig->name);
+        endsFrame = flags & CALL_FLAG_END_FRAME ? 2 : 1;
+    }
+    return endsFrame == 2;
+}
 
+unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
+    if (m_index) {
+        indexCall(sig, call_no);
+    }
+    writeEnterEvent(sig, thread_id);
     return call_no++;
 }
 
@@ -216,13 +378,16 @@ void Writer::beginArray(size_t length) {
 void Writer::beginStruct(const StructSig *sig) {
     _writeByte(trace::TYPE_STRUCT);
     _writeUInt(sig->id);
-    if (!lookup(structs, sig->id)) {
-        _writeString(sig->name);
-        _writeUInt(sig->num_members);
-        for (unsigned i = 0; i < sig->num_members; ++i) {
-            _writeString(sig->member_names[i]);
-        }
-        structs[sig->id] = true;
+    if (!lookupSig(SIG_STRUCT, sig->id)) {
+        writeStructSigDef(sig);
+    }
+}
+
+void Writer::writeStructSigDef(const StructSig *sig) {
+    _writeString(sig->name);
+    _writeUInt(sig->num_members);
+    for (unsigned i = 0; i < sig->num_members; ++i) {
+        _writeString(sig->member_names[i]);
     }
 }
 
@@ -264,8 +429,7 @@ void Writer::writeString(const char *str) {
         Writer::writeNull();
         return;
     }
-    _writeByte(trace::TYPE_STRING);
-    _writeString(str);
+    writeString(str, strlen(str));
 }
 
 void Writer::writeString(const char *str, size_t len) {
@@ -273,6 +437,10 @@ void Writer::writeString(const char *str, size_t len) {
         Writer::writeNull();
         return;
     }
+    if (m_stringRefs && len >= STRING_REF_MIN_LENGTH) {
+        writeStringRef(str, len);
+        return;
+    }
     _writeByte(trace::TYPE_STRING);
     _writeUInt(len);
     _write(str, len);
@@ -311,11 +479,150 @@ void Writer::writeWString(const wchar_t *str) {
     writeWString(str, len);
 }
 
+/*
+ * MurmurHash64A, by Austin Appleby, which is in the public domain.
+ */
+static unsigned long long
+hashBlob(const void *data, size_t size)
+{
+    const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    unsigned long long h = size * m;
+
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + (size & ~size_t(7));
+    for (; p != end; p += 8) {
+        unsigned long long k;
+        memcpy(&k, p, sizeof k);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (size & 7) {
+    case 7: h ^= (unsigned long long)p[6] << 48; /* fall-through */
+    case 6: h ^= (unsigned long long)p[5] << 40; /* fall-through */
+    case 5: h ^= (unsigned long long)p[4] << 32; /* fall-through */
+    case 4: h ^= (unsigned long long)p[3] << 24; /* fall-through */
+    case 3: h ^= (unsigned long long)p[2] << 16; /* fall-through */
+    case 2: h ^= (unsigned long long)p[1] << 8; /* fall-through */
+    case 1: h ^= (unsigned long long)p[0];
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+/*
+ * Write a blob as a reference if an identical one may still be referred to,
+ * or define it otherwise, forgetting the oldest blobs which fall out of the
+ * window readers keep.
+ */
+void Writer::writeBlobRef(const void *data, size_t size) {
+    unsigned long long hash = hashBlob(data, size);
+
+    std::unordered_map<unsigned long long, BlobCopy>::iterator it = m_blobs.find(hash);
+    if (it != m_blobs.end() &&
+        it->second.data.size() == size &&
+        memcmp(it->second.data.data(), data, size) == 0) {
+        _writeByte(trace::TYPE_BLOB_REF);
+        _writeUInt(it->second.id);
+        _writeUInt(size);
+        return;
+    }
+
+    // Either new, or colliding with another blob, which is then forgotten
+    BlobDef def;
+    def.hash = hash;
+    def.id = m_nextBlobId++;
+    def.size = size;
+    BlobCopy &copy = m_blobs[hash];
+    copy.id = def.id;
+    copy.data.assign(static_cast<const char *>(data), size);
+    m_blobOrder.push_back(def);
+    m_blobWindow += size;
+
+    _writeByte(trace::TYPE_BLOB_DEF);
+    _writeUInt(def.id);
+    _writeUInt(size);
+    if (m_index) {
+        m_index->blobs.push_back(Index::Entry(def.id, m_position, size));
+    }
+    _write(data, size);
+
+    while (m_blobWindow > BLOB_WINDOW_SIZE) {
+        const BlobDef &oldest = m_blobOrder.front();
+        m_blobWindow -= oldest.size;
+        it = m_blobs.find(oldest.hash);
+        if (it != m_blobs.end() && it->second.id == oldest.id) {
+            m_blobs.erase(it);
+        }
+        m_blobOrder.pop_front();
+    }
+}
+
+/*
+ * Same as writeBlobRef, for strings.
+ */
+void Writer::writeStringRef(const char *str, size_t len) {
+    unsigned long long hash = hashBlob(str, len);
+
+    std::unordered_map<unsigned long long, BlobCopy>::iterator it = m_strings.find(hash);
+    if (it != m_strings.end() &&
+        it->second.data.size() == len &&
+        memcmp(it->second.data.data(), str, len) == 0) {
+        _writeByte(trace::TYPE_STRING_REF);
+        _writeUInt(it->second.id);
+        return;
+    }
+
+    StringDef def;
+    def.hash = hash;
+    def.id = m_nextStringId++;
+    def.length = len;
+    BlobCopy &copy = m_strings[hash];
+    copy.id = def.id;
+    copy.data.assign(str, len);
+    m_stringOrder.push_back(def);
+    m_stringWindow += len;
+
+    _writeByte(trace::TYPE_STRING_DEF);
+    _writeUInt(def.id);
+    _writeUInt(len);
+    if (m_index) {
+        m_index->strings.push_back(Index::Entry(def.id, m_position, len));
+    }
+    _write(str, len);
+
+    while (m_stringWindow > STRING_WINDOW_SIZE) {
+        const StringDef &oldest = m_stringOrder.front();
+        m_stringWindow -= oldest.length;
+        it = m_strings.find(oldest.hash);
+        if (it != m_strings.end() && it->second.id == oldest.id) {
+            m_strings.erase(it);
+        }
+        m_stringOrder.pop_front();
+    }
+}
+
 void Writer::writeBlob(const void *data, size_t size) {
     if (!data) {
         Writer::writeNull();
         return;
     }
+    if (m_blobRefs && size >= BLOB_REF_MIN_SIZE) {
+        writeBlobRef(data, size);
+        return;
+    }
     _writeByte(trace::TYPE_BLOB);
     _writeUInt(size);
     if (size) {
@@ -326,34 +633,40 @@ void Writer::writeBlob(const void *data, size_t size) {
 void Writer::writeEnum(const EnumSig *sig, signed long long value) {
     _writeByte(trace::TYPE_ENUM);
     _writeUInt(sig->id);
-    if (!lookup(enums, sig->id)) {
-        _writeUInt(sig->num_values);
-        for (unsigned i = 0; i < sig->num_values; ++i) {
-            _writeString(sig->values[i].name);
-            writeSInt(sig->values[i].value);
-        }
-        enums[sig->id] = true;
+    if (!lookupSig(SIG_ENUM, sig->id)) {
+        writeEnumSigDef(sig);
     }
     writeSInt(value);
 }
 
+void Writer::writeEnumSigDef(const EnumSig *sig) {
+    _writeUInt(sig->num_values);
+    for (unsigned i = 0; i < sig->num_values; ++i) {
+        _writeString(sig->values[i].name);
+        writeSInt(sig->values[i].value);
+    }
+}
+
 void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
     _writeByte(trace::TYPE_BITMASK);
     _writeUInt(sig->id);
-    if (!lookup(bitmasks, sig->id)) {
-        _writeUInt(sig->num_flags);
-        for (unsigned i = 0; i < sig->num_flags; ++i) {
-            if (i != 0 && sig->flags[i].value == 0) {
-                os::log("apitrace: warning: sig %s is zero but is not first flag\n", sig->flags[i].name);
-            }
-            _writeString(sig->flags[i].name);
-            _writeUInt(sig->flags[i].value);
-        }
-        bitmasks[sig->id] = true;
+    if (!lookupSig(SIG_BITMASK, sig->id)) {
+        writeBitmaskSigDef(sig);
     }
     _writeUInt(value);
 }
 
+void Writer::writeBitmaskSigDef(const BitmaskSig *sig) {
+    _writeUInt(sig->num_flags);
+    for (unsigned i = 0; i < sig->num_flags; ++i) {
+        if (i != 0 && sig->flags[i].value == 0) {
+            os::log("apitrace: warning: sig %s is zero but is not first flag\n", sig->flags[i].name);
+        }
+        _writeString(sig->flags[i].name);
+        _writeUInt(sig->flags[i].value);
+    }
+}
+
 void Writer::writeNull(void) {
     _writeByte(trace::TYPE_NULL);
 }
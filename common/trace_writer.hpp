@@ -32,29 +32,108 @@
 
 #include <stddef.h>
 
+#include <deque>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "trace_model.hpp"
+#include "trace_format.hpp"
+#include "trace_ostream.hpp"
 
 namespace trace {
-    class OutStream;
+    class Index;
 
     class Writer {
     protected:
         OutStream *m_file;
         unsigned call_no;
 
-        std::vector<bool> functions;
-        std::vector<bool> structs;
-        std::vector<bool> enums;
-        std::vector<bool> bitmasks;
-        std::vector<bool> frames;
+        /**
+         * Which signatures (and stack frames) were already defined in the
+         * stream, indexed by their ids.
+         */
+        std::vector<bool> sigs[SIG_KIND_COUNT];
+
+        /**
+         * Seek index appended on close, or NULL when not indexing.
+         */
+        Index *m_index;
+
+        /**
+         * Number of uncompressed bytes written so far.  Only kept up to date
+         * while indexing, as LocalWriter's per-thread buffers write without
+         * holding any lock.
+         */
+        unsigned long long m_position;
+
+        /**
+         * Whether each function ends a frame, indexed by id: 0 if unknown yet,
+         * 1 if not, 2 if it does.
+         */
+        std::vector<unsigned char> m_endsFrame;
+        bool m_frameStart;
+
+        /**
+         * Whether large blobs are written once and referred to afterwards.
+         */
+        bool m_blobRefs;
+
+        struct BlobDef {
+            unsigned long long hash;
+            unsigned long long id;
+            size_t size;
+        };
+
+        /**
+         * Copy of a blob (or string) which may be referred to, as hashes
+         * alone can collide.
+         */
+        struct BlobCopy {
+            unsigned long long id;
+            std::string data;
+        };
+
+        /**
+         * Blobs defined within the window readers keep, in order of
+         * definition and adding up to m_blobWindow bytes, and those which
+         * may be referred to by hash of their contents.
+         */
+        std::deque<BlobDef> m_blobOrder;
+        std::unordered_map<unsigned long long, BlobCopy> m_blobs;
+        size_t m_blobWindow;
+        unsigned long long m_nextBlobId;
+
+        /**
+         * Likewise for strings, which are interned regardless of their size
+         * since the window is much smaller.
+         */
+        bool m_stringRefs;
+
+        struct StringDef {
+            unsigned long long hash;
+            unsigned long long id;
+            size_t length;
+        };
+
+        std::deque<StringDef> m_stringOrder;
+        std::unordered_map<unsigned long long, BlobCopy> m_strings;
+        size_t m_stringWindow;
+        unsigned long long m_nextStringId;
 
     public:
         Writer();
-        ~Writer();
+        virtual ~Writer();
+
+        bool open(const char *filename,
+                  Compression compression = COMPRESSION_SNAPPY,
+                  int level = 0);
+
+        /**
+         * Write into the given stream, taking ownership of it.
+         */
+        void open(OutStream *stream);
 
-        bool open(const char *filename);
         void close(void);
 
         unsigned beginEnter(const FunctionSig *sig, unsigned thread_id);
@@ -102,7 +181,80 @@ namespace trace {
 
         void writeCall(Call *call);
 
+        /**
+         * Write the enter and leave events of a call apart, for example to
+         * keep calls of different threads which overlapped interleaved.
+         * All arguments are written on enter.  writeCallEnter() returns the
+         * number of the call, to pass to writeCallLeave().
+         */
+        unsigned writeCallEnter(Call *call);
+        void writeCallLeave(Call *call, unsigned call_no);
+
+        /**
+         * Write blobs of BLOB_REF_MIN_SIZE bytes or more only once, referring
+         * to them afterwards.  Enabled by default.  Must not be used when
+         * blobs are written concurrently.
+         */
+        void setBlobRefs(bool enable) {
+            m_blobRefs = enable;
+        }
+
+        /**
+         * Write strings of STRING_REF_MIN_LENGTH characters or more only
+         * once, referring to them afterwards.  Enabled by default.  Same
+         * restrictions as setBlobRefs.
+         */
+        void setStringRefs(bool enable) {
+            m_stringRefs = enable;
+        }
+
     protected:
+        /**
+         * Write a lazily parsed call by copying its encoded details, adding
+         * the definitions of the signatures they refer to as needed.
+         */
+        void writeRawCall(const Call *call);
+        void writeRawDetails(const Call *call, size_t begin, size_t end,
+                             std::vector<Call::SigRef>::const_iterator &sig);
+
+        void writeStructSigDef(const StructSig *sig);
+        void writeEnumSigDef(const EnumSig *sig);
+        void writeBitmaskSigDef(const BitmaskSig *sig);
+        void writeStackFrameDef(const RawStackFrame *frame);
+
+        void writeBlobRef(const void *data, size_t size);
+        void writeStringRef(const char *str, size_t len);
+
+        /**
+         * Check whether the signature was already defined, marking it as
+         * defined otherwise.  When this returns false the caller must emit
+         * the signature definition.
+         */
+        virtual bool lookupSig(SigKind kind, size_t index);
+
+        void writeEnterEvent(const FunctionSig *sig, unsigned thread_id);
+
+        void indexCall(const FunctionSig *sig, unsigned call);
+
+        /**
+         * Whether calls to this function end a frame.
+         */
+        bool endsFrame(const FunctionSig *sig);
+
+        /**
+         * Start over a self-contained trace in the current stream: write the
+         * version header again, number calls from zero, and forget which
+         * signatures and blobs were defined.  Must not be used while
+         * indexing.
+         */
+        void restart(void);
+
+        /**
+         * Stop indexing the current stream, e.g., when the stream positions
+         * are not known, or the stream must not be written to anymore.
+         */
+        void discardIndex(void);
+
         void inline _write(const void *sBuffer, size_t dwBytesToWrite);
         void inline _writeByte(char c);
         void inline _writeUInt(unsigned long long value);
@@ -25,16 +25,23 @@
 
 
 #include <assert.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <vector>
+
 #include "os.hpp"
 #include "os_thread.hpp"
 #include "os_string.hpp"
 #include "os_version.hpp"
+#include "os_time.hpp"
 #include "trace_ostream.hpp"
+#include "trace_overhead.hpp"
+#include "trace_parser.hpp"
+#include "trace_ring.hpp"
 #include "trace_writer_local.hpp"
 #include "trace_format.hpp"
 #include "os_backtrace.hpp"
@@ -55,22 +62,258 @@ const FunctionSig free_sig = {2, "free", 1, free_args};
 static const char *realloc_args[2] = {"ptr", "size"};
 const FunctionSig realloc_sig = {3, "realloc", 2, realloc_args};
 
+static const char *memcpy_patch_args[5] = {"dest", "shadow", "offset", "patch", "n"};
+const FunctionSig memcpy_patch_sig = {4, "memcpy_patch", 5, memcpy_patch_args};
+
 
 static void exceptionCallback(void)
 {
-    localWriter.flush();
+    localWriter.flushForCrash();
 }
 
 
+/**
+ * Set asynchronously to request a dump of the flight recorder ring, which
+ * is done on the next call.
+ */
+static volatile sig_atomic_t dumpRequested = 0;
+
+#ifndef _WIN32
+static void dumpSignalHandler(int sig)
+{
+    dumpRequested = 1;
+}
+#endif
+
+
+/**
+ * Set asynchronously to start/stop recording the filtered calls, which is
+ * done at the next frame boundary.
+ */
+static volatile sig_atomic_t toggleRequested = 0;
+
+#ifndef _WIN32
+static void toggleSignalHandler(int sig)
+{
+    toggleRequested = 1;
+}
+#endif
+
+
+/*
+ * Calls skipped by default outside of the selected frames: those that only
+ * consume state to render, rather than create or modify it.  The GL tracer
+ * still records them while they render into a framebuffer object, capture
+ * transform feedback, or read back into a pixel pack buffer (see
+ * gltrace.py), as their results may then be used later.
+ */
+static const char *defaultSkipCalls =
+    "glDrawArrays* glDrawElements* glDrawRangeElements* "
+    "glDrawElementArray* glDrawRangeElementArray* glDrawTransformFeedback* "
+    "glDrawPixels glDrawTex* "
+    "glMultiDrawArrays* glMultiDrawElements* glMultiDrawRangeElementArray* "
+    "glMultiModeDraw* "
+    "glBegin glEnd glVertex2* glVertex3* glVertex4* glArrayElement* "
+    "glRect* glEvalMesh* glEvalPoint* "
+    "glClear glClearBufferfv glClearBufferiv glClearBufferuiv glClearBufferfi "
+    "glBlitFramebuffer* "
+    "glReadPixels glReadnPixels*";
+
+
+enum {
+    FILTER_KNOWN     = 1 << 0,
+    FILTER_SKIP      = 1 << 1,
+    FILTER_END_FRAME = 1 << 2,
+};
+
+/**
+ * Number of signature ids whose filter flags are cached.  Flags of larger
+ * ids are worked out on every call.
+ */
+#define FILTER_MAX_SIGS 16384
+
+
+/**
+ * Maximum nesting of calls within a thread (i.e., fake calls emitted between
+ * the enter and leave events of a real call).
+ */
+#define THREAD_BUFFER_MAX_CALLS 16
+
+
+/**
+ * Per-thread serialization state.
+ *
+ * These are never freed, as there is no portable way to be notified of
+ * thread termination, but they are small compared to the data they buffer.
+ */
+struct ThreadBuffer {
+    unsigned thread_id;
+    unsigned generation;
+
+    /* Serialized bytes of the enter/leave record being built */
+    char *data;
+    size_t size;
+    size_t capacity;
+
+    /* Signatures known to be defined in the trace file */
+    std::vector<bool> sigs[SIG_KIND_COUNT];
+
+    /* Whether we hold the mutex, because the record being built defines a
+     * new signature */
+    bool locked;
+
+    /* Call numbers assigned to the enter records, indexed by the token
+     * returned by beginEnter */
+    unsigned next_token;
+    unsigned call_nos[THREAD_BUFFER_MAX_CALLS];
+
+    ThreadBuffer() :
+        thread_id(0),
+        // Never a valid generation, so that the first call syncs
+        generation(~0u),
+        data(nullptr),
+        size(0),
+        capacity(0),
+        locked(false),
+        next_token(0)
+    {}
+
+    inline void
+    append(const void *buffer, size_t length) {
+        if (size + length > capacity) {
+            grow(size + length);
+        }
+        memcpy(data + size, buffer, length);
+        size += length;
+    }
+
+    void
+    grow(size_t length) {
+        size_t newCapacity = capacity ? capacity : 4096;
+        while (newCapacity < length) {
+            newCapacity *= 2;
+        }
+        char *newData = new char[newCapacity];
+        memcpy(newData, data, size);
+        delete [] data;
+        data = newData;
+        capacity = newCapacity;
+    }
+};
+
+
+static OS_THREAD_SPECIFIC_PTR(ThreadBuffer)
+thread_buffer;
+
+
+/**
+ * Stream that appends everything into the current thread's buffer.
+ */
+class ThreadBufferStream : public OutStream {
+private:
+    OutStream *m_stream;
+
+public:
+    ThreadBufferStream(OutStream *stream) :
+        m_stream(stream)
+    {}
+
+    ~ThreadBufferStream() {
+        delete m_stream;
+    }
+
+    bool write(const void *buffer, size_t length) {
+        ThreadBuffer *tb = thread_buffer;
+        assert(tb);
+        tb->append(buffer, length);
+        return true;
+    }
+
+    void flush(void) {
+        m_stream->flush();
+    }
+
+    void flushForCrash(void) {
+        m_stream->flushForCrash();
+    }
+};
+
+
 LocalWriter::LocalWriter() :
-    acquired(0)
+    acquired(0),
+    m_stream(nullptr),
+    generation(0),
+    m_patchEpoch(0),
+    m_ring(nullptr),
+    m_ringFrames(0),
+    m_spikeThreshold(0),
+    m_dumps(0),
+    m_compression(COMPRESSION_SNAPPY),
+    m_level(0),
+    m_frameEndCall(0),
+    m_frameEndPending(false),
+    m_cutPending(false),
+    m_frameStartTime(0),
+    m_callFilter(false),
+    m_filterFlags(nullptr),
+    m_frameSignal(false),
+    m_firstFrame(0),
+    m_lastFrame(~0U),
+    m_frameNo(0),
+    m_recording(true),
+    m_finished(false)
 {
     os::String process = os::getProcessName();
     os::log("apitrace: loaded into %s\n", process.str());
 
+    const char *threadBuffersEnv = getenv("APITRACE_THREAD_BUFFERS");
+    threadBuffers = threadBuffersEnv && atoi(threadBuffersEnv) != 0;
+
+    const char *flightRecorderEnv = getenv("APITRACE_FLIGHT_RECORDER");
+    if (flightRecorderEnv && atoi(flightRecorderEnv) > 0) {
+        m_ringFrames = atoi(flightRecorderEnv);
+
+        const char *spikeEnv = getenv("APITRACE_FLIGHT_RECORDER_SPIKE");
+        if (spikeEnv) {
+            m_spikeThreshold = atoi(spikeEnv);
+        }
+
+        // The ring is cut between calls, which per-thread buffers reorder
+        threadBuffers = false;
+    }
+
+    if (threadBuffers) {
+        os::log("apitrace: using per-thread buffers\n");
+    }
+
+    parseCallFilter();
+
+    const char *overheadEnv = getenv("APITRACE_OVERHEAD");
+    if (overheadEnv && atoi(overheadEnv) != 0) {
+        overhead::enable();
+    }
+
     // Install the signal handlers as early as possible, to prevent
     // interfering with the application's signal handling.
     os::setExceptionCallback(exceptionCallback);
+
+#ifndef _WIN32
+    // After the exception handlers, which would otherwise claim SIGUSR2
+    if (m_ringFrames) {
+        struct sigaction action;
+        action.sa_handler = dumpSignalHandler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &action, NULL);
+    }
+    if (m_frameSignal) {
+        struct sigaction action;
+        action.sa_handler = toggleSignalHandler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+#endif
 }
 
 LocalWriter::~LocalWriter()
@@ -78,6 +321,16 @@ LocalWriter::~LocalWriter()
     os::resetExceptionCallback();
     checkProcessId();
 
+    if (overhead::enabled && !m_fileName.empty()) {
+        std::string fileName = m_fileName;
+        size_t ext = fileName.rfind(".trace");
+        if (ext != std::string::npos && ext + strlen(".trace") == fileName.size()) {
+            fileName.erase(ext);
+        }
+        fileName += ".overhead.json";
+        overhead::report(fileName.c_str());
+    }
+
     os::String process = os::getProcessName();
     os::log("apitrace: unloaded from %s\n", process.str());
 }
@@ -137,14 +390,66 @@ LocalWriter::open(void) {
         }
     }
 
+    Compression compression = COMPRESSION_SNAPPY;
+    int level = 0;
+    const char *compressionEnv = getenv("APITRACE_COMPRESSION");
+    if (compressionEnv && !parseCompression(compressionEnv, compression, level)) {
+        os::log("apitrace: warning: unsupported compression %s, using snappy\n", compressionEnv);
+        compression = COMPRESSION_SNAPPY;
+        level = 0;
+    }
+
+    m_fileName = lpFileName;
+
+    if (m_ringFrames) {
+        os::log("apitrace: recording the last %u frames, to be dumped to %s\n",
+                m_ringFrames, lpFileName);
+
+        m_dumpFileName = lpFileName;
+        m_dumps = 0;
+        m_compression = compression;
+        m_level = level;
+
+        m_ring = new RingStream(m_ringFrames);
+        Writer::open(m_ring);
+
+        // Segments are parsed and rewritten when dumped
+        discardIndex();
+
+        m_frameEndPending = false;
+        m_cutPending = false;
+        m_frameStartTime = 0;
+
+        pid = os::getCurrentProcessId();
+        return;
+    }
+
+    m_ring = nullptr;
+
     os::log("apitrace: tracing to %s\n", lpFileName);
 
-    if (!Writer::open(lpFileName)) {
+    if (!Writer::open(lpFileName, compression, level)) {
         os::log("apitrace: error: failed to open %s\n", lpFileName);
         os::abort();
     }
 
+    if (threadBuffers) {
+        m_stream = m_file;
+        m_file = new ThreadBufferStream(m_stream);
+
+        // Records are serialized before their final position is known
+        discardIndex();
+
+        // Nor is the order of the blobs and strings they define
+        setBlobRefs(false);
+        setStringRefs(false);
+    }
+
+    // Only publish the new file once it is fully set up, as other threads
+    // check these without holding the mutex
     pid = os::getCurrentProcessId();
+    ++generation;
+    ++m_patchEpoch;
 
 #if 0
     // For debugging the exception handler
@@ -164,6 +469,7 @@ void LocalWriter::checkProcessId(void) {
         // create a new file.  We can't call any method of the current
         // file, as it may cause it to flush and corrupt the parent's
         // trace, so we effectively leak the old file object.
+        discardIndex();
         close();
         // Don't want to open the same file again
         os::unsetEnvironment("TRACE_FILE");
@@ -171,15 +477,63 @@ void LocalWriter::checkProcessId(void) {
     }
 }
 
+/**
+ * Obtain the backtrace for a call, if one was requested for it.
+ *
+ * This is done before taking the writer mutex, so that symbolizing frames
+ * seen for the first time doesn't stall the threads not needing backtraces.
+ * Threads needing them only contend while symbolizing frames they haven't
+ * seen before.
+ */
+static bool
+getBacktrace(const FunctionSig *sig, bool fake, std::vector<RawStackFrame> &backtrace)
+{
+    if (fake || !os::backtrace_is_needed(sig->name)) {
+        return false;
+    }
+
+    overhead::Scope scope(overhead::CATEGORY_BACKTRACE);
+    backtrace = os::get_backtrace();
+    return true;
+}
+
 unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
-    mutex.lock();
-    ++acquired;
+    if (overhead::enabled) {
+        overhead::beginEnter(sig);
+    }
+
+    std::vector<RawStackFrame> backtrace;
+    bool hasBacktrace = getBacktrace(sig, fake, backtrace);
+
+    if (threadBuffers) {
+        ThreadBuffer *tb = getThreadBuffer();
+        assert(tb->size == 0);
+
+        writeEnterEvent(sig, tb->thread_id);
+        if (hasBacktrace) {
+            beginBacktrace(backtrace.size());
+            for (unsigned i = 0; i < backtrace.size(); ++i) {
+                writeStackFrame(&backtrace[i]);
+            }
+            endBacktrace();
+        }
+
+        // The real call number is only known once the record is published
+        // in endEnter, so hand out a token instead
+        return tb->next_token++;
+    }
+
+    lock();
 
     checkProcessId();
     if (!m_file) {
         open();
     }
 
+    if (m_ring && (m_cutPending || dumpRequested)) {
+        cutFrame();
+    }
+
     uintptr_t this_thread_num = thread_num;
     if (!this_thread_num) {
         this_thread_num = next_thread_num++;
@@ -189,8 +543,11 @@ unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
     assert(this_thread_num);
     unsigned thread_id = this_thread_num - 1;
     unsigned call_no = Writer::beginEnter(sig, thread_id);
-    if (!fake && os::backtrace_is_needed(sig->name)) {
-        std::vector<RawStackFrame> backtrace = os::get_backtrace();
+    if (m_ring && !fake && endsFrame(sig)) {
+        m_frameEndCall = call_no;
+        m_frameEndPending = true;
+    }
+    if (hasBacktrace) {
         beginBacktrace(backtrace.size());
         for (unsigned i = 0; i < backtrace.size(); ++i) {
             writeStackFrame(&backtrace[i]);
@@ -202,23 +559,184 @@ unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
 
 void LocalWriter::endEnter(void) {
     Writer::endEnter();
-    --acquired;
-    mutex.unlock();
+    if (threadBuffers) {
+        ThreadBuffer *tb = thread_buffer;
+        unsigned token = tb->next_token - 1;
+        tb->call_nos[token % THREAD_BUFFER_MAX_CALLS] = publish(tb, true);
+    } else {
+        --acquired;
+        mutex.unlock();
+    }
+    if (overhead::enabled) {
+        overhead::endEnter();
+    }
 }
 
 void LocalWriter::beginLeave(unsigned call) {
-    mutex.lock();
-    ++acquired;
+    if (overhead::enabled) {
+        overhead::beginLeave();
+    }
+
+    if (threadBuffers) {
+        ThreadBuffer *tb = getThreadBuffer();
+        assert(tb->size == 0);
+        assert(tb->next_token - call <= THREAD_BUFFER_MAX_CALLS);
+        Writer::beginLeave(tb->call_nos[call % THREAD_BUFFER_MAX_CALLS]);
+        return;
+    }
+    lock();
+    if (m_ring && m_frameEndPending && call == m_frameEndCall) {
+        m_frameEndPending = false;
+        m_cutPending = true;
+    }
     Writer::beginLeave(call);
 }
 
 void LocalWriter::endLeave(void) {
     Writer::endLeave();
+    if (threadBuffers) {
+        publish(thread_buffer, false);
+    } else {
+        --acquired;
+        mutex.unlock();
+    }
+    if (overhead::enabled) {
+        overhead::endLeave();
+    }
+}
+
+void LocalWriter::lock(void) {
+    overhead::Scope scope(overhead::CATEGORY_LOCK);
+    mutex.lock();
+    ++acquired;
+}
+
+ThreadBuffer *LocalWriter::getThreadBuffer(void) {
+    ThreadBuffer *tb = thread_buffer;
+    if (!tb) {
+        tb = new ThreadBuffer;
+        thread_buffer = tb;
+    }
+
+    if (tb->generation != generation ||
+        os::getCurrentProcessId() != pid) {
+        syncThreadBuffer(tb);
+    }
+
+    return tb;
+}
+
+/*
+ * Slow path of getThreadBuffer, taken when a thread first traces a call, or
+ * after a new trace file was opened.
+ */
+void LocalWriter::syncThreadBuffer(ThreadBuffer *tb) {
+    mutex.lock();
+    ++acquired;
+
+    checkProcessId();
+    if (!m_file) {
+        open();
+    }
+
+    uintptr_t this_thread_num = thread_num;
+    if (!this_thread_num) {
+        this_thread_num = next_thread_num++;
+        thread_num = this_thread_num;
+    }
+    tb->thread_id = this_thread_num - 1;
+
+    if (tb->generation != generation) {
+        for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+            tb->sigs[kind].clear();
+        }
+        tb->generation = generation;
+    }
+
     --acquired;
     mutex.unlock();
 }
 
+/*
+ * Append the record built by the current thread to the trace file.  Enter
+ * records implicitly number calls by their order in the file, so the call
+ * number is assigned here and returned.
+ */
+unsigned LocalWriter::publish(ThreadBuffer *tb, bool enter) {
+    if (!tb->locked) {
+        lock();
+    }
+
+    m_stream->write(tb->data, tb->size);
+    unsigned no = enter ? call_no++ : 0;
+
+    tb->locked = false;
+    --acquired;
+    mutex.unlock();
+
+    // Don't hold on to the memory of huge blobs
+    tb->size = 0;
+    if (tb->capacity > 16*1024*1024) {
+        delete [] tb->data;
+        tb->data = nullptr;
+        tb->capacity = 0;
+    }
+
+    return no;
+}
+
+/*
+ * Check signatures against the per-thread cache first, only consulting the
+ * shared state with the mutex held.  When a signature must be defined, the
+ * mutex is held until the record is published, so that no other thread can
+ * publish a reference to the signature before its definition.
+ */
+bool LocalWriter::lookupSig(SigKind kind, size_t index) {
+    if (!threadBuffers) {
+        return Writer::lookupSig(kind, index);
+    }
+
+    ThreadBuffer *tb = thread_buffer;
+    std::vector<bool> &map = tb->sigs[kind];
+    if (index >= map.size()) {
+        map.resize(index + 1);
+    } else if (map[index]) {
+        return true;
+    }
+
+    if (!tb->locked) {
+        mutex.lock();
+        ++acquired;
+    }
+
+    bool defined = Writer::lookupSig(kind, index);
+    map[index] = true;
+
+    if (!defined) {
+        tb->locked = true;
+    } else if (!tb->locked) {
+        --acquired;
+        mutex.unlock();
+    }
+
+    return defined;
+}
+
 void LocalWriter::flush(void) {
+    mutex.lock();
+    if (!acquired) {
+        ++acquired;
+        // The flight recorder only writes the ring out on demand
+        if (m_file && !m_ring &&
+            os::getCurrentProcessId() == pid) {
+            m_file->flush();
+        }
+        --acquired;
+    }
+    mutex.unlock();
+}
+
+void LocalWriter::flushForCrash(void) {
     /*
      * Do nothing if the mutex is already acquired (e.g., if a segfault happen
      * while writing the file) as state could be inconsistent, therefore yield
@@ -233,9 +751,11 @@ void LocalWriter::flush(void) {
         if (m_file) {
             if (os::getCurrentProcessId() != pid) {
                 os::log("apitrace: ignoring exception in child process\n");
+            } else if (m_ring) {
+                dumpRing("exception");
             } else {
                 os::log("apitrace: flushing trace due to an exception\n");
-                m_file->flush();
+                m_file->flushForCrash();
             }
         }
         --acquired;
@@ -244,6 +764,186 @@ void LocalWriter::flush(void) {
 }
 
 
+/*
+ * Start a new ring segment once a frame has ended, and dump the ring when
+ * requested or when the frame took too long.
+ */
+void LocalWriter::cutFrame(void) {
+    bool spike = false;
+    if (m_cutPending) {
+        m_cutPending = false;
+
+        long long now = os::getTime();
+        if (m_spikeThreshold && m_frameStartTime &&
+            (now - m_frameStartTime) * 1000 > m_spikeThreshold * os::timeFrequency) {
+            spike = true;
+        }
+        m_frameStartTime = now;
+
+        m_ring->cut();
+        restart();
+        ++m_patchEpoch;
+    }
+
+    if (dumpRequested) {
+        dumpRequested = 0;
+        dumpRing("signal");
+    } else if (spike) {
+        dumpRing("frame time spike");
+    }
+}
+
+void LocalWriter::dumpRing(const char *reason) {
+    std::string fileName = m_dumpFileName;
+    if (m_dumps) {
+        // application.trace, application.1.trace, application.2.trace, ...
+        std::string suffix = os::String::format(".%u", m_dumps).str();
+        size_t ext = fileName.rfind(".trace");
+        if (ext != std::string::npos && ext + strlen(".trace") == fileName.size()) {
+            fileName.insert(ext, suffix);
+        } else {
+            fileName += suffix;
+        }
+    }
+    ++m_dumps;
+
+    os::log("apitrace: dumping %lu KB flight recording due to %s to %s\n",
+            (unsigned long)(m_ring->size() / 1024), reason, fileName.c_str());
+    if (!m_ring->dump(fileName.c_str(), m_compression, m_level)) {
+        os::log("apitrace: error: failed to open %s\n", fileName.c_str());
+    }
+}
+
+
+/*
+ * Parse APITRACE_FRAMES, which is either "signal", or a frame range like
+ * "N", "N-M", or "N-" (frames are numbered from zero), and
+ * APITRACE_SKIP_CALLS, a whitespace separated list of function names, where
+ * a trailing '*' matches any suffix.
+ */
+void LocalWriter::parseCallFilter(void) {
+    const char *framesEnv = getenv("APITRACE_FRAMES");
+    if (!framesEnv || !*framesEnv) {
+        return;
+    }
+
+    if (strcmp(framesEnv, "signal") == 0) {
+#ifdef _WIN32
+        os::log("apitrace: warning: APITRACE_FRAMES=signal not supported on this platform\n");
+        return;
+#else
+        m_frameSignal = true;
+        m_recording = false;
+#endif
+    } else {
+        char *end;
+        m_firstFrame = strtoul(framesEnv, &end, 0);
+        if (end == framesEnv) {
+            os::log("apitrace: warning: invalid APITRACE_FRAMES=%s\n", framesEnv);
+            return;
+        }
+        if (*end == '-') {
+            const char *last = end + 1;
+            m_lastFrame = *last ? strtoul(last, &end, 0) : ~0U;
+        } else {
+            m_lastFrame = m_firstFrame;
+        }
+        if (*end || m_lastFrame < m_firstFrame) {
+            os::log("apitrace: warning: invalid APITRACE_FRAMES=%s\n", framesEnv);
+            return;
+        }
+        m_recording = m_firstFrame == 0;
+    }
+
+    const char *skipEnv = getenv("APITRACE_SKIP_CALLS");
+    if (!skipEnv) {
+        skipEnv = defaultSkipCalls;
+    }
+    char *list = strdup(skipEnv);
+    for (char *tok = strtok(list, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        if (tok[0] != '#') {
+            m_skipPatterns.push_back(tok);
+        }
+    }
+    free(list);
+
+    // Never freed, as calls may still be traced while exiting
+    m_filterFlags = new std::atomic<unsigned char>[FILTER_MAX_SIGS]();
+
+    m_callFilter = true;
+
+    if (m_frameSignal) {
+        os::log("apitrace: recording frames on SIGUSR1\n");
+    } else if (m_lastFrame == ~0U) {
+        os::log("apitrace: recording frames %u-\n", m_firstFrame);
+    } else {
+        os::log("apitrace: recording frames %u-%u\n", m_firstFrame, m_lastFrame);
+    }
+}
+
+bool LocalWriter::filterCall(const FunctionSig *sig) {
+    // Threads racing to fill in the same entry store the same flags, and the
+    // skip patterns are not changed after parsing, so no lock is needed
+    unsigned char flags = 0;
+    if (sig->id < FILTER_MAX_SIGS) {
+        flags = m_filterFlags[sig->id].load(std::memory_order_relaxed);
+    }
+    if (!flags) {
+        flags = FILTER_KNOWN;
+        for (const std::string &pattern : m_skipPatterns) {
+            size_t n = pattern.size();
+            if (pattern[n - 1] == '*' ?
+                strncmp(sig->name, pattern.c_str(), n - 1) == 0 :
+                pattern == sig->name) {
+                flags |= FILTER_SKIP;
+                break;
+            }
+        }
+        if (Parser::lookupCallFlags(sig->name) & CALL_FLAG_END_FRAME) {
+            flags |= FILTER_END_FRAME;
+        }
+        if (sig->id < FILTER_MAX_SIGS) {
+            m_filterFlags[sig->id].store(flags, std::memory_order_relaxed);
+        }
+    }
+
+    // Nothing after the last frame is needed to replay the selected ones
+    bool skip = m_finished.load(std::memory_order_relaxed) ||
+                (!m_recording.load(std::memory_order_relaxed) && (flags & FILTER_SKIP));
+
+    // The frame ending call itself belongs to the frame it ends
+    if (flags & FILTER_END_FRAME) {
+        os::unique_lock<os::mutex> lock(m_filterMutex);
+        ++m_frameNo;
+        updateRecording();
+    }
+
+    return skip;
+}
+
+void LocalWriter::updateRecording(void) {
+    bool recording;
+    if (m_frameSignal) {
+        if (!toggleRequested) {
+            return;
+        }
+        toggleRequested = 0;
+        recording = !m_recording;
+    } else {
+        recording = m_frameNo >= m_firstFrame && m_frameNo <= m_lastFrame;
+        if (m_frameNo > m_lastFrame) {
+            m_finished = true;
+        }
+    }
+
+    if (recording != m_recording) {
+        os::log("apitrace: %s recording at frame %u\n",
+                recording ? "started" : "stopped", m_frameNo);
+        m_recording = recording;
+    }
+}
+
+
 LocalWriter localWriter;
 
 
@@ -283,5 +983,54 @@ void fakeMemcpy(const void *ptr, size_t size) {
 }
 
 
+void fakeMemcpyPatch(const void *ptr, size_t size,
+                     unsigned shadow, size_t offset,
+                     const void *patch, size_t patchSize,
+                     unsigned epoch) {
+    assert(ptr);
+    if (!size) {
+        return;
+    }
+
+    unsigned _call = localWriter.beginEnter(&memcpy_patch_sig, true);
+
+    // A new segment may have been started after diffing, dropping the
+    // patches this one depends on, so send the whole range as one run
+    std::string full;
+    if (epoch != localWriter.getPatchEpoch()) {
+        const unsigned char header[8] = {
+            0, 0, 0, 0,
+            (unsigned char)(size & 0xff),
+            (unsigned char)((size >> 8) & 0xff),
+            (unsigned char)((size >> 16) & 0xff),
+            (unsigned char)((size >> 24) & 0xff),
+        };
+        full.append((const char *)header, sizeof header);
+        full.append((const char *)ptr, size);
+        patch = full.data();
+        patchSize = full.size();
+    }
+
+    localWriter.beginArg(0);
+    localWriter.writePointer((uintptr_t)ptr);
+    localWriter.endArg();
+    localWriter.beginArg(1);
+    localWriter.writeUInt(shadow);
+    localWriter.endArg();
+    localWriter.beginArg(2);
+    localWriter.writeUInt(offset);
+    localWriter.endArg();
+    localWriter.beginArg(3);
+    localWriter.writeBlob(patch, patchSize);
+    localWriter.endArg();
+    localWriter.beginArg(4);
+    localWriter.writeUInt(size);
+    localWriter.endArg();
+    localWriter.endEnter();
+    localWriter.beginLeave(_call);
+    localWriter.endLeave();
+}
+
+
 } /* namespace trace */
 
@@ -32,6 +32,10 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <string>
+#include <vector>
+
 #include "os_thread.hpp"
 #include "os_process.hpp"
 #include "trace_writer.hpp"
@@ -43,6 +47,10 @@ namespace trace {
     extern const FunctionSig malloc_sig;
     extern const FunctionSig free_sig;
     extern const FunctionSig realloc_sig;
+    extern const FunctionSig memcpy_patch_sig;
+
+    struct ThreadBuffer;
+    class RingStream;
 
     /**
      * A specialized Writer class, mean to trace the current process.
@@ -52,6 +60,25 @@ namespace trace {
      * - uses mutexes to allow tracing from multiple threades
      * - flushes the output to ensure the last call is traced in event of
      *   abnormal termination
+     *
+     * When the APITRACE_THREAD_BUFFERS environment variable is set, each
+     * thread serializes its calls into a private buffer, and the mutex is
+     * only taken to publish complete enter/leave records into the trace file
+     * (or when a signature is defined for the first time).
+     *
+     * When the APITRACE_FLIGHT_RECORDER environment variable is set to a
+     * number of frames, calls are kept in an in-memory ring holding the
+     * first and the most recent frames, which is only written to the trace
+     * file on demand (SIGUSR2), when a frame takes longer than
+     * APITRACE_FLIGHT_RECORDER_SPIKE milliseconds, or on exceptions.
+     *
+     * When the APITRACE_FRAMES environment variable is set, to a frame range
+     * or to "signal" (toggled by SIGUSR1), the calls matching
+     * APITRACE_SKIP_CALLS are not recorded outside of the selected frames.
+     *
+     * When the APITRACE_OVERHEAD environment variable is set, the time spent
+     * tracing each function is reported at exit in a JSON file next to the
+     * trace (see trace_overhead.hpp).
      */
     class LocalWriter : public Writer {
     protected:
@@ -77,6 +104,96 @@ namespace trace {
 
         void checkProcessId();
 
+        /**
+         * Acquire the mutex, accounting for the time waited.
+         */
+        void lock(void);
+
+        /**
+         * Name of the trace file, once opened.
+         */
+        std::string m_fileName;
+
+        /**
+         * Whether calls are serialized into per-thread buffers.
+         */
+        bool threadBuffers;
+
+        /**
+         * The underlying trace file stream, when m_file points to the
+         * per-thread buffers.
+         */
+        OutStream *m_stream;
+
+        /**
+         * Incremented whenever a trace file is opened, to invalidate the
+         * signatures cached by each thread.
+         */
+        std::atomic<unsigned> generation;
+
+        /**
+         * Incremented whenever a trace file is opened or a flight recorder
+         * segment started, as the calls recorded before may then not be
+         * replayed before the next ones.  Patches (see fakeMemcpyPatch) only
+         * depend on earlier patches of the same epoch.
+         */
+        std::atomic<unsigned> m_patchEpoch;
+
+        ThreadBuffer *getThreadBuffer(void);
+        void syncThreadBuffer(ThreadBuffer *buffer);
+        unsigned publish(ThreadBuffer *buffer, bool enter);
+
+        bool lookupSig(SigKind kind, size_t index);
+
+        /**
+         * Flight recorder ring, when m_file points to it.
+         */
+        RingStream *m_ring;
+        unsigned m_ringFrames;
+        long long m_spikeThreshold;
+
+        /**
+         * File name of the next ring dump, and number of dumps so far.
+         */
+        std::string m_dumpFileName;
+        unsigned m_dumps;
+
+        Compression m_compression;
+        int m_level;
+
+        /**
+         * The pending frame ending call, and whether it has completed, so
+         * that the ring is cut before the next call.
+         */
+        unsigned m_frameEndCall;
+        bool m_frameEndPending;
+        bool m_cutPending;
+        long long m_frameStartTime;
+
+        void cutFrame(void);
+        void dumpRing(const char *reason);
+
+        /**
+         * Capture-time call filtering.  The filter is consulted before every
+         * call, so per-signature flags are cached by signature id, and the
+         * recording state is read without locking.  The mutex is only taken
+         * at frame ends, to advance the frame.
+         */
+        bool m_callFilter;
+        os::mutex m_filterMutex;
+        std::atomic<unsigned char> *m_filterFlags;
+        std::vector<std::string> m_skipPatterns;
+        bool m_frameSignal;
+        unsigned m_firstFrame;
+        unsigned m_lastFrame;
+        unsigned m_frameNo;
+        std::atomic<bool> m_recording;
+        std::atomic<bool> m_finished;
+
+        void parseCallFilter(void);
+        bool filterCall(const FunctionSig *sig);
+        void updateRecording(void);
+
     public:
         /**
          * Should never called directly -- use localWriter singleton below
@@ -107,7 +224,38 @@ namespace trace {
          */
         void endLeave(void);
 
+        /**
+         * Write out everything traced so far.
+         */
         void flush(void);
+
+        /**
+         * Write out as much as possible when crashing or about to abort.
+         */
+        void flushForCrash(void);
+
+        /**
+         * Whether the given call should not be recorded at all.  The real
+         * function must still be invoked.
+         */
+        inline bool
+        skipCall(const FunctionSig *sig) {
+            return m_callFilter && filterCall(sig);
+        }
+
+        /**
+         * Whether calls are written in the order they are made, which
+         * recording patches requires.
+         */
+        inline bool
+        canPatch(void) const {
+            return !threadBuffers;
+        }
+
+        inline unsigned
+        getPatchEpoch(void) const {
+            return m_patchEpoch;
+        }
     };
 
     /**
@@ -117,5 +265,16 @@ namespace trace {
 
     void fakeMemcpy(const void *ptr, size_t size);
 
+    /**
+     * Like fakeMemcpy, but only record the bytes that changed since the last
+     * patch of the same shadow buffer, made in the given patch epoch.  See
+     * gltrace::Buffer::diff for the patch encoding.  The whole range is
+     * recorded instead when the epoch has changed since.
+     */
+    void fakeMemcpyPatch(const void *ptr, size_t size,
+                         unsigned shadow, size_t offset,
+                         const void *patch, size_t patchSize,
+                         unsigned epoch);
+
 } /* namespace trace */
 
@@ -112,6 +112,11 @@ public:
     }
 
     void visit(Call *call) {
+        unsigned call_no = visitEnter(call);
+        visitLeave(call, call_no);
+    }
+
+    unsigned visitEnter(Call *call) {
         unsigned call_no = writer.beginEnter(call->sig, call->thread_id);
         if (call->backtrace != NULL) {
             writer.beginBacktrace(call->backtrace->size());
@@ -128,6 +133,10 @@ public:
             }
         }
         writer.endEnter();
+        return call_no;
+    }
+
+    void visitLeave(Call *call, unsigned call_no) {
         writer.beginLeave(call_no);
         if (call->ret) {
             writer.beginReturn();
@@ -140,10 +149,31 @@ public:
 
 
 void Writer::writeCall(Call *call) {
+    if (call->decoder && !call->rawRefs) {
+        writeRawCall(call);
+        return;
+    }
+
+    call->decode();
+
     ModelWriter visitor(*this);
     visitor.visit(call);
 }
 
 
+unsigned Writer::writeCallEnter(Call *call) {
+    call->decode();
+
+    ModelWriter visitor(*this);
+    return visitor.visitEnter(call);
+}
+
+
+void Writer::writeCallLeave(Call *call, unsigned call_no) {
+    ModelWriter visitor(*this);
+    visitor.visitLeave(call, call_no);
+}
+
+
 } /* namespace trace */
 
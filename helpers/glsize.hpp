@@ -39,6 +39,14 @@
 
 #include <algorithm>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define GLSIZE_SSE2 1
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define GLSIZE_NEON 1
+#  include <arm_neon.h>
+#endif
+
 #include "os.hpp"
 #include "glimports.hpp"
 
@@ -404,11 +412,169 @@ _glDrawArrays_count(GLint first, GLsizei count)
 
 #define _glDrawArraysEXT_count _glDrawArrays_count
 
+/*
+ * Maximum of an index array, ignoring the primitive restart index, if any.
+ *
+ * These run on every draw with user arrays, so the bulk of the indices is
+ * scanned with SSE2/NEON when available, and the rest with the scalar loop.
+ */
+
+template< class T >
+static inline GLuint
+_glMaxIndex_scalar(const T *p, GLsizei begin, GLsizei count,
+                   bool restart_enabled, GLuint restart_index, GLuint maxindex)
+{
+    for (GLsizei i = begin; i < count; ++i) {
+        GLuint index = p[i];
+        if (restart_enabled && index == restart_index) {
+            continue;
+        }
+        if (index > maxindex) {
+            maxindex = index;
+        }
+    }
+    return maxindex;
+}
+
+static inline GLuint
+_glMaxIndex_ubyte(const GLubyte *p, GLsizei count, bool restart_enabled, GLuint restart_index)
+{
+    GLsizei i = 0;
+    GLuint maxindex = 0;
+    // Restart indices not representable in the type never match
+    bool restart = restart_enabled && restart_index <= 0xff;
+#if defined(GLSIZE_SSE2)
+    __m128i vmax = _mm_setzero_si128();
+    __m128i vrestart = _mm_set1_epi8((char)restart_index);
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (restart) {
+            v = _mm_andnot_si128(_mm_cmpeq_epi8(v, vrestart), v);
+        }
+        vmax = _mm_max_epu8(vmax, v);
+    }
+    GLubyte lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, vmax);
+    maxindex = _glMaxIndex_scalar(lanes, 0, 16, false, 0, maxindex);
+#elif defined(GLSIZE_NEON)
+    uint8x16_t vmax = vdupq_n_u8(0);
+    uint8x16_t vrestart = vdupq_n_u8((GLubyte)restart_index);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        if (restart) {
+            v = vbicq_u8(v, vceqq_u8(v, vrestart));
+        }
+        vmax = vmaxq_u8(vmax, v);
+    }
+    GLubyte lanes[16];
+    vst1q_u8(lanes, vmax);
+    maxindex = _glMaxIndex_scalar(lanes, 0, 16, false, 0, maxindex);
+#endif
+    return _glMaxIndex_scalar(p, i, count, restart, restart_index, maxindex);
+}
+
+static inline GLuint
+_glMaxIndex_ushort(const GLushort *p, GLsizei count, bool restart_enabled, GLuint restart_index)
+{
+    GLsizei i = 0;
+    GLuint maxindex = 0;
+    bool restart = restart_enabled && restart_index <= 0xffff;
+#if defined(GLSIZE_SSE2)
+    // SSE2 only has signed 16-bit max, so flip the sign bit
+    const __m128i vbias = _mm_set1_epi16((short)0x8000);
+    __m128i vmax = vbias;
+    __m128i vrestart = _mm_set1_epi16((short)restart_index);
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (restart) {
+            v = _mm_andnot_si128(_mm_cmpeq_epi16(v, vrestart), v);
+        }
+        vmax = _mm_max_epi16(vmax, _mm_xor_si128(v, vbias));
+    }
+    GLushort lanes[8];
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, vbias));
+    maxindex = _glMaxIndex_scalar(lanes, 0, 8, false, 0, maxindex);
+#elif defined(GLSIZE_NEON)
+    uint16x8_t vmax = vdupq_n_u16(0);
+    uint16x8_t vrestart = vdupq_n_u16((GLushort)restart_index);
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t v = vld1q_u16(p + i);
+        if (restart) {
+            v = vbicq_u16(v, vceqq_u16(v, vrestart));
+        }
+        vmax = vmaxq_u16(vmax, v);
+    }
+    GLushort lanes[8];
+    vst1q_u16(lanes, vmax);
+    maxindex = _glMaxIndex_scalar(lanes, 0, 8, false, 0, maxindex);
+#endif
+    return _glMaxIndex_scalar(p, i, count, restart, restart_index, maxindex);
+}
+
+static inline GLuint
+_glMaxIndex_uint(const GLuint *p, GLsizei count, bool restart_enabled, GLuint restart_index)
+{
+    GLsizei i = 0;
+    GLuint maxindex = 0;
+#if defined(GLSIZE_SSE2)
+    // SSE2 has neither unsigned 32-bit max nor compare, so flip the sign bit
+    const __m128i vbias = _mm_set1_epi32((int)0x80000000);
+    __m128i vmax = vbias;
+    __m128i vrestart = _mm_set1_epi32((int)restart_index);
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (restart_enabled) {
+            v = _mm_andnot_si128(_mm_cmpeq_epi32(v, vrestart), v);
+        }
+        v = _mm_xor_si128(v, vbias);
+        __m128i gt = _mm_cmpgt_epi32(v, vmax);
+        vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+    }
+    GLuint lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, vbias));
+    maxindex = _glMaxIndex_scalar(lanes, 0, 4, false, 0, maxindex);
+#elif defined(GLSIZE_NEON)
+    uint32x4_t vmax = vdupq_n_u32(0);
+    uint32x4_t vrestart = vdupq_n_u32(restart_index);
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t v = vld1q_u32(p + i);
+        if (restart_enabled) {
+            v = vbicq_u32(v, vceqq_u32(v, vrestart));
+        }
+        vmax = vmaxq_u32(vmax, v);
+    }
+    GLuint lanes[4];
+    vst1q_u32(lanes, vmax);
+    maxindex = _glMaxIndex_scalar(lanes, 0, 4, false, 0, maxindex);
+#endif
+    return _glMaxIndex_scalar(p, i, count, restart_enabled, restart_index, maxindex);
+}
+
 /* Forward declaration for definition in gltrace.py */
 void
 _shadow_glGetBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size,
                               GLvoid *data);
 
+/* Forward declarations for definitions in gltrace_indices.cpp */
+namespace gltrace {
+
+void
+getPrimitiveRestart(GLboolean *enabled, GLuint *index);
+
+bool
+lookupMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type,
+               GLboolean restart_enabled, GLuint restart_index, GLuint *maxindex);
+
+unsigned
+sampleWriteClock(void);
+
+void
+cacheMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type,
+              GLboolean restart_enabled, GLuint restart_index, GLuint maxindex,
+              unsigned clock);
+
+}
+
 static inline GLuint
 _glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indices, GLint basevertex)
 {
@@ -418,10 +584,26 @@ _glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indice
         return 0;
     }
 
+    GLboolean restart_enabled = GL_FALSE;
+    GLuint restart_index = 0;
+    gltrace::getPrimitiveRestart(&restart_enabled, &restart_index);
+
+    GLuint maxindex = 0;
+    unsigned clock = 0;
+
+    GLintptr offset = (GLintptr)indices;
     GLint element_array_buffer = _element_array_buffer_binding();
     if (element_array_buffer) {
+        // Static index buffers are usually drawn from over and over
+        if (gltrace::lookupMaxIndex(element_array_buffer, offset, count, type,
+                                    restart_enabled, restart_index, &maxindex)) {
+            return maxindex + basevertex + 1;
+        }
+
+        // Before reading, so that any write from now on is seen as newer
+        clock = gltrace::sampleWriteClock();
+
         // Read indices from index buffer object
-        GLintptr offset = (GLintptr)indices;
         GLsizeiptr size = count*_gl_type_size(type);
         temp = malloc(size);
         if (!temp) {
@@ -436,56 +618,19 @@ _glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indice
         }
     }
 
-    GLuint maxindex = 0;
-
-    GLboolean restart_enabled = _glIsEnabled(GL_PRIMITIVE_RESTART);
-    while ((_glGetError() == GL_INVALID_ENUM))
-        ;
-
-    GLuint restart_index = 0;
-    if (restart_enabled) {
-        restart_index = (GLuint)_glGetInteger(GL_PRIMITIVE_RESTART_INDEX);
-    }
-
-    GLsizei i;
     if (type == GL_UNSIGNED_BYTE) {
-        const GLubyte *p = (const GLubyte *)indices;
-        for (i = 0; i < count; ++i) {
-            GLuint index = p[i];
-            if (restart_enabled && index == restart_index) {
-                continue;
-            }
-            if (index > maxindex) {
-                maxindex = index;
-            }
-        }
+        maxindex = _glMaxIndex_ubyte((const GLubyte *)indices, count, restart_enabled, restart_index);
     } else if (type == GL_UNSIGNED_SHORT) {
-        const GLushort *p = (const GLushort *)indices;
-        for (i = 0; i < count; ++i) {
-            GLuint index = p[i];
-            if (restart_enabled && index == restart_index) {
-                continue;
-            }
-            if (index > maxindex) {
-                maxindex = index;
-            }
-        }
+        maxindex = _glMaxIndex_ushort((const GLushort *)indices, count, restart_enabled, restart_index);
     } else if (type == GL_UNSIGNED_INT) {
-        const GLuint *p = (const GLuint *)indices;
-        for (i = 0; i < count; ++i) {
-            GLuint index = p[i];
-            if (restart_enabled && index == restart_index) {
-                continue;
-            }
-            if (index > maxindex) {
-                maxindex = index;
-            }
-        }
+        maxindex = _glMaxIndex_uint((const GLuint *)indices, count, restart_enabled, restart_index);
     } else {
         os::log("apitrace: warning: %s: unknown GLenum 0x%04X\n", __FUNCTION__, type);
     }
 
     if (element_array_buffer) {
+        gltrace::cacheMaxIndex(element_array_buffer, offset, count, type,
+                               restart_enabled, restart_index, maxindex, clock);
         free(temp);
     }
 
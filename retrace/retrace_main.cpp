@@ -384,7 +384,7 @@ public:
             assert(call->thread_id == leg);
 
             retraceCall(call);
-            delete call;
+            parser->recycle(call);
             call = parser->parse_call();
 
         } while (call && call->thread_id == leg);
@@ -558,7 +558,7 @@ mainLoop() {
         trace::Call *call;
         while ((call = parser->parse_call())) {
             retraceCall(call);
-            delete call;
+            parser->recycle(call);
         }
     } else {
         RelayRace race;
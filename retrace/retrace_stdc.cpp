@@ -29,6 +29,8 @@
 
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <vector>
 
 #include "retrace.hpp"
 #include "retrace_swizzle.hpp"
@@ -82,8 +84,76 @@ static void retrace_memcpy(trace::Call &call) {
 }
 
 
+/*
+ * Shadows of the ranges recorded with memcpy_patch, mirroring those kept by
+ * the tracer (see gltrace::Buffer::diff).
+ */
+static std::map<unsigned, std::vector<unsigned char> > shadows;
+
+
+static inline size_t
+readUInt32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((size_t)p[3] << 24);
+}
+
+
+static void retrace_memcpy_patch(trace::Call &call) {
+    void * destPtr;
+    size_t destLen;
+    retrace::toRange(call.arg(0), destPtr, destLen);
+
+    unsigned shadowId = call.arg(1).toUInt();
+    size_t offset = call.arg(2).toUInt();
+
+    const trace::Blob *patch = call.arg(3).toBlob();
+
+    size_t n = call.arg(4).toUInt();
+
+    if (!n) {
+        return;
+    }
+
+    std::vector<unsigned char> &shadow = shadows[shadowId];
+    if (shadow.size() < offset + n) {
+        shadow.resize(offset + n);
+    }
+
+    // Apply the changed runs
+    if (patch) {
+        const unsigned char *p = (const unsigned char *)patch->buf;
+        const unsigned char *end = p + patch->size;
+        size_t pos = offset;
+        while (p + 8 <= end) {
+            size_t skip = readUInt32(p);
+            size_t len = readUInt32(p + 4);
+            p += 8;
+            pos += skip;
+            if (len > (size_t)(end - p) || pos + len > offset + n) {
+                retrace::warning(call) << "malformed patch\n";
+                break;
+            }
+            memcpy(&shadow[pos], p, len);
+            p += len;
+            pos += len;
+        }
+    }
+
+    if (!destPtr) {
+        return;
+    }
+
+    if (n > destLen) {
+        retrace::warning(call) << "dest buffer overflow of " << n - destLen << " bytes\n";
+        n = destLen;
+    }
+
+    memcpy(destPtr, &shadow[offset], n);
+}
+
+
 const retrace::Entry retrace::stdc_callbacks[] = {
     {"malloc", &retrace_malloc},
     {"memcpy", &retrace_memcpy},
+    {"memcpy_patch", &retrace_memcpy_patch},
     {NULL, NULL}
 };
@@ -29,11 +29,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "os_thread.hpp"
 
 #include "glimports.hpp"
 
 #include "glprofile.hpp"
 
+#include "trace_overhead.hpp"
+
 
 namespace gltrace {
 
@@ -41,48 +49,109 @@ namespace gltrace {
 /**
  * OpenGL ES buffers cannot be read. This class is used to track index buffer
  * contents.
+ *
+ * Contents are kept in fixed size pages, only allocated once written (bytes
+ * never written read as zero), and shared between buffers on copies until
+ * either is written to.
  */
 class Buffer {
 public:
     GLsizeiptr size;
-    GLvoid *data;
 
     Buffer() :
-        size(0),
-        data(0)
+        size(0)
     {}
 
-    ~Buffer() {
-        free(data);
-    }
+    void
+    bufferData(GLsizeiptr new_size, const void *new_data);
 
     void
-    bufferData(GLsizeiptr new_size, const void *new_data) {
-        if (new_size < 0) {
-            new_size = 0;
-        }
-        size = new_size;
-        data = realloc(data, new_size);
-        if (new_size && new_data) {
-            memcpy(data, new_data, size);
-        }
-    }
+    bufferSubData(GLsizeiptr offset, GLsizeiptr length, const void *new_data);
 
     void
-    bufferSubData(GLsizeiptr offset, GLsizeiptr length, const void *new_data) {
-        if (offset >= 0 && offset < size && length > 0 && offset + length <= size && new_data) {
-            memcpy((GLubyte *)data + offset, new_data, length);
-        }
-    }
+    getSubData(GLsizeiptr offset, GLsizeiptr length, void *out_data) const;
+
+    void
+    copySubData(const Buffer &src, GLsizeiptr read_offset, GLsizeiptr write_offset, GLsizeiptr length);
+
+    /**
+     * Update the contents, and append to `patch` the byte runs that changed,
+     * each encoded as the number of unchanged bytes skipped since the previous
+     * run and the run length (both 32-bit little-endian), followed by the run
+     * bytes.  Bytes never written before are assumed to be zero.
+     */
+    void
+    diff(GLsizeiptr offset, GLsizeiptr length, const void *new_data, std::string &patch);
+
+    static const GLsizeiptr pageSize = 4096;
+
+private:
+    struct Page {
+        GLubyte data[pageSize];
+    };
+
+    std::vector< std::shared_ptr<Page> > pages;
+
+    void
+    resize(GLsizeiptr new_size);
+
+    GLubyte *
+    writablePage(size_t index);
 
     void
-    getSubData(GLsizeiptr offset, GLsizeiptr length, void *out_data) {
-        if (offset >= 0 && offset < size && length > 0 && offset + length <= size && out_data) {
-            memcpy(out_data, (GLubyte *)data + offset, length);
-        }
+    write(GLsizeiptr offset, GLsizeiptr length, const void *data);
+
+    void
+    read(GLsizeiptr offset, GLsizeiptr length, void *data) const;
+
+    void
+    diffPage(const GLubyte *src, size_t index, GLsizeiptr page_offset, GLsizeiptr length,
+             GLsizeiptr base, GLsizeiptr &last, std::string &patch);
+
+    static void
+    appendUInt32(std::string &s, GLsizeiptr value);
+};
+
+/**
+ * State shared by the contexts of a share group, which may be current in
+ * different threads.
+ */
+class SharedState {
+public:
+    os::mutex mutex;
+
+    // Shadows of the buffers used as element array buffers
+    std::unordered_map <GLuint, Buffer> buffers;
+};
+
+/**
+ * Range of an element array buffer, as drawn from.
+ */
+struct IndexRange {
+    GLuint buffer;
+    GLintptr offset;
+    GLsizei count;
+    GLenum type;
+    GLuint restartIndex;
+    GLboolean restartEnabled;
+
+    bool
+    operator < (const IndexRange &other) const {
+        if (buffer != other.buffer) return buffer < other.buffer;
+        if (offset != other.offset) return offset < other.offset;
+        if (count != other.count) return count < other.count;
+        if (type != other.type) return type < other.type;
+        if (restartEnabled != other.restartEnabled) return restartEnabled < other.restartEnabled;
+        return restartIndex < other.restartIndex;
     }
 };
 
+struct MaxIndex {
+    GLuint value;
+    // Buffer write clock when computed, see gltrace_indices.cpp
+    unsigned clock;
+};
+
 class Context {
 public:
     glprofile::Profile profile;
@@ -94,8 +163,19 @@ public:
     // Whether it has been bound before
     bool bound;
 
-    // TODO: This will fail for buffers shared by multiple contexts.
-    std::map <GLuint, Buffer> buffers;
+    // Objects shared with other contexts
+    std::shared_ptr<SharedState> shared;
+
+    // GL_PRIMITIVE_RESTART state, -1 while unknown
+    GLint primitiveRestart;
+    GLint64 primitiveRestartIndex;
+
+    // Draw framebuffer binding and whether transform feedback is active
+    GLuint drawFramebuffer;
+    bool transformFeedbackActive;
+
+    // Maximum indices of element array buffer ranges drawn with user arrays
+    std::map <IndexRange, MaxIndex> maxIndices;
 
     Context(void) :
         profile(glprofile::API_GL, 1, 0),
@@ -103,7 +183,12 @@ public:
         user_arrays_nv(false),
         userArraysOnBegin(false),
         retain_count(0),
-        bound(false)
+        bound(false),
+        shared(new SharedState),
+        primitiveRestart(-1),
+        primitiveRestartIndex(-1),
+        drawFramebuffer(0),
+        transformFeedbackActive(false)
     { }
 
     inline bool
@@ -114,7 +199,7 @@ public:
 };
 
 void
-createContext(uintptr_t context_id);
+createContext(uintptr_t context_id, uintptr_t shared_context_id = 0);
 
 void
 retainContext(uintptr_t context_id);
@@ -141,6 +226,101 @@ const GLubyte *
 _glGetStringi_override(GLenum name, GLuint index);
 
 
+/*
+ * Dirty page tracking of persistent/coherent buffer mappings, whose contents
+ * may change at any time without a glFlushMappedBufferRange or glUnmapBuffer
+ * call to hook into.  See gltrace_mapping.cpp.
+ */
+
+bool
+trackMapping(GLuint buffer, GLintptr offset, void *map, GLsizeiptr length);
+
+void
+untrackBuffer(GLuint buffer);
+
+GLuint
+getMappedBufferBinding(GLenum target);
+
+/*
+ * Record the contents of a mapped range, at the given offset of the buffer,
+ * either as a fake memcpy or, when APITRACE_PATCH_MAPPINGS is set, as a patch
+ * against the contents last recorded for it.
+ */
+
+bool
+patchMappings(void);
+
+void
+emitMappedRange(GLuint buffer, GLintptr offset, const void *ptr, GLsizeiptr length);
+
+extern volatile unsigned trackedMappings;
+
+void
+_flushMappings(void);
+
+/**
+ * Emit fake memcpys for the pages written since the last flush.  Called
+ * whenever the GL may consume mapped memory (draws, fences, etc).
+ */
+inline void
+flushMappings(void)
+{
+    if (trackedMappings) {
+        _flushMappings();
+    }
+}
+
+/*
+ * Shadowing of OpenGL ES element array buffers (see gltrace_buffers.cpp).
+ * All are no-ops on other APIs.
+ */
+
+void
+shadowBufferData(GLenum target, GLsizeiptr size, const void *data);
+
+void
+shadowBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data);
+
+// Offset relative to the start of the current mapping of the buffer
+void
+shadowMappedRange(GLenum target, GLintptr offset, GLsizeiptr size, const void *data);
+
+void
+shadowCopyBufferSubData(GLenum read_target, GLenum write_target,
+                        GLintptr read_offset, GLintptr write_offset, GLsizeiptr size);
+
+void
+shadowDeleteBuffers(GLsizei n, const GLuint *buffers);
+
+/**
+ * Read the contents of the buffer bound to target, returning false if it
+ * is not shadowed, i.e., not an OpenGL ES context.
+ */
+bool
+getShadowBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, void *data);
+
+
+/*
+ * Invalidation of the memoized maximum indices (see gltrace_indices.cpp),
+ * only needed once some were memoized.
+ */
+
+extern volatile bool maxIndicesCached;
+
+void
+invalidateBufferContents(GLuint buffer);
+
+void
+invalidateAllBufferContents(void);
+
+void
+beginBufferMapping(GLuint buffer);
+
+// Also for calls that implicitly unmap (glBufferData, glDeleteBuffers)
+void
+endBufferMapping(GLuint buffer);
+
+
 } /* namespace gltrace */
 
 
@@ -330,45 +330,36 @@ class GlTracer(Tracer):
         print 'void _shadow_glGetBufferSubData(GLenum target, GLintptr offset,'
         print '                                GLsizeiptr size, GLvoid *data)'
         print '{'
-        print '    gltrace::Context *ctx = gltrace::getContext();'
-        print '    if (!ctx->needsShadowBuffers() || target != GL_ELEMENT_ARRAY_BUFFER) {'
+        print '    if (!gltrace::getShadowBufferSubData(target, offset, size, data)) {'
         print '        _glGetBufferSubData(target, offset, size, data);'
-        print '        return;'
-        print '    }'
-        print
-        print '    GLint buffer_binding = _glGetInteger(GL_ELEMENT_ARRAY_BUFFER_BINDING);'
-        print '    if (buffer_binding > 0) {'
-        print '        gltrace::Buffer & buf = ctx->buffers[buffer_binding];'
-        print '        buf.getSubData(offset, size, data);'
         print '    }'
         print '}'
 
-    def shadowBufferMethod(self, method):
-        # Emit code to fetch the shadow buffer, and invoke a method
-        print '    gltrace::Context *ctx = gltrace::getContext();'
-        print '    if (ctx->needsShadowBuffers() && target == GL_ELEMENT_ARRAY_BUFFER) {'
-        print '        GLint buffer_binding = _glGetInteger(GL_ELEMENT_ARRAY_BUFFER_BINDING);'
-        print '        if (buffer_binding > 0) {'
-        print '            gltrace::Buffer & buf = ctx->buffers[buffer_binding];'
-        print '            buf.' + method + ';'
+    def emit_mapped_memcpy(self, buffer, get_map_offset, offset, length):
+        # Emit a fake memcpy of a flushed range, or a patch against the
+        # contents last recorded for the same buffer range
+        print '        if (gltrace::patchMappings()) {'
+        print '            GLint map_offset = 0;'
+        if get_map_offset is not None:
+            print '            %s;' % get_map_offset
+        print '            gltrace::emitMappedRange(%s, map_offset + %s, (const char *)map + %s, %s);' % (buffer, offset, offset, length)
+        print '        } else {'
+        print '            trace::fakeMemcpy((const char *)map + %s, %s);' % (offset, length)
         print '        }'
-        print '    }'
-        print
 
     def shadowBufferProlog(self, function):
+        # Update the OpenGL ES shadow buffers (see gltrace_buffers.cpp)
         if function.name == 'glBufferData':
-            self.shadowBufferMethod('bufferData(size, data)')
+            print '    gltrace::shadowBufferData(target, size, data);'
 
         if function.name == 'glBufferSubData':
-            self.shadowBufferMethod('bufferSubData(offset, size, data)')
+            print '    gltrace::shadowBufferSubData(target, offset, size, data);'
+
+        if function.name == 'glCopyBufferSubData':
+            print '    gltrace::shadowCopyBufferSubData(readTarget, writeTarget, readOffset, writeOffset, size);'
 
         if function.name == 'glDeleteBuffers':
-            print '    gltrace::Context *ctx = gltrace::getContext();'
-            print '    if (ctx->needsShadowBuffers()) {'
-            print '        for (GLsizei i = 0; i < n; i++) {'
-            print '            ctx->buffers.erase(buffer[i]);'
-            print '        }'
-            print '    }'
+            print '    gltrace::shadowDeleteBuffers(n, buffer);'
 
     array_pointer_function_names = set((
         "glVertexPointer",
@@ -422,7 +413,51 @@ class GlTracer(Tracer):
          'GL_T4F_C4F_N3F_V4F',
     ]
 
+    def isFunctionFilterable(self, function):
+        # GL calls take no wrapped objects
+        return True
+
+    # Entrypoints that merely render into the draw framebuffer, which may be
+    # left out outside of the APITRACE_FRAMES range
+    render_function_regex = re.compile(r'^gl(' + r'|'.join([
+        r'(Multi)?(Mode)?Draw(Range)?(Arrays|Elements|ElementArray|TransformFeedback)[0-9A-Za-z]*',
+        r'DrawPixels',
+        r'DrawTex[0-9A-Za-z]+',
+        r'Begin',
+        r'End',
+        r'Vertex[234][0-9A-Za-z]+',
+        r'ArrayElement[A-Z]*',
+        r'Rect[0-9A-Za-z]+',
+        r'Eval(Mesh|Point)[0-9A-Za-z]+',
+        r'Clear',
+        r'ClearBuffer(fv|iv|uiv|fi)',
+        r'BlitFramebuffer[A-Z]*',
+    ]) + r')$')
+
     def traceFunctionImplBody(self, function):
+        # Only leave out rendering that can't be observed later, i.e., into
+        # the default framebuffer, without transform feedback, and without
+        # reading back into a pixel pack buffer
+        if self.render_function_regex.match(function.name):
+            print '    if (_skip) {'
+            print '        gltrace::Context *_ctx = gltrace::getContext();'
+            print '        if (_ctx->drawFramebuffer || _ctx->transformFeedbackActive) {'
+            print '            _skip = false;'
+            print '        }'
+            print '    }'
+        if re.match(r'^glReadn?Pixels[A-Z]*$', function.name):
+            print '    if (_skip) {'
+            print '        gltrace::Context *_ctx = gltrace::getContext();'
+            print '        GLint _pack_buffer = 0;'
+            print '        if (_ctx->profile.desktop() ||'
+            print '            _ctx->profile.versionGreaterOrEqual(glprofile::API_GLES, 3, 0)) {'
+            print '            _glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &_pack_buffer);'
+            print '        }'
+            print '        if (_pack_buffer) {'
+            print '            _skip = false;'
+            print '        }'
+            print '    }'
+
         # Defer tracing of user array pointers...
         if function.name in self.array_pointer_function_names:
             print '    GLint _array_buffer = _glGetInteger(GL_ARRAY_BUFFER_BINDING);'
@@ -503,7 +538,7 @@ class GlTracer(Tracer):
 
         # ... to the draw calls
         if self.draw_function_regex.match(function.name):
-            print '    if (_need_user_arrays()) {'
+            print '    if (!_skip && _need_user_arrays()) {'
             if 'Indirect' in function.name:
                 print r'        os::log("apitrace: warning: %s: indirect user arrays not supported\n");' % (function.name,)
             else:
@@ -580,6 +615,7 @@ class GlTracer(Tracer):
             print '            }'
             print '            if (flush && length > 0) {'
             self.emit_memcpy('map', 'length')
+            print '                gltrace::shadowMappedRange(target, 0, length, map);'
             print '            }'
             print '        }'
             print '    }'
@@ -609,7 +645,7 @@ class GlTracer(Tracer):
             print '            }'
             print '            if (flush && length > 0) {'
             self.emit_memcpy('map', 'length')
-            self.shadowBufferMethod('bufferSubData(offset, length, map)')
+            print '                gltrace::shadowBufferSubData(target, offset, length, map);'
             print '            }'
             print '        }'
             print '    }'
@@ -643,40 +679,128 @@ class GlTracer(Tracer):
             print '    GLvoid *map = NULL;'
             print '    _glGetBufferPointerv(target, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapped_memcpy('gltrace::getMappedBufferBinding(target)',
+                                    '_glGetBufferParameteriv(target, GL_BUFFER_MAP_OFFSET, &map_offset)',
+                                    'offset', 'length')
+            print '        gltrace::shadowMappedRange(target, offset, length, (const char *)map + offset);'
             print '    }'
         if function.name == 'glFlushMappedBufferRangeEXT':
             print '    GLvoid *map = NULL;'
             print '    _glGetBufferPointervOES(target, GL_BUFFER_MAP_POINTER_OES, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapped_memcpy('gltrace::getMappedBufferBinding(target)',
+                                    '_glGetBufferParameteriv(target, GL_BUFFER_MAP_OFFSET, &map_offset)',
+                                    'offset', 'length')
+            print '        gltrace::shadowMappedRange(target, offset, length, (const char *)map + offset);'
             print '    }'
         if function.name == 'glFlushMappedBufferRangeAPPLE':
+            # APPLE_flush_buffer_range maps always the whole buffer
             print '    GLvoid *map = NULL;'
             print '    _glGetBufferPointerv(target, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && size > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'size')
+            self.emit_mapped_memcpy('gltrace::getMappedBufferBinding(target)', None,
+                                    'offset', 'size')
             print '    }'
         if function.name == 'glFlushMappedNamedBufferRange':
             print '    GLvoid *map = NULL;'
             print '    _glGetNamedBufferPointerv(buffer, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapped_memcpy('buffer',
+                                    '_glGetNamedBufferParameteriv(buffer, GL_BUFFER_MAP_OFFSET, &map_offset)',
+                                    'offset', 'length')
             print '    }'
         if function.name == 'glFlushMappedNamedBufferRangeEXT':
             print '    GLvoid *map = NULL;'
             print '    _glGetNamedBufferPointervEXT(buffer, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapped_memcpy('buffer',
+                                    '_glGetNamedBufferParameterivEXT(buffer, GL_BUFFER_MAP_OFFSET, &map_offset)',
+                                    'offset', 'length')
             print '    }'
 
-        # FIXME: We don't support coherent/pinned memory mappings
+        # Coherent/persistent mappings are tracked with dirty pages (see
+        # gltrace_mapping.cpp), written back whenever the GL may read them
+        if function.name in self.mapping_flush_function_names or \
+           self.draw_function_regex.match(function.name) or \
+           self.unpack_function_regex.match(function.name):
+            print r'    gltrace::flushMappings();'
+        if function.name in ('glUnmapBuffer', 'glUnmapBufferARB', 'glUnmapBufferOES'):
+            print r'    if (gltrace::trackedMappings) {'
+            print r'        gltrace::untrackBuffer(gltrace::getMappedBufferBinding(target));'
+            print r'    }'
+        if function.name in ('glUnmapNamedBuffer', 'glUnmapNamedBufferEXT'):
+            print r'    gltrace::untrackBuffer(buffer);'
+        if function.name in ('glDeleteBuffers', 'glDeleteBuffersARB'):
+            print r'    if (gltrace::trackedMappings) {'
+            print r'        for (GLsizei i = 0; i < n; i++) {'
+            print r'            gltrace::untrackBuffer(%s[i]);' % function.args[1].name
+            print r'        }'
+            print r'    }'
+
+        # Invalidate the maximum indices memoized by _glDrawElementsBaseVertex_count
+        if function.name in self.buffer_write_function_names:
+            buffer = self.buffer_write_function_names[function.name]
+            if buffer in ('target', 'writeTarget'):
+                buffer = 'gltrace::getMappedBufferBinding(%s)' % buffer
+            if function.name in self.buffer_map_function_names:
+                method = 'beginBufferMapping'
+            elif function.name in self.buffer_reset_function_names:
+                method = 'endBufferMapping'
+            else:
+                method = 'invalidateBufferContents'
+            print r'    if (gltrace::maxIndicesCached) {'
+            print r'        gltrace::%s(%s);' % (method, buffer)
+            print r'    }'
+        if function.name in ('glDeleteBuffers', 'glDeleteBuffersARB'):
+            print r'    if (gltrace::maxIndicesCached) {'
+            print r'        for (GLsizei i = 0; i < n; i++) {'
+            print r'            gltrace::endBufferMapping(%s[i]);' % function.args[1].name
+            print r'        }'
+            print r'    }'
+        if function.name in self.gl_buffer_write_function_names or \
+           self.pack_function_regex.match(function.name):
+            print r'    if (gltrace::maxIndicesCached) {'
+            print r'        gltrace::invalidateAllBufferContents();'
+            print r'    }'
+
+        # Shadow GL_PRIMITIVE_RESTART state, also needed for every indexed draw
+        if function.name in ('glEnable', 'glDisable'):
+            print r'    if (cap == GL_PRIMITIVE_RESTART) {'
+            print r'        gltrace::getContext()->primitiveRestart = %u;' % (function.name == 'glEnable')
+            print r'    }'
+        if function.name == 'glPrimitiveRestartIndex':
+            print r'    gltrace::getContext()->primitiveRestartIndex = index;'
+        if function.name == 'glPopAttrib':
+            print r'    gltrace::getContext()->primitiveRestart = -1;'
+
+        # Shadow the draw framebuffer and transform feedback state, which
+        # decide whether rendering may be left out (see above)
+        if function.name in ('glBindFramebuffer', 'glBindFramebufferEXT', 'glBindFramebufferOES'):
+            print r'    if (target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER) {'
+            print r'        gltrace::getContext()->drawFramebuffer = framebuffer;'
+            print r'    }'
+        if function.name in ('glDeleteFramebuffers', 'glDeleteFramebuffersEXT', 'glDeleteFramebuffersOES'):
+            print r'    {'
+            print r'        gltrace::Context *_ctx = gltrace::getContext();'
+            print r'        for (GLsizei i = 0; i < n; i++) {'
+            print r'            if (framebuffers[i] == _ctx->drawFramebuffer) {'
+            print r'                _ctx->drawFramebuffer = 0;'
+            print r'            }'
+            print r'        }'
+            print r'    }'
+        if function.name in ('glBeginTransformFeedback', 'glBeginTransformFeedbackEXT', 'glBeginTransformFeedbackNV'):
+            print r'    gltrace::getContext()->transformFeedbackActive = true;'
+        if function.name in ('glEndTransformFeedback', 'glEndTransformFeedbackEXT', 'glEndTransformFeedbackNV'):
+            print r'    gltrace::getContext()->transformFeedbackActive = false;'
+
+        # FIXME: We don't support pinned memory mappings
         if function.name in ('glBufferStorage', 'glNamedBufferStorage', 'glNamedBufferStorageEXT'):
             print r'    if (!(flags & GL_MAP_PERSISTENT_BIT)) {'
             print r'        os::log("apitrace: warning: %s: MAP_NOTIFY_EXPLICIT_BIT_VMWX set w/o MAP_PERSISTENT_BIT\n", __FUNCTION__);'
             print r'    }'
             print r'    flags &= ~GL_MAP_NOTIFY_EXPLICIT_BIT_VMWX;'
         if function.name in ('glMapBufferRange', 'glMapBufferRangeEXT', 'glMapNamedBufferRange', 'glMapNamedBufferRangeEXT'):
+            print r'    bool _track_mapping = false;'
             print r'    if (access & GL_MAP_NOTIFY_EXPLICIT_BIT_VMWX) {'
             print r'        if (!(access & GL_MAP_PERSISTENT_BIT)) {'
             print r'            os::log("apitrace: warning: %s: MAP_NOTIFY_EXPLICIT_BIT_VMWX set w/o MAP_PERSISTENT_BIT\n", __FUNCTION__);'
@@ -685,11 +809,11 @@ class GlTracer(Tracer):
             print r'            os::log("apitrace: warning: %s: MAP_NOTIFY_EXPLICIT_BIT_VMWX set w/ MAP_FLUSH_EXPLICIT_BIT\n", __FUNCTION__);'
             print r'        }'
             print r'        access &= ~GL_MAP_NOTIFY_EXPLICIT_BIT_VMWX;'
-            print r'    } else if (access & GL_MAP_COHERENT_BIT) {'
-            print r'        os::log("apitrace: warning: %s: MAP_COHERENT_BIT unsupported (https://github.com/apitrace/apitrace/issues/232)\n", __FUNCTION__);'
-            print r'    } else if ((access & GL_MAP_PERSISTENT_BIT) &&'
-            print r'               !(access & GL_MAP_FLUSH_EXPLICIT_BIT)) {'
-            print r'        os::log("apitrace: warning: %s: MAP_PERSISTENT_BIT w/o FLUSH_EXPLICIT_BIT unsupported (https://github.com/apitrace/apitrace/issues/232)\n", __FUNCTION__);'
+            print r'    } else if ((access & GL_MAP_WRITE_BIT) &&'
+            print r'               ((access & GL_MAP_COHERENT_BIT) ||'
+            print r'                ((access & GL_MAP_PERSISTENT_BIT) &&'
+            print r'                 !(access & GL_MAP_FLUSH_EXPLICIT_BIT)))) {'
+            print r'        _track_mapping = true;'
             print r'    }'
         if function.name in ('glBufferData', 'glBufferDataARB'):
             print r'    if (target == GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD) {'
@@ -748,6 +872,116 @@ class GlTracer(Tracer):
 
         Tracer.traceFunctionImplBody(self, function)
 
+        # Start tracking coherent/persistent mappings once the call has been
+        # recorded, so that the fake memcpys follow it
+        if function.name in ('glMapBufferRange', 'glMapBufferRangeEXT', 'glMapNamedBufferRange', 'glMapNamedBufferRangeEXT'):
+            if function.name.startswith('glMapNamed'):
+                buffer = 'buffer'
+            else:
+                buffer = 'gltrace::getMappedBufferBinding(target)'
+            print r'    if (_track_mapping && _result &&'
+            print r'        !gltrace::trackMapping(%s, offset, _result, length)) {' % buffer
+            print r'        os::log("apitrace: warning: %s: MAP_COHERENT_BIT/MAP_PERSISTENT_BIT w/o FLUSH_EXPLICIT_BIT unsupported (https://github.com/apitrace/apitrace/issues/232)\n", __FUNCTION__);'
+            print r'    }'
+
+    # Entrypoints at which the GL may read from mapped buffer memory
+    mapping_flush_function_names = set((
+        'glFlush',
+        'glFinish',
+        'glFenceSync',
+        'glMemoryBarrier',
+        'glMemoryBarrierByRegion',
+        'glDispatchCompute',
+        'glDispatchComputeIndirect',
+        'glCopyBufferSubData',
+        'glCopyNamedBufferSubData',
+    ))
+
+    # Entrypoints that may write to a buffer, and the expression for it
+    buffer_write_function_names = {
+        'glBufferData': 'target',
+        'glBufferDataARB': 'target',
+        'glBufferSubData': 'target',
+        'glBufferSubDataARB': 'target',
+        'glBufferStorage': 'target',
+        'glClearBufferData': 'target',
+        'glClearBufferSubData': 'target',
+        'glCopyBufferSubData': 'writeTarget',
+        'glMapBuffer': 'target',
+        'glMapBufferARB': 'target',
+        'glMapBufferOES': 'target',
+        'glMapBufferRange': 'target',
+        'glMapBufferRangeEXT': 'target',
+        'glUnmapBuffer': 'target',
+        'glUnmapBufferARB': 'target',
+        'glUnmapBufferOES': 'target',
+        'glNamedBufferData': 'buffer',
+        'glNamedBufferDataEXT': 'buffer',
+        'glNamedBufferSubData': 'buffer',
+        'glNamedBufferSubDataEXT': 'buffer',
+        'glNamedBufferStorage': 'buffer',
+        'glNamedBufferStorageEXT': 'buffer',
+        'glClearNamedBufferData': 'buffer',
+        'glClearNamedBufferDataEXT': 'buffer',
+        'glClearNamedBufferSubData': 'buffer',
+        'glClearNamedBufferSubDataEXT': 'buffer',
+        'glCopyNamedBufferSubData': 'writeBuffer',
+        'glNamedCopyBufferSubDataEXT': 'writeBuffer',
+        'glInvalidateBufferData': 'buffer',
+        'glInvalidateBufferSubData': 'buffer',
+        'glMapNamedBuffer': 'buffer',
+        'glMapNamedBufferEXT': 'buffer',
+        'glMapNamedBufferRange': 'buffer',
+        'glMapNamedBufferRangeEXT': 'buffer',
+        'glUnmapNamedBuffer': 'buffer',
+        'glUnmapNamedBufferEXT': 'buffer',
+    }
+
+    buffer_map_function_names = set((
+        'glMapBuffer',
+        'glMapBufferARB',
+        'glMapBufferOES',
+        'glMapBufferRange',
+        'glMapBufferRangeEXT',
+        'glMapNamedBuffer',
+        'glMapNamedBufferEXT',
+        'glMapNamedBufferRange',
+        'glMapNamedBufferRangeEXT',
+    ))
+
+    # Entrypoints that unmap the buffer, implicitly or not
+    buffer_reset_function_names = set((
+        'glBufferData',
+        'glBufferDataARB',
+        'glNamedBufferData',
+        'glNamedBufferDataEXT',
+        'glUnmapBuffer',
+        'glUnmapBufferARB',
+        'glUnmapBufferOES',
+        'glUnmapNamedBuffer',
+        'glUnmapNamedBufferEXT',
+    ))
+
+    # Entrypoints after which buffers may hold data written by the GL itself
+    gl_buffer_write_function_names = set((
+        'glEndTransformFeedback',
+        'glEndTransformFeedbackEXT',
+        'glEndTransformFeedbackNV',
+        'glPauseTransformFeedback',
+        'glMemoryBarrier',
+        'glMemoryBarrierByRegion',
+        'glMemoryBarrierEXT',
+        'glDispatchCompute',
+        'glDispatchComputeIndirect',
+    ))
+
+    # Entrypoints that may write into the bound pixel pack or query buffer
+    pack_function_regex = re.compile(r'^gl(' + r'|'.join([
+        r'Readn?Pixels(ARB|EXT|KHR)?',
+        r'Getn?(Compressed)?Tex(ture)?(Sub)?Image(ARB|EXT)?',
+        r'GetQuery(Buffer)?Object(i|ui|i64|ui64)v(ARB|EXT)?',
+    ]) + r')$')
+
     # These entrypoints are only expected to be implemented by tools;
     # drivers will probably not implement them.
     marker_functions = [
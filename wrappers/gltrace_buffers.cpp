@@ -0,0 +1,459 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Shadowing of OpenGL ES element array buffers.
+ *
+ * OpenGL ES has no glGetBufferSubData, yet the tracer needs to read the
+ * indices to know how many vertices to record when drawing with user arrays.
+ * So buffers uploaded through GL_ELEMENT_ARRAY_BUFFER are shadowed, per share
+ * group, and so are later uploads to them through other targets.  Any other
+ * buffer drawn from is only materialized when first read, which is possible
+ * from OpenGL ES 3.0 onwards by mapping it for reading.
+ */
+
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "glproc.hpp"
+#include "gltrace.hpp"
+#include "trace_overhead.hpp"
+
+
+namespace gltrace {
+
+
+static const GLubyte zeroPage[Buffer::pageSize] = {0};
+
+
+void
+Buffer::resize(GLsizeiptr new_size)
+{
+    size = new_size;
+    pages.resize((new_size + pageSize - 1) / pageSize);
+}
+
+
+/*
+ * Get a page for writing, allocating it, or copying it when shared.
+ */
+GLubyte *
+Buffer::writablePage(size_t index)
+{
+    std::shared_ptr<Page> &page = pages[index];
+    if (!page) {
+        page = std::make_shared<Page>();
+    } else if (page.use_count() > 1) {
+        page = std::make_shared<Page>(*page);
+    }
+    return page->data;
+}
+
+
+void
+Buffer::write(GLsizeiptr offset, GLsizeiptr length, const void *data)
+{
+    const GLubyte *src = static_cast<const GLubyte *>(data);
+    while (length > 0) {
+        size_t index = offset / pageSize;
+        GLsizeiptr page_offset = offset % pageSize;
+        GLsizeiptr n = std::min(length, pageSize - page_offset);
+        memcpy(writablePage(index) + page_offset, src, n);
+        offset += n;
+        src += n;
+        length -= n;
+    }
+}
+
+
+void
+Buffer::read(GLsizeiptr offset, GLsizeiptr length, void *data) const
+{
+    GLubyte *dst = static_cast<GLubyte *>(data);
+    while (length > 0) {
+        size_t index = offset / pageSize;
+        GLsizeiptr page_offset = offset % pageSize;
+        GLsizeiptr n = std::min(length, pageSize - page_offset);
+        const Page *page = pages[index].get();
+        memcpy(dst, page ? page->data + page_offset : zeroPage, n);
+        offset += n;
+        dst += n;
+        length -= n;
+    }
+}
+
+
+void
+Buffer::bufferData(GLsizeiptr new_size, const void *new_data)
+{
+    trace::overhead::Scope scope(trace::overhead::CATEGORY_SHADOW);
+
+    if (new_size < 0) {
+        new_size = 0;
+    }
+    pages.clear();
+    resize(new_size);
+    if (new_size && new_data) {
+        write(0, new_size, new_data);
+    }
+}
+
+
+void
+Buffer::bufferSubData(GLsizeiptr offset, GLsizeiptr length, const void *new_data)
+{
+    trace::overhead::Scope scope(trace::overhead::CATEGORY_SHADOW);
+
+    if (offset >= 0 && offset < size && length > 0 && offset + length <= size && new_data) {
+        write(offset, length, new_data);
+    }
+}
+
+
+void
+Buffer::getSubData(GLsizeiptr offset, GLsizeiptr length, void *out_data) const
+{
+    if (offset >= 0 && offset < size && length > 0 && offset + length <= size && out_data) {
+        read(offset, length, out_data);
+    }
+}
+
+
+/*
+ * Whole pages are shared rather than copied, when the source and destination
+ * offsets are equally aligned.
+ */
+void
+Buffer::copySubData(const Buffer &src, GLsizeiptr read_offset, GLsizeiptr write_offset, GLsizeiptr length)
+{
+    trace::overhead::Scope scope(trace::overhead::CATEGORY_SHADOW);
+
+    if (read_offset < 0 || read_offset + length > src.size ||
+        write_offset < 0 || write_offset + length > size ||
+        length <= 0) {
+        return;
+    }
+
+    while (length > 0) {
+        size_t index = write_offset / pageSize;
+        GLsizeiptr page_offset = write_offset % pageSize;
+        GLsizeiptr n = std::min(length, pageSize - page_offset);
+        if (n == pageSize && read_offset % pageSize == 0) {
+            pages[index] = src.pages[read_offset / pageSize];
+        } else {
+            GLubyte temp[pageSize];
+            src.read(read_offset, n, temp);
+            memcpy(writablePage(index) + page_offset, temp, n);
+        }
+        read_offset += n;
+        write_offset += n;
+        length -= n;
+    }
+}
+
+
+void
+Buffer::diff(GLsizeiptr offset, GLsizeiptr length, const void *new_data, std::string &patch)
+{
+    if (offset < 0 || length <= 0 || !new_data) {
+        return;
+    }
+
+    trace::overhead::Scope scope(trace::overhead::CATEGORY_SHADOW);
+
+    if (offset + length > size) {
+        resize(offset + length);
+    }
+
+    const GLubyte *src = static_cast<const GLubyte *>(new_data);
+    GLsizeiptr last = 0;
+    GLsizeiptr pos = 0;
+    while (pos < length) {
+        size_t index = (offset + pos) / pageSize;
+        GLsizeiptr page_offset = (offset + pos) % pageSize;
+        GLsizeiptr n = std::min(length - pos, pageSize - page_offset);
+        diffPage(src + pos, index, page_offset, n, pos, last, patch);
+        pos += n;
+    }
+}
+
+
+/*
+ * Diff the part of a page at the given offset, `base` bytes into the range
+ * being diffed.  Pages are only allocated or copied once a change is found.
+ */
+void
+Buffer::diffPage(const GLubyte *src, size_t index, GLsizeiptr page_offset, GLsizeiptr length,
+                 GLsizeiptr base, GLsizeiptr &last, std::string &patch)
+{
+    const GLubyte *dst = pages[index] ? pages[index]->data + page_offset : zeroPage + page_offset;
+
+    // Runs separated by less than a run header are merged
+    const GLsizeiptr minGap = 8;
+
+    GLsizeiptr i = 0;
+    while (i < length) {
+        while (i + 16 <= length && memcmp(src + i, dst + i, 16) == 0) {
+            i += 16;
+        }
+        if (i >= length) {
+            break;
+        }
+        if (src[i] == dst[i]) {
+            ++i;
+            continue;
+        }
+
+        GLsizeiptr j = i + 1;
+        GLsizeiptr equal = 0;
+        while (j < length && equal < minGap) {
+            equal = src[j] == dst[j] ? equal + 1 : 0;
+            ++j;
+        }
+        GLsizeiptr end = j - equal;
+
+        appendUInt32(patch, base + i - last);
+        appendUInt32(patch, end - i);
+        patch.append((const char *)src + i, end - i);
+
+        GLubyte *out = writablePage(index) + page_offset;
+        memcpy(out + i, src + i, end - i);
+        dst = out;
+
+        last = base + end;
+        i = j;
+    }
+}
+
+
+void
+Buffer::appendUInt32(std::string &s, GLsizeiptr value)
+{
+    char bytes[4] = {
+        (char)(value & 0xff),
+        (char)((value >> 8) & 0xff),
+        (char)((value >> 16) & 0xff),
+        (char)((value >> 24) & 0xff),
+    };
+    s.append(bytes, sizeof bytes);
+}
+
+
+/*
+ * Look up the shadow of the buffer bound to target, which is created for
+ * element array buffers.
+ */
+static Buffer *
+lookupShadow(SharedState *shared, GLenum target, bool create)
+{
+    if (target != GL_ELEMENT_ARRAY_BUFFER && shared->buffers.empty()) {
+        return nullptr;
+    }
+
+    GLuint buffer = getMappedBufferBinding(target);
+    if (!buffer) {
+        return nullptr;
+    }
+
+    if (create && target == GL_ELEMENT_ARRAY_BUFFER) {
+        return &shared->buffers[buffer];
+    }
+
+    auto it = shared->buffers.find(buffer);
+    return it != shared->buffers.end() ? &it->second : nullptr;
+}
+
+
+void
+shadowBufferData(GLenum target, GLsizeiptr size, const void *data)
+{
+    Context *ctx = getContext();
+    if (!ctx->needsShadowBuffers()) {
+        return;
+    }
+
+    SharedState *shared = ctx->shared.get();
+    os::unique_lock<os::mutex> lock(shared->mutex);
+    Buffer *buf = lookupShadow(shared, target, true);
+    if (buf) {
+        buf->bufferData(size, data);
+    }
+}
+
+
+void
+shadowBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+{
+    Context *ctx = getContext();
+    if (!ctx->needsShadowBuffers()) {
+        return;
+    }
+
+    SharedState *shared = ctx->shared.get();
+    os::unique_lock<os::mutex> lock(shared->mutex);
+    Buffer *buf = lookupShadow(shared, target, false);
+    if (buf) {
+        buf->bufferSubData(offset, size, data);
+    }
+}
+
+
+void
+shadowMappedRange(GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+{
+    Context *ctx = getContext();
+    if (!ctx->needsShadowBuffers()) {
+        return;
+    }
+
+    SharedState *shared = ctx->shared.get();
+    os::unique_lock<os::mutex> lock(shared->mutex);
+    Buffer *buf = lookupShadow(shared, target, false);
+    if (buf) {
+        // OpenGL ES 2.0 can only map whole buffers
+        GLint map_offset = 0;
+        if (ctx->profile.versionGreaterOrEqual(glprofile::API_GLES, 3, 0)) {
+            _glGetBufferParameteriv(target, GL_BUFFER_MAP_OFFSET, &map_offset);
+        }
+        buf->bufferSubData(map_offset + offset, size, data);
+    }
+}
+
+
+void
+shadowCopyBufferSubData(GLenum read_target, GLenum write_target,
+                        GLintptr read_offset, GLintptr write_offset, GLsizeiptr size)
+{
+    Context *ctx = getContext();
+    if (!ctx->needsShadowBuffers()) {
+        return;
+    }
+
+    SharedState *shared = ctx->shared.get();
+    os::unique_lock<os::mutex> lock(shared->mutex);
+    if (shared->buffers.empty()) {
+        return;
+    }
+
+    GLuint write_buffer = getMappedBufferBinding(write_target);
+    auto write_it = shared->buffers.find(write_buffer);
+    if (write_it == shared->buffers.end()) {
+        return;
+    }
+
+    GLuint read_buffer = getMappedBufferBinding(read_target);
+    auto read_it = shared->buffers.find(read_buffer);
+    if (read_it != shared->buffers.end()) {
+        write_it->second.copySubData(read_it->second, read_offset, write_offset, size);
+    } else {
+        // Contents unknown, so materialize it again when read
+        shared->buffers.erase(write_it);
+    }
+}
+
+
+void
+shadowDeleteBuffers(GLsizei n, const GLuint *buffers)
+{
+    Context *ctx = getContext();
+    if (!ctx->needsShadowBuffers() || !buffers) {
+        return;
+    }
+
+    SharedState *shared = ctx->shared.get();
+    os::unique_lock<os::mutex> lock(shared->mutex);
+    for (GLsizei i = 0; i < n; i++) {
+        shared->buffers.erase(buffers[i]);
+    }
+}
+
+
+/*
+ * Read back a buffer not shadowed yet, by mapping it.
+ */
+static bool
+materializeShadow(Context *ctx, GLenum target, Buffer &buf)
+{
+    if (!ctx->profile.versionGreaterOrEqual(glprofile::API_GLES, 3, 0)) {
+        return false;
+    }
+
+    GLint mapped = GL_FALSE;
+    _glGetBufferParameteriv(target, GL_BUFFER_MAPPED, &mapped);
+    if (mapped) {
+        return false;
+    }
+
+    GLint size = 0;
+    _glGetBufferParameteriv(target, GL_BUFFER_SIZE, &size);
+    if (size <= 0) {
+        return false;
+    }
+
+    const void *map = _glMapBufferRange(target, 0, size, GL_MAP_READ_BIT);
+    if (!map) {
+        return false;
+    }
+    buf.bufferData(size, map);
+    _glUnmapBuffer(target);
+
+    return true;
+}
+
+
+bool
+getShadowBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, void *data)
+{
+    Context *ctx = getContext();
+    if (!ctx->needsShadowBuffers()) {
+        return false;
+    }
+
+    SharedState *shared = ctx->shared.get();
+    os::unique_lock<os::mutex> lock(shared->mutex);
+
+    GLuint buffer = getMappedBufferBinding(target);
+    if (!buffer) {
+        return true;
+    }
+
+    auto it = shared->buffers.find(buffer);
+    if (it == shared->buffers.end()) {
+        Buffer buf;
+        if (!materializeShadow(ctx, target, buf)) {
+            return true;
+        }
+        it = shared->buffers.emplace(buffer, std::move(buf)).first;
+    }
+
+    it->second.getSubData(offset, size, data);
+    return true;
+}
+
+
+} /* namespace gltrace */
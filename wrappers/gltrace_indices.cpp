@@ -0,0 +1,223 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Memoization of the maximum index of element array buffer ranges.
+ *
+ * When drawing with user arrays the tracer must know how many vertices to
+ * record, which for indexed draws from an element array buffer means reading
+ * back and scanning the index range on every draw.  Applications drawing with
+ * user arrays tend to do so from static index buffers, so the result is kept
+ * per context and range, and reused until the buffer contents may have
+ * changed.
+ *
+ * Buffer names are shared between contexts, so rather than tracking which
+ * contexts hold which ranges, every write bumps a global clock, and a
+ * memoized result is only valid if computed after the last write to its
+ * buffer.  Writes done by the GL itself (transform feedback, shader stores,
+ * pack buffers, etc) are conservatively treated as writes to all buffers.
+ */
+
+
+#include <algorithm>
+#include <map>
+
+#include "os_thread.hpp"
+#include "glproc.hpp"
+#include "glsize.hpp"
+#include "gltrace.hpp"
+
+
+namespace gltrace {
+
+
+volatile bool maxIndicesCached = false;
+
+static os::mutex mutex;
+
+static unsigned writeClock = 0;
+static unsigned lastGlobalWrite = 0;
+static std::map<GLuint, unsigned> lastWrites;
+
+// Buffers being mapped may be written at any time
+static const unsigned MAPPED = ~0U;
+
+// Bound the memory used by applications drawing from many ranges
+static const size_t MAX_RANGES_PER_CONTEXT = 4096;
+
+
+void
+getPrimitiveRestart(GLboolean *enabled, GLuint *index)
+{
+    Context *ctx = getContext();
+
+    if (ctx->primitiveRestart < 0) {
+        GLboolean restart_enabled = _glIsEnabled(GL_PRIMITIVE_RESTART);
+        // Not supported by OpenGL ES or older OpenGL versions
+        while ((_glGetError() == GL_INVALID_ENUM))
+            ;
+        ctx->primitiveRestart = restart_enabled ? 1 : 0;
+    }
+
+    *enabled = ctx->primitiveRestart ? GL_TRUE : GL_FALSE;
+    *index = 0;
+
+    if (ctx->primitiveRestart) {
+        if (ctx->primitiveRestartIndex < 0) {
+            ctx->primitiveRestartIndex = (GLuint)_glGetInteger(GL_PRIMITIVE_RESTART_INDEX);
+        }
+        *index = (GLuint)ctx->primitiveRestartIndex;
+    }
+}
+
+
+static unsigned
+lastWrite(GLuint buffer)
+{
+    std::map<GLuint, unsigned>::const_iterator it = lastWrites.find(buffer);
+    unsigned last = it != lastWrites.end() ? it->second : 0;
+    return std::max(last, lastGlobalWrite);
+}
+
+
+bool
+lookupMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type,
+               GLboolean restart_enabled, GLuint restart_index, GLuint *maxindex)
+{
+    Context *ctx = getContext();
+
+    IndexRange range = {buffer, offset, count, type, restart_index, restart_enabled};
+    std::map<IndexRange, MaxIndex>::iterator it = ctx->maxIndices.find(range);
+    if (it == ctx->maxIndices.end()) {
+        return false;
+    }
+
+    mutex.lock();
+    unsigned last = lastWrite(buffer);
+    mutex.unlock();
+
+    if (last == MAPPED || it->second.clock < last) {
+        ctx->maxIndices.erase(it);
+        return false;
+    }
+
+    *maxindex = it->second.value;
+    return true;
+}
+
+
+/*
+ * Sample the clock before reading a range back, and start tracking writes if
+ * not done yet, so that writes racing with the read are not mistaken for
+ * older ones.
+ */
+unsigned
+sampleWriteClock(void)
+{
+    mutex.lock();
+    unsigned clock = writeClock;
+    maxIndicesCached = true;
+    mutex.unlock();
+    return clock;
+}
+
+
+void
+cacheMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type,
+              GLboolean restart_enabled, GLuint restart_index, GLuint maxindex,
+              unsigned clock)
+{
+    Context *ctx = getContext();
+
+    mutex.lock();
+    unsigned last = lastWrite(buffer);
+    mutex.unlock();
+
+    // Mapped, or written since the range was read
+    if (last == MAPPED || last > clock) {
+        return;
+    }
+
+    // Buffers mapped before anything was memoized weren't seen being mapped
+    if (ctx->profile.desktop() ||
+        ctx->profile.versionGreaterOrEqual(glprofile::API_GLES, 3, 0)) {
+        GLint mapped = GL_FALSE;
+        _glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_MAPPED, &mapped);
+        if (mapped) {
+            return;
+        }
+    }
+
+    if (ctx->maxIndices.size() >= MAX_RANGES_PER_CONTEXT) {
+        ctx->maxIndices.clear();
+    }
+
+    IndexRange range = {buffer, offset, count, type, restart_index, restart_enabled};
+    MaxIndex value = {maxindex, clock};
+    ctx->maxIndices[range] = value;
+}
+
+
+void
+invalidateBufferContents(GLuint buffer)
+{
+    mutex.lock();
+    unsigned &last = lastWrites[buffer];
+    if (last != MAPPED) {
+        last = ++writeClock;
+    }
+    mutex.unlock();
+}
+
+
+void
+invalidateAllBufferContents(void)
+{
+    mutex.lock();
+    lastGlobalWrite = ++writeClock;
+    mutex.unlock();
+}
+
+
+void
+beginBufferMapping(GLuint buffer)
+{
+    mutex.lock();
+    lastWrites[buffer] = MAPPED;
+    mutex.unlock();
+}
+
+
+void
+endBufferMapping(GLuint buffer)
+{
+    mutex.lock();
+    lastWrites[buffer] = ++writeClock;
+    mutex.unlock();
+}
+
+
+} /* namespace gltrace */
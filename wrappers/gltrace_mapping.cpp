@@ -0,0 +1,515 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Recording of mapped buffer ranges, and dirty page tracking for persistent
+ * and coherent buffer mappings.
+ *
+ * Persistent mappings stay valid across draw calls, so there is no unmap or
+ * flush call at which to capture what the application wrote.  Instead the
+ * mapped pages are write protected, and the first write to each page faults
+ * into a SIGSEGV handler, which records the page as dirty and lifts the
+ * protection.  Whenever the GL may consume the mapped memory (draws, fences,
+ * etc) the dirty pages are emitted as fake memcpys and write protected again.
+ *
+ * System calls writing directly into a protected page (e.g., read(2) into a
+ * mapped buffer) fail with EFAULT instead of faulting, breaking the
+ * application, so the tracking is only done when APITRACE_TRACK_MAPPINGS=1.
+ */
+
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "os.hpp"
+#include "os_thread.hpp"
+#include "glproc.hpp"
+#include "gltrace.hpp"
+#include "trace_writer_local.hpp"
+
+#if defined(__linux__)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+
+namespace gltrace {
+
+
+volatile unsigned trackedMappings = 0;
+
+
+GLuint
+getMappedBufferBinding(GLenum target)
+{
+    GLenum binding;
+    switch (target) {
+    case GL_ARRAY_BUFFER:
+        binding = GL_ARRAY_BUFFER_BINDING;
+        break;
+    case GL_ELEMENT_ARRAY_BUFFER:
+        binding = GL_ELEMENT_ARRAY_BUFFER_BINDING;
+        break;
+    case GL_PIXEL_PACK_BUFFER:
+        binding = GL_PIXEL_PACK_BUFFER_BINDING;
+        break;
+    case GL_PIXEL_UNPACK_BUFFER:
+        binding = GL_PIXEL_UNPACK_BUFFER_BINDING;
+        break;
+    case GL_UNIFORM_BUFFER:
+        binding = GL_UNIFORM_BUFFER_BINDING;
+        break;
+    case GL_TEXTURE_BUFFER:
+        binding = GL_TEXTURE_BUFFER_BINDING;
+        break;
+    case GL_TRANSFORM_FEEDBACK_BUFFER:
+        binding = GL_TRANSFORM_FEEDBACK_BUFFER_BINDING;
+        break;
+    case GL_COPY_READ_BUFFER:
+        binding = GL_COPY_READ_BUFFER_BINDING;
+        break;
+    case GL_COPY_WRITE_BUFFER:
+        binding = GL_COPY_WRITE_BUFFER_BINDING;
+        break;
+    case GL_DRAW_INDIRECT_BUFFER:
+        binding = GL_DRAW_INDIRECT_BUFFER_BINDING;
+        break;
+    case GL_DISPATCH_INDIRECT_BUFFER:
+        binding = GL_DISPATCH_INDIRECT_BUFFER_BINDING;
+        break;
+    case GL_ATOMIC_COUNTER_BUFFER:
+        binding = GL_ATOMIC_COUNTER_BUFFER_BINDING;
+        break;
+    case GL_SHADER_STORAGE_BUFFER:
+        binding = GL_SHADER_STORAGE_BUFFER_BINDING;
+        break;
+    case GL_QUERY_BUFFER:
+        binding = GL_QUERY_BUFFER_BINDING;
+        break;
+    default:
+        return 0;
+    }
+
+    GLint buffer = 0;
+    _glGetIntegerv(binding, &buffer);
+    return buffer;
+}
+
+
+/*
+ * Shadows of the mapped ranges last recorded for each buffer, so that
+ * repeated flushes of mostly unchanged data (e.g., ring buffers of dynamic
+ * vertices) are recorded as patches of the changed bytes.
+ *
+ * Correctness does not depend on the shadows matching the actual buffer
+ * contents, as the retracer keeps identical shadows and copies the whole
+ * range from them, so buffers are simply keyed by name.  But the retracer
+ * must replay every patch of a shadow, so the shadows start over, under new
+ * ids, whenever the trace writer starts a new patch epoch (a new trace file
+ * or flight recorder segment).
+ */
+
+struct Shadow {
+    unsigned id;
+    Buffer contents;
+};
+
+static os::mutex shadowMutex;
+static std::map<GLuint, Shadow> shadows;
+static unsigned shadowEpoch = 0;
+static unsigned nextShadowId = 0;
+
+
+bool
+patchMappings(void)
+{
+    static int enabled = -1;
+    if (enabled < 0) {
+        const char *env = getenv("APITRACE_PATCH_MAPPINGS");
+        enabled = env && strcmp(env, "0") != 0;
+        if (enabled && !trace::localWriter.canPatch()) {
+            // Per-thread buffers don't preserve the order of the patches
+            os::log("apitrace: warning: APITRACE_PATCH_MAPPINGS ignored with APITRACE_THREAD_BUFFERS\n");
+            enabled = 0;
+        }
+    }
+    return enabled;
+}
+
+
+void
+emitMappedRange(GLuint buffer, GLintptr offset, const void *ptr, GLsizeiptr length)
+{
+    if (length <= 0) {
+        return;
+    }
+
+    if (!patchMappings()) {
+        trace::fakeMemcpy(ptr, length);
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(shadowMutex);
+
+    unsigned epoch = trace::localWriter.getPatchEpoch();
+    if (epoch != shadowEpoch) {
+        shadows.clear();
+        shadowEpoch = epoch;
+    }
+
+    std::map<GLuint, Shadow>::iterator it = shadows.find(buffer);
+    if (it == shadows.end()) {
+        it = shadows.insert(std::make_pair(buffer, Shadow())).first;
+        it->second.id = nextShadowId++;
+    }
+
+    std::string patch;
+    it->second.contents.diff(offset, length, ptr, patch);
+    trace::fakeMemcpyPatch(ptr, length, it->second.id, offset, patch.data(), patch.size(), epoch);
+}
+
+
+#if defined(__linux__)
+
+
+struct Mapping {
+    GLuint buffer;
+    GLintptr offset;
+    const char *map;
+    size_t length;
+
+    // Page aligned range covering [map, map + length)
+    uintptr_t begin;
+    uintptr_t end;
+
+    // One byte per page, written from the signal handler
+    std::vector<unsigned char> dirty;
+};
+
+struct Range {
+    GLuint buffer;
+    GLintptr offset;
+    const void *ptr;
+    size_t size;
+};
+
+static os::mutex mutex;
+static std::vector<Mapping *> mappings;
+static uintptr_t pageSize = 0;
+static bool enabled = true;
+static bool handlerInstalled = false;
+static struct sigaction oldAction;
+
+
+static Mapping *
+findMapping(uintptr_t addr)
+{
+    for (Mapping *mapping : mappings) {
+        if (mapping->begin <= addr && addr < mapping->end) {
+            return mapping;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Whether the page is also covered by another mapping, e.g., when the driver
+ * sub-allocates small buffers from the same pages.
+ */
+static bool
+isPageShared(const Mapping *self, uintptr_t page)
+{
+    for (const Mapping *mapping : mappings) {
+        if (mapping != self &&
+            mapping->begin <= page && page < mapping->end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void
+segvHandler(int sig, siginfo_t *info, void *context)
+{
+    if (info->si_code == SEGV_ACCERR) {
+        uintptr_t addr = (uintptr_t)info->si_addr;
+        uintptr_t page = addr & ~(pageSize - 1);
+
+        /*
+         * The fault is synchronous, and the tracked memory is never written
+         * while holding the mutex, so it is safe to lock here.
+         */
+        os::unique_lock<os::mutex> lock(mutex);
+
+        bool handled = false;
+        for (Mapping *mapping : mappings) {
+            if (mapping->begin <= page && page < mapping->end) {
+                mapping->dirty[(page - mapping->begin) / pageSize] = 1;
+                handled = true;
+            }
+        }
+        if (handled) {
+            mprotect((void *)page, pageSize, PROT_READ | PROT_WRITE);
+            return;
+        }
+    }
+
+    // Not ours -- chain to the previous handler (usually os::signalHandler)
+    if (oldAction.sa_flags & SA_SIGINFO) {
+        oldAction.sa_sigaction(sig, info, context);
+    } else if (oldAction.sa_handler == SIG_DFL) {
+        struct sigaction dfl_action;
+        dfl_action.sa_handler = SIG_DFL;
+        sigemptyset(&dfl_action.sa_mask);
+        dfl_action.sa_flags = 0;
+        sigaction(sig, &dfl_action, NULL);
+        raise(sig);
+    } else if (oldAction.sa_handler != SIG_IGN) {
+        oldAction.sa_handler(sig);
+    }
+}
+
+
+static bool
+installHandler(void)
+{
+    if (handlerInstalled) {
+        return true;
+    }
+
+    const char *env = getenv("APITRACE_TRACK_MAPPINGS");
+    if (!env || strcmp(env, "1") != 0) {
+        os::log("apitrace: warning: set APITRACE_TRACK_MAPPINGS=1 to record coherent/persistent buffer mappings\n");
+        enabled = false;
+        return false;
+    }
+
+    pageSize = sysconf(_SC_PAGESIZE);
+
+    struct sigaction new_action;
+    new_action.sa_sigaction = segvHandler;
+    sigemptyset(&new_action.sa_mask);
+    new_action.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGSEGV, &new_action, &oldAction) < 0) {
+        os::log("apitrace: warning: failed to install SIGSEGV handler for buffer mapping tracking\n");
+        enabled = false;
+        return false;
+    }
+
+    handlerInstalled = true;
+    return true;
+}
+
+
+/*
+ * Collect the dirty runs of a mapping, clipped to the mapped range, and write
+ * protect them again.  The pages are protected before their contents are
+ * copied, so that no write can slip in between unnoticed.
+ */
+static void
+collectDirty(Mapping *mapping, std::vector<Range> &ranges, bool unprotect)
+{
+    size_t numPages = mapping->dirty.size();
+    size_t i = 0;
+    while (i < numPages) {
+        if (!mapping->dirty[i]) {
+            ++i;
+            continue;
+        }
+        size_t j = i;
+        while (j < numPages && mapping->dirty[j]) {
+            mapping->dirty[j] = 0;
+            ++j;
+        }
+
+        uintptr_t begin = mapping->begin + i * pageSize;
+        uintptr_t end = mapping->begin + j * pageSize;
+        if (!unprotect) {
+            mprotect((void *)begin, end - begin, PROT_READ);
+        }
+
+        uintptr_t map = (uintptr_t)mapping->map;
+        begin = std::max(begin, map);
+        end = std::min(end, map + mapping->length);
+        Range range;
+        range.buffer = mapping->buffer;
+        range.offset = mapping->offset + (begin - map);
+        range.ptr = (const void *)begin;
+        range.size = end - begin;
+        ranges.push_back(range);
+
+        i = j;
+    }
+
+    if (unprotect) {
+        // Restore write access to the pages no other mapping still watches
+        for (uintptr_t page = mapping->begin; page < mapping->end; page += pageSize) {
+            if (!isPageShared(mapping, page)) {
+                mprotect((void *)page, pageSize, PROT_READ | PROT_WRITE);
+            }
+        }
+    }
+}
+
+
+/*
+ * Fake memcpys are emitted outside the mutex, as they need the trace writer's
+ * mutex, which is held while tracking new mappings.
+ */
+static void
+emitRanges(const std::vector<Range> &ranges)
+{
+    for (const Range &range : ranges) {
+        emitMappedRange(range.buffer, range.offset, range.ptr, range.size);
+    }
+}
+
+
+static void
+removeMapping(std::vector<Mapping *>::iterator it, std::vector<Range> &ranges)
+{
+    Mapping *mapping = *it;
+    mappings.erase(it);
+    collectDirty(mapping, ranges, true);
+    delete mapping;
+    trackedMappings = mappings.size();
+}
+
+
+bool
+trackMapping(GLuint buffer, GLintptr offset, void *map, GLsizeiptr length)
+{
+    if (!map || length <= 0) {
+        return true;
+    }
+
+    {
+        os::unique_lock<os::mutex> lock(mutex);
+
+        if (!enabled || !installHandler()) {
+            return false;
+        }
+
+        Mapping *mapping = new Mapping;
+        mapping->buffer = buffer;
+        mapping->offset = offset;
+        mapping->map = (const char *)map;
+        mapping->length = length;
+        mapping->begin = (uintptr_t)map & ~(pageSize - 1);
+        mapping->end = ((uintptr_t)map + length + pageSize - 1) & ~(pageSize - 1);
+        mapping->dirty.resize((mapping->end - mapping->begin) / pageSize);
+
+        // Pages may be already partially dirty when shared with another mapping
+        for (uintptr_t page = mapping->begin; page < mapping->end; page += pageSize) {
+            Mapping *other = findMapping(page);
+            if (other && other->dirty[(page - other->begin) / pageSize]) {
+                mapping->dirty[(page - mapping->begin) / pageSize] = 1;
+            }
+        }
+
+        if (mprotect((void *)mapping->begin, mapping->end - mapping->begin, PROT_READ) != 0) {
+            os::log("apitrace: warning: failed to write protect buffer mapping; whole range will be recorded on every flush\n");
+            delete mapping;
+            return false;
+        }
+
+        mappings.push_back(mapping);
+        trackedMappings = mappings.size();
+    }
+    return true;
+}
+
+
+void
+untrackBuffer(GLuint buffer)
+{
+    if (!trackedMappings) {
+        return;
+    }
+
+    std::vector<Range> ranges;
+    {
+        os::unique_lock<os::mutex> lock(mutex);
+        for (auto it = mappings.begin(); it != mappings.end(); ++it) {
+            if ((*it)->buffer == buffer) {
+                removeMapping(it, ranges);
+                break;
+            }
+        }
+    }
+    emitRanges(ranges);
+}
+
+
+void
+_flushMappings(void)
+{
+    std::vector<Range> ranges;
+    {
+        os::unique_lock<os::mutex> lock(mutex);
+        for (Mapping *mapping : mappings) {
+            collectDirty(mapping, ranges, false);
+        }
+    }
+    emitRanges(ranges);
+}
+
+
+#else /* !__linux__ */
+
+
+bool
+trackMapping(GLuint buffer, GLintptr offset, void *map, GLsizeiptr length)
+{
+    return false;
+}
+
+
+void
+untrackBuffer(GLuint buffer)
+{
+}
+
+
+void
+_flushMappings(void)
+{
+}
+
+
+#endif /* !__linux__ */
+
+
+} /* namespace gltrace */
@@ -108,7 +108,7 @@ bool releaseContext(uintptr_t context_id)
     return res;
 }
 
-void createContext(uintptr_t context_id)
+void createContext(uintptr_t context_id, uintptr_t shared_context_id)
 {
     // wglCreateContextAttribsARB causes internal calls to wglCreateContext to be
     // traced, causing context to be defined twice.
@@ -120,6 +120,13 @@ void createContext(uintptr_t context_id)
 
     context_map_mutex.lock();
 
+    if (shared_context_id) {
+        auto it = context_map.find(shared_context_id);
+        if (it != context_map.end()) {
+            ctx->shared = it->second->shared;
+        }
+    }
+
     _retainContext(ctx);
     context_map[context_id] = ctx;
 
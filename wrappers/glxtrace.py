@@ -69,8 +69,9 @@ class GlxTracer(GlTracer):
         GlTracer.traceFunctionImplBody(self, function)
 
         if function.name in self.createContextFunctionNames:
+            share_list = [arg.name for arg in function.args if arg.name.lower().startswith('share')][0]
             print '    if (_result != NULL)'
-            print '        gltrace::createContext((uintptr_t)_result);'
+            print '        gltrace::createContext((uintptr_t)_result, (uintptr_t)%s);' % share_list
 
         if function.name in self.makeCurrentFunctionNames:
             print '    if (_result) {'
@@ -456,8 +456,8 @@ def getInterfaceHierarchy(allIfaces, baseIface):
 class Tracer:
     '''Base class to orchestrate the code generation of API tracing.'''
 
-    # 0-3 are reserved to memcpy, malloc, free, and realloc
-    __id = 4
+    # 0-4 are reserved to memcpy, malloc, free, realloc, and memcpy_patch
+    __id = 5
 
     def __init__(self):
         self.api = None
@@ -536,6 +536,13 @@ class Tracer:
     def isFunctionPublic(self, function):
         return True
 
+    def isFunctionFilterable(self, function):
+        # Whether the call may be left out of the trace at capture time (see
+        # trace::LocalWriter::skipCall), which is only safe when nothing but
+        # the recording depends on the enter/leave blocks (e.g., no object
+        # wrapping).
+        return False
+
     def traceFunctionImpl(self, function):
         if self.isFunctionPublic(function):
             print 'extern "C" PUBLIC'
@@ -549,6 +556,9 @@ class Tracer:
             if not arg.output:
                 self.unwrapArg(function, arg)
 
+        if not function.internal and self.isFunctionFilterable(function):
+            print '    bool _skip = trace::localWriter.skipCall(&_%s_sig);' % (function.name,)
+
         self.traceFunctionImplBody(function)
 
         # XXX: wrapping should go here, but before we can do that we'll need to protect g_WrappedObjects with its own mutex
@@ -560,13 +570,23 @@ class Tracer:
         print
 
     def traceFunctionImplBody(self, function):
-        if not function.internal:
+        filterable = not function.internal and self.isFunctionFilterable(function)
+        if filterable:
+            print '    unsigned _call = 0;'
+            print '    if (!_skip) {'
+            print '    _call = trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)
+        elif not function.internal:
             print '    unsigned _call = trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)
+        if not function.internal:
             for arg in function.args:
                 if not arg.output:
                     self.serializeArg(function, arg)
             print '    trace::localWriter.endEnter();'
+        if filterable:
+            print '    }'
         self.invokeFunction(function)
+        if filterable:
+            print '    if (!_skip) {'
         if not function.internal:
             print '    trace::localWriter.beginLeave(_call);'
             print '    if (%s) {' % self.wasFunctionSuccessful(function)
@@ -580,6 +600,8 @@ class Tracer:
             if function.type is not stdapi.Void:
                 self.wrapRet(function, "_result")
             print '    trace::localWriter.endLeave();'
+        if filterable:
+            print '    }'
 
     def invokeFunction(self, function):
         self.doInvokeFunction(function)
@@ -714,7 +736,7 @@ class Tracer:
         print r'private:'
         print r'    void _dummy(unsigned i) const {'
         print r'        os::log("error: %%s: unexpected virtual method %%i of instance pWrapper=%%p pvObj=%%p pVtbl=%%p\n", "%s", i, this, m_pInstance, m_pVtbl);' % interface.name
-        print r'        trace::localWriter.flush();'
+        print r'        trace::localWriter.flushForCrash();'
         print r'        os::abort();'
         print r'    }'
         print
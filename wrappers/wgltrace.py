@@ -87,7 +87,10 @@ class WglTracer(GlTracer):
 
         if function.name in self.createContextFunctionNames:
             print '    if (_result)'
-            print '        gltrace::createContext((uintptr_t)_result);'
+            if function.name == 'wglCreateContextAttribsARB':
+                print '        gltrace::createContext((uintptr_t)_result, (uintptr_t)hShareContext);'
+            else:
+                print '        gltrace::createContext((uintptr_t)_result);'
 
         if function.name in self.makeCurrentFunctionNames:
             print '    if (_result) {'